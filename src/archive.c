@@ -0,0 +1,1404 @@
+/* live-f1
+ *
+ * archive.c - compact archives of recorded data streams
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif /* HAVE_LIBZ */
+
+#include "live-f1.h"
+#include "mapfile.h"
+#include "packet.h"
+#include "record.h"
+#include "stream.h"
+#include "archive.h"
+
+
+/* Number of payloads remembered in each segment's dictionary */
+#define DICT_SIZE 255
+
+/* Set on the source of a read continued from the previous segment */
+#define CONTINUED 0x80
+
+
+/**
+ * Dictionary:
+ * @text: payloads seen,
+ * @len: length of each of @text,
+ * @used: number of @text filled,
+ * @next: entry of @text to be replaced next.
+ *
+ * Decrypted payloads are mostly texts repeated many times over: driver
+ * names, sector times that don't change, gaps and so on.  Each payload
+ * in a segment is either written out in full, and added to the
+ * dictionary, or as the index of the same text in the dictionary.  The
+ * packer and unpacker fill it the same way, so it isn't stored.
+ **/
+typedef struct {
+	unsigned char text[DICT_SIZE][128];
+	int           len[DICT_SIZE];
+	size_t        used, next;
+} Dictionary;
+
+/**
+ * ArchiveScan:
+ * @state: decryption state, first so the data source can find the rest,
+ * @archive: archive being packed or unpacked,
+ * @dict: payload dictionary of the current segment.
+ *
+ * What's needed to follow the salt through a segment, which is all the
+ * packer and unpacker have in common.
+ **/
+typedef struct {
+	CurrentState  state;
+	Archive      *archive;
+	Dictionary    dict;
+} ArchiveScan;
+
+/**
+ * PackRecord:
+ * @time_ns: time the data was read,
+ * @source: where the data came from,
+ * @arg: source-specific argument,
+ * @len: length of the data,
+ * @data: the data itself, or NULL for reads of the data stream,
+ * @offset: offset in the data stream of the read, or of the next read.
+ *
+ * A record of the file being packed; reads of the data stream are taken
+ * from the data stream as a whole.
+ **/
+typedef struct {
+	long long            time_ns;
+	CaptureSource        source;
+	unsigned int         arg;
+	size_t               len;
+	const unsigned char *data;
+	size_t               offset;
+} PackRecord;
+
+/**
+ * Packer:
+ * @scan: salt and dictionary,
+ * @records: records of the file being packed,
+ * @num_records: number of @records,
+ * @next_record: first of @records not yet in a segment,
+ * @done: bytes of @next_record already in a segment,
+ * @stream: data stream, without the capture framing,
+ * @given_key: key to use for events with none recorded,
+ * @out: archive being written,
+ * @recs: records section of the current segment,
+ * @pkts: packets section of the current segment,
+ * @num_packets: number of packets in the current segment,
+ * @header: segment header, filled in as the segment begins.
+ *
+ * State while packing.
+ **/
+typedef struct {
+	ArchiveScan          scan;
+	PackRecord          *records;
+	size_t               num_records, next_record, done;
+	const unsigned char *stream;
+	unsigned int         given_key;
+	ArchiveOutput        out, recs, pkts;
+	size_t               num_packets;
+	unsigned char        header[ARCHIVE_SEGMENT_HEADER];
+} Packer;
+
+
+/* Forward prototypes */
+static unsigned char *grow          (ArchiveOutput *out, size_t len);
+static void           put_bytes     (ArchiveOutput *out, const void *buf,
+				     size_t len);
+static void           put_varint    (ArchiveOutput *out,
+				     unsigned long long value);
+static int            get_varint    (const unsigned char **p,
+				     const unsigned char *end,
+				     unsigned long long *value);
+static void           follow_packet (CurrentState *state,
+				     const Packet *packet);
+static void           add_text      (Dictionary *dict,
+				     const unsigned char *text, int len);
+static unsigned int   pack_key      (CurrentState *state,
+				     unsigned int event_no);
+static unsigned int   archive_key   (CurrentState *state,
+				     unsigned int event_no);
+static int            pack          (Packer *packer,
+				     const unsigned char *data, size_t len,
+				     int framed, size_t *packed_len);
+static void           begin_segment (Packer *packer);
+static void           end_segment   (Packer *packer, size_t offset,
+				     const unsigned char *tail,
+				     size_t tail_len, int last);
+static void           put_table     (Packer *packer);
+static int            write_file    (const char *filename,
+				     const unsigned char *buf, size_t len);
+
+
+/* Where the packer and unpacker find keys for each event */
+static const DataSource pack_source = { pack_key, NULL, NULL, NULL };
+static const DataSource archive_source = { archive_key, NULL, NULL, NULL };
+
+
+/**
+ * put_le32:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value to @buf as a little-endian 32-bit integer.
+ **/
+static inline void
+put_le32 (unsigned char *buf,
+	  unsigned long  value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * get_le32:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian 32-bit integer read from @buf.
+ **/
+static inline unsigned long
+get_le32 (const unsigned char *buf)
+{
+	return ((unsigned long) buf[3] << 24) | ((unsigned long) buf[2] << 16)
+		| ((unsigned long) buf[1] << 8) | buf[0];
+}
+
+/**
+ * put_le64:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value to @buf as a little-endian 64-bit integer.
+ **/
+static inline void
+put_le64 (unsigned char      *buf,
+	  unsigned long long  value)
+{
+	put_le32 (buf, value & 0xffffffff);
+	put_le32 (buf + 4, value >> 32);
+}
+
+/**
+ * get_le64:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian 64-bit integer read from @buf.
+ **/
+static inline unsigned long long
+get_le64 (const unsigned char *buf)
+{
+	return ((unsigned long long) get_le32 (buf + 4) << 32)
+		| get_le32 (buf);
+}
+
+
+/**
+ * pack_archive:
+ * @filename: capture file or raw dump to pack,
+ * @archive_name: archive to write,
+ * @key: decryption key for events the recording has no key for.
+ *
+ * Packs the recording in @filename into a compact archive.  Encryption
+ * leaves nothing for a general purpose compressor to find, so instead
+ * each payload is stored decrypted, with its packet header untouched;
+ * the salt needn't be stored since it's only ever reset at event starts
+ * and key frame markers, which are in the packets.  Payloads repeated
+ * within a segment are stored as references to a dictionary, and the
+ * times of reads as the difference from the one before.  If built with
+ * zlib, each segment is then compressed, which the decrypted payloads
+ * now allow.
+ *
+ * The archive is split into segments at each key frame marker, so each
+ * can be unpacked without the ones before.  Unpacking re-encrypts the
+ * payloads with the same salt, giving back the original recording byte
+ * for byte; this is checked before the archive is written.  A partial
+ * record at the end of a capture file isn't packed.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+pack_archive (const char   *filename,
+	      const char   *archive_name,
+	      unsigned int  key)
+{
+	MappedFile    map;
+	Packer       *packer;
+	Archive       check;
+	ArchiveOutput unpacked;
+	size_t        packed_len;
+	int           framed, ret = 1;
+
+	if (map_file (&map, filename)) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to pack"), filename, strerror (errno));
+		return 1;
+	}
+
+	framed = ((map.len >= CAPTURE_FILE_HEADER)
+		  && (! memcmp (map.data, CAPTURE_MAGIC, 4)));
+
+	packer = malloc (sizeof (Packer));
+	if (! packer)
+		abort ();
+	memset (packer, 0, sizeof (Packer));
+	packer->given_key = key;
+
+	info (1, _("Packing %s ...\n"), filename);
+	if (pack (packer, map.data, map.len, framed, &packed_len)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("unable to pack recording"));
+		goto error;
+	}
+	if (packed_len < map.len)
+		info (1, _("Discarding %zu bytes at the end of %s\n"),
+		      map.len - packed_len, filename);
+
+	/* Make sure we can get back what we started with */
+	memset (&unpacked, 0, sizeof (unpacked));
+	if (open_archive (&check, packer->out.buf, packer->out.len)) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("archive is corrupt"));
+		goto error;
+	}
+	if (read_archive (&check, &unpacked)
+	    || (unpacked.len != packed_len)
+	    || memcmp (unpacked.buf, map.data, packed_len)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("archive doesn't unpack to the recording"));
+		close_archive (&check);
+		free (unpacked.buf);
+		goto error;
+	}
+	close_archive (&check);
+	free (unpacked.buf);
+
+	if (write_file (archive_name, packer->out.buf, packer->out.len)) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to write archive"), archive_name,
+			 strerror (errno));
+		goto error;
+	}
+
+	info (0, _("Packed %zu bytes into %zu\n"), packed_len,
+	      packer->out.len);
+	ret = 0;
+
+error:
+	free (packer->records);
+	if (framed)
+		free ((void *) packer->stream);
+	if (packer->scan.archive) {
+		free (packer->scan.archive->keys);
+		free (packer->scan.archive->segments);
+		free (packer->scan.archive);
+	}
+	free (packer->out.buf);
+	free (packer->recs.buf);
+	free (packer->pkts.buf);
+	free (packer);
+	unmap_file (&map);
+
+	return ret;
+}
+
+/**
+ * unpack_archive:
+ * @archive_name: archive to unpack,
+ * @filename: file to write the recording to.
+ *
+ * Unpacks the whole of an archive written by pack_archive() back into
+ * the original recording.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+unpack_archive (const char *archive_name,
+		const char *filename)
+{
+	MappedFile    map;
+	Archive       archive;
+	ArchiveOutput out;
+	int           ret = 1;
+
+	if (map_file (&map, archive_name)) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to unpack"), archive_name,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (open_archive (&archive, map.data, map.len)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, archive_name,
+			 _("not an archive"));
+		unmap_file (&map);
+		return 1;
+	}
+
+	memset (&out, 0, sizeof (out));
+	if (read_archive (&archive, &out)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, archive_name,
+			 _("archive is corrupt"));
+	} else if (write_file (filename, out.buf, out.len)) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to write"), filename, strerror (errno));
+	} else {
+		info (0, _("Unpacked %s into %s\n"), archive_name, filename);
+		ret = 0;
+	}
+
+	free (out.buf);
+	close_archive (&archive);
+	unmap_file (&map);
+
+	return ret;
+}
+
+
+/**
+ * open_archive:
+ * @archive: archive to fill,
+ * @data: contents of the archive,
+ * @len: length of @data.
+ *
+ * Reads the header and table of segments of an archive.
+ *
+ * Returns: 0 on success, non-zero if @data isn't an archive.
+ **/
+int
+open_archive (Archive             *archive,
+	      const unsigned char *data,
+	      size_t               len)
+{
+	unsigned long long  table;
+	const unsigned char *p;
+	size_t              i;
+
+	memset (archive, 0, sizeof (Archive));
+	archive->data = data;
+	archive->len = len;
+
+	if ((len < ARCHIVE_FILE_HEADER + ARCHIVE_TRAILER + 8)
+	    || memcmp (data, ARCHIVE_MAGIC, 4)
+	    || (get_le32 (data + 4) != ARCHIVE_VERSION)
+	    || memcmp (data + len - 4, ARCHIVE_TABLE_MAGIC, 4))
+		return 1;
+
+	archive->flags = get_le32 (data + 8);
+	archive->capture_version = get_le32 (data + 12);
+
+	table = get_le64 (data + len - ARCHIVE_TRAILER);
+	if ((table < ARCHIVE_FILE_HEADER)
+	    || (table > len - ARCHIVE_TRAILER - 8))
+		return 1;
+
+	p = data + table;
+	archive->num_keys = get_le32 (p);
+	p += 4;
+	if (archive->num_keys > (data + len - ARCHIVE_TRAILER - 4 - p) / 8)
+		goto error;
+
+	archive->keys = malloc (sizeof (unsigned int) * 2
+				* MAX (archive->num_keys, 1));
+	if (! archive->keys)
+		abort ();
+	for (i = 0; i < archive->num_keys; i++, p += 8) {
+		archive->keys[i * 2] = get_le32 (p);
+		archive->keys[i * 2 + 1] = get_le32 (p + 4);
+	}
+
+	archive->num_segments = get_le32 (p);
+	p += 4;
+	if (archive->num_segments > ((data + len - ARCHIVE_TRAILER - p)
+				     / ARCHIVE_TABLE_ENTRY))
+		goto error;
+
+	archive->segments = malloc (sizeof (ArchiveSegment)
+				    * MAX (archive->num_segments, 1));
+	if (! archive->segments)
+		abort ();
+	for (i = 0; i < archive->num_segments; i++) {
+		ArchiveSegment *segment = &archive->segments[i];
+
+		segment->offset = get_le64 (p);
+		segment->frame = get_le32 (p + 8);
+		segment->time_ns = get_le64 (p + 12);
+		p += ARCHIVE_TABLE_ENTRY;
+
+		if ((segment->offset < ARCHIVE_FILE_HEADER)
+		    || (segment->offset + ARCHIVE_SEGMENT_HEADER > table))
+			goto error;
+	}
+
+	return 0;
+
+error:
+	close_archive (archive);
+	return 1;
+}
+
+/**
+ * close_archive:
+ * @archive: archive opened with open_archive().
+ *
+ * Frees the table read from the archive.
+ **/
+void
+close_archive (Archive *archive)
+{
+	free (archive->keys);
+	free (archive->segments);
+
+	archive->keys = NULL;
+	archive->segments = NULL;
+	archive->num_keys = archive->num_segments = 0;
+}
+
+/**
+ * read_archive:
+ * @archive: archive opened with open_archive(),
+ * @out: where to unpack to.
+ *
+ * Unpacks every segment of @archive, giving the recording that was
+ * packed.
+ *
+ * Returns: 0 on success, non-zero if the archive is corrupt.
+ **/
+int
+read_archive (const Archive *archive,
+	      ArchiveOutput *out)
+{
+	size_t i;
+
+	if ((archive->flags & ARCHIVE_FRAMED) && (! out->len)) {
+		memcpy (grow (out, CAPTURE_FILE_HEADER), CAPTURE_MAGIC, 4);
+		put_le32 (out->buf + 4, archive->capture_version);
+	}
+
+	for (i = 0; i < archive->num_segments; i++)
+		if (read_archive_segment (archive, i, out))
+			return 1;
+
+	return 0;
+}
+
+/**
+ * read_archive_segment:
+ * @archive: archive opened with open_archive(),
+ * @n: segment to unpack,
+ * @out: where to unpack to.
+ *
+ * Unpacks the segment numbered @n, appending it to @out.  For a packed
+ * capture file, if @out is empty the file header is written first, so
+ * @out always holds a valid capture file; a read split between this
+ * segment and the one before is joined back together if that one was
+ * the last unpacked to @out.  For a raw dump only the data stream is
+ * written.
+ *
+ * The segment needn't be the one after the last unpacked, so segments
+ * may be unpacked in any order, or at once by different threads into
+ * different outputs.
+ *
+ * Returns: 0 on success, non-zero if the segment is corrupt.
+ **/
+int
+read_archive_segment (const Archive *archive,
+		      size_t         n,
+		      ArchiveOutput *out)
+{
+	const unsigned char *p, *end;
+	ArchiveScan         *scan;
+	PackRecord          *records = NULL;
+	ArchiveOutput        stream;
+	unsigned long long   value, time_ns, last_time;
+	unsigned char       *inflated = NULL;
+	unsigned long        check;
+	size_t               stored_len, payload_len, num_records;
+	size_t               num_packets, tail_len, i, used = 0;
+	int                  ret = 1;
+
+	if (n >= archive->num_segments)
+		return 1;
+
+	p = archive->data + archive->segments[n].offset;
+	stored_len = get_le32 (p);
+	payload_len = get_le32 (p + 4);
+	if (stored_len > (archive->len - archive->segments[n].offset
+			  - ARCHIVE_SEGMENT_HEADER))
+		return 1;
+
+	scan = malloc (sizeof (ArchiveScan));
+	if (! scan)
+		abort ();
+	memset (scan, 0, sizeof (ArchiveScan));
+	memset (&stream, 0, sizeof (stream));
+
+	scan->archive = (Archive *) archive;
+	scan->state.source = &archive_source;
+	scan->state.frame = get_le32 (p + 8);
+	scan->state.event_no = get_le32 (p + 12);
+	scan->state.key = get_le32 (p + 16);
+	reset_decryption (&scan->state);
+
+	time_ns = last_time = get_le64 (p + 20);
+	num_records = get_le32 (p + 28);
+	num_packets = get_le32 (p + 32);
+	tail_len = get_le32 (p + 36);
+	check = get_le32 (p + 40);
+
+	p += ARCHIVE_SEGMENT_HEADER;
+	if (archive->flags & ARCHIVE_DEFLATE) {
+#if HAVE_LIBZ
+		uLongf len = payload_len;
+
+		inflated = malloc (MAX (payload_len, 1));
+		if (! inflated)
+			abort ();
+		if ((uncompress (inflated, &len, p, stored_len) != Z_OK)
+		    || (len != payload_len))
+			goto error;
+
+		p = inflated;
+#else /* HAVE_LIBZ */
+		info (0, _("Archive is compressed, and live-f1 was built "
+			   "without zlib\n"));
+		goto error;
+#endif /* HAVE_LIBZ */
+	} else if (stored_len != payload_len) {
+		goto error;
+	}
+
+	end = p + payload_len;
+	if (adler32_sum (1, p, payload_len) != check)
+		goto error;
+
+	if (num_records > payload_len)
+		goto error;
+	records = malloc (sizeof (PackRecord) * MAX (num_records, 1));
+	if (! records)
+		abort ();
+
+	/* Records come first, without the data of reads from the data
+	 * stream, which is made from the packets that follow.
+	 */
+	for (i = 0; i < num_records; i++) {
+		PackRecord *record = &records[i];
+
+		if (p >= end)
+			goto error;
+		record->source = *(p++);
+
+		if (! get_varint (&p, end, &value))
+			goto error;
+		time_ns = last_time + (long long) ((value >> 1)
+						   ^ -(value & 1));
+		record->time_ns = last_time = time_ns;
+
+		if (! get_varint (&p, end, &value))
+			goto error;
+		record->len = value;
+		if (! get_varint (&p, end, &value))
+			goto error;
+		record->arg = value;
+
+		if ((record->source & ~CONTINUED) == CAPTURE_STREAM) {
+			record->data = NULL;
+		} else {
+			if (record->len > (size_t) (end - p))
+				goto error;
+			record->data = p;
+			p += record->len;
+		}
+	}
+
+	/* Then each packet: the header, then if there's a payload either
+	 * zero and the decrypted payload, or its place in the dictionary.
+	 * Payloads are encrypted again, following the salt as we go.
+	 */
+	for (i = 0; i < num_packets; i++) {
+		Packet         packet;
+		unsigned char *dest;
+		int            decrypt;
+
+		if (end - p < 2)
+			goto error;
+		decrypt = packet_header (&packet, p);
+
+		dest = grow (&stream, 2 + MAX (packet.len, 0));
+		dest[0] = p[0];
+		dest[1] = p[1];
+		p += 2;
+
+		if (packet.len > 0) {
+			size_t code;
+
+			if (p >= end)
+				goto error;
+			code = *(p++);
+
+			if (code) {
+				if ((code > scan->dict.used)
+				    || (scan->dict.len[code - 1] != packet.len))
+					goto error;
+				memcpy (packet.payload,
+					scan->dict.text[code - 1], packet.len);
+			} else {
+				if (packet.len > end - p)
+					goto error;
+				memcpy (packet.payload, p, packet.len);
+				add_text (&scan->dict, p, packet.len);
+				p += packet.len;
+			}
+			packet.payload[packet.len] = 0;
+
+			memcpy (dest + 2, packet.payload, packet.len);
+			if (decrypt)
+				decrypt_bytes (&scan->state, dest + 2,
+					       packet.len);
+		} else {
+			packet.payload[0] = 0;
+		}
+
+		follow_packet (&scan->state, &packet);
+	}
+
+	/* Partial packet at the end of the recording */
+	if (tail_len > (size_t) (end - p))
+		goto error;
+	put_bytes (&stream, p, tail_len);
+	p += tail_len;
+	if (p != end)
+		goto error;
+
+	/* Now put the records back together, taking each read in turn
+	 * from the data stream.
+	 */
+	if (! (archive->flags & ARCHIVE_FRAMED)) {
+		for (i = 0; i < num_records; i++)
+			used += records[i].len;
+		if (used != stream.len)
+			goto error;
+
+		put_bytes (out, stream.buf, stream.len);
+		ret = 0;
+		goto error;
+	}
+
+	if (! out->len) {
+		memcpy (grow (out, CAPTURE_FILE_HEADER), CAPTURE_MAGIC, 4);
+		put_le32 (out->buf + 4, archive->capture_version);
+		out->last = 0;
+	}
+
+	for (i = 0; i < num_records; i++) {
+		PackRecord          *record = &records[i];
+		CaptureSource        source = record->source & ~CONTINUED;
+		const unsigned char *data = record->data;
+		unsigned char       *header;
+
+		if (source == CAPTURE_STREAM) {
+			if (record->len > stream.len - used)
+				goto error;
+			data = stream.buf + used;
+			used += record->len;
+		}
+
+		if ((record->source & CONTINUED) && out->last
+		    && (out->buf[out->last + 16] == CAPTURE_STREAM)) {
+			size_t len;
+
+			len = get_le32 (out->buf + out->last + 8);
+			put_bytes (out, data, record->len);
+
+			header = out->buf + out->last;
+			put_capture_header (header, get_le64 (header), source,
+					    get_le32 (header + 12),
+					    header + CAPTURE_HEADER,
+					    len + record->len);
+		} else {
+			out->last = out->len;
+			grow (out, CAPTURE_HEADER);
+			put_bytes (out, data, record->len);
+
+			header = out->buf + out->last;
+			put_capture_header (header, record->time_ns, source,
+					    record->arg,
+					    header + CAPTURE_HEADER,
+					    record->len);
+		}
+	}
+
+	if (used != stream.len)
+		goto error;
+
+	ret = 0;
+
+error:
+	free (stream.buf);
+	free (records);
+	free (inflated);
+	free (scan);
+
+	return ret;
+}
+
+
+/**
+ * grow:
+ * @out: buffer to grow,
+ * @len: number of bytes to add.
+ *
+ * Extends @out by @len bytes.
+ *
+ * Returns: pointer to the bytes added.
+ **/
+static unsigned char *
+grow (ArchiveOutput *out,
+      size_t         len)
+{
+	if (out->len + len > out->alloc) {
+		out->alloc = MAX (out->alloc * 2, out->len + len);
+		out->alloc = MAX (out->alloc, 4096);
+		out->buf = realloc (out->buf, out->alloc);
+		if (! out->buf)
+			abort ();
+	}
+
+	out->len += len;
+	return out->buf + out->len - len;
+}
+
+/**
+ * put_bytes:
+ * @out: buffer to append to,
+ * @buf: bytes to append,
+ * @len: length of @buf.
+ *
+ * Appends @buf to @out.
+ **/
+static void
+put_bytes (ArchiveOutput *out,
+	   const void    *buf,
+	   size_t         len)
+{
+	if (len)
+		memcpy (grow (out, len), buf, len);
+}
+
+/**
+ * put_varint:
+ * @out: buffer to append to,
+ * @value: value to append.
+ *
+ * Appends @value seven bits at a time, least significant first, with
+ * the top bit of each byte set if there are more to follow.
+ **/
+static void
+put_varint (ArchiveOutput      *out,
+	    unsigned long long  value)
+{
+	unsigned char buf[10];
+	size_t        len = 0;
+
+	do {
+		buf[len] = value & 0x7f;
+		value >>= 7;
+		if (value)
+			buf[len] |= 0x80;
+		len++;
+	} while (value);
+
+	put_bytes (out, buf, len);
+}
+
+/**
+ * get_varint:
+ * @p: pointer to the value, moved past it,
+ * @end: end of the buffer,
+ * @value: pointer to store the value.
+ *
+ * Reads a value written by put_varint().
+ *
+ * Returns: TRUE on success, FALSE if it runs past @end.
+ **/
+static int
+get_varint (const unsigned char **p,
+	    const unsigned char  *end,
+	    unsigned long long   *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while ((*p < end) && (shift < 64)) {
+		*value |= (unsigned long long) (**p & 0x7f) << shift;
+		shift += 7;
+
+		if (! (*((*p)++) & 0x80))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * follow_packet:
+ * @state: decryption state,
+ * @packet: decrypted packet.
+ *
+ * Changes the key and resets the salt as handle_system_packet() does,
+ * which is all that's needed to decrypt the next packet.  Key frames
+ * fetched while parsing a marker leave the salt reset, so they don't
+ * matter.
+ **/
+static void
+follow_packet (CurrentState *state,
+	       const Packet *packet)
+{
+	unsigned int number;
+	int          i;
+
+	if (packet->car)
+		return;
+
+	switch ((SystemPacketType) packet->type) {
+	case SYS_EVENT_ID:
+		number = 0;
+		for (i = 1; i < packet->len; i++) {
+			number *= 10;
+			number += packet->payload[i] - '0';
+		}
+
+		state->event_no = number;
+		state->key = get_decryption_key (state, number);
+		reset_decryption (state);
+		break;
+	case SYS_KEY_FRAME:
+		number = 0;
+		i = packet->len;
+		while (i > 0) {
+			number <<= 8;
+			number |= packet->payload[--i];
+		}
+
+		state->frame = number;
+		reset_decryption (state);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * add_text:
+ * @dict: dictionary to add to,
+ * @text: payload to add,
+ * @len: length of @text.
+ *
+ * Adds @text to @dict, replacing the oldest entry once it's full.
+ **/
+static void
+add_text (Dictionary          *dict,
+	  const unsigned char *text,
+	  int                  len)
+{
+	memcpy (dict->text[dict->next], text, len);
+	dict->len[dict->next] = len;
+
+	dict->next = (dict->next + 1) % DICT_SIZE;
+	dict->used = MAX (dict->used, dict->next ? dict->next : DICT_SIZE);
+}
+
+/**
+ * pack_key:
+ * @state: decryption state within the packer,
+ * @event_no: event number.
+ *
+ * Finds the key for @event_no as a replay of the recording would: the
+ * first recorded, otherwise the one given.  Keys are added to the table
+ * in the archive as they're found.
+ *
+ * Returns: decryption key.
+ **/
+static unsigned int
+pack_key (CurrentState *state,
+	  unsigned int  event_no)
+{
+	Packer       *packer = (Packer *) state;
+	Archive      *archive = packer->scan.archive;
+	unsigned int  key = 0;
+	size_t        i;
+
+	for (i = 0; i < archive->num_keys; i++)
+		if (archive->keys[i * 2] == event_no)
+			return archive->keys[i * 2 + 1];
+
+	for (i = 0; (! key) && (i < packer->num_records); i++) {
+		const PackRecord *record = &packer->records[i];
+
+		if ((record->source == CAPTURE_KEY)
+		    && (record->arg == event_no) && (record->len == 4))
+			key = get_le32 (record->data);
+	}
+	if (! key)
+		key = packer->given_key;
+	if (! key)
+		info (1, _("No decryption key for event %u, use --key\n"),
+		      event_no);
+
+	archive->keys = realloc (archive->keys, (sizeof (unsigned int) * 2
+						 * (archive->num_keys + 1)));
+	if (! archive->keys)
+		abort ();
+	archive->keys[archive->num_keys * 2] = event_no;
+	archive->keys[archive->num_keys * 2 + 1] = key;
+	archive->num_keys++;
+
+	return key;
+}
+
+/**
+ * archive_key:
+ * @state: decryption state within read_archive_segment(),
+ * @event_no: event number.
+ *
+ * Returns: key used for @event_no when the archive was packed.
+ **/
+static unsigned int
+archive_key (CurrentState *state,
+	     unsigned int  event_no)
+{
+	const Archive *archive = ((ArchiveScan *) state)->archive;
+	size_t         i;
+
+	for (i = 0; i < archive->num_keys; i++)
+		if (archive->keys[i * 2] == event_no)
+			return archive->keys[i * 2 + 1];
+
+	return 0;
+}
+
+
+/**
+ * pack:
+ * @packer: packer state,
+ * @data: recording to pack,
+ * @len: length of @data,
+ * @framed: TRUE if @data is a capture file, FALSE for a raw dump,
+ * @packed_len: pointer to store the length of @data packed.
+ *
+ * Packs @data into @packer's output.  The data stream is put back
+ * together from the reads in a capture file first, since packets cross
+ * from one read to the next.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+pack (Packer              *packer,
+      const unsigned char *data,
+      size_t               len,
+      int                  framed,
+      size_t              *packed_len)
+{
+	const unsigned char *buf, *hdr;
+	Packet               packet;
+	PacketReader         reader;
+	unsigned char        header[ARCHIVE_FILE_HEADER];
+	size_t               stream_len = 0, buf_len, alloc = 0;
+
+	packer->scan.archive = malloc (sizeof (Archive));
+	if (! packer->scan.archive)
+		abort ();
+	memset (packer->scan.archive, 0, sizeof (Archive));
+
+	if (framed) {
+		unsigned char *stream;
+		CaptureRecord  record;
+		size_t         off;
+		ssize_t        used;
+
+		for (off = CAPTURE_FILE_HEADER; off < len; off += used) {
+			used = parse_capture_record (data + off, len - off,
+						     &record);
+			if (used <= 0)
+				break;
+
+			if (packer->num_records == alloc) {
+				alloc = MAX (alloc * 2, 1024);
+				packer->records = realloc (packer->records,
+							   (sizeof (PackRecord)
+							    * alloc));
+				if (! packer->records)
+					abort ();
+			}
+
+			packer->records[packer->num_records].time_ns
+				= record.time_ns;
+			packer->records[packer->num_records].source
+				= record.source;
+			packer->records[packer->num_records].arg = record.arg;
+			packer->records[packer->num_records].len = record.len;
+			packer->records[packer->num_records].data
+				= record.data;
+			packer->records[packer->num_records].offset
+				= stream_len;
+			packer->num_records++;
+
+			if (record.source == CAPTURE_STREAM)
+				stream_len += record.len;
+		}
+		*packed_len = off;
+
+		stream = malloc (MAX (stream_len, 1));
+		if (! stream)
+			abort ();
+
+		for (off = 0; off < packer->num_records; off++) {
+			PackRecord *record = &packer->records[off];
+
+			if (record->source == CAPTURE_STREAM) {
+				memcpy (stream + record->offset, record->data,
+					record->len);
+				record->data = NULL;
+			}
+		}
+
+		packer->stream = stream;
+	} else {
+		packer->records = malloc (sizeof (PackRecord));
+		if (! packer->records)
+			abort ();
+		memset (packer->records, 0, sizeof (PackRecord));
+		packer->records[0].source = CAPTURE_STREAM;
+		packer->records[0].len = len;
+		packer->num_records = 1;
+
+		packer->stream = data;
+		stream_len = *packed_len = len;
+	}
+
+	packer->scan.archive->flags = framed ? ARCHIVE_FRAMED : 0;
+#if HAVE_LIBZ
+	packer->scan.archive->flags |= ARCHIVE_DEFLATE;
+#endif /* HAVE_LIBZ */
+
+	memcpy (header, ARCHIVE_MAGIC, 4);
+	put_le32 (header + 4, ARCHIVE_VERSION);
+	put_le32 (header + 8, packer->scan.archive->flags);
+	put_le32 (header + 12, framed ? get_le32 (data + 4) : 0);
+	put_bytes (&packer->out, header, sizeof (header));
+
+	/* As a fresh connection would begin */
+	packer->scan.state.source = &pack_source;
+	reset_decryption (&packer->scan.state);
+	begin_segment (packer);
+
+	memset (&reader, 0, sizeof (reader));
+	buf = packer->stream;
+	buf_len = stream_len;
+	for (;;) {
+		hdr = buf;
+		if (! next_packet (&packer->scan.state, &reader, &packet,
+				   &buf, &buf_len))
+			break;
+
+		put_bytes (&packer->pkts, hdr, 2);
+		if (packet.len > 0) {
+			Dictionary *dict = &packer->scan.dict;
+			size_t      i;
+
+			for (i = 0; i < dict->used; i++)
+				if ((dict->len[i] == packet.len)
+				    && (! memcmp (dict->text[i],
+						  packet.payload,
+						  packet.len)))
+					break;
+
+			if (i < dict->used) {
+				unsigned char code = i + 1;
+
+				put_bytes (&packer->pkts, &code, 1);
+			} else {
+				unsigned char code = 0;
+
+				put_bytes (&packer->pkts, &code, 1);
+				put_bytes (&packer->pkts, packet.payload,
+					   packet.len);
+				add_text (dict, packet.payload, packet.len);
+			}
+		}
+		packer->num_packets++;
+
+		follow_packet (&packer->scan.state, &packet);
+		if ((! packet.car) && (packet.type == SYS_KEY_FRAME)) {
+			end_segment (packer, buf - packer->stream, NULL, 0,
+				     FALSE);
+			begin_segment (packer);
+		}
+	}
+
+	end_segment (packer, stream_len, hdr,
+		     packer->stream + stream_len - hdr, TRUE);
+	put_table (packer);
+
+	return 0;
+}
+
+/**
+ * begin_segment:
+ * @packer: packer state.
+ *
+ * Begins a new segment where the salt has just been reset;
+ * the header is filled in with the state needed to carry on from here.
+ **/
+static void
+begin_segment (Packer *packer)
+{
+	packer->num_packets = 0;
+	packer->recs.len = packer->pkts.len = 0;
+
+	packer->scan.dict.used = packer->scan.dict.next = 0;
+
+	memset (packer->header, 0, sizeof (packer->header));
+	put_le32 (packer->header + 8, packer->scan.state.frame);
+	put_le32 (packer->header + 12, packer->scan.state.event_no);
+	put_le32 (packer->header + 16, packer->scan.state.key);
+}
+
+/**
+ * end_segment:
+ * @packer: packer state,
+ * @offset: offset in the data stream the segment ends at,
+ * @tail: partial packet at the end of the data stream,
+ * @tail_len: length of @tail,
+ * @last: TRUE if this is the last segment.
+ *
+ * Writes out the segment, along with the records before @offset; a
+ * read that crosses @offset is split in two, the second half marked as
+ * continued in the next segment.  Everything left goes in the last
+ * segment.
+ **/
+static void
+end_segment (Packer              *packer,
+	     size_t               offset,
+	     const unsigned char *tail,
+	     size_t               tail_len,
+	     int                  last)
+{
+	Archive       *archive = packer->scan.archive;
+	ArchiveSegment *segment;
+	long long      last_time = 0;
+	size_t         num_records = 0;
+
+	while (packer->next_record < packer->num_records) {
+		const PackRecord *record;
+		unsigned char     source;
+		size_t            start, len;
+
+		record = &packer->records[packer->next_record];
+		source = record->source;
+		start = record->offset + packer->done;
+		len = record->len - packer->done;
+
+		if ((! last) && (start >= offset))
+			break;
+
+		if (source == CAPTURE_STREAM) {
+			if (packer->done)
+				source |= CONTINUED;
+			if ((! last) && (start + len > offset))
+				len = offset - start;
+		}
+
+		if (! num_records) {
+			put_le64 (packer->header + 20, record->time_ns);
+			last_time = record->time_ns;
+		}
+
+		put_bytes (&packer->recs, &source, 1);
+		put_varint (&packer->recs,
+			    (((unsigned long long) (record->time_ns
+						    - last_time) << 1)
+			     ^ (unsigned long long) ((record->time_ns
+						      - last_time) >> 63)));
+		put_varint (&packer->recs, len);
+		put_varint (&packer->recs, record->arg);
+		if (record->data)
+			put_bytes (&packer->recs, record->data, len);
+
+		last_time = record->time_ns;
+		num_records++;
+
+		if ((source & ~CONTINUED) == CAPTURE_STREAM) {
+			packer->done += len;
+			if (packer->done < record->len)
+				break;
+		}
+
+		packer->done = 0;
+		packer->next_record++;
+	}
+
+	archive->segments = realloc (archive->segments,
+				     (sizeof (ArchiveSegment)
+				      * (archive->num_segments + 1)));
+	if (! archive->segments)
+		abort ();
+	segment = &archive->segments[archive->num_segments++];
+	segment->offset = packer->out.len;
+	segment->frame = get_le32 (packer->header + 8);
+	segment->time_ns = get_le64 (packer->header + 20);
+
+	put_bytes (&packer->recs, packer->pkts.buf, packer->pkts.len);
+	put_bytes (&packer->recs, tail, tail_len);
+
+	put_le32 (packer->header + 4, packer->recs.len);
+	put_le32 (packer->header + 28, num_records);
+	put_le32 (packer->header + 32, packer->num_packets);
+	put_le32 (packer->header + 36, tail_len);
+	put_le32 (packer->header + 40,
+		  adler32_sum (1, packer->recs.buf, packer->recs.len));
+
+#if HAVE_LIBZ
+	if (archive->flags & ARCHIVE_DEFLATE) {
+		uLongf len;
+
+		len = compressBound (packer->recs.len);
+		grow (&packer->out, sizeof (packer->header) + len);
+		if (compress2 (packer->out.buf + segment->offset
+			       + sizeof (packer->header), &len,
+			       packer->recs.buf, packer->recs.len,
+			       Z_BEST_COMPRESSION) != Z_OK)
+			abort ();
+
+		put_le32 (packer->header, len);
+		memcpy (packer->out.buf + segment->offset, packer->header,
+			sizeof (packer->header));
+		packer->out.len = (segment->offset + sizeof (packer->header)
+				   + len);
+		return;
+	}
+#endif /* HAVE_LIBZ */
+
+	put_le32 (packer->header, packer->recs.len);
+	put_bytes (&packer->out, packer->header, sizeof (packer->header));
+	put_bytes (&packer->out, packer->recs.buf, packer->recs.len);
+}
+
+/**
+ * put_table:
+ * @packer: packer state.
+ *
+ * Writes the keys and the table of segments at the end of the archive,
+ * and the trailer pointing to them.
+ **/
+static void
+put_table (Packer *packer)
+{
+	const Archive *archive = packer->scan.archive;
+	unsigned char  buf[ARCHIVE_TABLE_ENTRY];
+	size_t         table, i;
+
+	table = packer->out.len;
+
+	put_le32 (buf, archive->num_keys);
+	put_bytes (&packer->out, buf, 4);
+	for (i = 0; i < archive->num_keys; i++) {
+		put_le32 (buf, archive->keys[i * 2]);
+		put_le32 (buf + 4, archive->keys[i * 2 + 1]);
+		put_bytes (&packer->out, buf, 8);
+	}
+
+	put_le32 (buf, archive->num_segments);
+	put_bytes (&packer->out, buf, 4);
+	for (i = 0; i < archive->num_segments; i++) {
+		const ArchiveSegment *segment = &archive->segments[i];
+
+		put_le64 (buf, segment->offset);
+		put_le32 (buf + 8, segment->frame);
+		put_le64 (buf + 12, segment->time_ns);
+		put_bytes (&packer->out, buf, ARCHIVE_TABLE_ENTRY);
+	}
+
+	put_le64 (buf, table);
+	memcpy (buf + 8, ARCHIVE_TABLE_MAGIC, 4);
+	put_bytes (&packer->out, buf, ARCHIVE_TRAILER);
+}
+
+/**
+ * write_file:
+ * @filename: file to write,
+ * @buf: contents of the file,
+ * @len: length of @buf.
+ *
+ * Writes @buf to a temporary file next to @filename, then renames it
+ * over @filename, so nothing is left half-written.
+ *
+ * Returns: 0 on success, non-zero on failure with errno set.
+ **/
+static int
+write_file (const char          *filename,
+	    const unsigned char *buf,
+	    size_t               len)
+{
+	char   *tmpfile;
+	FILE   *outf;
+	size_t  written;
+
+	tmpfile = malloc (strlen (filename) + 5);
+	if (! tmpfile)
+		abort ();
+	sprintf (tmpfile, "%s.tmp", filename);
+
+	outf = fopen (tmpfile, "w");
+	if (! outf)
+		goto error;
+
+	written = fwrite (buf, 1, len, outf);
+	if (fclose (outf) || (written != len)
+	    || rename (tmpfile, filename)) {
+		unlink (tmpfile);
+		goto error;
+	}
+
+	free (tmpfile);
+	return 0;
+
+error:
+	free (tmpfile);
+	return 1;
+}
@@ -0,0 +1,120 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_ARCHIVE_H
+#define LIVE_F1_ARCHIVE_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Archive file magic, and the size of the file header, the header
+ * before each segment and each entry in the table at the end */
+#define ARCHIVE_MAGIC          "LF1A"
+#define ARCHIVE_VERSION        1
+#define ARCHIVE_FILE_HEADER    16
+#define ARCHIVE_SEGMENT_HEADER 44
+#define ARCHIVE_TABLE_ENTRY    20
+
+/* Magic and size of the trailer giving the offset of the table */
+#define ARCHIVE_TABLE_MAGIC    "LF1T"
+#define ARCHIVE_TRAILER        12
+
+
+/**
+ * ArchiveFlags:
+ *
+ * What was packed into an archive.
+ **/
+typedef enum {
+	ARCHIVE_FRAMED		= (1 << 0),
+	ARCHIVE_DEFLATE		= (1 << 1),
+} ArchiveFlags;
+
+/**
+ * ArchiveSegment:
+ * @offset: offset of the segment header in the archive,
+ * @frame: key frame marker the segment begins after, zero for the first,
+ * @time_ns: time of the first read in the segment, or zero.
+ *
+ * Each segment of an archive can be unpacked on its own, since the salt
+ * is reset at the key frame marker that begins it.
+ **/
+typedef struct {
+	unsigned long long offset;
+	unsigned int       frame;
+	long long          time_ns;
+} ArchiveSegment;
+
+/**
+ * Archive:
+ * @data: contents of the archive,
+ * @len: length of @data,
+ * @flags: ArchiveFlags,
+ * @capture_version: version from the header of the packed capture file,
+ * @keys: event number and key pairs,
+ * @num_keys: number of pairs in @keys,
+ * @segments: segments of the archive, in order,
+ * @num_segments: number of @segments.
+ *
+ * An archive opened with open_archive(); @data isn't copied, so must
+ * remain valid until close_archive() is called.
+ **/
+typedef struct {
+	const unsigned char *data;
+	size_t               len;
+	unsigned int         flags, capture_version;
+	unsigned int        *keys;
+	size_t               num_keys;
+	ArchiveSegment      *segments;
+	size_t               num_segments;
+} Archive;
+
+/**
+ * ArchiveOutput:
+ * @buf: unpacked data,
+ * @len: length of @buf,
+ * @alloc: bytes allocated for @buf,
+ * @last: offset of the last capture record in @buf, or zero.
+ *
+ * Where archive segments are unpacked to; zero it before the first.
+ **/
+typedef struct {
+	unsigned char *buf;
+	size_t         len, alloc, last;
+} ArchiveOutput;
+
+
+SJR_BEGIN_EXTERN
+
+int  pack_archive         (const char *filename, const char *archive_name,
+			   unsigned int key);
+int  unpack_archive       (const char *archive_name, const char *filename);
+
+int  open_archive         (Archive *archive, const unsigned char *data,
+			   size_t len);
+int  read_archive_segment (const Archive *archive, size_t n,
+			   ArchiveOutput *out);
+int  read_archive         (const Archive *archive, ArchiveOutput *out);
+void close_archive        (Archive *archive);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_ARCHIVE_H */
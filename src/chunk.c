@@ -0,0 +1,206 @@
+/* live-f1
+ *
+ * chunk.c - reference-counted blocks of data queued for sockets
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "chunk.h"
+
+
+/* Most chunks sent by one call */
+#define CHUNK_IOV_MAX 16
+
+
+/**
+ * new_chunk:
+ * @data: bytes to copy into the chunk, or NULL,
+ * @len: length of @data.
+ *
+ * Allocates a chunk with room for @len bytes, copying @data into it if
+ * given; otherwise the caller fills it in, and may shorten its length.
+ *
+ * Returns: new chunk with a single reference.
+ **/
+Chunk *
+new_chunk (const void *data,
+	   size_t      len)
+{
+	Chunk *chunk;
+
+	chunk = malloc (sizeof (Chunk) + len);
+	if (! chunk)
+		abort ();
+
+	chunk->refs = 1;
+	chunk->len = len;
+	if (data)
+		memcpy (chunk->data, data, len);
+
+	return chunk;
+}
+
+/**
+ * ref_chunk:
+ * @chunk: chunk.
+ *
+ * Adds a reference to @chunk.
+ *
+ * Returns: @chunk.
+ **/
+Chunk *
+ref_chunk (Chunk *chunk)
+{
+	chunk->refs++;
+	return chunk;
+}
+
+/**
+ * unref_chunk:
+ * @chunk: chunk.
+ *
+ * Drops a reference to @chunk, freeing it once it has been sent on
+ * every queue it was pushed onto.
+ **/
+void
+unref_chunk (Chunk *chunk)
+{
+	if (--chunk->refs == 0)
+		free (chunk);
+}
+
+/**
+ * push_chunk:
+ * @queue: queue to add to,
+ * @chunk: chunk to send.
+ *
+ * Adds a reference to @chunk to the end of @queue; nothing is sent
+ * until send_chunks() is called.
+ *
+ * Returns: 0 on success, -1 if the queue is full.
+ **/
+int
+push_chunk (ChunkQueue *queue,
+	    Chunk      *chunk)
+{
+	if (queue->count >= CHUNK_QUEUE_MAX)
+		return -1;
+
+	queue->chunks[(queue->head + queue->count) % CHUNK_QUEUE_MAX]
+		= ref_chunk (chunk);
+	queue->count++;
+
+	return 0;
+}
+
+/**
+ * send_chunks:
+ * @queue: queue to send,
+ * @fd: non-blocking socket to send on.
+ *
+ * Sends as much of @queue as @fd will take, gathering the chunks so
+ * each call to the kernel sends as many as it can.  Chunks that have
+ * been sent completely are dropped from the queue.
+ *
+ * Returns: 1 if some of @queue is left to send, 0 if it's empty, -1 on
+ * error.
+ **/
+int
+send_chunks (ChunkQueue *queue,
+	     int         fd)
+{
+	struct iovec  iov[CHUNK_IOV_MAX];
+	struct msghdr msg;
+	Chunk        *chunk;
+	ssize_t       len;
+	int           niov, i;
+
+	while (queue->count) {
+		niov = MIN (queue->count, CHUNK_IOV_MAX);
+		for (i = 0; i < niov; i++) {
+			chunk = queue->chunks[(queue->head + i)
+					      % CHUNK_QUEUE_MAX];
+			iov[i].iov_base = chunk->data;
+			iov[i].iov_len = chunk->len;
+		}
+		iov[0].iov_base = (char *) iov[0].iov_base + queue->off;
+		iov[0].iov_len -= queue->off;
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = niov;
+
+		len = sendmsg (fd, &msg, MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 1;
+
+			return -1;
+		}
+
+		/* Drop the chunks that have gone completely */
+		len += queue->off;
+		while (queue->count) {
+			chunk = queue->chunks[queue->head];
+			if ((size_t) len < chunk->len)
+				break;
+
+			len -= chunk->len;
+			unref_chunk (chunk);
+			queue->head = (queue->head + 1) % CHUNK_QUEUE_MAX;
+			queue->count--;
+		}
+		queue->off = len;
+	}
+
+	return 0;
+}
+
+/**
+ * clear_chunks:
+ * @queue: queue to clear.
+ *
+ * Drops everything left on @queue.
+ **/
+void
+clear_chunks (ChunkQueue *queue)
+{
+	while (queue->count) {
+		unref_chunk (queue->chunks[queue->head]);
+		queue->head = (queue->head + 1) % CHUNK_QUEUE_MAX;
+		queue->count--;
+	}
+
+	queue->head = 0;
+	queue->off = 0;
+}
@@ -0,0 +1,76 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_CHUNK_H
+#define LIVE_F1_CHUNK_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Most chunks queued for a socket; one that falls further behind is
+ * dropped by its owner */
+#define CHUNK_QUEUE_MAX 64
+
+
+/**
+ * Chunk:
+ * @refs: number of queues it's on, and other references,
+ * @len: length of @data,
+ * @data: bytes to send.
+ *
+ * Block of data to send.  Chunks are reference counted so the same one
+ * can be queued for any number of sockets without being copied.
+ **/
+typedef struct {
+	int           refs;
+	size_t        len;
+	unsigned char data[];
+} Chunk;
+
+/**
+ * ChunkQueue:
+ * @chunks: chunks waiting to be sent,
+ * @head: index of the first chunk in @chunks,
+ * @count: number of chunks in @chunks,
+ * @off: how much of the first chunk has been sent.
+ *
+ * Chunks waiting to be sent on a non-blocking socket.
+ **/
+typedef struct {
+	Chunk  *chunks[CHUNK_QUEUE_MAX];
+	int     head, count;
+	size_t  off;
+} ChunkQueue;
+
+
+SJR_BEGIN_EXTERN
+
+Chunk *new_chunk    (const void *data, size_t len);
+Chunk *ref_chunk    (Chunk *chunk);
+void   unref_chunk  (Chunk *chunk);
+
+int    push_chunk   (ChunkQueue *queue, Chunk *chunk);
+int    send_chunks  (ChunkQueue *queue, int fd);
+void   clear_chunks (ChunkQueue *queue);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_CHUNK_H */
@@ -0,0 +1,197 @@
+/* live-f1
+ *
+ * client.c - connecting to and reading from the live timing server
+ *
+ * Copyright © 2005 Scott James Remnant <scott@netsplit.com>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "client.h"
+#include "record.h"
+#include "relay.h"
+#include "sink.h"
+#include "stats.h"
+#include "stream.h"
+#include "timeshift.h"
+#include "watch.h"
+
+
+/**
+ * open_stream:
+ * @hostname: hostname of timing server,
+ * @port: port of timing server.
+ *
+ * Creates a socket for the data stream and connects to the live timing
+ * server so data can be received.
+ *
+ * Returns: connected socket or -1 on failure.
+ **/
+int
+open_stream (const char   *hostname,
+	     unsigned int  port)
+{
+	struct addrinfo *res, *addr, hints;
+	static char      service[6];
+	int              sock, ret;
+
+	info (2, _("Looking up %s ...\n"), hostname);
+
+	sprintf (service, "%hu", port);
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_CANONNAME;
+
+	ret = getaddrinfo (hostname, service, &hints, &res);
+	if (ret != 0) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("failed to resolve host"), hostname,
+			 gai_strerror (ret));
+		return -1;
+	}
+
+	info (1, _("Connecting to data stream ...\n"));
+
+	sock = -1;
+	for (addr = res; addr; addr = addr->ai_next) {
+		info (3, _("Trying %s ...\n"), addr->ai_canonname);
+
+		sock = socket (addr->ai_family, addr->ai_socktype,
+			       addr->ai_protocol);
+		if (sock < 0)
+			continue;
+
+		ret = connect (sock, addr->ai_addr, addr->ai_addrlen);
+		if (ret < 0) {
+			close (sock);
+			sock = -1;
+			continue;
+		}
+
+		break;
+	}
+
+	if (sock >= 0)
+		info (2, _("Connected to %s.\n"), addr->ai_canonname);
+
+	freeaddrinfo (res);
+	return sock;
+}
+
+/**
+ * read_stream:
+ * @state: application state structure,
+ * @sock: socket to read from.
+ *
+ * Read a block of data from the stream, this isn't quite as simple as it
+ * seems because the server won't actually send us data unless we ping it;
+ * but we don't want to ping as often as we need to check for things like
+ * key presses from the user.  Any other watched file descriptors are
+ * polled at the same time.
+ *
+ * Returns: 0 if socket closed, > 0 on success, < 0 on error.
+ **/
+int
+read_stream (CurrentState *state, int sock)
+{
+	struct pollfd    poll_fd;
+	static long long active = 0;
+	int              numr, len;
+
+	poll_fd.fd = sock;
+	poll_fd.events = POLLIN;
+	poll_fd.revents = 0;
+
+	if (! active)
+		active = monotonic_ns ();
+
+	numr = poll_watches (&poll_fd, 100);
+	if (numr > 0) {
+		unsigned char buf[512];
+
+		len = read (sock, buf, sizeof (buf));
+		if (len > 0) {
+			stats.bytes += len;
+			stats.reads++;
+			if (stats.ping_ns) {
+				stats.ping_burst_ns = (monotonic_ns ()
+						       - stats.ping_ns);
+				stats.ping_ns = 0;
+			}
+
+			capture (CAPTURE_STREAM, 0, buf, len);
+			relay_block (buf, len);
+			parse_stream_block (state, buf, len);
+			time_shift (state, buf, len);
+			active = monotonic_ns ();
+			return len;
+		} else if ((len < 0) && (errno != ECONNRESET)) {
+			if (errno == EINTR)
+				return 1;
+
+			return -1;
+		} else {
+			return 0;
+		}
+	} else if (numr < 0) {
+		if (errno == EINTR)
+			return 1;
+
+		return -1;
+	} else {
+		char buf[1];
+
+		/* Only when we've heard nothing for a second */
+		if (monotonic_ns () - active < 1000000000LL)
+			return 1;
+
+		/* Wake the server up */
+		buf[0] = 0x10;
+		len = write (sock, buf, sizeof (buf));
+		if (len > 0) {
+			stats.pings++;
+			if (! stats.ping_ns)
+				stats.ping_ns = monotonic_ns ();
+
+			sink_update_time (state);
+			active = monotonic_ns ();
+			return len;
+		} else if ((len < 0) && (errno != EPIPE)) {
+			if (errno == EINTR)
+				return 1;
+
+			return -1;
+		} else {
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,518 @@
+/* live-f1
+ *
+ * dashboard.c - the board in a web browser, pushed as server-sent events
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "httpd.h"
+#include "json.h"
+#include "packet.h"
+#include "sink.h"
+#include "stats.h"
+#include "stream.h"
+#include "dashboard.h"
+
+
+/* Path of the stream of updates */
+#define EVENTS_PATH "/events"
+
+/* Seconds without an update before a comment is sent to keep the
+ * connections open through proxies */
+#define KEEPALIVE_SECS 15
+
+/* Longest fastest lap field sent */
+#define FL_TEXT_MAX    32
+
+
+
+/* Forward prototypes */
+static void changed_board  (CurrentState *state);
+static void changed_car    (CurrentState *state, int car);
+static void changed_cell   (CurrentState *state, int car, int type);
+static void changed_status (CurrentState *state);
+static void serve_page     (HttpClient *client, const char *path,
+			    const char *query);
+static void serve_events   (HttpClient *client, const char *path,
+			    const char *query);
+static Chunk *encode_snapshot (CurrentState *state);
+static Chunk *encode_delta    (CurrentState *state);
+static void put_status     (JsonBuf *out, CurrentState *state);
+
+
+/* State shown, or NULL if the dashboard isn't open */
+static CurrentState *dash_state = NULL;
+
+/* What has changed since the last update was sent: atoms by car as a
+ * bit for each type, whether each car has moved, and the status */
+static unsigned int *dirty_cells = NULL;
+static char         *dirty_cars = NULL;
+static int           dirty_size = 0;
+static int           dirty = FALSE, dirty_board = FALSE, dirty_status = FALSE;
+
+/* Snapshot sent to new connections, until the next update */
+static Chunk *snapshot = NULL;
+
+/* When the last update or keep-alive was sent */
+static time_t last_sent = 0;
+
+/* Sink noting what has changed */
+static const Sink dashboard_sink = {
+	changed_board,
+	changed_car,
+	changed_car,
+	changed_cell,
+	changed_status,
+	changed_status,
+	NULL,
+};
+
+/* Page served at /, which does all the drawing */
+static const char dashboard_page[] =
+"<!DOCTYPE html>\n"
+"<html><head><meta charset=\"utf-8\"><title>live-f1</title>\n"
+"<style>\n"
+"body{background:#000;color:#ccc;font:14px monospace;margin:1em}\n"
+"table{border-collapse:collapse}td,th{padding:1px 6px;text-align:left}\n"
+"th{color:#888}#status{margin:.5em 0}\n"
+".c0,.c1{color:#fff}.c1{font-weight:bold}.c2{color:#f44}.c3{color:#4f4}\n"
+".c4{color:#f4f}.c5{color:#4ff}.c6{color:#ff4}.c7{color:#444}\n"
+".f1{color:#4f4}.f2,.f3,.f4{color:#ff4}.f5{color:#f44}\n"
+"</style></head><body>\n"
+"<div id=\"status\">Connecting...</div><table id=\"board\"></table>\n"
+"<script>\n"
+"var heads={1:['P','','Name','Gap','Int','Time','Sector 1','Pit',"
+"'Sector 2','Pit','Sector 3','Pit','Ps'],\n"
+"2:['P','','Name','Best','Gap','Sec 1','Sec 2','Sec 3','Lap'],\n"
+"3:['P','','Name','Period 1','Period 2','Period 3','Sec 1','Sec 2',"
+"'Sec 3','Lp']};\n"
+"var flags=['','Green','Yellow','SC standby','SC deployed','Red'];\n"
+"var b=null,left=0,tick=null;\n"
+"function esc(s){return s.replace(/&/g,'&amp;').replace(/</g,'&lt;');}\n"
+"function draw(){var h=heads[b.type]||[],rows=[],i,j,s,r;\n"
+" s='<tr>'+h.map(function(x){return '<th>'+x+'</th>';}).join('')+'</tr>';\n"
+" for(i=0;i<b.pos.length;i++)if(b.pos[i])rows[b.pos[i]]=i;\n"
+" for(r=1;r<rows.length;r++){if(rows[r]===undefined)continue;s+='<tr>';\n"
+"  for(j=1;j<=h.length;j++){var a=b.cells[rows[r]][j]||[0,''];\n"
+"   s+='<td class=\"c'+a[0]+'\">'+esc(a[1])+'</td>';}s+='</tr>';}\n"
+" document.getElementById('board').innerHTML=s;status();}\n"
+"function status(){var t=b.status,m=Math.floor(left/60),\n"
+" c=Math.floor(m/60)+':'+('0'+m%60).slice(-2)+':'+('0'+left%60).slice(-2);\n"
+" document.getElementById('status').innerHTML=\n"
+"  '<span class=\"f'+t.flag+'\">'+(flags[t.flag]||'')+'</span> '+\n"
+"  (b.type==1?'Lap '+t.laps+(t.total?'/'+t.total:'')+' ':'')+c+\n"
+"  ' &nbsp; Track '+t.track_temp+'&deg;C Air '+t.air_temp+'&deg;C'+\n"
+"  ' Humidity '+t.humidity+'% Wind '+(t.wind_speed/10)+'m/s '+\n"
+"  t.wind_direction+'&deg; &nbsp; Fastest lap '+esc(t.fl_driver)+' '+\n"
+"  esc(t.fl_time)+(t.fl_lap?' lap '+esc(t.fl_lap):'');}\n"
+"function move(k,p){for(var i=0;p&&i<b.pos.length;i++)\n"
+" if(b.pos[i]==p)b.pos[i]=0;b.pos[k-1]=p;}\n"
+"function clock(){left=b.status.remaining;clearInterval(tick);\n"
+" if(b.status.running)tick=setInterval(function(){if(left>0)left--;\n"
+"  status();},1000);}\n"
+"var es=new EventSource('events');\n"
+"es.addEventListener('snapshot',function(e){b=JSON.parse(e.data);\n"
+" clock();draw();});\n"
+"es.addEventListener('delta',function(e){var d=JSON.parse(e.data),k;\n"
+" if(!b)return;for(k in d.pos)move(k,d.pos[k]);\n"
+" d.cells.forEach(function(c){b.cells[c[0]-1][c[1]]=[c[2],c[3]];});\n"
+" if(d.status){b.status=d.status;clock();}draw();});\n"
+"es.onerror=function(){document.getElementById('status').textContent=\n"
+" 'Reconnecting...';};\n"
+"</script></body></html>\n";
+
+
+/**
+ * open_dashboard:
+ * @state: application state structure.
+ *
+ * Serves a page at / on the HTTP server opened with open_httpd() that
+ * draws the board in a browser, and streams @state to it at /events as
+ * server-sent events: a "snapshot" of the whole board when it connects,
+ * then a "delta" of only what has changed after each read of the data
+ * stream, sent by flush_dashboard().
+ **/
+void
+open_dashboard (CurrentState *state)
+{
+	dash_state = state;
+	dirty_board = TRUE;
+
+	add_sink (&dashboard_sink);
+	add_http_handler ("/", serve_page);
+	add_http_handler (EVENTS_PATH, serve_events);
+}
+
+/**
+ * flush_dashboard:
+ *
+ * Called from the main loop after each read of the data stream.  If the
+ * board has changed, the changes are encoded once into a single chunk
+ * queued for every browser connected, however many there are; so the
+ * cost of another viewer is only the writing of it.
+ **/
+void
+flush_dashboard (void)
+{
+	CurrentState *state = dash_state;
+	Chunk        *chunk;
+	time_t        now;
+
+	if (! state)
+		return;
+
+	now = time (NULL);
+	if (dirty_board) {
+		if (snapshot)
+			unref_chunk (snapshot);
+
+		chunk = encode_snapshot (state);
+		snapshot = ref_chunk (chunk);
+	} else if (dirty) {
+		chunk = encode_delta (state);
+	} else if (now - last_sent >= KEEPALIVE_SECS) {
+		chunk = new_chunk (":\n\n", 3);
+	} else {
+		return;
+	}
+
+	http_broadcast (EVENTS_PATH, chunk);
+	unref_chunk (chunk);
+	last_sent = now;
+
+	/* New connections need a snapshot with these changes in */
+	if (dirty && (! dirty_board) && snapshot) {
+		unref_chunk (snapshot);
+		snapshot = NULL;
+	}
+
+	if (dirty_size) {
+		memset (dirty_cells, 0, sizeof (unsigned int) * dirty_size);
+		memset (dirty_cars, 0, dirty_size);
+	}
+	dirty = dirty_board = dirty_status = FALSE;
+}
+
+/**
+ * close_dashboard:
+ *
+ * Stops keeping track of changes for the dashboard; the HTTP server
+ * closes the connections.
+ **/
+void
+close_dashboard (void)
+{
+	if (! dash_state)
+		return;
+
+	remove_sink (&dashboard_sink);
+	if (snapshot)
+		unref_chunk (snapshot);
+	snapshot = NULL;
+
+	free (dirty_cells);
+	free (dirty_cars);
+	dirty_cells = NULL;
+	dirty_cars = NULL;
+	dirty_size = 0;
+
+	dash_state = NULL;
+}
+
+
+/**
+ * changed_board:
+ * @state: application state structure.
+ *
+ * Notes that the whole board needs sending again, since the cars or the
+ * event have changed; changes to time-shift views are ignored.
+ **/
+static void
+changed_board (CurrentState *state)
+{
+	if (state != dash_state)
+		return;
+
+	if (state->num_cars > dirty_size) {
+		dirty_cells = realloc (dirty_cells,
+				       sizeof (unsigned int) * state->num_cars);
+		dirty_cars = realloc (dirty_cars, state->num_cars);
+		if ((! dirty_cells) || (! dirty_cars))
+			abort ();
+
+		dirty_size = state->num_cars;
+	}
+
+	memset (dirty_cells, 0, sizeof (unsigned int) * dirty_size);
+	memset (dirty_cars, 0, dirty_size);
+	dirty = dirty_board = TRUE;
+}
+
+/**
+ * changed_car:
+ * @state: application state structure,
+ * @car: car that is moving.
+ *
+ * Notes that @car's position needs sending; it's sent as it is when the
+ * update is, so moving out of a position and into another is one.
+ **/
+static void
+changed_car (CurrentState *state,
+	     int           car)
+{
+	if ((state != dash_state) || (car < 1) || (car > dirty_size))
+		return;
+
+	dirty_cars[car - 1] = TRUE;
+	dirty = TRUE;
+}
+
+/**
+ * changed_cell:
+ * @state: application state structure,
+ * @car: car whose atom has changed,
+ * @type: type of the atom.
+ *
+ * Notes that the atom needs sending.
+ **/
+static void
+changed_cell (CurrentState *state,
+	      int           car,
+	      int           type)
+{
+	if ((state != dash_state) || (car < 1) || (car > dirty_size))
+		return;
+
+	dirty_cells[car - 1] |= 1U << type;
+	dirty = TRUE;
+}
+
+/**
+ * changed_status:
+ * @state: application state structure.
+ *
+ * Notes that the status, which includes the clock, needs sending.
+ **/
+static void
+changed_status (CurrentState *state)
+{
+	if (state != dash_state)
+		return;
+
+	dirty = dirty_status = TRUE;
+}
+
+
+/**
+ * serve_page:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Responds with the page that draws the board.
+ **/
+static void
+serve_page (HttpClient *client,
+	    const char *path,
+	    const char *query)
+{
+	http_respond (client, 200, "text/html; charset=utf-8",
+		      dashboard_page, sizeof (dashboard_page) - 1);
+}
+
+/**
+ * serve_events:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Begins the stream of updates with a snapshot of the board.  The
+ * snapshot is kept until the board next changes, so any number of
+ * browsers connecting at once only cost one.
+ **/
+static void
+serve_events (HttpClient *client,
+	      const char *path,
+	      const char *query)
+{
+	static const char retry[] = "retry: 2000\n\n";
+
+	http_begin_stream (client, "text/event-stream");
+	http_send (client, retry, sizeof (retry) - 1);
+
+	if (! snapshot)
+		snapshot = encode_snapshot (dash_state);
+	http_send_chunk (client, snapshot);
+}
+
+
+/**
+ * encode_snapshot:
+ * @state: application state structure.
+ *
+ * Encodes the whole board as a "snapshot" event: the event type, the
+ * position of each car, every atom of each car as its colour and text,
+ * and the status.
+ *
+ * Returns: new chunk.
+ **/
+static Chunk *
+encode_snapshot (CurrentState *state)
+{
+	JsonBuf  out = { NULL, 0, 0 };
+	Chunk   *chunk;
+	int      i, j;
+
+	put_json (&out, "event: snapshot\ndata: {\"event\":%u,\"type\":%d,"
+		  "\"pos\":[", state->event_no, state->event_type);
+	for (i = 0; i < state->num_cars; i++)
+		put_json (&out, "%s%d", i ? "," : "",
+			  state->car_position[i]);
+
+	put_json (&out, "],\"cells\":[");
+	for (i = 0; i < state->num_cars; i++) {
+		put_json (&out, "%s[", i ? "," : "");
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			const CarAtom *atom = &state->car_info[i][j];
+
+			put_json (&out, "%s[%d,", j ? "," : "", atom->data);
+			put_json_text (&out, atom->text, sizeof (atom->text));
+			put_json (&out, "]");
+		}
+		put_json (&out, "]");
+	}
+
+	put_json (&out, "],\"status\":");
+	put_status (&out, state);
+	put_json (&out, "}\n\n");
+
+	chunk = new_chunk (out.buf, out.len);
+	free (out.buf);
+
+	return chunk;
+}
+
+/**
+ * encode_delta:
+ * @state: application state structure.
+ *
+ * Encodes what has changed since the last update as a "delta" event:
+ * the new positions of cars that have moved, keyed by car number; each
+ * changed atom as its car, type, colour and text; and the status, only
+ * if it has changed.
+ *
+ * Returns: new chunk.
+ **/
+static Chunk *
+encode_delta (CurrentState *state)
+{
+	JsonBuf  out = { NULL, 0, 0 };
+	Chunk   *chunk;
+	int      i, j, first;
+
+	put_json (&out, "event: delta\ndata: {\"pos\":{");
+	for (i = first = 0; i < dirty_size; i++) {
+		if (! dirty_cars[i])
+			continue;
+
+		put_json (&out, "%s\"%d\":%d", first++ ? "," : "",
+			  i + 1, state->car_position[i]);
+	}
+
+	put_json (&out, "},\"cells\":[");
+	for (i = first = 0; i < dirty_size; i++) {
+		if (! dirty_cells[i])
+			continue;
+
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			const CarAtom *atom = &state->car_info[i][j];
+
+			if (! (dirty_cells[i] & (1U << j)))
+				continue;
+
+			put_json (&out, "%s[%d,%d,%d,", first++ ? "," : "",
+				  i + 1, j, atom->data);
+			put_json_text (&out, atom->text, sizeof (atom->text));
+			put_json (&out, "]");
+		}
+	}
+	put_json (&out, "]");
+
+	if (dirty_status) {
+		put_json (&out, ",\"status\":");
+		put_status (&out, state);
+	}
+	put_json (&out, "}\n\n");
+
+	chunk = new_chunk (out.buf, out.len);
+	free (out.buf);
+
+	return chunk;
+}
+
+/**
+ * put_status:
+ * @out: buffer to append to,
+ * @state: application state structure.
+ *
+ * Appends the status of the session as an object.  The clock is sent
+ * as the seconds remaining now and whether it's running, so the page
+ * can count it down itself.
+ **/
+static void
+put_status (JsonBuf      *out,
+	    CurrentState *state)
+{
+	time_t remaining;
+
+	if (state->epoch_time) {
+		remaining = MAX ((state->epoch_time + state->remaining_time)
+				 - get_time (state), 0);
+	} else {
+		remaining = state->remaining_time;
+	}
+
+	put_json (out, "{\"laps\":%u,\"total\":%u,\"flag\":%d,"
+		  "\"remaining\":%ld,\"running\":%s,"
+		  "\"track_temp\":%d,\"air_temp\":%d,\"humidity\":%d,"
+		  "\"wind_speed\":%d,\"wind_direction\":%d,\"pressure\":%d,",
+		  state->laps_completed, state->total_laps, state->flag,
+		  (long) remaining, state->epoch_time ? "true" : "false",
+		  state->track_temp, state->air_temp, state->humidity,
+		  state->wind_speed, state->wind_direction, state->pressure);
+
+	put_json (out, "\"fl_car\":");
+	put_json_text (out, state->fl_car, FL_TEXT_MAX);
+	put_json (out, ",\"fl_driver\":");
+	put_json_text (out, state->fl_driver, FL_TEXT_MAX);
+	put_json (out, ",\"fl_time\":");
+	put_json_text (out, state->fl_time, FL_TEXT_MAX);
+	put_json (out, ",\"fl_lap\":");
+	put_json_text (out, state->fl_lap, FL_TEXT_MAX);
+	put_json (out, "}");
+}
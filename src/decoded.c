@@ -0,0 +1,508 @@
+/* live-f1
+ *
+ * decoded.c - writing changes to the board as fixed-size records
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "live-f1-decoded.h"
+#include "mapfile.h"
+#include "ring.h"
+#include "decoded.h"
+
+
+/* Records buffered before being written */
+#define DECODED_RECORDS 2048
+
+/* Initial size of the hash table of strings, a power of two */
+#define STRINGS_HASH    4096
+
+
+/* Forward prototypes */
+static void     write_change   (const LiveF1Event *event);
+static uint32_t add_string     (const char *text);
+static size_t   find_string    (const char *text);
+static void     append_strings (const void *data, size_t len);
+static uint32_t hash_string    (const char *text);
+static void     grow_hash      (void);
+static int      open_records   (const char *path);
+static int      open_strings   (const char *path);
+static int      write_all      (int fd, const void *buf, size_t len);
+
+
+/* Files written to, or -1 */
+static int records_fd = -1, strings_fd = -1;
+
+/* State whose changes are written */
+static CurrentState *decoded_state = NULL;
+
+/* Records not yet written */
+static LiveF1Record records[DECODED_RECORDS];
+static size_t       num_records = 0;
+
+/* Whole string table, and how much of it has been written */
+static char  *strings = NULL;
+static size_t strings_len = 0, strings_alloc = 0, strings_written = 0;
+
+/* Offset of each string in the table, by hash, or zero */
+static uint32_t *strings_hash = NULL;
+static size_t    hash_size = 0, hash_used = 0;
+
+
+/**
+ * open_decoded:
+ * @path: file to write records to,
+ * @state: application state structure.
+ *
+ * Writes each change to @state from now on as a LiveF1Record in @path,
+ * with the texts they refer to in the string table in @path.str; each
+ * text is only stored once, however often it changes to it.  If the
+ * files exist they're appended to, after dropping any part-written
+ * record at the end, and the strings already in the table are reused.
+ *
+ * The changes are the LiveF1Event that --ring writes; records are made
+ * in a buffer and only written when flush_decoded() is called after each
+ * read of the data stream, or when the buffer fills.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_decoded (const char   *path,
+	      CurrentState *state)
+{
+	char *strings_path;
+
+	strings_path = malloc (strlen (path) + 5);
+	if (! strings_path)
+		abort ();
+	sprintf (strings_path, "%s.str", path);
+
+	if (open_records (path) || open_strings (strings_path)) {
+		free (strings_path);
+		close_decoded ();
+		return 1;
+	}
+	free (strings_path);
+
+	if (watch_changes (write_change, state)) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("too many watching the changes"));
+		close_decoded ();
+		return 1;
+	}
+
+	decoded_state = state;
+
+	info (1, _("Writing decoded changes to %s\n"), path);
+
+	return 0;
+}
+
+/**
+ * flush_decoded:
+ *
+ * Called from the main loop after each read of the data stream to write
+ * the records it caused, after any new strings they refer to so that a
+ * reader never finds a record without its text.  If there's an error,
+ * records are no longer written rather than interrupting anything else.
+ **/
+void
+flush_decoded (void)
+{
+	if (records_fd < 0)
+		return;
+
+	if (write_all (strings_fd, strings + strings_written,
+		       strings_len - strings_written)
+	    || write_all (records_fd, records,
+			  num_records * sizeof (LiveF1Record))) {
+		info (0, _("Unable to write decoded changes: %s\n"),
+		      strerror (errno));
+		num_records = 0;
+		close_decoded ();
+		return;
+	}
+
+	strings_written = strings_len;
+	num_records = 0;
+}
+
+/**
+ * close_decoded:
+ *
+ * Writes any records still buffered and stops writing them.
+ **/
+void
+close_decoded (void)
+{
+	if ((records_fd >= 0) && (strings_fd >= 0) && num_records)
+		flush_decoded ();
+
+	if (decoded_state)
+		unwatch_changes (write_change);
+
+	if (records_fd >= 0)
+		close (records_fd);
+	if (strings_fd >= 0)
+		close (strings_fd);
+	records_fd = strings_fd = -1;
+
+	free (strings);
+	strings = NULL;
+	strings_len = strings_alloc = strings_written = 0;
+
+	free (strings_hash);
+	strings_hash = NULL;
+	hash_size = hash_used = 0;
+	decoded_state = NULL;
+}
+
+
+/**
+ * write_change:
+ * @event: change to the board.
+ *
+ * Makes a record of @event in the buffer, writing out what's already
+ * there if it's full.
+ **/
+static void
+write_change (const LiveF1Event *event)
+{
+	LiveF1Record *record;
+
+	if (records_fd < 0)
+		return;
+	if (num_records == DECODED_RECORDS)
+		flush_decoded ();
+
+	record = &records[num_records++];
+	record->time = event->time;
+	record->value = event->value;
+	record->event_no = decoded_state->event_no;
+	record->data = event->data;
+	record->text = event->text[0] ? add_string (event->text) : 0;
+	record->kind = event->kind;
+	record->value_type = event->value_type;
+	record->car = event->car;
+	record->type = event->type;
+}
+
+/**
+ * add_string:
+ * @text: text to add.
+ *
+ * Looks @text up in the string table, adding it to the end if it isn't
+ * there already.
+ *
+ * Returns: offset of @text in the string table.
+ **/
+static uint32_t
+add_string (const char *text)
+{
+	size_t i;
+
+	i = find_string (text);
+	if (! strings_hash[i]) {
+		strings_hash[i] = strings_len;
+		hash_used++;
+		append_strings (text, strlen (text) + 1);
+	}
+
+	return strings_hash[i];
+}
+
+/**
+ * find_string:
+ * @text: text to look for.
+ *
+ * Returns: slot in the hash table holding the offset of @text, or the
+ * empty one it belongs in.
+ **/
+static size_t
+find_string (const char *text)
+{
+	size_t i;
+
+	if (hash_used * 2 >= hash_size)
+		grow_hash ();
+
+	for (i = hash_string (text) & (hash_size - 1); strings_hash[i];
+	     i = (i + 1) & (hash_size - 1))
+		if (! strcmp (strings + strings_hash[i], text))
+			break;
+
+	return i;
+}
+
+/**
+ * append_strings:
+ * @data: terminated strings to append,
+ * @len: length of @data.
+ *
+ * Copies @data onto the end of the string table.
+ **/
+static void
+append_strings (const void *data,
+		size_t      len)
+{
+	if (strings_len + len > strings_alloc) {
+		strings_alloc = MAX (strings_alloc * 2,
+				     MAX (strings_len + len, 65536));
+		strings = realloc (strings, strings_alloc);
+		if (! strings)
+			abort ();
+	}
+
+	memcpy (strings + strings_len, data, len);
+	strings_len += len;
+}
+
+/**
+ * hash_string:
+ * @text: text to hash.
+ *
+ * Returns: FNV-1a hash of @text.
+ **/
+static uint32_t
+hash_string (const char *text)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*text) {
+		hash ^= (unsigned char) *(text++);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/**
+ * grow_hash:
+ *
+ * Doubles the size of the hash table of strings, putting each back
+ * where it now belongs.
+ **/
+static void
+grow_hash (void)
+{
+	uint32_t *old = strings_hash;
+	size_t    old_size = hash_size, i, j;
+
+	hash_size = hash_size ? hash_size * 2 : STRINGS_HASH;
+	strings_hash = calloc (hash_size, sizeof (uint32_t));
+	if (! strings_hash)
+		abort ();
+
+	for (i = 0; i < old_size; i++) {
+		if (! old[i])
+			continue;
+
+		for (j = hash_string (strings + old[i]) & (hash_size - 1);
+		     strings_hash[j]; j = (j + 1) & (hash_size - 1))
+			;
+		strings_hash[j] = old[i];
+	}
+
+	free (old);
+}
+
+
+/**
+ * open_records:
+ * @path: file to write records to.
+ *
+ * Opens @path to append records to, writing the header if it's new, or
+ * checking it and dropping any part-written record at the end if not.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+open_records (const char *path)
+{
+	LiveF1DecodedHeader header;
+	struct stat         statbuf;
+
+	records_fd = open (path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if ((records_fd < 0) || (fstat (records_fd, &statbuf) < 0))
+		goto error;
+
+	if (statbuf.st_size == 0) {
+		memset (&header, 0, sizeof (header));
+		header.magic = LIVE_F1_DECODED_MAGIC;
+		header.version = LIVE_F1_DECODED_VERSION;
+		header.record_size = sizeof (LiveF1Record);
+
+		if (write_all (records_fd, &header, sizeof (header)))
+			goto error;
+
+		return 0;
+	}
+
+	if ((pread (records_fd, &header, sizeof (header), 0)
+	     != sizeof (header))
+	    || (header.magic != LIVE_F1_DECODED_MAGIC)
+	    || (header.version != LIVE_F1_DECODED_VERSION)
+	    || (header.record_size != sizeof (LiveF1Record))) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, path,
+			 _("not a file of decoded changes"));
+		return 1;
+	}
+
+	if ((statbuf.st_size - sizeof (header)) % sizeof (LiveF1Record)
+	    && (ftruncate (records_fd, (statbuf.st_size
+					- ((statbuf.st_size - sizeof (header))
+					   % sizeof (LiveF1Record)))) < 0))
+		goto error;
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to write decoded changes to"), path,
+		 strerror (errno));
+	return 1;
+}
+
+/**
+ * open_strings:
+ * @path: file to write the string table to.
+ *
+ * Opens @path to append strings to, writing the header if it's new, or
+ * checking it and reading the strings already there if not, so that
+ * they keep their offsets and are reused.  Anything after the last
+ * complete string was never referred to, so is dropped.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+open_strings (const char *path)
+{
+	LiveF1StringsHeader header;
+	struct stat         statbuf;
+	MappedFile          map;
+	size_t              i, len;
+
+	strings_fd = open (path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if ((strings_fd < 0) || (fstat (strings_fd, &statbuf) < 0))
+		goto error;
+
+	if (statbuf.st_size == 0) {
+		memset (&header, 0, sizeof (header));
+		header.magic = LIVE_F1_STRINGS_MAGIC;
+		header.version = LIVE_F1_DECODED_VERSION;
+
+		append_strings (&header, sizeof (header));
+		if (write_all (strings_fd, strings, strings_len))
+			goto error;
+
+		strings_written = strings_len;
+		return 0;
+	}
+
+	if (map_file (&map, path))
+		goto error;
+
+	if (map.len >= sizeof (header))
+		memcpy (&header, map.data, sizeof (header));
+	if ((map.len < sizeof (header))
+	    || (header.magic != LIVE_F1_STRINGS_MAGIC)
+	    || (header.version != LIVE_F1_DECODED_VERSION)) {
+		unmap_file (&map);
+		fprintf (stderr, "%s: %s: %s\n", program_name, path,
+			 _("not a string table of decoded changes"));
+		return 1;
+	}
+
+	/* Keep up to the last terminated string */
+	for (len = map.len; (len > sizeof (header)) && map.data[len - 1]; len--)
+		;
+	append_strings (map.data, len);
+	unmap_file (&map);
+
+	for (i = sizeof (header); i < strings_len;
+	     i += strlen (strings + i) + 1) {
+		size_t slot = find_string (strings + i);
+
+		if (! strings_hash[slot]) {
+			strings_hash[slot] = i;
+			hash_used++;
+		}
+	}
+
+	strings_written = strings_len;
+	if ((strings_len < (size_t) statbuf.st_size)
+	    && (ftruncate (strings_fd, strings_len) < 0))
+		goto error;
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to write decoded changes to"), path,
+		 strerror (errno));
+	return 1;
+}
+
+/**
+ * write_all:
+ * @fd: file to write to,
+ * @buf: data to write,
+ * @len: length of @buf.
+ *
+ * Writes all of @buf to @fd.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_all (int         fd,
+	   const void *buf,
+	   size_t      len)
+{
+	const char *p = buf;
+	ssize_t     ret;
+
+	while (len) {
+		ret = write (fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return 1;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
@@ -24,8 +24,11 @@
 #endif /* HAVE_CONFIG_H */
 
 
+#include <sys/ioctl.h>
+
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef __CYGWIN__
 # include <ncurses/curses.h>
@@ -38,7 +41,11 @@
 
 #include "live-f1.h"
 #include "packet.h" /* for packet type */
+#include "stats.h"
+#include "stream.h"
 #include "display.h"
+#include "replay.h"
+#include "timeshift.h"
 
 
 /* Colours to be allocated, note that this mostly matches the data stream
@@ -62,17 +69,52 @@ typedef enum {
 } TextColour;
 
 
+/* Bytes left in the terminal's output queue that count as a stall */
+#define STALL_QUEUED_BYTES 1024
+
+/* Number of consecutive quick updates before we stop throttling */
+#define CALM_UPDATES 16
+
+/* Flags for cells whose drawing has been deferred */
+#define DIRTY_TEXT   0x01
+#define DIRTY_COLOUR 0x02
+
+/* Seconds the arrow keys move a time-shifted board by */
+#define SKIP_SECS 10
+
+
 /* Forward prototypes */
-static void _update_cell (CurrentState *state, int car, int type);
-static void _update_time (CurrentState *state);
+static void      _update_cell (CurrentState *state, int car, int type);
+static void      _update_time (CurrentState *state);
+static void      update_clock (CurrentState *state);
+static int       defer_cell   (CurrentState *state, int car, int type);
+static void      flush_cells  (CurrentState *state, int flags);
+static void      update_screen (void);
+static long long now_ms       (void);
+static void      draw_stats   (CurrentState *state);
+static void      refresh_board (void);
 
 
 /* Curses display running */
 int cursed = 0;
 
+/* Sink drawing the board, added unless running headless */
+const Sink display_sink = {
+	clear_board,
+	update_car,
+	clear_car,
+	update_cell,
+	update_status,
+	update_clock,
+	update_time,
+};
+
 /* Number of lines being used for the board */
 static int nlines = 0;
 
+/* First line of the board shown, when it's taller than the screen */
+static int board_top = 0;
+
 /* Attributes for the colours */
 static int attrs[LAST_COLOUR];
 
@@ -80,8 +122,47 @@ static int attrs[LAST_COLOUR];
 static WINDOW *boardwin = NULL;
 static WINDOW *statwin = NULL;
 static WINDOW *popupwin = NULL;
+static WINDOW *statswin = NULL;
+
+/* When the stats panel was last drawn */
+static long long stats_drawn = 0;
+
+/* Set while nothing should be drawn */
+static int suspended = 0;
+
+/* State the board is drawn from, or NULL for whichever is updated */
+static CurrentState *shown_state = NULL;
+
+/* Latency budget for a slow terminal in milliseconds, 0 when disabled */
+static int latency_budget = 0;
+
+/* Set while the terminal isn't draining fast enough to keep up */
+static int throttled = 0;
+static int calm = 0;
+
+/* What was last drawn in each cell, and which cells are out of date */
+static CarAtom       *shown = NULL;
+static unsigned char *dirty = NULL;
+static int            shown_cars = 0;
+
+/* When the oldest deferred text and colour changes must be drawn by */
+static long long text_due = 0;
+static long long colour_due = 0;
 
 
+/**
+ * hidden:
+ * @state: application state structure.
+ *
+ * Returns: TRUE if changes to @state shouldn't be drawn, because the
+ * display is suspended or showing another state.
+ **/
+static inline int
+hidden (const CurrentState *state)
+{
+	return suspended || (shown_state && (state != shown_state));
+}
+
 /**
  * open_display:
  * @state: application state structure.
@@ -164,6 +245,9 @@ clear_board (CurrentState *state)
 {
 	int i, j;
 
+	if (hidden (state))
+		return;
+
 	open_display ();
 	close_popup ();
 
@@ -176,12 +260,6 @@ clear_board (CurrentState *state)
 
 	nlines += 3;
 
-	if (LINES < nlines) {
-		close_display ();
-		fprintf (stderr, "%s: %s\n", program_name,
-			 _("insufficient lines on display"));
-		exit (10);
-	}
 	if (COLS < 69) {
 		close_display ();
 		fprintf (stderr, "%s: %s\n", program_name,
@@ -189,7 +267,8 @@ clear_board (CurrentState *state)
 		exit (10);
 	}
 
-	boardwin = newwin (nlines, 69, 0, 0);
+	/* The board is a pad so it can be scrolled if it doesn't fit */
+	boardwin = newpad (nlines, 69);
 	wbkgdset (boardwin, attrs[COLOUR_DATA]);
 	werase (boardwin);
 
@@ -216,13 +295,31 @@ clear_board (CurrentState *state)
 			break;
 		}
 
+	/* Forget what we've drawn, since we're about to draw it all again */
+	if (shown_cars != state->num_cars) {
+		shown = realloc (shown, sizeof (CarAtom) * LAST_CAR_PACKET
+				 * MAX (state->num_cars, 1));
+		dirty = realloc (dirty, LAST_CAR_PACKET
+				 * MAX (state->num_cars, 1));
+		if ((! shown) || (! dirty))
+			abort ();
+
+		shown_cars = state->num_cars;
+	}
+	for (i = 0; i < shown_cars * LAST_CAR_PACKET; i++) {
+		shown[i].data = -1;
+		shown[i].text[0] = 0;
+		dirty[i] = 0;
+	}
+	text_due = colour_due = 0;
+
 	for (i = 1; i <= state->num_cars; i++) {
 		for (j = 0; j < LAST_CAR_PACKET; j++)
 			_update_cell (state, i, j);
 	}
 
-	wnoutrefresh (boardwin);
-	doupdate ();
+	refresh_board ();
+	update_screen ();
 
 	if (statwin) {
 		delwin (statwin);
@@ -232,6 +329,41 @@ clear_board (CurrentState *state)
 	}
 }
 
+/**
+ * refresh_board:
+ *
+ * Copies the visible part of the board to the virtual screen, ready for
+ * the next doupdate().
+ **/
+static void
+refresh_board (void)
+{
+	int height;
+
+	height = MIN (nlines, LINES);
+	board_top = MAX (MIN (board_top, nlines - height), 0);
+
+	pnoutrefresh (boardwin, board_top, 0, 0, 0, height - 1, 68);
+}
+
+/**
+ * scroll_board:
+ * @lines: number of lines to scroll by.
+ *
+ * Scrolls the board up or down when it's taller than the screen,
+ * updating the display when done.
+ **/
+static void
+scroll_board (int lines)
+{
+	if (! boardwin)
+		return;
+
+	board_top += lines;
+	refresh_board ();
+	update_screen ();
+}
+
 /**
  * _update_cell:
  * @state: application state structure,
@@ -468,6 +600,12 @@ _update_cell (CurrentState *state,
 	waddstr (boardwin, text);
 	while ((align < 0) && pad--)
 		waddch (boardwin, ' ');
+
+	/* Remember what the cell now shows */
+	if (car <= shown_cars) {
+		shown[(car - 1) * LAST_CAR_PACKET + type] = *atom;
+		dirty[(car - 1) * LAST_CAR_PACKET + type] = 0;
+	}
 }
 
 /**
@@ -485,15 +623,248 @@ update_cell (CurrentState *state,
 	     int           car,
 	     int           type)
 {
+	if (hidden (state))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
+	if (throttled && defer_cell (state, car, type))
+		return;
+
 	_update_cell (state, car, type);
 
 	_update_time (state);
- 	wnoutrefresh (boardwin);
+ 	refresh_board ();
+	update_screen ();
+}
+
+/**
+ * defer_cell:
+ * @state: application state structure,
+ * @car: car number to update,
+ * @type: atom to update.
+ *
+ * Called instead of drawing a cell while the terminal is falling behind;
+ * compares the atom with what the cell currently shows and marks it to
+ * be drawn later by flush_display().  Only the latest value is ever
+ * drawn, so any in between are dropped.  Colour-only changes are given
+ * the whole latency budget, new text gets half of it.
+ *
+ * Returns: TRUE if the cell was deferred, FALSE if it must be drawn now.
+ **/
+static int
+defer_cell (CurrentState *state,
+	    int           car,
+	    int           type)
+{
+	CarAtom *atom, *old;
+	int      idx;
+
+	if (car > shown_cars)
+		return FALSE;
+
+	idx = (car - 1) * LAST_CAR_PACKET + type;
+	atom = &state->car_info[car - 1][type];
+	old = &shown[idx];
+
+	if (strcmp (atom->text, old->text)) {
+		if (! text_due)
+			text_due = now_ms () + latency_budget / 2;
+		dirty[idx] |= DIRTY_TEXT;
+	} else if (atom->data != old->data) {
+		if (! colour_due)
+			colour_due = now_ms () + latency_budget;
+		dirty[idx] |= DIRTY_COLOUR;
+	} else {
+		/* Changed back to what's on screen already */
+		dirty[idx] = 0;
+	}
+
+	return TRUE;
+}
+
+/**
+ * flush_cells:
+ * @state: application state structure,
+ * @flags: which deferred changes to draw.
+ *
+ * Draws any cells with deferred changes matching @flags from the
+ * current state, does not refresh or update the screen.
+ **/
+static void
+flush_cells (CurrentState *state,
+	     int           flags)
+{
+	int i, j;
+
+	for (i = 1; i <= MIN (shown_cars, state->num_cars); i++)
+		for (j = 0; j < LAST_CAR_PACKET; j++)
+			if (dirty[(i - 1) * LAST_CAR_PACKET + j] & flags)
+				_update_cell (state, i, j);
+
+	if (flags & DIRTY_TEXT)
+		text_due = 0;
+	if (flags & DIRTY_COLOUR)
+		colour_due = 0;
+}
+
+/**
+ * flush_display:
+ * @state: application state structure.
+ *
+ * Draws any cells whose changes were deferred while the terminal was
+ * falling behind and whose time is up, or all of them once it has
+ * caught up again.  Called from the main loop.
+ **/
+void
+flush_display (CurrentState *state)
+{
+	long long now;
+	int       flags = 0;
+
+	if ((! cursed) || (! boardwin) || ((! text_due) && (! colour_due)))
+		return;
+	if (shown_state)
+		state = shown_state;
+
+	now = now_ms ();
+	if (text_due && ((! throttled) || (now >= text_due)))
+		flags |= DIRTY_TEXT;
+	if (colour_due && ((! throttled) || (now >= colour_due)))
+		flags |= DIRTY_COLOUR;
+	if (! flags)
+		return;
+
+	/* Don't draw over a popup, it'll all be redrawn when it closes */
+	if (popupwin)
+		return;
+
+	flush_cells (state, flags);
+
+	_update_time (state);
+	refresh_board ();
+	update_screen ();
+}
+
+/**
+ * set_display_latency:
+ * @budget: latency budget in milliseconds, or zero.
+ *
+ * Enables the mode for slow terminals; the time taken to write each
+ * update is measured, and if the terminal isn't keeping up, less
+ * important changes are deferred so that the board is never more than
+ * @budget milliseconds behind.
+ **/
+void
+set_display_latency (int budget)
+{
+	latency_budget = MAX (budget, 0);
+	throttled = 0;
+}
+
+/**
+ * suspend_display:
+ * @state: application state structure,
+ * @suspend: TRUE to stop drawing, FALSE to start again.
+ *
+ * Stops the display being drawn at all, for when the data is being
+ * processed faster than it could be shown.  When started again, the
+ * whole board is drawn from the current state, unless running headless.
+ **/
+void
+suspend_display (CurrentState *state,
+		 int           suspend)
+{
+	if (suspended == suspend)
+		return;
+
+	suspended = suspend;
+	if ((! suspended) && has_sink (&display_sink)) {
+		if (shown_state)
+			state = shown_state;
+
+		clear_board (state);
+		update_status (state);
+	}
+}
+
+/**
+ * show_state:
+ * @state: application state structure.
+ *
+ * Draws the board from @state, ignoring changes to any other state
+ * until this is called again; the whole board is drawn straight away.
+ **/
+void
+show_state (CurrentState *state)
+{
+	shown_state = state;
+	if (! has_sink (&display_sink))
+		return;
+
+	clear_board (state);
+	update_status (state);
+}
+
+/**
+ * update_screen:
+ *
+ * Wrapper around doupdate() that keeps the stats panel on top and
+ * counts the time taken.  When a latency budget is set, also checks
+ * how much output is still queued for the terminal and changes the
+ * throttled state accordingly.
+ **/
+static void
+update_screen (void)
+{
+	long long start, elapsed;
+	int       queued = 0;
+
+	/* Keep the stats panel on top of anything else drawn */
+	if (statswin) {
+		touchwin (statswin);
+		wnoutrefresh (statswin);
+	}
+
+	start = monotonic_ns ();
 	doupdate ();
+	elapsed = monotonic_ns () - start;
+
+	stats.render_ns += elapsed;
+	stats.renders++;
+	observe (&stats.render_hist, elapsed);
+
+	if (! latency_budget)
+		return;
+
+#ifdef TIOCOUTQ
+	if (ioctl (STDOUT_FILENO, TIOCOUTQ, &queued) < 0)
+		queued = 0;
+#endif /* TIOCOUTQ */
+
+	if ((elapsed / 1000000 > latency_budget / 8)
+	    || (queued > STALL_QUEUED_BYTES)) {
+		if (! throttled)
+			info (3, _("Terminal is falling behind\n"));
+
+		throttled = 1;
+		calm = 0;
+	} else if (throttled && (++calm >= CALM_UPDATES)) {
+		throttled = 0;
+	}
+}
+
+/**
+ * now_ms:
+ *
+ * Returns: monotonic time in milliseconds.
+ **/
+static long long
+now_ms (void)
+{
+	return monotonic_ns () / 1000000;
 }
 
 /**
@@ -509,6 +880,9 @@ update_car (CurrentState *state,
 {
 	int i;
 
+	if (hidden (state))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
@@ -517,8 +891,8 @@ update_car (CurrentState *state,
 		_update_cell (state, car, i);
 
 	_update_time (state);
- 	wnoutrefresh (boardwin);
-	doupdate ();
+ 	refresh_board ();
+	update_screen ();
 }
 
 /**
@@ -534,6 +908,9 @@ clear_car (CurrentState *state,
 {
 	int y;
 
+	if (hidden (state))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 
@@ -548,9 +925,19 @@ clear_car (CurrentState *state,
 	wmove (boardwin, y, 0);
 	wclrtoeol (boardwin);
 
+	/* Nothing is shown for the car now */
+	if (car <= shown_cars) {
+		int i;
+
+		for (i = 0; i < LAST_CAR_PACKET; i++) {
+			shown[(car - 1) * LAST_CAR_PACKET + i].data = -1;
+			shown[(car - 1) * LAST_CAR_PACKET + i].text[0] = 0;
+		}
+	}
+
 	_update_time (state);
-	wnoutrefresh (boardwin);
-	doupdate ();
+	refresh_board ();
+	update_screen ();
 }
 
 /**
@@ -582,6 +969,9 @@ draw_bar (WINDOW *win, int len)
 void
 update_status (CurrentState *state)
 {
+	if (hidden (state))
+		return;
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
@@ -591,7 +981,7 @@ update_status (CurrentState *state)
 		if (COLS < 80)
 			return;
 
-		statwin = newwin (nlines, 10, 0, COLS - 10);
+		statwin = newwin (MIN (nlines, LINES), 10, 0, COLS - 10);
 		wbkgdset (statwin, attrs[COLOUR_DATA]);
 		werase (statwin);
 	}
@@ -719,8 +1109,8 @@ update_status (CurrentState *state)
 	/* Refresh display */
 
 	wnoutrefresh (statwin);
-	wnoutrefresh (boardwin);
-	doupdate ();
+	refresh_board ();
+	update_screen ();
 }
 
 /**
@@ -737,7 +1127,7 @@ _update_time (CurrentState *state)
 	if (! statwin)
 		return;
 
-	wmove (statwin, nlines - 1, 2);
+	wmove (statwin, getmaxy (statwin) - 1, 2);
 	wattrset (statwin, attrs[COLOUR_DATA]);
 
 	// Pause the clock during a red flag, but only for Qualifying and the Race.
@@ -745,7 +1135,7 @@ _update_time (CurrentState *state)
 	{
 		remaining = state->remaining_time;
 	} else if (state->epoch_time) {
-		remaining = MAX ((state->epoch_time + state->remaining_time) - time (NULL), 0);
+		remaining = MAX ((state->epoch_time + state->remaining_time) - get_time (state), 0);
 	} else {
 		remaining = state->remaining_time;
 	}
@@ -778,12 +1168,27 @@ _update_time (CurrentState *state)
 void
 update_time (CurrentState *state)
 {
-	if ((! cursed) || (! statwin))
+	if ((! cursed) || (! statwin) || hidden (state))
 		return;
 
 	_update_time (state);
 
-	doupdate ();
+	update_screen ();
+}
+
+/**
+ * update_clock:
+ * @state: application state structure.
+ *
+ * The data stream has set the session clock, which happens once a
+ * minute, so any popup has been up long enough; close it and update the
+ * time.
+ **/
+static void
+update_clock (CurrentState *state)
+{
+	close_popup ();
+	update_time (state);
 }
 
 /**
@@ -800,6 +1205,8 @@ close_display (void)
 
 	if (popupwin)
 		delwin (popupwin);
+	if (statswin)
+		delwin (statswin);
 	if (boardwin)
 		delwin (boardwin);
 
@@ -823,6 +1230,13 @@ handle_keys (CurrentState *state)
 {
 	if (! cursed)
 		return 0;
+	if (shown_state)
+		state = shown_state;
+
+	flush_display (state);
+
+	if (statswin && (now_ms () - stats_drawn >= 1000))
+		draw_stats (state);
 
 	switch (getch ()) {
 	case KEY_ENTER:
@@ -832,14 +1246,195 @@ handle_keys (CurrentState *state)
 	case 'q':
 	case 'Q':
 		return -1;
+	case 's':
+	case 'S':
+		toggle_stats (state);
+		return 1;
+	case ' ':
+		pause_replay ();
+		pause_time_shift ();
+		return 1;
+	case KEY_LEFT:
+		skip_time_shift (-SKIP_SECS);
+		return 1;
+	case KEY_RIGHT:
+		skip_time_shift (SKIP_SECS);
+		return 1;
+	case 'l':
+	case 'L':
+		go_live ();
+		return 1;
+	case 'n':
+	case 'N':
+		step_replay ();
+		return 1;
+	case '[':
+		seek_replay_laps (state, -1);
+		return 1;
+	case ']':
+		seek_replay_laps (state, 1);
+		return 1;
+	case KEY_UP:
+		scroll_board (-1);
+		return 1;
+	case KEY_DOWN:
+		scroll_board (1);
+		return 1;
+	case KEY_PPAGE:
+		scroll_board (-(LINES - 1));
+		return 1;
+	case KEY_NPAGE:
+		scroll_board (LINES - 1);
+		return 1;
+	case KEY_HOME:
+		scroll_board (-nlines);
+		return 1;
+	case KEY_END:
+		scroll_board (nlines);
+		return 1;
 	case KEY_RESIZE:
 		clear_board (state);
+		if (statswin)
+			draw_stats (state);
 		return 1;
 	default:
 		return 0;
 	}
 }
 
+/**
+ * toggle_stats:
+ * @state: application state structure.
+ *
+ * Shows the statistics panel over the board if it's hidden, or hides it
+ * and redraws what was underneath.
+ **/
+void
+toggle_stats (CurrentState *state)
+{
+	if (! cursed)
+		return;
+
+	if (statswin) {
+		delwin (statswin);
+		statswin = NULL;
+
+		redrawwin (stdscr);
+		wnoutrefresh (stdscr);
+		if (boardwin) {
+			redrawwin (boardwin);
+			refresh_board ();
+		}
+		if (statwin) {
+			redrawwin (statwin);
+			wnoutrefresh (statwin);
+		}
+		if (popupwin) {
+			redrawwin (popupwin);
+			wnoutrefresh (popupwin);
+		}
+
+		update_screen ();
+	} else {
+		StatsRates rates;
+
+		/* Start the rates afresh */
+		sample_stats (&rates);
+		draw_stats (state);
+	}
+}
+
+/**
+ * draw_stats:
+ * @state: application state structure.
+ *
+ * Draws the statistics panel, creating it if necessary, with the rates
+ * since it was last drawn.  Updates the display when done.
+ **/
+static void
+draw_stats (CurrentState *state)
+{
+	static const struct {
+		int         car, type;
+		const char *name;
+	} rows[] = {
+		{ 1, -1,                   N_("Car atom") },
+		{ 1, CAR_POSITION_UPDATE,  N_("Position") },
+		{ 1, CAR_POSITION_HISTORY, N_("History") },
+		{ 0, SYS_EVENT_ID,         N_("Event") },
+		{ 0, SYS_KEY_FRAME,        N_("Key frame") },
+		{ 0, SYS_TIMESTAMP,        N_("Timestamp") },
+		{ 0, SYS_WEATHER,          N_("Weather") },
+		{ 0, SYS_SPEED,            N_("Speed") },
+		{ 0, SYS_TRACK_STATUS,     N_("Track") },
+		{ 0, SYS_COMMENTARY,       N_("Comment") },
+		{ 0, SYS_NOTICE,           N_("Notice") },
+	};
+	StatsRates rates;
+	double     rate;
+	int        nrows, i, j;
+
+	nrows = sizeof (rows) / sizeof (rows[0]);
+	if (! statswin) {
+		statswin = newwin (nrows + 3, 48,
+				   MAX ((LINES - (nrows + 3)) / 2, 0),
+				   MAX ((COLS - 48) / 2, 0));
+		wbkgdset (statswin, attrs[COLOUR_POPUP]);
+	}
+
+	sample_stats (&rates);
+	stats_drawn = now_ms ();
+
+	werase (statswin);
+	box (statswin, 0, 0);
+	mvwprintw (statswin, 0, 2, " %s ", _("Statistics"));
+
+	/* Packets per second by type down the left */
+	mvwprintw (statswin, 1, 2, "%-10s %8.0f B/s", _("Read"),
+		   rates.bytes);
+	for (i = 0; i < nrows; i++) {
+		if (rows[i].type >= 0) {
+			rate = (rows[i].car ? rates.car_packets[rows[i].type]
+				: rates.sys_packets[rows[i].type]);
+		} else {
+			rate = 0;
+			for (j = 0; j < 16; j++)
+				if ((j != CAR_POSITION_UPDATE)
+				    && (j != CAR_POSITION_HISTORY))
+					rate += rates.car_packets[j];
+		}
+
+		mvwprintw (statswin, i + 2, 2, "%-10s %8.1f /s",
+			   _(rows[i].name), rate);
+	}
+
+	/* Timings down the right */
+	mvwprintw (statswin, 1, 26, "%-10s %6.1f /s", _("Packets"),
+		   rates.packets);
+	mvwprintw (statswin, 2, 26, "%-10s %6.1f us", _("Decrypt"),
+		   rates.decrypt_us);
+	mvwprintw (statswin, 3, 26, "%-10s %6.1f us", _("Handler"),
+		   rates.handler_us);
+	mvwprintw (statswin, 4, 26, "%-10s %6.2f ms", _("Render"),
+		   rates.render_ms);
+	mvwprintw (statswin, 5, 26, "%-10s %6.0f ms", _("Ping-burst"),
+		   rates.ping_burst_ms);
+	mvwprintw (statswin, 6, 26, "%-10s %6.0f ms", _("Key frame"),
+		   rates.key_frame_ms);
+	mvwprintw (statswin, 7, 26, "%-10s %9lu", _("Key frames"),
+		   stats.key_frames);
+	mvwprintw (statswin, 8, 26, "%-10s %9s", _("Decryption"),
+		   (state->decryption_failure ? _("FAILED")
+		    : (state->key ? _("ok") : _("no key"))));
+	mvwprintw (statswin, 9, 26, "%-10s %9lu", _("Failures"),
+		   stats.decryption_failures);
+	mvwprintw (statswin, 10, 26, "%-10s %9lu", _("Pings"),
+		   stats.pings);
+
+	wnoutrefresh (statswin);
+	update_screen ();
+}
+
 /**
  * popup_message:
  * @message: message to display.
@@ -855,6 +1450,9 @@ popup_message (const char *message)
 	int    nlines, ncols, col, ls, i;
 	regex_t re;
 
+	if (suspended)
+		return;
+
 	open_display ();
 	close_popup ();
 
@@ -961,11 +1559,16 @@ close_popup (void)
 
 	if (boardwin) {
 		redrawwin (boardwin);
-		wnoutrefresh (boardwin);
+		refresh_board ();
 	}
 
 	if (statwin) {
 		redrawwin (statwin);
 		wnoutrefresh (statwin);
 	}
+
+	if (statswin) {
+		redrawwin (statswin);
+		wnoutrefresh (statswin);
+	}
 }
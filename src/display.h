@@ -22,6 +22,7 @@
 
 #include "live-f1.h"
 #include "packet.h"
+#include "sink.h"
 
 
 SJR_BEGIN_EXTERN
@@ -29,11 +30,20 @@ SJR_BEGIN_EXTERN
 /* Curses display running */
 int cursed;
 
+/* Sink drawing the board */
+extern const Sink display_sink;
+
 
 void open_display  (void);
 void close_display (void);
 int  handle_keys   (CurrentState *state);
 
+void set_display_latency (int budget);
+void flush_display (CurrentState *state);
+void toggle_stats  (CurrentState *state);
+void suspend_display (CurrentState *state, int suspend);
+void show_state      (CurrentState *state);
+
 void clear_board   (CurrentState *state);
 void update_cell   (CurrentState *state, int car, int type);
 void update_car    (CurrentState *state, int car);
@@ -0,0 +1,575 @@
+/* live-f1
+ *
+ * events.c - writing each change to the state as a line of JSON
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "sink.h"
+#include "stream.h"
+#include "json.h"
+#include "events.h"
+
+
+/* Size of the buffer events are written to before going out */
+#define EVENTS_SIZE 65536
+
+/* Room to leave for the largest event, so each is written whole */
+#define EVENT_MAX   1024
+
+/* Lengths of the fastest lap fields */
+#define FL_CAR_LEN    3
+#define FL_DRIVER_LEN 15
+#define FL_TIME_LEN   9
+#define FL_LAP_LEN    3
+
+
+/**
+ * EventStatus:
+ *
+ * What was last written of the session status, so that only what has
+ * changed is written when update_status() is called.
+ **/
+typedef struct {
+	unsigned int laps_completed, total_laps;
+	FlagStatus   flag;
+	int          track_temp, air_temp, humidity;
+	int          wind_speed, wind_direction, pressure;
+	char         fl_car[FL_CAR_LEN], fl_driver[FL_DRIVER_LEN];
+	char         fl_time[FL_TIME_LEN], fl_lap[FL_LAP_LEN];
+} EventStatus;
+
+
+/* Forward prototypes */
+static void clear_board   (CurrentState *state);
+static void update_car    (CurrentState *state, int car);
+static void update_cell   (CurrentState *state, int car, int type);
+static void update_status (CurrentState *state);
+static void update_clock  (CurrentState *state);
+static int  changed_field (char *last, const char *text, size_t len);
+static void begin_event   (CurrentState *state, const char *name);
+static void end_event     (void);
+static void put_raw       (const char *str);
+static void put_key       (const char *key);
+static void put_digits    (long value);
+static void put_int       (const char *key, long value);
+static void put_tenths    (const char *key, long value);
+static void put_text      (const char *key, const char *text, size_t len);
+
+
+/* Where events are written, or -1 */
+static int events_fd = -1;
+
+/* State whose changes are written */
+static CurrentState *events_state = NULL;
+
+/* Events not yet written */
+static char   events_buf[EVENTS_SIZE];
+static size_t events_len = 0;
+
+/* Status last written */
+static EventStatus last;
+
+/* Sink writing the events */
+static const Sink events_sink = {
+	clear_board,
+	update_car,
+	NULL,
+	update_cell,
+	update_status,
+	update_clock,
+	NULL,
+	&output_filter,
+};
+
+
+/**
+ * open_events:
+ * @path: file, pipe or Unix socket to write to,
+ * @state: application state structure.
+ *
+ * Writes every change to @state to @path from now on, each as a compact
+ * JSON object on a line of its own.  If @path is a Unix socket we
+ * connect to it, otherwise it's opened for writing, appending to it if
+ * it's a file that exists.
+ *
+ * Events are built in a buffer without allocating anything, and only
+ * written when flush_events() is called after each read of the data
+ * stream, or when the buffer fills.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_events (const char   *path,
+	     CurrentState *state)
+{
+	struct stat statbuf;
+
+	if ((stat (path, &statbuf) == 0) && S_ISSOCK (statbuf.st_mode)) {
+		struct sockaddr_un addr;
+
+		if (strlen (path) >= sizeof (addr.sun_path)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name, path,
+				 _("socket path too long"));
+			return 1;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		addr.sun_family = AF_UNIX;
+		strcpy (addr.sun_path, path);
+
+		events_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+		if ((events_fd >= 0)
+		    && (connect (events_fd, (struct sockaddr *) &addr,
+				 sizeof (addr)) < 0)) {
+			close (events_fd);
+			events_fd = -1;
+		}
+	} else {
+		events_fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	}
+
+	if (events_fd < 0) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to write events to"), path,
+			 strerror (errno));
+		return 1;
+	}
+
+	/* A reader going away shouldn't take us with it */
+	signal (SIGPIPE, SIG_IGN);
+
+	events_state = state;
+	events_len = 0;
+	memset (&last, 0, sizeof (last));
+	add_sink (&events_sink);
+
+	info (1, _("Writing events to %s\n"), path);
+
+	return 0;
+}
+
+/**
+ * flush_events:
+ *
+ * Called from the main loop after each read of the data stream to write
+ * the events it caused.  If there's an error, events are no longer
+ * written rather than interrupting anything else.
+ **/
+void
+flush_events (void)
+{
+	size_t  off = 0;
+	ssize_t len;
+
+	if (events_fd < 0)
+		return;
+
+	while (off < events_len) {
+		len = write (events_fd, events_buf + off, events_len - off);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			info (0, _("Unable to write events: %s\n"),
+			      strerror (errno));
+			remove_sink (&events_sink);
+			close (events_fd);
+			events_fd = -1;
+			break;
+		}
+
+		off += len;
+	}
+
+	events_len = 0;
+}
+
+/**
+ * close_events:
+ *
+ * Writes any events still buffered and stops writing them.
+ **/
+void
+close_events (void)
+{
+	if (events_fd < 0)
+		return;
+
+	flush_events ();
+	if (events_fd < 0)
+		return;
+
+	remove_sink (&events_sink);
+	close (events_fd);
+	events_fd = -1;
+}
+
+
+/**
+ * clear_board:
+ * @state: application state structure.
+ *
+ * Writes a "board" event giving the event number and type and number of
+ * cars, since these are what change the board.  Everything about the
+ * status will be written again when it's next updated.
+ **/
+static void
+clear_board (CurrentState *state)
+{
+	if (state != events_state)
+		return;
+
+	begin_event (state, "board");
+	put_int ("event", state->event_no);
+	put_int ("type", state->event_type);
+	put_int ("cars", state->num_cars);
+	end_event ();
+
+	memset (&last, 0, sizeof (last));
+}
+
+/**
+ * update_car:
+ * @state: application state structure,
+ * @car: car that has moved.
+ *
+ * Writes a "position" event for @car.
+ **/
+static void
+update_car (CurrentState *state,
+	    int           car)
+{
+	if (state != events_state)
+		return;
+
+	begin_event (state, "position");
+	put_int ("car", car);
+	put_int ("position", state->car_position[car - 1]);
+	end_event ();
+}
+
+/**
+ * update_cell:
+ * @state: application state structure,
+ * @car: car whose atom has changed,
+ * @type: type of the atom.
+ *
+ * Writes an "atom" event with the colour and text of the atom.
+ **/
+static void
+update_cell (CurrentState *state,
+	     int           car,
+	     int           type)
+{
+	const CarAtom *atom;
+
+	if (state != events_state)
+		return;
+
+	atom = &state->car_info[car - 1][type];
+
+	begin_event (state, "atom");
+	put_int ("car", car);
+	put_int ("type", type);
+	put_int ("colour", atom->data);
+	put_text ("text", atom->text, sizeof (atom->text));
+	end_event ();
+}
+
+/**
+ * update_status:
+ * @state: application state structure.
+ *
+ * Compares the status of the session with what was last written, and
+ * writes a "laps", "flag", "weather" or "fastest_lap" event for each
+ * part that has changed.  Wind speed and pressure are sent in tenths
+ * by the data stream, so are written as decimals.
+ **/
+static void
+update_status (CurrentState *state)
+{
+	if (state != events_state)
+		return;
+
+	if ((state->laps_completed != last.laps_completed)
+	    || (state->total_laps != last.total_laps)) {
+		begin_event (state, "laps");
+		put_int ("completed", state->laps_completed);
+		put_int ("total", state->total_laps);
+		end_event ();
+
+		last.laps_completed = state->laps_completed;
+		last.total_laps = state->total_laps;
+	}
+
+	if (state->flag != last.flag) {
+		begin_event (state, "flag");
+		put_int ("flag", state->flag);
+		end_event ();
+
+		last.flag = state->flag;
+	}
+
+	if ((state->track_temp != last.track_temp)
+	    || (state->air_temp != last.air_temp)
+	    || (state->humidity != last.humidity)
+	    || (state->wind_speed != last.wind_speed)
+	    || (state->wind_direction != last.wind_direction)
+	    || (state->pressure != last.pressure)) {
+		begin_event (state, "weather");
+		put_int ("track_temp", state->track_temp);
+		put_int ("air_temp", state->air_temp);
+		put_int ("humidity", state->humidity);
+		put_tenths ("wind_speed", state->wind_speed);
+		put_int ("wind_direction", state->wind_direction);
+		put_tenths ("pressure", state->pressure);
+		end_event ();
+
+		last.track_temp = state->track_temp;
+		last.air_temp = state->air_temp;
+		last.humidity = state->humidity;
+		last.wind_speed = state->wind_speed;
+		last.wind_direction = state->wind_direction;
+		last.pressure = state->pressure;
+	}
+
+	/* Each of these must be updated, so no short-circuit */
+	if (changed_field (last.fl_car, state->fl_car, FL_CAR_LEN)
+	    | changed_field (last.fl_driver, state->fl_driver, FL_DRIVER_LEN)
+	    | changed_field (last.fl_time, state->fl_time, FL_TIME_LEN)
+	    | changed_field (last.fl_lap, state->fl_lap, FL_LAP_LEN)) {
+		begin_event (state, "fastest_lap");
+		put_text ("car", last.fl_car, FL_CAR_LEN);
+		put_text ("driver", last.fl_driver, FL_DRIVER_LEN);
+		put_text ("lap_time", last.fl_time, FL_TIME_LEN);
+		put_text ("lap", last.fl_lap, FL_LAP_LEN);
+		end_event ();
+	}
+}
+
+/**
+ * update_clock:
+ * @state: application state structure.
+ *
+ * Writes a "clock" event with the time remaining in the session when
+ * it was set, and whether the clock is running.
+ **/
+static void
+update_clock (CurrentState *state)
+{
+	if (state != events_state)
+		return;
+
+	begin_event (state, "clock");
+	put_int ("remaining", state->remaining_time);
+	put_raw (state->epoch_time ? ",\"running\":true"
+		 : ",\"running\":false");
+	end_event ();
+}
+
+/**
+ * changed_field:
+ * @last: copy last written,
+ * @text: current value, may be NULL,
+ * @len: size of @last.
+ *
+ * Compares one of the fastest lap fields with the copy last written,
+ * updating the copy.
+ *
+ * Returns: TRUE if the field has changed, FALSE otherwise.
+ **/
+static int
+changed_field (char       *last,
+	       const char *text,
+	       size_t      len)
+{
+	size_t n;
+
+	if (! text)
+		text = "";
+	if (! strncmp (last, text, len - 1))
+		return FALSE;
+
+	n = strnlen (text, len - 1);
+	memcpy (last, text, n);
+	last[n] = 0;
+	return TRUE;
+}
+
+
+/**
+ * begin_event:
+ * @state: application state structure,
+ * @name: type of event.
+ *
+ * Starts an event in the buffer, writing out what's already there if
+ * it's nearly full.  Every event has its type and the time of the
+ * session it happened, in seconds since the epoch.
+ **/
+static void
+begin_event (CurrentState *state,
+	     const char   *name)
+{
+	if (events_len + EVENT_MAX > EVENTS_SIZE)
+		flush_events ();
+
+	put_raw ("{\"ev\":\"");
+	put_raw (name);
+	put_raw ("\"");
+	put_int ("ts", get_time (state));
+}
+
+/**
+ * end_event:
+ *
+ * Finishes the event being built in the buffer.
+ **/
+static void
+end_event (void)
+{
+	put_raw ("}\n");
+}
+
+/**
+ * put_raw:
+ * @str: string to copy.
+ *
+ * Copies @str into the buffer as it is.
+ **/
+static void
+put_raw (const char *str)
+{
+	while (*str)
+		events_buf[events_len++] = *(str++);
+}
+
+/**
+ * put_key:
+ * @key: name of the member.
+ *
+ * Starts a member of the event being built.
+ **/
+static void
+put_key (const char *key)
+{
+	put_raw (",\"");
+	put_raw (key);
+	put_raw ("\":");
+}
+
+/**
+ * put_digits:
+ * @value: sign of the number, and the number.
+ *
+ * Copies the decimal digits of @value into the buffer.
+ **/
+static void
+put_digits (long value)
+{
+	char          digits[24];
+	unsigned long number;
+	int           i = 0;
+
+	if (value < 0) {
+		events_buf[events_len++] = '-';
+		number = -(unsigned long) value;
+	} else {
+		number = value;
+	}
+
+	do {
+		digits[i++] = '0' + number % 10;
+		number /= 10;
+	} while (number);
+
+	while (i)
+		events_buf[events_len++] = digits[--i];
+}
+
+/**
+ * put_int:
+ * @key: name of the member,
+ * @value: value of the member.
+ *
+ * Adds a member with an integer value to the event being built.
+ **/
+static void
+put_int (const char *key,
+	 long        value)
+{
+	put_key (key);
+	put_digits (value);
+}
+
+/**
+ * put_tenths:
+ * @key: name of the member,
+ * @value: value of the member in tenths.
+ *
+ * Adds a member with a decimal value to the event being built.
+ **/
+static void
+put_tenths (const char *key,
+	    long        value)
+{
+	put_key (key);
+	if (value < 0) {
+		events_buf[events_len++] = '-';
+		value = -value;
+	}
+
+	put_digits (value / 10);
+	events_buf[events_len++] = '.';
+	events_buf[events_len++] = '0' + value % 10;
+}
+
+/**
+ * put_text:
+ * @key: name of the member,
+ * @text: value of the member,
+ * @len: most bytes of @text to use.
+ *
+ * Adds a member with a string value to the event being built, encoded
+ * by encode_json_text().
+ **/
+static void
+put_text (const char *key,
+	  const char *text,
+	  size_t      len)
+{
+	put_key (key);
+	events_len += encode_json_text (events_buf + events_len, text, len);
+}
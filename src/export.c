@@ -0,0 +1,1105 @@
+/* live-f1
+ *
+ * export.c - convert recorded sessions into lap, sector and pit tables
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if HAVE_GETOPT_H
+# include <getopt.h>
+#endif /* HAVE_GETOPT_H */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "archive.h"
+#include "mapfile.h"
+#include "packet.h"
+#include "record.h"
+#include "stream.h"
+
+
+/* Binary table file magic, and the size of its header and of each
+ * column description */
+#define TABLE_MAGIC       "LF1X"
+#define TABLE_VERSION     1
+#define TABLE_FILE_HEADER 20
+#define TABLE_COLUMN      24
+
+/* Width of a text column, as held for each car */
+#define TEXT_WIDTH        sizeof (((CarAtom *) 0)->text)
+
+/* Most columns in a table */
+#define MAX_COLUMNS       16
+
+/* Value of an integer column that isn't known */
+#define UNKNOWN           -1
+
+
+/**
+ * ColumnType:
+ *
+ * Type of the values in a column; integers are stored as 32-bit
+ * little-endian, texts as TEXT_WIDTH bytes padded with zeros.
+ **/
+typedef enum {
+	COLUMN_INT	= 1,
+	COLUMN_TEXT	= 2,
+} ColumnType;
+
+/**
+ * Column:
+ * @name: name of the column,
+ * @type: type of its values.
+ **/
+typedef struct {
+	const char *name;
+	ColumnType  type;
+} Column;
+
+/**
+ * Table:
+ * @name: name of the table, used in the names of the files written,
+ * @columns: columns of the table,
+ * @num_columns: number of @columns,
+ * @data: values of each column, one after another,
+ * @num_rows: number of rows,
+ * @alloc: number of rows allocated in @data.
+ *
+ * A table built up a row at a time, held column by column as it's
+ * written to the binary format.
+ **/
+typedef struct {
+	const char    *name;
+	const Column  *columns;
+	int            num_columns;
+	unsigned char *data[MAX_COLUMNS];
+	size_t         num_rows, alloc;
+} Table;
+
+/**
+ * AtomMap:
+ * @number: atom giving the car number,
+ * @driver: atom giving the driver's name,
+ * @lap_time: atom giving the time of the lap just completed,
+ * @laps: atom giving the number of laps completed,
+ * @sector: atoms giving the time of each sector just completed,
+ * @gap: atom giving the gap to the leader,
+ * @interval: atom giving the gap to the car in front,
+ * @pits: atom giving the number of pit stops.
+ *
+ * Which atoms mean what, for each type of event; zero if not sent.
+ **/
+typedef struct {
+	int number, driver, lap_time, laps;
+	int sector[3];
+	int gap, interval, pits;
+} AtomMap;
+
+/**
+ * ExportJob:
+ * @state: board the recording is parsed into, first so the data source
+ * and packet handlers can find the rest,
+ * @filename: recording being exported,
+ * @records: capture file records, if a capture file,
+ * @records_len: length of @records,
+ * @first_ns: time of the first read of the data stream,
+ * @read_ns: time of the read being parsed,
+ * @car_laps: laps completed by each car in the current event, or
+ * UNKNOWN,
+ * @num_cars: number of @car_laps,
+ * @laps: table of laps,
+ * @sectors: table of sectors,
+ * @pits: table of pit stops.
+ *
+ * Everything about one recording being exported; each worker has its
+ * own, so nothing here is shared.
+ **/
+typedef struct {
+	CurrentState         state;
+	const char          *filename;
+	const unsigned char *records;
+	size_t               records_len;
+	long long            first_ns, read_ns;
+	int                 *car_laps;
+	int                  num_cars;
+	Table                laps, sectors, pits;
+} ExportJob;
+
+
+/* Forward prototypes */
+static void         print_version (void);
+static void         print_usage   (void);
+static void        *worker        (void *arg);
+static int          export_file   (const char *filename);
+static void         car_packet    (CurrentState *state,
+				   const Packet *packet);
+static void         event_packet  (CurrentState *state,
+				   const Packet *packet);
+static void         add_row       (Table *table, ...);
+static int          elapsed_ms    (const ExportJob *job);
+static int          write_tables  (ExportJob *job);
+static int          write_csv     (const Table *table, FILE *out);
+static int          write_binary  (const Table *table, FILE *out);
+static void         free_table    (Table *table);
+static unsigned int export_key    (CurrentState *state,
+				   unsigned int event_no);
+static int          export_key_frame (CurrentState *state,
+				      unsigned int frame);
+static unsigned int export_laps   (CurrentState *state);
+
+
+/* Program name */
+const char *program_name = NULL;
+
+/* How verbose to be */
+static int verbosity = 0;
+
+/* Where to write the tables, in which formats, and what to use for
+ * recordings that don't contain keys and key frames */
+static const char   *output_dir = ".";
+static int           write_text = TRUE, write_columns = TRUE;
+static unsigned int  given_key = 0;
+static const char   *key_frame_dir = NULL;
+
+/* Recordings still to export, taken by each worker in turn */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static char          **queue = NULL;
+static int             queue_len = 0, queue_next = 0, failures = 0;
+
+/* Where the tables get their keys and key frames */
+static const DataSource export_source = {
+	export_key, export_key_frame, export_laps, NULL
+};
+
+/* Columns of each table */
+static const Column lap_columns[] = {
+	{ "event", COLUMN_INT }, { "type", COLUMN_INT },
+	{ "car", COLUMN_INT }, { "number", COLUMN_TEXT },
+	{ "driver", COLUMN_TEXT }, { "lap", COLUMN_INT },
+	{ "lap_time", COLUMN_TEXT }, { "lap_ms", COLUMN_INT },
+	{ "sector_1", COLUMN_TEXT }, { "sector_2", COLUMN_TEXT },
+	{ "sector_3", COLUMN_TEXT }, { "position", COLUMN_INT },
+	{ "gap", COLUMN_TEXT }, { "interval", COLUMN_TEXT },
+	{ "pits", COLUMN_INT }, { "time_ms", COLUMN_INT },
+};
+static const Column sector_columns[] = {
+	{ "event", COLUMN_INT }, { "type", COLUMN_INT },
+	{ "car", COLUMN_INT }, { "number", COLUMN_TEXT },
+	{ "driver", COLUMN_TEXT }, { "lap", COLUMN_INT },
+	{ "sector", COLUMN_INT }, { "sector_time", COLUMN_TEXT },
+	{ "sector_ms", COLUMN_INT }, { "time_ms", COLUMN_INT },
+};
+static const Column pit_columns[] = {
+	{ "event", COLUMN_INT }, { "type", COLUMN_INT },
+	{ "car", COLUMN_INT }, { "number", COLUMN_TEXT },
+	{ "driver", COLUMN_TEXT }, { "lap", COLUMN_INT },
+	{ "stop", COLUMN_INT }, { "time_ms", COLUMN_INT },
+};
+
+/* Meaning of the atoms, indexed by EventType */
+static const AtomMap atom_maps[] = {
+	{ 0, 0, 0, 0, { 0, 0, 0 }, 0, 0, 0 },
+	{ RACE_NUMBER, RACE_DRIVER, RACE_LAP_TIME, 0,
+	  { RACE_SECTOR_1, RACE_SECTOR_2, RACE_SECTOR_3 },
+	  RACE_GAP, RACE_INTERVAL, RACE_NUM_PITS },
+	{ PRACTICE_NUMBER, PRACTICE_DRIVER, 0, PRACTICE_LAP,
+	  { PRACTICE_SECTOR_1, PRACTICE_SECTOR_2, PRACTICE_SECTOR_3 },
+	  PRACTICE_GAP, 0, 0 },
+	{ QUALIFYING_NUMBER, QUALIFYING_DRIVER, 0, QUALIFYING_LAP,
+	  { QUALIFYING_SECTOR_1, QUALIFYING_SECTOR_2, QUALIFYING_SECTOR_3 },
+	  0, 0, 0 },
+};
+
+/* Command-line options */
+static const char opts[] = "j:o:v";
+static const struct option longopts[] = {
+	{ "format",	required_argument, NULL, 0400 + 'F' },
+	{ "jobs",	required_argument, NULL, 'j' },
+	{ "key",	required_argument, NULL, 0400 + 'k' },
+	{ "key-frames",	required_argument, NULL, 0400 + 'f' },
+	{ "output",	required_argument, NULL, 'o' },
+	{ "verbose",	no_argument, NULL, 'v' },
+	{ "help",	no_argument, NULL, 0400 + 'h' },
+	{ "version",	no_argument, NULL, 0400 + 'v' },
+	{ NULL,		no_argument, NULL, 0 }
+};
+
+
+/**
+ * put_le32:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value to @buf as a little-endian 32-bit integer.
+ **/
+static inline void
+put_le32 (unsigned char *buf,
+	  unsigned long  value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * get_le32:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian 32-bit integer read from @buf.
+ **/
+static inline unsigned long
+get_le32 (const unsigned char *buf)
+{
+	return ((unsigned long) buf[3] << 24) | ((unsigned long) buf[2] << 16)
+		| ((unsigned long) buf[1] << 8) | buf[0];
+}
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	pthread_t *threads;
+	long       jobs = 0;
+	int        opt, i, err;
+
+	setlocale (LC_ALL, "");
+	bindtextdomain (PACKAGE, LOCALEDIR);
+	textdomain (PACKAGE);
+
+	program_name = argv[0];
+
+	while ((opt = getopt_long (argc, argv, opts, longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atoi (optarg);
+			break;
+		case 'o':
+			output_dir = optarg;
+			break;
+		case 'v':
+			verbosity++;
+			break;
+		case 0400 + 'F':
+			write_text = (! strcmp (optarg, "csv")
+				      || ! strcmp (optarg, "both"));
+			write_columns = (! strcmp (optarg, "binary")
+					 || ! strcmp (optarg, "both"));
+			if (write_text || write_columns)
+				break;
+
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("unknown format"), optarg);
+			return 1;
+		case 0400 + 'k':
+			given_key = strtoul (optarg, NULL, 16);
+			break;
+		case 0400 + 'f':
+			key_frame_dir = optarg;
+			break;
+		case 0400 + 'h':
+			print_usage ();
+			return 0;
+		case 0400 + 'v':
+			print_version ();
+			return 0;
+		case '?':
+			fprintf (stderr,
+				 _("Try `%s --help' for more information.\n"),
+				 program_name);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("no recordings given"));
+		fprintf (stderr,
+			 _("Try `%s --help' for more information.\n"),
+			 program_name);
+		return 1;
+	}
+
+	queue = argv + optind;
+	queue_len = argc - optind;
+
+	/* One recording per worker, as many workers as there are CPUs */
+	if (jobs <= 0)
+		jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	jobs = MAX (MIN (jobs, queue_len), 1);
+
+	threads = malloc (sizeof (pthread_t) * jobs);
+	if (! threads)
+		abort ();
+
+	/* Each car packet and each new event goes through the handler
+	 * live-f1 uses, then on to the tables
+	 */
+	for (i = 0; i < PACKET_TYPES; i++)
+		car_dispatch[i] = car_packet;
+	system_dispatch[SYS_EVENT_ID] = event_packet;
+
+	info (1, _("Exporting %d recordings with %ld workers ...\n"),
+	      queue_len, jobs);
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create (&threads[i], NULL, worker, NULL);
+		if (err) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("unable to start worker"),
+				 strerror (err));
+			abort ();
+		}
+	}
+
+	for (i = 0; i < jobs; i++)
+		pthread_join (threads[i], NULL);
+
+	free (threads);
+
+	return failures ? 1 : 0;
+}
+
+
+/**
+ * info:
+ * @irrelevance: minimum verbosity level to output the message,
+ * @format: format string for vprintf.
+ *
+ * Print the formatted message to standard output if verbosity is high
+ * enough.
+ **/
+int
+info (int         irrelevance,
+      const char *format, ...)
+{
+	va_list ap;
+	int     ret;
+
+	if (verbosity >= irrelevance) {
+		va_start (ap, format);
+		ret = vprintf (format, ap);
+		va_end (ap);
+
+		return ret;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * print_version:
+ *
+ * Print the package name, version, copyright and licence preamble to
+ * standard output.
+ **/
+static void
+print_version (void)
+{
+	printf ("live-f1-export (%s)\n", PACKAGE_STRING);
+	printf ("Copyright (C) 2011, Dave Pusey <dave@puseyuk.co.uk>\n");
+	printf ("\n");
+	printf (_("This is free software, covered by the GNU General Public License; see the\n"
+		  "source for copying conditions.  There is NO warranty; not even for\n"
+		  "MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n"));
+}
+
+/**
+ * print_usage:
+ *
+ * Print the program usage instructions to standard output.
+ **/
+static void
+print_usage (void)
+{
+	printf (_("Usage: %s [OPTION]... FILE...\n"), program_name);
+	printf (_("Converts recorded sessions into tables of laps, sectors and pit stops.\n"));
+	printf ("\n");
+	printf (_("Options:\n"
+		  "      --format=FORMAT        write csv, binary or both (default both).\n"
+		  "  -j, --jobs=N               convert N recordings at once (default the\n"
+		  "                             number of CPUs).\n"
+		  "      --key=HEX              decryption key to use for recordings that\n"
+		  "                             don't contain it.\n"
+		  "      --key-frames=DIR       read key frames missing from a recording\n"
+		  "                             from DIR.\n"
+		  "  -o, --output=DIR           write the tables to DIR (default the\n"
+		  "                             current directory).\n"
+		  "  -v, --verbose              increase verbosity for each time repeated.\n"
+		  "      --help                 display this help and exit.\n"
+		  "      --version              output version information and exit.\n"));
+	printf ("\n");
+	printf (_("Report bugs to <%s>\n"), PACKAGE_BUGREPORT);
+}
+
+
+/**
+ * worker:
+ * @arg: unused.
+ *
+ * Takes recordings from the queue and exports each in turn, until none
+ * are left.
+ *
+ * Returns: NULL.
+ **/
+static void *
+worker (void *arg)
+{
+	for (;;) {
+		const char *filename;
+
+		pthread_mutex_lock (&queue_lock);
+		filename = (queue_next < queue_len) ? queue[queue_next++]
+			: NULL;
+		pthread_mutex_unlock (&queue_lock);
+
+		if (! filename)
+			break;
+
+		if (export_file (filename)) {
+			pthread_mutex_lock (&queue_lock);
+			failures++;
+			pthread_mutex_unlock (&queue_lock);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * export_file:
+ * @filename: recording to export.
+ *
+ * Follows the data stream in @filename, a capture file, raw dump or
+ * archive, a read at a time as live-f1 would have, adding a row to the
+ * tables each time a car completes a lap or sector or makes a pit stop,
+ * then writes the tables out.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+export_file (const char *filename)
+{
+	MappedFile           map;
+	ArchiveOutput        unpacked;
+	ExportJob           *job;
+	const unsigned char *data;
+	size_t               len;
+	int                  ret;
+
+	if (map_file (&map, filename)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	data = map.data;
+	len = map.len;
+
+	memset (&unpacked, 0, sizeof (unpacked));
+	if ((len >= ARCHIVE_FILE_HEADER)
+	    && (! memcmp (data, ARCHIVE_MAGIC, 4))) {
+		Archive archive;
+
+		if (open_archive (&archive, data, len)
+		    || read_archive (&archive, &unpacked)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 filename, _("archive is corrupt"));
+			close_archive (&archive);
+			free (unpacked.buf);
+			unmap_file (&map);
+			return 1;
+		}
+		close_archive (&archive);
+
+		data = unpacked.buf;
+		len = unpacked.len;
+	}
+
+	job = malloc (sizeof (ExportJob));
+	if (! job)
+		abort ();
+	memset (job, 0, sizeof (ExportJob));
+
+	job->filename = filename;
+	job->state.source = &export_source;
+	reset_decryption (&job->state);
+
+	job->laps.name = "laps";
+	job->laps.columns = lap_columns;
+	job->laps.num_columns = sizeof (lap_columns) / sizeof (Column);
+	job->sectors.name = "sectors";
+	job->sectors.columns = sector_columns;
+	job->sectors.num_columns = sizeof (sector_columns) / sizeof (Column);
+	job->pits.name = "pits";
+	job->pits.columns = pit_columns;
+	job->pits.num_columns = sizeof (pit_columns) / sizeof (Column);
+
+	/* Parse each read of a capture file in turn, noting when it was
+	 * made; a raw dump has no reads or times, so is parsed whole
+	 */
+	if ((len >= CAPTURE_FILE_HEADER) && (! memcmp (data, CAPTURE_MAGIC, 4))) {
+		CaptureRecord record;
+		size_t        off;
+		ssize_t       used;
+		int           first = TRUE;
+
+		job->records = data + CAPTURE_FILE_HEADER;
+		job->records_len = len - CAPTURE_FILE_HEADER;
+
+		for (off = CAPTURE_FILE_HEADER; off < len; off += used) {
+			used = parse_capture_record (data + off, len - off,
+						     &record);
+			if (used <= 0)
+				break;
+			if (record.source != CAPTURE_STREAM)
+				continue;
+
+			if (first)
+				job->first_ns = record.time_ns;
+			job->read_ns = record.time_ns;
+			first = FALSE;
+
+			parse_stream_block (&job->state, record.data,
+					    record.len);
+		}
+	} else {
+		parse_stream_block (&job->state, data, len);
+	}
+
+	ret = write_tables (job);
+	if (! ret)
+		info (1, _("%s: %zu laps, %zu sectors, %zu pit stops\n"),
+		      filename, job->laps.num_rows, job->sectors.num_rows,
+		      job->pits.num_rows);
+
+	free_table (&job->laps);
+	free_table (&job->sectors);
+	free_table (&job->pits);
+	free_state (&job->state);
+	free (job->car_laps);
+	free (job);
+	free (unpacked.buf);
+	unmap_file (&map);
+
+	return ret;
+}
+
+/**
+ * car_packet:
+ * @state: board within an ExportJob,
+ * @packet: car packet.
+ *
+ * Handles @packet as live-f1 does, then adds to the tables if it's the
+ * time of a lap or sector just completed, or a pit stop.  Nothing is
+ * added while parsing a key frame, since that only gives the state so
+ * far, nor while decryption has been lost, until a key frame puts the
+ * board right again.
+ **/
+static void
+car_packet (CurrentState *state,
+	    const Packet *packet)
+{
+	ExportJob     *job = (ExportJob *) state;
+	const AtomMap *map;
+	CarAtom       *atoms, *atom;
+	int           *laps, leader_laps, position, i;
+
+	handle_car_packet (state, packet);
+
+	if ((packet->type == CAR_POSITION_UPDATE)
+	    || (packet->type >= CAR_POSITION_HISTORY))
+		return;
+
+	if (packet->car > job->num_cars) {
+		job->car_laps = realloc (job->car_laps,
+					 sizeof (int) * packet->car);
+		if (! job->car_laps)
+			abort ();
+
+		for (i = job->num_cars; i < packet->car; i++)
+			job->car_laps[i] = UNKNOWN;
+
+		job->num_cars = packet->car;
+	}
+
+	if ((state->event_type < RACE_EVENT)
+	    || (state->event_type > QUALIFYING_EVENT))
+		return;
+	map = &atom_maps[state->event_type];
+
+	atoms = state->car_info[packet->car - 1];
+	atom = &atoms[packet->type];
+	laps = &job->car_laps[packet->car - 1];
+	position = state->car_position[packet->car - 1];
+
+	/* Practice and qualifying give the laps completed as an atom */
+	if (packet->type == map->laps)
+		*laps = atoi (atom->text);
+
+	if (state->in_key_frame || state->decryption_failure
+	    || (packet->len <= 0))
+		return;
+
+	/* The leader's interval, which the handler keeps, is the number
+	 * of laps completed */
+	leader_laps = (state->laps_completed
+		       ? (int) state->laps_completed : UNKNOWN);
+	if (packet->type == map->lap_time)
+		*laps = count_lap (*laps, leader_laps, atoms[map->gap].text);
+
+	if ((packet->type == map->lap_time) || (packet->type == map->laps))
+		add_row (&job->laps, state->event_no, state->event_type,
+			 packet->car, atoms[map->number].text,
+			 atoms[map->driver].text, *laps,
+			 map->lap_time ? atoms[map->lap_time].text : "",
+			 (map->lap_time
+			  ? parse_time_ms (atoms[map->lap_time].text)
+			  : UNKNOWN),
+			 atoms[map->sector[0]].text,
+			 atoms[map->sector[1]].text,
+			 atoms[map->sector[2]].text,
+			 position ? position : UNKNOWN,
+			 map->gap ? atoms[map->gap].text : "",
+			 map->interval ? atoms[map->interval].text : "",
+			 map->pits ? atoi (atoms[map->pits].text) : UNKNOWN,
+			 elapsed_ms (job));
+
+	for (i = 0; i < 3; i++)
+		if (packet->type == map->sector[i])
+			add_row (&job->sectors, state->event_no,
+				 state->event_type, packet->car,
+				 atoms[map->number].text,
+				 atoms[map->driver].text,
+				 (*laps != UNKNOWN) ? *laps + 1 : UNKNOWN,
+				 i + 1, atom->text, parse_time_ms (atom->text),
+				 elapsed_ms (job));
+
+	if (map->pits && (packet->type == map->pits))
+		add_row (&job->pits, state->event_no, state->event_type,
+			 packet->car, atoms[map->number].text,
+			 atoms[map->driver].text, *laps,
+			 atoi (atom->text), elapsed_ms (job));
+}
+
+/**
+ * event_packet:
+ * @state: board within an ExportJob,
+ * @packet: system packet beginning an event.
+ *
+ * Handles @packet as live-f1 does, which clears the board, and forgets
+ * the laps each car had completed along with it.
+ **/
+static void
+event_packet (CurrentState *state,
+	      const Packet *packet)
+{
+	ExportJob *job = (ExportJob *) state;
+
+	handle_system_packet (state, packet);
+	job->num_cars = 0;
+}
+
+/**
+ * add_row:
+ * @table: table to add to,
+ * @...: value of each column, an int or a string.
+ *
+ * Adds a row to the end of @table.  Strings longer than TEXT_WIDTH are
+ * cut short.
+ **/
+static void
+add_row (Table *table,
+	 ...)
+{
+	va_list ap;
+	int     i;
+
+	if (table->num_rows == table->alloc) {
+		table->alloc = MAX (table->alloc * 2, 1024);
+		for (i = 0; i < table->num_columns; i++) {
+			table->data[i] = realloc (table->data[i],
+						  (table->alloc
+						   * ((table->columns[i].type
+						       == COLUMN_INT)
+						      ? 4 : TEXT_WIDTH)));
+			if (! table->data[i])
+				abort ();
+		}
+	}
+
+	va_start (ap, table);
+	for (i = 0; i < table->num_columns; i++) {
+		unsigned char *cell;
+		const char    *text;
+
+		if (table->columns[i].type == COLUMN_INT) {
+			cell = table->data[i] + table->num_rows * 4;
+			put_le32 (cell, va_arg (ap, int));
+		} else {
+			cell = table->data[i] + table->num_rows * TEXT_WIDTH;
+			text = va_arg (ap, const char *);
+
+			memset (cell, 0, TEXT_WIDTH);
+			memcpy (cell, text, strnlen (text, TEXT_WIDTH));
+		}
+	}
+	va_end (ap);
+
+	table->num_rows++;
+}
+
+/**
+ * elapsed_ms:
+ * @job: recording being exported.
+ *
+ * Returns: milliseconds from the first read in the recording to the one
+ * being parsed, or UNKNOWN for a raw dump.
+ **/
+static int
+elapsed_ms (const ExportJob *job)
+{
+	if (! job->records)
+		return UNKNOWN;
+
+	return (job->read_ns - job->first_ns) / 1000000;
+}
+
+
+/**
+ * write_tables:
+ * @job: recording exported.
+ *
+ * Writes each table to the output directory, named after the recording
+ * with the table name and .csv or .bin on the end; the recording's own
+ * extension is kept so that a capture file and the archive packed from
+ * it don't write over each other.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_tables (ExportJob *job)
+{
+	const Table *tables[3];
+	const char  *base;
+	char        *filename;
+	int          i, j;
+
+	tables[0] = &job->laps;
+	tables[1] = &job->sectors;
+	tables[2] = &job->pits;
+
+	base = strrchr (job->filename, '/');
+	base = base ? base + 1 : job->filename;
+
+	filename = malloc (strlen (output_dir) + strlen (base) + 32);
+	if (! filename)
+		abort ();
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 2; j++) {
+			FILE *out;
+			int   ret;
+
+			if ((j == 0) && (! write_text))
+				continue;
+			if ((j == 1) && (! write_columns))
+				continue;
+
+			sprintf (filename, "%s/%s.%s.%s", output_dir, base,
+				 tables[i]->name, j ? "bin" : "csv");
+
+			out = fopen (filename, "w");
+			if (! out)
+				goto error;
+
+			ret = j ? write_binary (tables[i], out)
+				: write_csv (tables[i], out);
+			if (fclose (out) || ret)
+				goto error;
+		}
+	}
+
+	free (filename);
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to write"), filename, strerror (errno));
+	free (filename);
+	return 1;
+}
+
+/**
+ * write_csv:
+ * @table: table to write,
+ * @out: file to write to.
+ *
+ * Writes @table as comma-separated values, with the column names on
+ * the first line.  Texts are quoted, and integers that aren't known are
+ * left empty.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_csv (const Table *table,
+	   FILE        *out)
+{
+	size_t row;
+	int    i;
+
+	for (i = 0; i < table->num_columns; i++)
+		fprintf (out, "%s%s", i ? "," : "", table->columns[i].name);
+	fputc ('\n', out);
+
+	for (row = 0; row < table->num_rows; row++) {
+		for (i = 0; i < table->num_columns; i++) {
+			const unsigned char *cell;
+
+			if (i)
+				fputc (',', out);
+
+			if (table->columns[i].type == COLUMN_INT) {
+				long value;
+
+				cell = table->data[i] + row * 4;
+				value = (long) get_le32 (cell);
+				if (value > 0x7fffffffL)
+					value -= 0x100000000L;
+				if (value != UNKNOWN)
+					fprintf (out, "%ld", value);
+			} else {
+				size_t j;
+
+				cell = table->data[i] + row * TEXT_WIDTH;
+				fputc ('"', out);
+				for (j = 0; (j < TEXT_WIDTH) && cell[j]; j++) {
+					if (cell[j] == '"')
+						fputc ('"', out);
+					fputc (cell[j], out);
+				}
+				fputc ('"', out);
+			}
+		}
+		fputc ('\n', out);
+	}
+
+	return ferror (out);
+}
+
+/**
+ * write_binary:
+ * @table: table to write,
+ * @out: file to write to.
+ *
+ * Writes @table in a fixed-width columnar format, so that a column can
+ * be read, or mapped, without touching the rest of the table.  All
+ * fields are little-endian.  The file begins with a TABLE_FILE_HEADER
+ * byte header: the magic, 32-bit version, 32-bit number of columns and
+ * 64-bit number of rows.  Then each column is described in TABLE_COLUMN
+ * bytes: its name padded with zeros to 16 bytes, 32-bit ColumnType and
+ * 32-bit width of each value.  The values of each column follow, one
+ * column after another.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_binary (const Table *table,
+	      FILE        *out)
+{
+	unsigned char buf[TABLE_COLUMN];
+	int           i;
+
+	memcpy (buf, TABLE_MAGIC, 4);
+	put_le32 (buf + 4, TABLE_VERSION);
+	put_le32 (buf + 8, table->num_columns);
+	put_le32 (buf + 12, table->num_rows & 0xffffffff);
+	put_le32 (buf + 16, (unsigned long long) table->num_rows >> 32);
+	fwrite (buf, TABLE_FILE_HEADER, 1, out);
+
+	for (i = 0; i < table->num_columns; i++) {
+		memset (buf, 0, sizeof (buf));
+		memcpy (buf, table->columns[i].name,
+			strnlen (table->columns[i].name, 16));
+		put_le32 (buf + 16, table->columns[i].type);
+		put_le32 (buf + 20, ((table->columns[i].type == COLUMN_INT)
+				     ? 4 : TEXT_WIDTH));
+		fwrite (buf, TABLE_COLUMN, 1, out);
+	}
+
+	for (i = 0; (i < table->num_columns) && table->num_rows; i++)
+		fwrite (table->data[i], ((table->columns[i].type == COLUMN_INT)
+					 ? 4 : TEXT_WIDTH),
+			table->num_rows, out);
+
+	return ferror (out);
+}
+
+/**
+ * free_table:
+ * @table: table to free.
+ *
+ * Frees the values in @table.
+ **/
+static void
+free_table (Table *table)
+{
+	int i;
+
+	for (i = 0; i < table->num_columns; i++) {
+		free (table->data[i]);
+		table->data[i] = NULL;
+	}
+
+	table->num_rows = table->alloc = 0;
+}
+
+
+/**
+ * export_key:
+ * @state: decryption state within an ExportJob,
+ * @event_no: event number.
+ *
+ * Finds the key for @event_no in the capture file being exported,
+ * otherwise uses the one given on the command line.
+ *
+ * Returns: decryption key.
+ **/
+static unsigned int
+export_key (CurrentState *state,
+	    unsigned int  event_no)
+{
+	ExportJob     *job = (ExportJob *) state;
+	CaptureRecord  record;
+	size_t         off;
+	ssize_t        used;
+
+	for (off = 0; off < job->records_len; off += used) {
+		used = parse_capture_record (job->records + off,
+					     job->records_len - off, &record);
+		if (used <= 0)
+			break;
+
+		if ((record.source == CAPTURE_KEY) && (record.arg == event_no)
+		    && (record.len == 4) && get_le32 (record.data))
+			return get_le32 (record.data);
+	}
+
+	if (! given_key)
+		fprintf (stderr, "%s: %s: %s %u\n", program_name,
+			 job->filename, _("no decryption key for event"),
+			 event_no);
+
+	return given_key;
+}
+
+/**
+ * export_key_frame:
+ * @state: board within an ExportJob,
+ * @frame: key frame number.
+ *
+ * Finds the key frame in the capture file being exported, otherwise in
+ * the key frame directory, and parses it; what it holds is the state so
+ * far, so doesn't add to the tables.
+ *
+ * Returns: 0 on success, non-zero if it wasn't found.
+ **/
+static int
+export_key_frame (CurrentState *state,
+		  unsigned int  frame)
+{
+	ExportJob     *job = (ExportJob *) state;
+	CaptureRecord  record;
+	MappedFile     map;
+	char          *filename;
+	size_t         off;
+	ssize_t        used;
+	int            found = FALSE;
+
+	/* A key frame may have been recorded over several reads */
+	for (off = 0; off < job->records_len; off += used) {
+		used = parse_capture_record (job->records + off,
+					     job->records_len - off, &record);
+		if (used <= 0)
+			break;
+
+		if ((record.source == CAPTURE_KEY_FRAME)
+		    && (record.arg == frame)) {
+			parse_stream_block (state, record.data, record.len);
+			found = TRUE;
+		} else if (found) {
+			break;
+		}
+	}
+
+	if (found)
+		return 0;
+	if (! key_frame_dir)
+		return 1;
+
+	filename = malloc (strlen (key_frame_dir) + 32);
+	if (! filename)
+		abort ();
+	if (frame) {
+		sprintf (filename, "%s/keyframe_%05u.bin", key_frame_dir,
+			 frame);
+	} else {
+		sprintf (filename, "%s/keyframe.bin", key_frame_dir);
+	}
+
+	if (map_file (&map, filename)) {
+		info (1, _("%s: no key frame %u\n"), job->filename, frame);
+		free (filename);
+		return 1;
+	}
+	free (filename);
+
+	parse_stream_block (state, map.data, map.len);
+
+	unmap_file (&map);
+	return 0;
+}
+
+/**
+ * export_laps:
+ * @state: board within an ExportJob.
+ *
+ * The tables don't need the total laps of a race; this only stops the
+ * handler asking the web site for it.
+ *
+ * Returns: zero.
+ **/
+static unsigned int
+export_laps (CurrentState *state)
+{
+	return 0;
+}
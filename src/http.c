@@ -30,6 +30,8 @@
 #include <ne_uri.h>
 
 #include "live-f1.h"
+#include "record.h"
+#include "stats.h"
 #include "stream.h"
 #include "http.h"
 
@@ -41,10 +43,53 @@
 #define KEYFRAME_URL_PREFIX "/keyframe"
 
 
+/**
+ * KeyFrameRead:
+ * @frame: key frame number being read,
+ * @userdata: pointer to pass to stream parser.
+ *
+ * Passed to the body reader for key frames so they can be recorded.
+ **/
+typedef struct {
+	unsigned int  frame;
+	void         *userdata;
+} KeyFrameRead;
+
+
+/**
+ * KeyFrameBody:
+ * @buf: bytes of the key frame received so far,
+ * @len: length of @buf.
+ *
+ * Passed to the body reader for key frames fetched to be passed on
+ * rather than parsed.
+ **/
+typedef struct {
+	char   *buf;
+	size_t  len;
+} KeyFrameBody;
+
+
 /* Forward prototypes */
 static void parse_cookie_hdr (char **value, const char  *header);
 static int  parse_key_body   (unsigned int *key, const char *buf, size_t len);
+static int  parse_key_frame  (KeyFrameRead *read, const char *buf,
+			      size_t len);
+static int  keep_key_frame   (KeyFrameBody *body, const char *buf,
+			      size_t len);
 static int  parse_number_body();
+static unsigned int web_key       (CurrentState *state,
+				   unsigned int event_no);
+static int          web_key_frame (CurrentState *state,
+				   unsigned int frame);
+static unsigned int web_laps      (CurrentState *state);
+
+
+/* The web site as a data source, for what live-f1 isn't given by a
+ * replay or the time-shift view */
+const DataSource web_source = {
+	web_key, web_key_frame, web_laps, NULL
+};
 
 
 /**
@@ -118,10 +163,12 @@ obtain_auth_cookie (const char *host,
 
 	/* Dispatch the event, and check it was a good one */
 	if (ne_request_dispatch (req)) {
+		stats.http_errors++;
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("login request failed"), ne_get_error (sess));
 		goto error;
 	} else if (ne_get_status (req)->code >= 400) {
+		stats.http_errors++;
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("login request failed"),
 			 ne_get_status (req)->reason_phrase);
@@ -199,10 +246,11 @@ obtain_decryption_key (const char   *host,
 		       unsigned int  event_no,
 		       const char   *cookie)
 {
-	ne_session   *sess;
-	ne_request   *req;
-	char         *url;
-	unsigned int  key = 0;
+	ne_session    *sess;
+	ne_request    *req;
+	char          *url;
+	unsigned int   key = 0;
+	unsigned char  key_buf[4];
 
 	info (1, _("Obtaining decryption key ...\n"));
 
@@ -221,12 +269,19 @@ obtain_decryption_key (const char   *host,
 
 	/* Dispatch the event */
 	if (ne_request_dispatch (req)) {
+		stats.http_errors++;
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("key request failed"), ne_get_error (sess));
 	}
 
 	info (3, _("Got decryption key: %08x\n"), key);
 
+	key_buf[0] = key & 0xff;
+	key_buf[1] = (key >> 8) & 0xff;
+	key_buf[2] = (key >> 16) & 0xff;
+	key_buf[3] = (key >> 24) & 0xff;
+	capture (CAPTURE_KEY, event_no, key_buf, sizeof (key_buf));
+
 	ne_request_destroy (req);
 	ne_session_destroy (sess);
 
@@ -280,9 +335,11 @@ obtain_key_frame (const char   *host,
 		  unsigned int  frame,
 		  void         *userdata)
 {
-	ne_session *sess;
-	ne_request *req;
-	char       *url;
+	ne_session   *sess;
+	ne_request   *req;
+	char         *url;
+	long long     start;
+	KeyFrameRead  read;
 
 	if (frame > 0) {
 		info (2, _("Obtaining key frame %d ...\n"), frame);
@@ -301,14 +358,19 @@ obtain_key_frame (const char   *host,
 	ne_set_useragent (sess, PACKAGE_STRING);
 
 	/* Create the request */
+	read.frame = frame;
+	read.userdata = userdata;
+
 	req = ne_request_create (sess, "GET", url);
 	ne_add_response_body_reader (req, ne_accept_2xx,
-				     (ne_block_reader) parse_stream_block,
-				     userdata);
+				     (ne_block_reader) parse_key_frame,
+				     &read);
 	free (url);
 
 	/* Dispatch the event */
+	start = monotonic_ns ();
 	if (ne_request_dispatch (req)) {
+		stats.http_errors++;
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("key frame request failed"), ne_get_error (sess));
 
@@ -317,6 +379,10 @@ obtain_key_frame (const char   *host,
 		return 1;
 	}
 
+	stats.key_frame_ns = monotonic_ns () - start;
+	stats.key_frames++;
+	observe (&stats.key_frame_hist, stats.key_frame_ns);
+
 	info (3, _("Key frame received\n"));
 
 	ne_request_destroy (req);
@@ -325,6 +391,105 @@ obtain_key_frame (const char   *host,
 	return 0;
 }
 
+/**
+ * parse_key_frame:
+ * @read: key frame being read,
+ * @buf: buffer of data received from server,
+ * @len: length of buffer.
+ *
+ * Records the key frame data received from the server, and passes it
+ * to the data stream parser.
+ **/
+static int
+parse_key_frame (KeyFrameRead *read,
+		 const char   *buf,
+		 size_t        len)
+{
+	capture (CAPTURE_KEY_FRAME, read->frame, buf, len);
+
+	return parse_stream_block (read->userdata,
+				   (const unsigned char *) buf, len);
+}
+
+/**
+ * fetch_key_frame:
+ * @host: host to obtain key frame from,
+ * @frame: key frame number to obtain, or 0 for the latest,
+ * @len: pointer to store length of key frame in.
+ *
+ * Obtains the key frame numbered from the website as obtain_key_frame()
+ * does, but returns it rather than parsing it, so that it can be passed
+ * on to others.
+ *
+ * Returns: newly allocated key frame, or NULL on failure.
+ **/
+char *
+fetch_key_frame (const char   *host,
+		 unsigned int  frame,
+		 size_t       *len)
+{
+	ne_session   *sess;
+	ne_request   *req;
+	char          url[32];
+	KeyFrameBody  body;
+
+	if (frame > 0) {
+		sprintf (url, "%s_%05u.bin", KEYFRAME_URL_PREFIX, frame);
+	} else {
+		sprintf (url, "%s.bin", KEYFRAME_URL_PREFIX);
+	}
+
+	info (2, _("Fetching key frame %d ...\n"), frame);
+
+	sess = ne_session_create ("http", host, 80);
+	ne_set_useragent (sess, PACKAGE_STRING);
+
+	body.buf = NULL;
+	body.len = 0;
+
+	req = ne_request_create (sess, "GET", url);
+	ne_add_response_body_reader (req, ne_accept_2xx,
+				     (ne_block_reader) keep_key_frame, &body);
+
+	if (ne_request_dispatch (req) || (ne_get_status (req)->code >= 300)) {
+		stats.http_errors++;
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("key frame request failed"), ne_get_error (sess));
+
+		free (body.buf);
+		body.buf = NULL;
+	}
+
+	ne_request_destroy (req);
+	ne_session_destroy (sess);
+
+	*len = body.len;
+	return body.buf;
+}
+
+/**
+ * keep_key_frame:
+ * @body: key frame being read,
+ * @buf: buffer of data received from server,
+ * @len: length of buffer.
+ *
+ * Appends the key frame data received from the server to @body.
+ **/
+static int
+keep_key_frame (KeyFrameBody *body,
+		const char   *buf,
+		size_t        len)
+{
+	body->buf = realloc (body->buf, body->len + len + 1);
+	if (! body->buf)
+		abort ();
+
+	memcpy (body->buf + body->len, buf, len);
+	body->len += len;
+
+	return 0;
+}
+
 /**
  * obtain_total_laps:
  *
@@ -333,7 +498,7 @@ obtain_key_frame (const char   *host,
  * Returns: total obtained on success, or zero on failure.
  **/
 unsigned int
-obtain_total_laps ()
+obtain_total_laps (void)
 {
 	ne_session   *sess;
 	ne_request   *req;
@@ -348,7 +513,9 @@ obtain_total_laps ()
 				     (ne_block_reader) parse_number_body, &total_laps);
 
 	/* Dispatch the request */
-	ne_request_dispatch (req);
+	if (ne_request_dispatch (req))
+		stats.http_errors++;
+	capture (CAPTURE_TOTAL_LAPS, total_laps, NULL, 0);
 
 	ne_request_destroy (req);
 	ne_session_destroy (sess);
@@ -384,3 +551,43 @@ parse_number_body (unsigned int *result,
 
 	return 0;
 }
+
+/**
+ * web_key:
+ * @state: application state structure,
+ * @event_no: official event number.
+ *
+ * Returns: key obtained from the web site, or zero on failure.
+ **/
+static unsigned int
+web_key (CurrentState *state,
+	 unsigned int  event_no)
+{
+	return obtain_decryption_key (state->host, event_no, state->cookie);
+}
+
+/**
+ * web_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number to obtain.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+web_key_frame (CurrentState *state,
+	       unsigned int  frame)
+{
+	return obtain_key_frame (state->host, frame, state);
+}
+
+/**
+ * web_laps:
+ * @state: application state structure.
+ *
+ * Returns: total obtained from the web site, or zero on failure.
+ **/
+static unsigned int
+web_laps (CurrentState *state)
+{
+	return obtain_total_laps ();
+}
@@ -20,17 +20,24 @@
 #ifndef LIVE_F1_HTTP_H
 #define LIVE_F1_HTTP_H
 
+#include <sys/types.h>
+
 #include "live-f1.h"
 
 
 SJR_BEGIN_EXTERN
 
+extern const DataSource web_source;
+
 char *       obtain_auth_cookie    (const char *host,
 				    const char *email, const char *password);
 unsigned int obtain_decryption_key (const char *host, unsigned int event_no,
 				    const char *cookie);
 int          obtain_key_frame      (const char *host, unsigned int frame,
 				    void *unknown);
+char *       fetch_key_frame       (const char *host, unsigned int frame,
+				    size_t *len);
+unsigned int obtain_total_laps     (void);
 
 SJR_END_EXTERN
 
@@ -0,0 +1,714 @@
+/* live-f1
+ *
+ * httpd.c - a small HTTP server for local monitoring
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <strings.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "chunk.h"
+#include "stream.h"
+#include "watch.h"
+#include "httpd.h"
+
+
+/* Address listened on when only a port is given */
+#define HTTP_DEFAULT_ADDR  "127.0.0.1"
+
+/* Longest request accepted, including headers */
+#define HTTP_REQUEST_MAX   4096
+
+/* Most connections open at once; any more are closed straight away */
+#define HTTP_MAX_CLIENTS   1024
+
+/* Most paths that may be registered */
+#define HTTP_MAX_HANDLERS  16
+
+/**
+ * HttpClient:
+ * @fd: connected socket,
+ * @req: request received so far,
+ * @req_len: length of @req,
+ * @headers: header lines of @req, once the request line has been parsed,
+ * @stream: path being streamed, or NULL,
+ * @queue: chunks waiting to be sent,
+ * @done: close the connection once @queue is empty,
+ * @failed: the connection has failed, and is waiting to be closed.
+ *
+ * A connection to the server.  Each carries a single request; the
+ * connection is closed once the response has been sent, unless it's
+ * a stream, which stays open until the other end closes it.
+ **/
+struct http_client {
+	int         fd;
+	char        req[HTTP_REQUEST_MAX + 1];
+	size_t      req_len;
+	const char *headers;
+	const char *stream;
+
+	ChunkQueue  queue;
+	int         done, failed;
+};
+
+/**
+ * HttpPath:
+ * @path: path handled,
+ * @func: function to call.
+ *
+ * A path the server responds to.
+ **/
+typedef struct {
+	const char  *path;
+	HttpHandler  func;
+} HttpPath;
+
+
+/* Forward prototypes */
+static void accept_client  (void *data, int fd, short revents);
+static void client_ready   (void *data, int fd, short revents);
+static void handle_request (HttpClient *client);
+static void queue_chunk    (HttpClient *client, Chunk *chunk);
+static void send_queue     (HttpClient *client);
+static void fail_client    (HttpClient *client);
+static void drop_client    (HttpClient *client);
+static int  put_headers    (char *buf, size_t size, int status,
+			    const char *type, const char *etag, long len);
+
+
+/* Listening socket */
+static int listen_fd = -1;
+
+/* Open connections */
+static HttpClient **clients = NULL;
+static int          nclients = 0;
+
+/* Registered paths */
+static HttpPath handlers[HTTP_MAX_HANDLERS];
+static int      nhandlers = 0;
+
+
+/**
+ * open_httpd:
+ * @where: port to listen on, optionally preceded by an address and colon.
+ *
+ * Listens for HTTP connections on @where, on the loopback address
+ * unless another is given, and answers GET requests for the paths
+ * registered with add_http_handler() from the main loop.  Nothing
+ * blocks: requests are read and responses written as the sockets
+ * become ready.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_httpd (const char *where)
+{
+	listen_fd = listen_stream (where, HTTP_DEFAULT_ADDR);
+	if (listen_fd < 0)
+		return 1;
+
+	if (add_watch (listen_fd, POLLIN, accept_client, NULL) < 0) {
+		close (listen_fd);
+		listen_fd = -1;
+		return 1;
+	}
+
+	info (1, _("Listening for HTTP on %s\n"), where);
+
+	return 0;
+}
+
+/**
+ * close_httpd:
+ *
+ * Drops any open connections and stops listening.
+ **/
+void
+close_httpd (void)
+{
+	while (nclients)
+		drop_client (clients[0]);
+
+	if (listen_fd < 0)
+		return;
+
+	remove_watch (listen_fd);
+	close (listen_fd);
+	listen_fd = -1;
+}
+
+/**
+ * add_http_handler:
+ * @path: path to respond to,
+ * @func: function to call.
+ *
+ * Arranges for @func to be called for GET requests for @path, which
+ * must be a string that lasts as long as the program.  If @path ends
+ * in an asterisk, it matches any path beginning with the rest of it.
+ **/
+void
+add_http_handler (const char  *path,
+		  HttpHandler  func)
+{
+	if (nhandlers >= HTTP_MAX_HANDLERS)
+		abort ();
+
+	handlers[nhandlers].path = path;
+	handlers[nhandlers].func = func;
+	nhandlers++;
+}
+
+/**
+ * http_respond:
+ * @client: connection to respond on,
+ * @status: HTTP status code,
+ * @type: Content-Type of @body,
+ * @body: body of the response,
+ * @len: length of @body.
+ *
+ * Sends the response to the request on @client, after which the
+ * connection is closed.  @body is copied, so may be freed as soon as
+ * this returns.
+ **/
+void
+http_respond (HttpClient *client,
+	      int         status,
+	      const char *type,
+	      const char *body,
+	      size_t      len)
+{
+	Chunk *chunk;
+
+	chunk = http_response (status, type, NULL, body, len);
+	http_respond_chunk (client, chunk);
+	unref_chunk (chunk);
+}
+
+/**
+ * http_response:
+ * @status: HTTP status code,
+ * @type: Content-Type of @body,
+ * @etag: entity tag of @body, without the quotes, or NULL,
+ * @body: body of the response,
+ * @len: length of @body.
+ *
+ * Makes a whole response, headers and all, for a handler to keep and
+ * send with http_respond_chunk() to as many requests as it likes.  A
+ * 304 response has no body, so @type, @body and @len are ignored.
+ *
+ * Returns: new chunk.
+ **/
+Chunk *
+http_response (int         status,
+	       const char *type,
+	       const char *etag,
+	       const char *body,
+	       size_t      len)
+{
+	Chunk *chunk;
+	int    hlen;
+
+	if (status == 304)
+		len = 0;
+
+	chunk = new_chunk (NULL, len + 320);
+	hlen = put_headers ((char *) chunk->data, 320, status, type, etag,
+			    len);
+	memcpy (chunk->data + hlen, body, len);
+	chunk->len = hlen + len;
+
+	return chunk;
+}
+
+/**
+ * http_respond_chunk:
+ * @client: connection to respond on,
+ * @chunk: response from http_response().
+ *
+ * Sends @chunk as the response to the request on @client, without
+ * copying it, after which the connection is closed.
+ **/
+void
+http_respond_chunk (HttpClient *client,
+		    Chunk      *chunk)
+{
+	client->done = TRUE;
+	queue_chunk (client, chunk);
+}
+
+/**
+ * http_header:
+ * @client: connection the request arrived on,
+ * @name: name of the header,
+ * @len: set to the length of the value.
+ *
+ * Looks for the header @name in the request on @client, ignoring case;
+ * only valid while the handler is being called.
+ *
+ * Returns: start of the value, which isn't terminated, or NULL if
+ * there's no such header.
+ **/
+const char *
+http_header (HttpClient *client,
+	     const char *name,
+	     size_t     *len)
+{
+	const char *line = client->headers;
+	size_t      name_len = strlen (name);
+
+	while (line && *line && (*line != '\r') && (*line != '\n')) {
+		const char *end = line + strcspn (line, "\r\n");
+
+		if ((! strncasecmp (line, name, name_len))
+		    && (line[name_len] == ':')) {
+			const char *value = line + name_len + 1;
+
+			while ((*value == ' ') || (*value == '\t'))
+				value++;
+
+			*len = end - value;
+			return value;
+		}
+
+		line = end + strspn (end, "\r");
+		if (*line == '\n')
+			line++;
+	}
+
+	return NULL;
+}
+
+/**
+ * http_begin_stream:
+ * @client: connection to respond on,
+ * @type: Content-Type of the stream.
+ *
+ * Begins a response to the request on @client that has no end: the
+ * connection is kept open, and each chunk given to http_broadcast()
+ * for the path requested is sent down it until the other end closes
+ * it.  The handler may queue chunks of its own with http_send().
+ **/
+void
+http_begin_stream (HttpClient *client,
+		   const char *type)
+{
+	char buf[256];
+	int  hlen;
+
+	hlen = put_headers (buf, sizeof (buf), 200, type, NULL, -1);
+	http_send (client, buf, hlen);
+}
+
+/**
+ * http_send:
+ * @client: connection,
+ * @data: bytes to send,
+ * @len: length of @data.
+ *
+ * Queues a copy of @data to be sent on @client.
+ **/
+void
+http_send (HttpClient *client,
+	   const char *data,
+	   size_t      len)
+{
+	Chunk *chunk;
+
+	chunk = new_chunk (data, len);
+	queue_chunk (client, chunk);
+	unref_chunk (chunk);
+}
+
+/**
+ * http_send_chunk:
+ * @client: connection,
+ * @chunk: chunk to send.
+ *
+ * Queues @chunk to be sent on @client, without copying it.
+ **/
+void
+http_send_chunk (HttpClient *client,
+		 Chunk      *chunk)
+{
+	queue_chunk (client, chunk);
+}
+
+/**
+ * http_broadcast:
+ * @path: path streamed,
+ * @chunk: chunk to send.
+ *
+ * Queues @chunk for every connection streaming @path, which is only
+ * ever encoded once however many there are.
+ **/
+void
+http_broadcast (const char *path,
+		Chunk      *chunk)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++)
+		if (clients[i]->stream && (! strcmp (clients[i]->stream, path)))
+			queue_chunk (clients[i], chunk);
+}
+
+
+/**
+ * accept_client:
+ * @data: unused,
+ * @fd: listening socket,
+ * @revents: events that occurred.
+ *
+ * Accepts a new connection and waits for its request.
+ **/
+static void
+accept_client (void  *data,
+	       int    fd,
+	       short  revents)
+{
+	HttpClient *client;
+	int         sock;
+
+	sock = accept (fd, NULL, NULL);
+	if (sock < 0)
+		return;
+
+	if (nclients >= HTTP_MAX_CLIENTS) {
+		close (sock);
+		return;
+	}
+
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+
+	client = calloc (1, sizeof (HttpClient));
+	clients = realloc (clients, sizeof (HttpClient *) * (nclients + 1));
+	if ((! client) || (! clients))
+		abort ();
+
+	client->fd = sock;
+	clients[nclients++] = client;
+
+	add_watch (sock, POLLIN, client_ready, client);
+}
+
+/**
+ * fail_client:
+ * @client: connection.
+ *
+ * Throws away anything queued for @client and arranges for it to be
+ * dropped from the main loop, since a handler or broadcast may still be
+ * using it.  Nothing more is sent to it.
+ **/
+static void
+fail_client (HttpClient *client)
+{
+	clear_chunks (&client->queue);
+	client->stream = NULL;
+	client->done = TRUE;
+	client->failed = TRUE;
+
+	shutdown (client->fd, SHUT_RDWR);
+	change_watch (client->fd, POLLOUT);
+}
+
+/**
+ * drop_client:
+ * @client: connection.
+ *
+ * Closes @client and frees it, along with anything still queued.
+ **/
+static void
+drop_client (HttpClient *client)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (clients[i] == client) {
+			clients[i] = clients[--nclients];
+			break;
+		}
+	}
+
+	clear_chunks (&client->queue);
+
+	remove_watch (client->fd);
+	close (client->fd);
+	free (client);
+}
+
+/**
+ * client_ready:
+ * @data: connection,
+ * @fd: its socket,
+ * @revents: events that occurred.
+ *
+ * Reads the request from a connection until the blank line after its
+ * headers arrives, then handles it; or carries on sending once the
+ * socket has room.  Anything sent after the request is thrown away,
+ * but is read to notice when a stream is closed.
+ **/
+static void
+client_ready (void  *data,
+	      int    fd,
+	      short  revents)
+{
+	HttpClient *client = data;
+	char        buf[256];
+	ssize_t     len;
+
+	/* Finished with, or failed */
+	if (client->done && (! client->queue.count)) {
+		drop_client (client);
+		return;
+	}
+
+	if (revents & POLLIN) {
+		if (client->stream || client->queue.count) {
+			len = read (fd, buf, sizeof (buf));
+		} else {
+			len = read (fd, client->req + client->req_len,
+				    HTTP_REQUEST_MAX - client->req_len);
+		}
+
+		if ((len == 0) || ((len < 0) && (errno != EAGAIN)
+				   && (errno != EINTR))) {
+			drop_client (client);
+			return;
+		}
+
+		if ((len > 0) && (! client->stream) && (! client->queue.count)) {
+			client->req_len += len;
+			client->req[client->req_len] = '\0';
+
+			if (strstr (client->req, "\r\n\r\n")
+			    || strstr (client->req, "\n\n")) {
+				handle_request (client);
+				return;
+			} else if (client->req_len >= HTTP_REQUEST_MAX) {
+				http_respond (client, 431, "text/plain", "", 0);
+				return;
+			}
+		}
+	} else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		drop_client (client);
+		return;
+	}
+
+	if (revents & POLLOUT)
+		send_queue (client);
+}
+
+/**
+ * handle_request:
+ * @client: connection.
+ *
+ * Parses the request line received on @client and calls the handler
+ * registered for its path, or responds with an error.  Only GET is
+ * supported.
+ **/
+static void
+handle_request (HttpClient *client)
+{
+	char *method, *path, *query, *end;
+	int   i;
+
+	method = client->req;
+	path = strchr (method, ' ');
+	if (! path) {
+		http_respond (client, 400, "text/plain", "", 0);
+		return;
+	}
+	*(path++) = '\0';
+
+	end = path + strcspn (path, " \r\n");
+	client->headers = strchr (end, '\n');
+	if (client->headers)
+		client->headers++;
+	*end = '\0';
+
+	if (strcmp (method, "GET")) {
+		http_respond (client, 405, "text/plain", "", 0);
+		return;
+	}
+
+	query = strchr (path, '?');
+	if (query)
+		*(query++) = '\0';
+
+	for (i = 0; i < nhandlers; i++) {
+		const char *match = handlers[i].path;
+		size_t      len = strlen (match);
+
+		if ((len && (match[len - 1] == '*'))
+		    ? (! strncmp (match, path, len - 1))
+		    : (! strcmp (match, path))) {
+			client->stream = handlers[i].path;
+			handlers[i].func (client, path, query);
+
+			/* Only a stream if the handler began one */
+			if (client->done)
+				client->stream = NULL;
+			return;
+		}
+	}
+
+	http_respond (client, 404, "text/plain", "", 0);
+}
+
+/**
+ * queue_chunk:
+ * @client: connection,
+ * @chunk: chunk to send.
+ *
+ * Adds @chunk to the queue for @client and sends what it can straight
+ * away.  A connection too far behind is dropped rather than letting the
+ * queue grow; a browser will reconnect and begin again.
+ **/
+static void
+queue_chunk (HttpClient *client,
+	     Chunk      *chunk)
+{
+	if (client->failed)
+		return;
+	if (push_chunk (&client->queue, chunk) < 0) {
+		fail_client (client);
+		return;
+	}
+
+	/* Already waiting for room */
+	if (client->queue.count > 1)
+		return;
+
+	send_queue (client);
+}
+
+/**
+ * send_queue:
+ * @client: connection.
+ *
+ * Sends as much of the queue for @client as its socket will take, and
+ * waits for room for the rest.  Once a response has all gone, the
+ * connection is closed from the main loop.
+ **/
+static void
+send_queue (HttpClient *client)
+{
+	if (send_chunks (&client->queue, client->fd) < 0) {
+		fail_client (client);
+		return;
+	}
+
+	if (client->queue.count || client->done) {
+		change_watch (client->fd, (client->stream
+					   ? POLLIN | POLLOUT : POLLOUT));
+	} else {
+		change_watch (client->fd, client->stream ? POLLIN : 0);
+	}
+}
+
+/**
+ * put_headers:
+ * @buf: buffer to write to,
+ * @size: size of @buf,
+ * @status: HTTP status code,
+ * @type: Content-Type of the body,
+ * @etag: entity tag of the body, or NULL,
+ * @len: length of the body, or -1 for a stream.
+ *
+ * Writes the status line and headers of a response into @buf; a 304
+ * response only has the entity tag.
+ *
+ * Returns: length written.
+ **/
+static int
+put_headers (char       *buf,
+	     size_t      size,
+	     int         status,
+	     const char *type,
+	     const char *etag,
+	     long        len)
+{
+	const char *reason;
+	char        tag[64] = "";
+	int         hlen;
+
+	switch (status) {
+	case 200: reason = "OK"; break;
+	case 304: reason = "Not Modified"; break;
+	case 400: reason = "Bad Request"; break;
+	case 404: reason = "Not Found"; break;
+	case 405: reason = "Method Not Allowed"; break;
+	case 431: reason = "Request Header Fields Too Large"; break;
+	case 502: reason = "Bad Gateway"; break;
+	case 503: reason = "Service Unavailable"; break;
+	default:  reason = "Unknown"; break;
+	}
+
+	if (etag)
+		snprintf (tag, sizeof (tag), "ETag: \"%s\"\r\n", etag);
+
+	if (status == 304) {
+		hlen = snprintf (buf, size,
+				 "HTTP/1.0 %d %s\r\n"
+				 "Server: %s\r\n"
+				 "%s"
+				 "Connection: close\r\n"
+				 "\r\n",
+				 status, reason, PACKAGE_STRING, tag);
+	} else if (len >= 0) {
+		hlen = snprintf (buf, size,
+				 "HTTP/1.0 %d %s\r\n"
+				 "Server: %s\r\n"
+				 "Content-Type: %s\r\n"
+				 "Content-Length: %ld\r\n"
+				 "%s"
+				 "Cache-Control: no-cache\r\n"
+				 "Connection: close\r\n"
+				 "\r\n",
+				 status, reason, PACKAGE_STRING, type, len, tag);
+	} else {
+		hlen = snprintf (buf, size,
+				 "HTTP/1.0 %d %s\r\n"
+				 "Server: %s\r\n"
+				 "Content-Type: %s\r\n"
+				 "Cache-Control: no-cache\r\n"
+				 "Connection: close\r\n"
+				 "\r\n",
+				 status, reason, PACKAGE_STRING, type);
+	}
+
+	if ((hlen < 0) || ((size_t) hlen >= size))
+		abort ();
+
+	return hlen;
+}
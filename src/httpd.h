@@ -0,0 +1,69 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_HTTPD_H
+#define LIVE_F1_HTTPD_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+#include "chunk.h"
+
+
+/* A connection to the HTTP server */
+typedef struct http_client HttpClient;
+
+/**
+ * HttpHandler:
+ * @client: connection the request arrived on,
+ * @path: path requested, without the query,
+ * @query: query string, or NULL if there wasn't one.
+ *
+ * Called when a GET request arrives for a path registered with
+ * add_http_handler(); the function should call http_respond() or
+ * http_begin_stream().
+ **/
+typedef void (*HttpHandler) (HttpClient *client, const char *path,
+			     const char *query);
+
+
+SJR_BEGIN_EXTERN
+
+int  open_httpd         (const char *where);
+void close_httpd        (void);
+
+void add_http_handler   (const char *path, HttpHandler func);
+
+void http_respond       (HttpClient *client, int status, const char *type,
+			 const char *body, size_t len);
+Chunk *http_response    (int status, const char *type, const char *etag,
+			 const char *body, size_t len);
+void http_respond_chunk (HttpClient *client, Chunk *chunk);
+
+const char *http_header (HttpClient *client, const char *name,
+			 size_t *len);
+
+void http_begin_stream  (HttpClient *client, const char *type);
+void http_send          (HttpClient *client, const char *data, size_t len);
+void http_send_chunk    (HttpClient *client, Chunk *chunk);
+void http_broadcast     (const char *path, Chunk *chunk);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_HTTPD_H */
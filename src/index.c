@@ -0,0 +1,645 @@
+/* live-f1
+ *
+ * index.c - index of key frames in recordings, for seeking
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "packet.h"
+#include "record.h"
+#include "stream.h"
+#include "index.h"
+
+
+/* How much of the start of the recording the index file checks */
+#define CHECK_LEN 4096
+
+
+/**
+ * IndexScan:
+ * @state: scratch state holding the key and salt,
+ * @reader: partial packet carried between reads,
+ * @frame_reader: partial packet carried between reads of a key frame,
+ * @in_frame: TRUE while reading a key frame,
+ * @leader: car currently leading the race, or zero,
+ * @laps: laps completed by the leader,
+ * @time_ns: time of the current read,
+ * @record: offset of the current read.
+ *
+ * What we need to know about the session while scanning a recording;
+ * much less than parsing it properly does.
+ **/
+typedef struct {
+	CurrentState       state;
+	PacketReader       reader, frame_reader;
+	int                in_frame;
+	unsigned int       leader, laps;
+	long long          time_ns;
+	unsigned long long record;
+} IndexScan;
+
+
+/* Forward prototypes */
+static int  load_index  (SeekIndex *index, const char *filename,
+			 const unsigned char *data, size_t len,
+			 unsigned long long *covered);
+static void save_index  (const SeekIndex *index, const char *filename,
+			 const unsigned char *data, size_t len);
+static void scan_block  (SeekIndex *index, IndexScan *scan,
+			 PacketReader *reader,
+			 const unsigned char *buf, size_t len,
+			 unsigned long long offset, int record_marks);
+static void add_entry   (SeekIndex *index, const IndexScan *scan,
+			 unsigned long long offset, unsigned int flags);
+static void mark_key_frame (SeekIndex *index, unsigned int frame);
+
+
+/**
+ * put_le32:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value into @buf in little-endian byte order.
+ **/
+static inline void
+put_le32 (unsigned char *buf,
+	  unsigned long  value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * get_le32:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian value read from @buf.
+ **/
+static inline unsigned long
+get_le32 (const unsigned char *buf)
+{
+	return ((unsigned long) buf[3] << 24) | (buf[2] << 16)
+		| (buf[1] << 8) | buf[0];
+}
+
+/**
+ * put_le64:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value into @buf in little-endian byte order.
+ **/
+static inline void
+put_le64 (unsigned char      *buf,
+	  unsigned long long  value)
+{
+	put_le32 (buf, value & 0xffffffff);
+	put_le32 (buf + 4, value >> 32);
+}
+
+/**
+ * get_le64:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian value read from @buf.
+ **/
+static inline unsigned long long
+get_le64 (const unsigned char *buf)
+{
+	return ((unsigned long long) get_le32 (buf + 4) << 32)
+		| get_le32 (buf);
+}
+
+
+/**
+ * update_index:
+ * @index: index to fill,
+ * @state: application state structure,
+ * @filename: recording @data was read from,
+ * @data: contents of the recording,
+ * @len: length of @data,
+ * @framed: TRUE if @data is a capture file, FALSE for a raw dump.
+ *
+ * Fills @index with the key frame markers in @data.  The index is kept
+ * next to the recording in a file of the same name with ".idx" on the
+ * end, which is read back if it still matches; if the recording has
+ * grown since, only the new part is scanned, starting from the last
+ * key frame marker in the index.  The file is then rewritten.
+ *
+ * The scan only follows the packet framing, the decryption and which
+ * car is leading, so is much quicker than parsing the recording.  Keys
+ * for the events found are obtained through @state's data source.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+update_index (SeekIndex           *index,
+	      CurrentState        *state,
+	      const char          *filename,
+	      const unsigned char *data,
+	      size_t               len,
+	      int                  framed)
+{
+	IndexScan           scan;
+	unsigned long long  covered = 0, start;
+	size_t              num_entries;
+
+	free_index (index);
+	load_index (index, filename, data, len, &covered);
+	if (covered == len)
+		return 0;
+
+	memset (&scan, 0, sizeof (scan));
+	scan.state.source = state->source;
+	scan.state.event_type = RACE_EVENT;
+	reset_decryption (&scan.state);
+
+	/* Carry on from the last marker, where the salt was reset */
+	if (index->num_entries) {
+		const IndexEntry *entry;
+
+		entry = &index->entries[index->num_entries - 1];
+		scan.state.event_no = entry->event_no;
+		scan.state.key = get_decryption_key (&scan.state,
+						     entry->event_no);
+		scan.leader = entry->leader;
+		scan.laps = entry->laps;
+		scan.time_ns = entry->time_ns;
+		scan.record = entry->record;
+		start = entry->offset;
+	} else {
+		start = framed ? CAPTURE_FILE_HEADER : 0;
+		scan.record = start;
+	}
+
+	num_entries = index->num_entries;
+	info (2, _("Indexing key frames from byte %llu ...\n"), start);
+
+	if (framed) {
+		unsigned long long off;
+		CaptureRecord      record;
+		ssize_t            used;
+
+		for (off = scan.record; off < len; off += used) {
+			unsigned long long begin;
+
+			used = parse_capture_record (data + off, len - off,
+						     &record);
+			if (used <= 0)
+				break;
+
+			begin = off + CAPTURE_HEADER;
+			if (start > begin)
+				begin = start;
+
+			scan.record = off;
+			scan.time_ns = record.time_ns;
+
+			if (record.source == CAPTURE_KEY_FRAME) {
+				/* Key frames have their own framing and
+				 * salt; the stream's salt was reset at
+				 * the marker before one was fetched, and
+				 * is again after it's been parsed.
+				 */
+				if (! scan.in_frame) {
+					memset (&scan.frame_reader, 0,
+						sizeof (scan.frame_reader));
+					reset_decryption (&scan.state);
+					scan.in_frame = TRUE;
+
+					mark_key_frame (index, record.arg);
+				}
+
+				scan_block (index, &scan, &scan.frame_reader,
+					    record.data, record.len, 0, FALSE);
+				continue;
+			} else if (scan.in_frame) {
+				reset_decryption (&scan.state);
+				scan.in_frame = FALSE;
+			}
+
+			if (record.source == CAPTURE_STREAM)
+				scan_block (index, &scan, &scan.reader,
+					    data + begin, off + used - begin,
+					    begin, TRUE);
+		}
+	} else {
+		scan_block (index, &scan, &scan.reader, data + start,
+			    len - start, start, TRUE);
+	}
+
+	info (2, _("Found %zu new key frames\n"),
+	      index->num_entries - num_entries);
+
+	save_index (index, filename, data, len);
+	return 0;
+}
+
+/**
+ * scan_block:
+ * @index: index to add to,
+ * @scan: scan state,
+ * @reader: partial packet carried over from the last block,
+ * @buf: block of the data stream or a key frame,
+ * @len: length of @buf,
+ * @offset: offset of @buf in the recording,
+ * @record_marks: TRUE if key frame markers should be indexed.
+ *
+ * Follows the packets in @buf, noting the leader and laps completed
+ * and adding an entry to @index at each key frame marker.
+ **/
+static void
+scan_block (SeekIndex           *index,
+	    IndexScan           *scan,
+	    PacketReader        *reader,
+	    const unsigned char *buf,
+	    size_t               len,
+	    unsigned long long   offset,
+	    int                  record_marks)
+{
+	const unsigned char *start = buf;
+	Packet               packet;
+	unsigned int         number;
+	int                  i;
+
+	while (next_packet (&scan->state, reader, &packet,
+			    &buf, &len)) {
+		if (packet.car) {
+			if (packet.type == CAR_POSITION_UPDATE) {
+				if (packet.data == 1) {
+					scan->leader = packet.car;
+				} else if (packet.car == scan->leader) {
+					scan->leader = 0;
+				}
+			} else if ((scan->state.event_type == RACE_EVENT)
+				   && (packet.car == scan->leader)
+				   && (packet.type == RACE_INTERVAL)) {
+				/* As handle_car_packet() does */
+				number = 0;
+				for (i = 0; i < packet.len; i++) {
+					number *= 10;
+					number += packet.payload[i] - '0';
+				}
+
+				scan->laps = number;
+			}
+
+			continue;
+		}
+
+		switch ((SystemPacketType) packet.type) {
+		case SYS_EVENT_ID:
+			number = 0;
+			for (i = 1; i < packet.len; i++) {
+				number *= 10;
+				number += packet.payload[i] - '0';
+			}
+
+			scan->state.event_no = number;
+			scan->state.event_type = packet.data;
+			scan->state.key = get_decryption_key (&scan->state,
+							      number);
+			scan->leader = scan->laps = 0;
+			reset_decryption (&scan->state);
+			break;
+		case SYS_KEY_FRAME:
+			number = 0;
+			i = packet.len;
+			while (i > 0) {
+				number <<= 8;
+				number |= packet.payload[--i];
+			}
+
+			scan->state.frame = number;
+			reset_decryption (&scan->state);
+			if (record_marks)
+				add_entry (index, scan, offset + (buf - start),
+					   0);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * add_entry:
+ * @index: index to add to,
+ * @scan: scan state,
+ * @offset: offset of the first byte after the marker,
+ * @flags: IndexFlags for the entry.
+ *
+ * Adds an entry for the key frame marker just scanned to @index.
+ **/
+static void
+add_entry (SeekIndex          *index,
+	   const IndexScan    *scan,
+	   unsigned long long  offset,
+	   unsigned int        flags)
+{
+	IndexEntry *entry;
+
+	if (index->num_entries == index->alloc) {
+		index->alloc = MAX (index->alloc * 2, 64);
+		index->entries = realloc (index->entries,
+					  (sizeof (IndexEntry)
+					   * index->alloc));
+		if (! index->entries)
+			abort ();
+	}
+
+	entry = &index->entries[index->num_entries++];
+	entry->frame = scan->state.frame;
+	entry->event_no = scan->state.event_no;
+	entry->leader = scan->leader;
+	entry->laps = scan->laps;
+	entry->time_ns = scan->time_ns;
+	entry->record = scan->record;
+	entry->offset = offset;
+	entry->flags = flags;
+}
+
+/**
+ * mark_key_frame:
+ * @index: index to update,
+ * @frame: key frame number.
+ *
+ * Notes that the recording contains key frame @frame, which will have
+ * been fetched just after the last marker scanned.
+ **/
+static void
+mark_key_frame (SeekIndex    *index,
+		unsigned int  frame)
+{
+	IndexEntry *entry;
+
+	if (! index->num_entries)
+		return;
+
+	entry = &index->entries[index->num_entries - 1];
+	if (entry->frame == frame)
+		entry->flags |= INDEX_HAVE_KEY_FRAME;
+}
+
+/**
+ * find_key_frame:
+ * @index: index to search,
+ * @by: what @value is measured in,
+ * @value: where to seek to.
+ *
+ * Finds the key frame to begin playback from to reach @value; for
+ * SEEK_FRAME that's the last entry with a frame number no later than
+ * @value, otherwise the last entry before the leader had completed
+ * @value laps, or before the recorded time @value in nanoseconds.
+ * Entries are in order of all three within an event, so this is a
+ * binary search.
+ *
+ * Returns: entry found, or NULL if @value is before the first one.
+ **/
+const IndexEntry *
+find_key_frame (const SeekIndex *index,
+		SeekBy           by,
+		long long        value)
+{
+	size_t lo = 0, hi = index->num_entries;
+
+	/* Find the first entry past @value */
+	while (lo < hi) {
+		const IndexEntry *entry;
+		size_t            mid = lo + (hi - lo) / 2;
+		int               past;
+
+		entry = &index->entries[mid];
+		switch (by) {
+		case SEEK_FRAME:
+			past = (entry->frame > value);
+			break;
+		case SEEK_LAP:
+			past = (entry->laps >= value);
+			break;
+		case SEEK_TIME:
+		default:
+			past = (entry->time_ns >= value);
+			break;
+		}
+
+		if (past) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return lo ? &index->entries[lo - 1] : NULL;
+}
+
+/**
+ * free_index:
+ * @index: index to free.
+ *
+ * Frees the entries in @index, leaving it empty.
+ **/
+void
+free_index (SeekIndex *index)
+{
+	free (index->entries);
+	index->entries = NULL;
+	index->num_entries = index->alloc = 0;
+}
+
+
+/**
+ * index_filename:
+ * @filename: recording.
+ *
+ * Returns: newly allocated name of the index file for @filename.
+ **/
+static char *
+index_filename (const char *filename)
+{
+	char *idxfile;
+
+	idxfile = malloc (strlen (filename) + 5);
+	if (! idxfile)
+		abort ();
+
+	sprintf (idxfile, "%s.idx", filename);
+	return idxfile;
+}
+
+/**
+ * load_index:
+ * @index: index to fill,
+ * @filename: recording,
+ * @data: contents of the recording,
+ * @len: length of @data,
+ * @covered: pointer to store length of recording the index covers.
+ *
+ * Reads the index file for @filename, if it was made for this
+ * recording; that is, it covers no more than @len bytes, and the start
+ * of @data has not changed since.
+ *
+ * Returns: 0 if loaded, non-zero otherwise.
+ **/
+static int
+load_index (SeekIndex           *index,
+	    const char          *filename,
+	    const unsigned char *data,
+	    size_t               len,
+	    unsigned long long  *covered)
+{
+	unsigned char  header[INDEX_FILE_HEADER], buf[INDEX_ENTRY];
+	unsigned long  check, num_entries, i;
+	char          *idxfile;
+	FILE          *idxf;
+
+	*covered = 0;
+
+	idxfile = index_filename (filename);
+	idxf = fopen (idxfile, "r");
+	free (idxfile);
+	if (! idxf)
+		return 1;
+
+	if ((fread (header, sizeof (header), 1, idxf) != 1)
+	    || memcmp (header, INDEX_MAGIC, 4)
+	    || (get_le32 (header + 4) != INDEX_VERSION))
+		goto error;
+
+	*covered = get_le64 (header + 8);
+	if (*covered > len)
+		goto error;
+
+	check = adler32_sum (1, data, MIN (*covered, CHECK_LEN));
+	if (get_le32 (header + 16) != check)
+		goto error;
+
+	num_entries = get_le32 (header + 20);
+	for (i = 0; i < num_entries; i++) {
+		IndexScan scan;
+
+		if (fread (buf, sizeof (buf), 1, idxf) != 1)
+			goto error;
+
+		scan.state.frame = get_le32 (buf);
+		scan.state.event_no = get_le32 (buf + 4);
+		scan.leader = get_le32 (buf + 8);
+		scan.laps = get_le32 (buf + 12);
+		scan.time_ns = (long long) get_le64 (buf + 16);
+		scan.record = get_le64 (buf + 24);
+		if ((scan.record > len) || (get_le64 (buf + 32) > len))
+			goto error;
+
+		add_entry (index, &scan, get_le64 (buf + 32),
+			   get_le32 (buf + 40));
+	}
+
+	fclose (idxf);
+	return 0;
+
+error:
+	info (2, _("Index for %s is out of date, rebuilding\n"), filename);
+	free_index (index);
+	*covered = 0;
+	fclose (idxf);
+	return 1;
+}
+
+/**
+ * save_index:
+ * @index: index to write,
+ * @filename: recording,
+ * @data: contents of the recording,
+ * @len: length of @data.
+ *
+ * Writes @index to the index file for @filename, by way of a temporary
+ * file so a reader never sees half of it.  Failing to do so isn't an
+ * error, we'll just have to scan again next time.
+ **/
+static void
+save_index (const SeekIndex     *index,
+	    const char          *filename,
+	    const unsigned char *data,
+	    size_t               len)
+{
+	unsigned char  header[INDEX_FILE_HEADER], buf[INDEX_ENTRY];
+	char          *idxfile, *tmpfile;
+	FILE          *idxf;
+	size_t         i;
+
+	idxfile = index_filename (filename);
+	tmpfile = malloc (strlen (idxfile) + 5);
+	if (! tmpfile)
+		abort ();
+	sprintf (tmpfile, "%s.tmp", idxfile);
+
+	idxf = fopen (tmpfile, "w");
+	if (! idxf)
+		goto error;
+
+	memcpy (header, INDEX_MAGIC, 4);
+	put_le32 (header + 4, INDEX_VERSION);
+	put_le64 (header + 8, len);
+	put_le32 (header + 16, adler32_sum (1, data, MIN (len, CHECK_LEN)));
+	put_le32 (header + 20, index->num_entries);
+	fwrite (header, sizeof (header), 1, idxf);
+
+	for (i = 0; i < index->num_entries; i++) {
+		const IndexEntry *entry = &index->entries[i];
+
+		put_le32 (buf, entry->frame);
+		put_le32 (buf + 4, entry->event_no);
+		put_le32 (buf + 8, entry->leader);
+		put_le32 (buf + 12, entry->laps);
+		put_le64 (buf + 16, entry->time_ns);
+		put_le64 (buf + 24, entry->record);
+		put_le64 (buf + 32, entry->offset);
+		put_le32 (buf + 40, entry->flags);
+		put_le32 (buf + 44, 0);
+		fwrite (buf, sizeof (buf), 1, idxf);
+	}
+
+	if (fclose (idxf) || rename (tmpfile, idxfile)) {
+		unlink (tmpfile);
+		goto error;
+	}
+
+	free (tmpfile);
+	free (idxfile);
+	return;
+
+error:
+	info (2, _("Unable to write index %s: %s\n"), idxfile,
+	      strerror (errno));
+	free (tmpfile);
+	free (idxfile);
+}
@@ -0,0 +1,103 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_INDEX_H
+#define LIVE_F1_INDEX_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Index file magic, and the size of the file header and each entry */
+#define INDEX_MAGIC         "LF1I"
+#define INDEX_VERSION       1
+#define INDEX_FILE_HEADER   24
+#define INDEX_ENTRY         48
+
+
+/**
+ * IndexFlags:
+ *
+ * What else we know about a key frame marker in the index.
+ **/
+typedef enum {
+	INDEX_HAVE_KEY_FRAME	= (1 << 0),
+} IndexFlags;
+
+/**
+ * SeekBy:
+ *
+ * What a seek target given to find_key_frame() is measured in.
+ **/
+typedef enum {
+	SEEK_FRAME,
+	SEEK_LAP,
+	SEEK_TIME,
+} SeekBy;
+
+/**
+ * IndexEntry:
+ * @frame: key frame number,
+ * @event_no: event the key frame belongs to,
+ * @leader: car leading the race at the key frame, or zero,
+ * @laps: laps completed by the leader at the key frame,
+ * @time_ns: time the key frame marker was recorded, or zero,
+ * @record: offset of the read containing the end of the marker,
+ * @offset: offset of the first byte after the marker,
+ * @flags: IndexFlags.
+ *
+ * The salt is reset at each key frame marker, so playback can begin
+ * from any of them once the key frame itself has been parsed.  For a
+ * raw dump of the data stream @record and @offset are the same.
+ **/
+typedef struct {
+	unsigned int       frame, event_no, leader, laps;
+	long long          time_ns;
+	unsigned long long record, offset;
+	unsigned int       flags;
+} IndexEntry;
+
+/**
+ * SeekIndex:
+ * @entries: key frame markers found, in order,
+ * @num_entries: number of @entries,
+ * @alloc: number of @entries allocated.
+ *
+ * Index of the places in a recording that playback can begin from.
+ **/
+typedef struct {
+	IndexEntry *entries;
+	size_t      num_entries, alloc;
+} SeekIndex;
+
+
+SJR_BEGIN_EXTERN
+
+int               update_index   (SeekIndex *index, CurrentState *state,
+				  const char *filename,
+				  const unsigned char *data, size_t len,
+				  int framed);
+const IndexEntry *find_key_frame (const SeekIndex *index, SeekBy by,
+				  long long value);
+void              free_index     (SeekIndex *index);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_INDEX_H */
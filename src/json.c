@@ -0,0 +1,195 @@
+/* live-f1
+ *
+ * json.c - encoding JSON into growing buffers
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "json.h"
+
+
+/* Forward prototypes */
+static int utf8_length (const unsigned char *text, size_t len);
+
+
+/**
+ * put_json_text:
+ * @out: buffer to append to,
+ * @text: text to append, may be NULL,
+ * @len: most bytes of @text to append.
+ *
+ * Appends @text as a JSON string, encoded by encode_json_text().
+ **/
+void
+put_json_text (JsonBuf    *out,
+	       const char *text,
+	       size_t      len)
+{
+	/* Room for the string, and the terminator */
+	if (out->len + JSON_TEXT_SIZE (len) + 1 > out->size) {
+		out->size = (out->len + JSON_TEXT_SIZE (len) + 1) * 2;
+		out->buf = realloc (out->buf, out->size);
+		if (! out->buf)
+			abort ();
+	}
+
+	out->len += encode_json_text (out->buf + out->len, text, len);
+	out->buf[out->len] = '\0';
+}
+
+/**
+ * encode_json_text:
+ * @dest: where to write the string, at least JSON_TEXT_SIZE(@len) bytes,
+ * @text: text to encode, may be NULL,
+ * @len: most bytes of @text to encode.
+ *
+ * Writes @text into @dest as a quoted JSON string, which isn't
+ * terminated.  The feed is mostly ASCII, but other valid UTF-8 is kept
+ * as it is; bytes that aren't are replaced with U+FFFD, since garbage
+ * from a failed decryption would otherwise make the result invalid.
+ * Quotes, backslashes and control characters are escaped.
+ *
+ * Every place JSON is written uses this, so the same text always
+ * comes out the same.
+ *
+ * Returns: number of bytes written.
+ **/
+size_t
+encode_json_text (char       *dest,
+		  const char *text,
+		  size_t      len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *) (text ? text : "");
+	size_t               i, n = 0;
+
+	dest[n++] = '"';
+	for (i = 0; (i < len) && p[i]; i++) {
+		int seq;
+
+		if ((p[i] == '"') || (p[i] == '\\')) {
+			dest[n++] = '\\';
+			dest[n++] = p[i];
+		} else if ((p[i] < 0x20) || (p[i] == 0x7f)) {
+			memcpy (dest + n, "\\u00", 4);
+			n += 4;
+			dest[n++] = hex[p[i] >> 4];
+			dest[n++] = hex[p[i] & 0xf];
+		} else if (p[i] < 0x80) {
+			dest[n++] = p[i];
+		} else if ((seq = utf8_length (p + i, len - i)) > 0) {
+			memcpy (dest + n, p + i, seq);
+			n += seq;
+			i += seq - 1;
+		} else {
+			memcpy (dest + n, "\\ufffd", 6);
+			n += 6;
+		}
+	}
+	dest[n++] = '"';
+
+	return n;
+}
+
+/**
+ * put_json:
+ * @out: buffer to append to,
+ * @format: format string for printf.
+ *
+ * Appends formatted text to @out, growing it as needed.
+ **/
+void
+put_json (JsonBuf    *out,
+	  const char *format,
+	  ...)
+{
+	va_list args;
+	int     len;
+
+	for (;;) {
+		va_start (args, format);
+		len = vsnprintf (out->buf + out->len, out->size - out->len,
+				 format, args);
+		va_end (args);
+
+		if (len < 0)
+			abort ();
+		if (out->len + len < out->size)
+			break;
+
+		out->size = (out->size + len + 1) * 2;
+		out->buf = realloc (out->buf, out->size);
+		if (! out->buf)
+			abort ();
+	}
+
+	out->len += len;
+}
+
+/**
+ * utf8_length:
+ * @text: start of a multi-byte sequence,
+ * @len: most bytes of @text to look at.
+ *
+ * Returns: length of the valid UTF-8 sequence at @text, or 0 if it
+ * isn't one.
+ **/
+static int
+utf8_length (const unsigned char *text,
+	     size_t               len)
+{
+	int seq, i;
+
+	if ((text[0] >= 0xc2) && (text[0] <= 0xdf)) {
+		seq = 2;
+	} else if ((text[0] >= 0xe0) && (text[0] <= 0xef)) {
+		seq = 3;
+	} else if ((text[0] >= 0xf0) && (text[0] <= 0xf4)) {
+		seq = 4;
+	} else {
+		return 0;
+	}
+
+	if ((size_t) seq > len)
+		return 0;
+	for (i = 1; i < seq; i++)
+		if ((text[i] & 0xc0) != 0x80)
+			return 0;
+
+	/* Overlong and surrogate forms */
+	if ((text[0] == 0xe0) && (text[1] < 0xa0))
+		return 0;
+	if ((text[0] == 0xed) && (text[1] >= 0xa0))
+		return 0;
+	if ((text[0] == 0xf0) && (text[1] < 0x90))
+		return 0;
+	if ((text[0] == 0xf4) && (text[1] >= 0x90))
+		return 0;
+
+	return seq;
+}
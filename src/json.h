@@ -0,0 +1,56 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_JSON_H
+#define LIVE_F1_JSON_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/**
+ * JsonBuf:
+ * @buf: text encoded so far,
+ * @len: length of @buf,
+ * @size: space allocated for @buf.
+ *
+ * Growing buffer JSON is encoded into, and the other text served over
+ * HTTP, such as the metrics, is formatted into; starts out all zero,
+ * and @buf is always terminated once anything has been put in it.
+ **/
+typedef struct {
+	char   *buf;
+	size_t  len, size;
+} JsonBuf;
+
+
+/* Most bytes encode_json_text() writes for @len bytes of text */
+#define JSON_TEXT_SIZE(len) ((len) * 6 + 2)
+
+
+SJR_BEGIN_EXTERN
+
+void   put_json         (JsonBuf *out, const char *format, ...);
+void   put_json_text    (JsonBuf *out, const char *text, size_t len);
+size_t encode_json_text (char *dest, const char *text, size_t len);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_JSON_H */
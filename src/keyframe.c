@@ -0,0 +1,340 @@
+/* live-f1
+ *
+ * keyframe.c - key frames made from the board
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "packet.h"
+#include "stream.h"
+#include "keyframe.h"
+
+
+/* Longest payload of a short packet; a length of 15 means -1 */
+#define SHORT_PACKET_MAX 14
+
+/* Longest payload of a long packet */
+#define LONG_PACKET_MAX  127
+
+/* Forward prototypes */
+static void put_packet (PacketWriter *out, const unsigned char *hdr,
+			const char *payload, size_t len, int encrypt);
+static void put_number (PacketWriter *out, int type, int data,
+			int number);
+
+
+/**
+ * encode_key_frame:
+ * @state: application state structure,
+ * @len: pointer to store length of key frame in.
+ *
+ * Encodes the board in @state as a key frame, in the same form as those
+ * on the web site, that parse_stream_block() would build the same board
+ * from: the event identifier packet, a position and data atoms for each
+ * car, then the flag, weather, fastest lap and session clock.  All but
+ * the event identifier are encrypted from the seed, as after a key frame
+ * marker.  The clock is given as it stands now.
+ *
+ * Returns: newly allocated key frame, or NULL if no event has begun.
+ **/
+unsigned char *
+encode_key_frame (CurrentState *state,
+		  size_t       *len)
+{
+	PacketWriter out;
+	char         text[16];
+	int          i, j;
+
+	if (! state->event_no)
+		return NULL;
+
+	memset (&out, 0, sizeof (out));
+	out.key = state->key;
+
+	/* The event identifier starts the board again, and the salt */
+	put_event_packet (&out, state->event_type, state->event_no);
+
+	for (i = 0; i < state->num_cars; i++) {
+		put_position_packet (&out, i + 1, state->car_position[i]);
+
+		for (j = 1; j < CAR_POSITION_HISTORY; j++) {
+			CarAtom *atom = &state->car_info[i][j];
+
+			if (atom->text[0] || atom->data)
+				put_short_packet (&out, i + 1, j, atom->data,
+						  atom->text, TRUE);
+		}
+	}
+
+	put_number (&out, SYS_TRACK_STATUS, 1, state->flag);
+	put_number (&out, SYS_WEATHER, WEATHER_TRACK_TEMP, state->track_temp);
+	put_number (&out, SYS_WEATHER, WEATHER_AIR_TEMP, state->air_temp);
+	put_number (&out, SYS_WEATHER, WEATHER_WIND_SPEED, state->wind_speed);
+	put_number (&out, SYS_WEATHER, WEATHER_HUMIDITY, state->humidity);
+	put_number (&out, SYS_WEATHER, WEATHER_PRESSURE, state->pressure);
+	put_number (&out, SYS_WEATHER, WEATHER_WIND_DIRECTION,
+		    state->wind_direction);
+
+	if (state->fl_car && state->fl_car[0])
+		put_long_packet (&out, SYS_SPEED, FL_CAR, state->fl_car);
+	if (state->fl_driver && state->fl_driver[0])
+		put_long_packet (&out, SYS_SPEED, FL_DRIVER,
+				 state->fl_driver);
+	if (state->fl_time && state->fl_time[0])
+		put_long_packet (&out, SYS_SPEED, FL_TIME, state->fl_time);
+	if (state->fl_lap && state->fl_lap[0])
+		put_long_packet (&out, SYS_SPEED, FL_LAP, state->fl_lap);
+
+	/* A clock that's running is started with an empty packet first,
+	 * then given what's left of the session now.
+	 */
+	if (state->remaining_time || state->epoch_time) {
+		time_t remaining = state->remaining_time;
+
+		if (state->epoch_time) {
+			remaining -= get_time (state) - state->epoch_time;
+			remaining = MAX (remaining, 0);
+
+			put_short_packet (&out, 0, SYS_WEATHER,
+					  WEATHER_SESSION_CLOCK, NULL, TRUE);
+		}
+
+		sprintf (text, "%d:%02d:%02d", (int) (remaining / 3600),
+			 (int) (remaining / 60 % 60), (int) (remaining % 60));
+		put_short_packet (&out, 0, SYS_WEATHER, WEATHER_SESSION_CLOCK,
+				  text, TRUE);
+	}
+
+	*len = out.len;
+	return out.buf;
+}
+
+
+/**
+ * put_packet:
+ * @out: packets being encoded,
+ * @hdr: the two bytes of the packet header,
+ * @payload: payload of the packet,
+ * @len: length of @payload,
+ * @encrypt: whether to encrypt @payload.
+ *
+ * Appends a packet to @out, encrypting its payload with the salt where
+ * the reader will decrypt it, so long as we have the key.
+ **/
+static void
+put_packet (PacketWriter        *out,
+	    const unsigned char *hdr,
+	    const char          *payload,
+	    size_t               len,
+	    int                  encrypt)
+{
+	unsigned char *p;
+
+	if (out->len + len + 2 > out->size) {
+		out->size = MAX (out->size * 2, 1024);
+		out->buf = realloc (out->buf, out->size);
+		if (! out->buf)
+			abort ();
+	}
+
+	p = out->buf + out->len;
+	memcpy (p, hdr, 2);
+	if (len)
+		memcpy (p + 2, payload, len);
+	out->len += len + 2;
+
+	if ((! encrypt) || (! out->key))
+		return;
+
+	for (p += 2; len--; p++) {
+		out->salt = ((out->salt >> 1)
+			     ^ (out->salt & 0x01 ? out->key : 0));
+		*p ^= (out->salt & 0xff);
+	}
+}
+
+/**
+ * put_event_packet:
+ * @out: packets being encoded,
+ * @type: type of event,
+ * @event_no: official event number.
+ *
+ * Appends the event identifier packet to @out, which the reader begins
+ * the board again at; the salt is reset after it.
+ **/
+void
+put_event_packet (PacketWriter *out,
+		  EventType     type,
+		  unsigned int  event_no)
+{
+	char text[16];
+
+	sprintf (text, "_%u", event_no);
+	put_short_packet (out, 0, SYS_EVENT_ID, type, text, FALSE);
+
+	out->salt = CRYPTO_SEED;
+}
+
+/**
+ * put_key_frame_marker:
+ * @out: packets being encoded,
+ * @frame: key frame number.
+ *
+ * Appends a key frame marker to @out, which carries @frame as a
+ * little-endian integer; the salt is reset after it.
+ **/
+void
+put_key_frame_marker (PacketWriter *out,
+		      unsigned int  frame)
+{
+	unsigned char hdr[2];
+	char          payload[4];
+	size_t        len = 0;
+
+	do {
+		payload[len++] = frame & 0xff;
+		frame >>= 8;
+	} while (frame && (len < sizeof (payload)));
+
+	hdr[0] = (SYS_KEY_FRAME & 0x07) << 5;
+	hdr[1] = ((SYS_KEY_FRAME >> 3) & 0x01) | (len << 4);
+
+	put_packet (out, hdr, payload, len, FALSE);
+
+	out->salt = CRYPTO_SEED;
+}
+
+/**
+ * put_short_packet:
+ * @out: packets being encoded,
+ * @car: index of car, or 0 for a system packet,
+ * @type: type of packet,
+ * @data: additional data for the header, such as a colour,
+ * @text: payload, or NULL for a length of -1,
+ * @encrypt: whether to encrypt @text.
+ *
+ * Appends a packet with the short form of header to @out; any more of
+ * @text than fits is lost.
+ **/
+void
+put_short_packet (PacketWriter *out,
+		  int           car,
+		  int           type,
+		  int           data,
+		  const char   *text,
+		  int           encrypt)
+{
+	unsigned char hdr[2];
+	size_t        len;
+
+	len = text ? MIN (strlen (text), SHORT_PACKET_MAX) : 0;
+
+	hdr[0] = (car & 0x1f) | ((type & 0x07) << 5);
+	hdr[1] = (((type >> 3) & 0x01) | ((data & 0x07) << 1)
+		  | ((text ? len : 0x0f) << 4));
+
+	put_packet (out, hdr, text, len, encrypt);
+}
+
+/**
+ * put_long_packet:
+ * @out: packets being encoded,
+ * @type: type of system packet,
+ * @field: first byte of the payload,
+ * @text: rest of the payload.
+ *
+ * Appends an encrypted system packet with the long form of header to
+ * @out, whose payload is @field followed by @text.
+ **/
+void
+put_long_packet (PacketWriter *out,
+		 int           type,
+		 int           field,
+		 const char   *text)
+{
+	unsigned char hdr[2];
+	char          payload[LONG_PACKET_MAX];
+	size_t        len;
+
+	len = MIN (strlen (text), LONG_PACKET_MAX - 1);
+	payload[0] = field;
+	memcpy (payload + 1, text, len);
+
+	hdr[0] = (type & 0x07) << 5;
+	hdr[1] = ((type >> 3) & 0x01) | ((len + 1) << 1);
+
+	put_packet (out, hdr, payload, len + 1, TRUE);
+}
+
+/**
+ * put_position_packet:
+ * @out: packets being encoded,
+ * @car: index of car,
+ * @position: its position, or 0 for none.
+ *
+ * Appends a position update for @car to @out, which carries the
+ * position in its header and has no payload.
+ **/
+void
+put_position_packet (PacketWriter *out,
+		     int           car,
+		     int           position)
+{
+	unsigned char hdr[2];
+
+	hdr[0] = (car & 0x1f) | (CAR_POSITION_UPDATE << 5);
+	hdr[1] = (position & 0x7f) << 1;
+
+	put_packet (out, hdr, NULL, 0, FALSE);
+}
+
+/**
+ * put_number:
+ * @out: packets being encoded,
+ * @type: type of system packet,
+ * @data: field to be updated,
+ * @number: value of the field.
+ *
+ * Appends an encrypted system packet giving @number in decimal to @out,
+ * unless it's zero, as it will be after the event identifier anyway.
+ * Those values stored with their decimal point removed are given
+ * without one, which reads back the same.
+ **/
+static void
+put_number (PacketWriter *out,
+	    int           type,
+	    int           data,
+	    int           number)
+{
+	char text[16];
+
+	if (! number)
+		return;
+
+	sprintf (text, "%d", number);
+	put_short_packet (out, 0, type, data, text, TRUE);
+}
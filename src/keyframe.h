@@ -0,0 +1,62 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_KEYFRAME_H
+#define LIVE_F1_KEYFRAME_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/**
+ * PacketWriter:
+ * @buf: packets encoded so far,
+ * @len: length of @buf,
+ * @size: space allocated for @buf,
+ * @key: decryption key of the event,
+ * @salt: encryption salt, as the reader's will be.
+ *
+ * Packets being encoded into the form of the data stream; zero it and
+ * set @key before the first, and free @buf when done.
+ **/
+typedef struct {
+	unsigned char *buf;
+	size_t         len, size;
+	unsigned int   key, salt;
+} PacketWriter;
+
+
+SJR_BEGIN_EXTERN
+
+unsigned char *encode_key_frame     (CurrentState *state, size_t *len);
+
+void           put_event_packet     (PacketWriter *out, EventType type,
+				     unsigned int event_no);
+void           put_key_frame_marker (PacketWriter *out, unsigned int frame);
+void           put_short_packet     (PacketWriter *out, int car, int type,
+				     int data, const char *text, int encrypt);
+void           put_long_packet      (PacketWriter *out, int type, int field,
+				     const char *text);
+void           put_position_packet  (PacketWriter *out, int car,
+				     int position);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_KEYFRAME_H */
@@ -0,0 +1,294 @@
+/* live-f1
+ *
+ * live-f1-decoded.h - reading decoded changes written to a file
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_DECODED_H
+#define LIVE_F1_DECODED_H
+
+/* This header is installed for programs reading the changes to the
+ * board that live-f1 --decoded=FILE writes, so depends on nothing else
+ * from live-f1 but live-f1-shm.h, whose LiveF1EventKind and
+ * LiveF1ValueType the records share.  FILE holds a header and then
+ * fixed-size records, and FILE.str the texts they refer to, each stored
+ * once; so a reader maps both and indexes the records directly:
+ *
+ *	LiveF1Decoded d;
+ *	size_t        i;
+ *
+ *	live_f1_decoded_open (&d, "race.lf1d");
+ *	for (i = live_f1_decoded_seek (&d, start); i < d.num_records; i++)
+ *		... d.records[i], live_f1_decoded_text (&d, &d.records[i])
+ *
+ * Records are only ever appended, strings before the records that refer
+ * to them, so a file still being written can be opened at any time.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1-shm.h"
+
+
+/* Identify the files, and the layout of LiveF1Record; a reader should
+ * check both, the version changes whenever the layout does */
+#define LIVE_F1_DECODED_MAGIC   0x44314c46 /* "LF1D" */
+#define LIVE_F1_STRINGS_MAGIC   0x54314c46 /* "LF1T" */
+#define LIVE_F1_DECODED_VERSION 1
+
+
+/**
+ * LiveF1Record:
+ * @time: time of the session the change was made, since the epoch,
+ * @value: value of the change, as @value_type says,
+ * @event_no: event number,
+ * @data: colour of an atom, or as for LiveF1Event,
+ * @text: offset of the text of an atom or fastest lap field in the
+ * string table, or zero if it has none,
+ * @kind: LiveF1EventKind,
+ * @value_type: LiveF1ValueType,
+ * @car: car changed, numbered from one, or zero,
+ * @type: atom type, weather field or fastest lap field changed.
+ *
+ * A single change to the board, with the same meaning as a LiveF1Event
+ * from the ring but with its text moved out into the string table, so
+ * that it's 32 bytes and naturally aligned.
+ **/
+typedef struct {
+	int64_t  time;
+	int64_t  value;
+	uint32_t event_no;
+	int32_t  data;
+	uint32_t text;
+	uint8_t  kind, value_type, car, type;
+} LiveF1Record;
+
+/**
+ * LiveF1DecodedHeader:
+ * @magic: LIVE_F1_DECODED_MAGIC,
+ * @version: LIVE_F1_DECODED_VERSION,
+ * @record_size: size of a LiveF1Record.
+ *
+ * Start of the file of records, padded to the size of one.
+ **/
+typedef struct {
+	uint32_t magic, version, record_size, reserved;
+	uint64_t reserved2[2];
+} LiveF1DecodedHeader;
+
+/**
+ * LiveF1StringsHeader:
+ * @magic: LIVE_F1_STRINGS_MAGIC,
+ * @version: LIVE_F1_DECODED_VERSION.
+ *
+ * Start of the string table, which is followed by terminated strings;
+ * none is at offset zero.
+ **/
+typedef struct {
+	uint32_t magic, version;
+} LiveF1StringsHeader;
+
+/**
+ * LiveF1Decoded:
+ * @records: records in the file,
+ * @num_records: number of @records,
+ * @strings: string table,
+ * @strings_len: size of @strings.
+ *
+ * Files mapped by live_f1_decoded_open().
+ **/
+typedef struct {
+	const LiveF1Record *records;
+	size_t              num_records;
+	const char         *strings;
+	size_t              strings_len;
+
+	void               *map, *strings_map;
+	size_t              map_len;
+} LiveF1Decoded;
+
+
+/**
+ * live_f1_decoded_map:
+ * @path: file to map,
+ * @len: set to its length.
+ *
+ * Maps @path read-only.
+ *
+ * Returns: mapped file, or NULL if it can't be or is empty.
+ **/
+static inline void *
+live_f1_decoded_map (const char *path,
+		     size_t     *len)
+{
+	struct stat statbuf;
+	void       *addr;
+	int         fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if ((fstat (fd, &statbuf) < 0) || (! statbuf.st_size)) {
+		close (fd);
+		return NULL;
+	}
+
+	addr = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	*len = statbuf.st_size;
+	return addr;
+}
+
+/**
+ * live_f1_decoded_open:
+ * @decoded: structure to fill,
+ * @path: name given to live-f1 --decoded.
+ *
+ * Maps the records in @path and the string table in @path.str, as much
+ * as had been written of each.  The records are mapped first, so every
+ * string they refer to is there.
+ *
+ * Returns: 0 on success, or -1 if either doesn't exist or isn't one this
+ * header understands.
+ **/
+static inline int
+live_f1_decoded_open (LiveF1Decoded *decoded,
+		      const char    *path)
+{
+	const LiveF1DecodedHeader *header;
+	const LiveF1StringsHeader *strings;
+	char                      *strings_path;
+
+	memset (decoded, 0, sizeof (LiveF1Decoded));
+
+	decoded->map = live_f1_decoded_map (path, &decoded->map_len);
+	if (! decoded->map)
+		return -1;
+
+	strings_path = malloc (strlen (path) + 5);
+	if (! strings_path)
+		goto error;
+	strcpy (strings_path, path);
+	strcat (strings_path, ".str");
+	decoded->strings_map = live_f1_decoded_map (strings_path,
+						    &decoded->strings_len);
+	free (strings_path);
+	if (! decoded->strings_map)
+		goto error;
+
+	header = decoded->map;
+	strings = decoded->strings_map;
+	if ((decoded->map_len < sizeof (LiveF1DecodedHeader))
+	    || (header->magic != LIVE_F1_DECODED_MAGIC)
+	    || (header->version != LIVE_F1_DECODED_VERSION)
+	    || (header->record_size != sizeof (LiveF1Record))
+	    || (decoded->strings_len < sizeof (LiveF1StringsHeader))
+	    || (strings->magic != LIVE_F1_STRINGS_MAGIC)
+	    || (strings->version != LIVE_F1_DECODED_VERSION))
+		goto error;
+
+	decoded->records = (const LiveF1Record *) (header + 1);
+	decoded->num_records = ((decoded->map_len
+				 - sizeof (LiveF1DecodedHeader))
+				/ sizeof (LiveF1Record));
+	decoded->strings = decoded->strings_map;
+
+	return 0;
+
+error:
+	if (decoded->strings_map)
+		munmap (decoded->strings_map, decoded->strings_len);
+	munmap (decoded->map, decoded->map_len);
+	memset (decoded, 0, sizeof (LiveF1Decoded));
+	return -1;
+}
+
+/**
+ * live_f1_decoded_text:
+ * @decoded: files from live_f1_decoded_open(),
+ * @record: record from them.
+ *
+ * Returns: text of @record, or an empty string if it has none.
+ **/
+static inline const char *
+live_f1_decoded_text (const LiveF1Decoded *decoded,
+		      const LiveF1Record  *record)
+{
+	if ((! record->text) || (record->text >= decoded->strings_len))
+		return "";
+
+	return decoded->strings + record->text;
+}
+
+/**
+ * live_f1_decoded_seek:
+ * @decoded: files from live_f1_decoded_open(),
+ * @time: time of the session, since the epoch.
+ *
+ * Finds the first change made at or after @time by binary search; the
+ * records are in order of time unless a replay was sought backwards
+ * while writing them.
+ *
+ * Returns: index of the record, or @num_records if there's none.
+ **/
+static inline size_t
+live_f1_decoded_seek (const LiveF1Decoded *decoded,
+		      int64_t              time)
+{
+	size_t low = 0, high = decoded->num_records;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (decoded->records[mid].time < time) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+/**
+ * live_f1_decoded_close:
+ * @decoded: files from live_f1_decoded_open().
+ *
+ * Unmaps the files.
+ **/
+static inline void
+live_f1_decoded_close (LiveF1Decoded *decoded)
+{
+	if (decoded->strings_map)
+		munmap (decoded->strings_map, decoded->strings_len);
+	if (decoded->map)
+		munmap (decoded->map, decoded->map_len);
+	memset (decoded, 0, sizeof (LiveF1Decoded));
+}
+
+#endif /* LIVE_F1_DECODED_H */
@@ -0,0 +1,478 @@
+/* live-f1
+ *
+ * live-f1-multicast.h - following the board multicast on the network
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_MULTICAST_H
+#define LIVE_F1_MULTICAST_H
+
+/* This header is installed for programs following the board that
+ * live-f1 --multicast=GROUP:PORT sends, so depends on nothing else from
+ * live-f1 but live-f1-shm.h, whose LiveF1Snapshot the board is kept in
+ * and whose LiveF1Event each change is.  A receiver does:
+ *
+ *	LiveF1Receiver rx;
+ *
+ *	live_f1_mcast_open (&rx, "239.192.0.1", "4321");
+ *	for (;;)
+ *		if (live_f1_mcast_receive (&rx) > 0)
+ *			... rx.board
+ *
+ * and may poll rx.fd with its other descriptors.  Changes are only
+ * applied once a whole snapshot has been seen, and a lost datagram
+ * means waiting for the next; live-f1 sends one every couple of
+ * seconds, and knows nothing about how many receivers there are.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1-shm.h"
+
+
+/* Identifies a datagram, and the layout of its header and entries; a
+ * receiver should check both, the version changes whenever the layout
+ * does */
+#define LIVE_F1_MCAST_MAGIC   0x4d314c46 /* "LF1M" */
+#define LIVE_F1_MCAST_VERSION 1
+
+/* Largest datagram sent, which fits in an Ethernet frame */
+#define LIVE_F1_MCAST_SIZE    1472
+
+/* Size of the header, and the most an entry may be */
+#define LIVE_F1_MCAST_HEADER  24
+#define LIVE_F1_MCAST_ENTRY   32
+
+/* Flags of a datagram that's part of a snapshot, and of the first and
+ * last parts of one */
+#define LIVE_F1_MCAST_SNAPSHOT 0x01
+#define LIVE_F1_MCAST_FIRST    0x02
+#define LIVE_F1_MCAST_LAST     0x04
+
+
+/* The wire format, all in network byte order:
+ *
+ * header: magic (4), version (1), flags (1), number of entries (2),
+ * sequence number (8), time of the session (8).
+ *
+ * entry: kind (1), value type (1), car (1), type (1), data (4),
+ * value (8), length of the text (1), then the text unterminated.
+ *
+ * Each entry is a LiveF1Event, made at the time in the header.  The
+ * sequence number goes up by one with every datagram, snapshot or not,
+ * so a receiver knows when it's lost one.
+ */
+
+
+/**
+ * LiveF1Receiver:
+ * @fd: socket the datagrams are received on,
+ * @next: sequence number expected next,
+ * @synced: non-zero once @board is complete,
+ * @building: non-zero while a snapshot is being put together,
+ * @build_next: sequence number expected next of the snapshot,
+ * @lost: number of times a datagram has been lost,
+ * @board: board as of the last datagram applied,
+ * @staging: snapshot being put together.
+ *
+ * State of a receiver, from live_f1_mcast_open().
+ **/
+typedef struct {
+	int            fd;
+	uint64_t       next;
+	int            synced, building;
+	uint64_t       build_next;
+	uint64_t       lost;
+	LiveF1Snapshot board, staging;
+} LiveF1Receiver;
+
+
+/**
+ * live_f1_mcast_get32:
+ * @p: bytes to read.
+ *
+ * Returns: 32-bit number at @p in network byte order.
+ **/
+static inline uint32_t
+live_f1_mcast_get32 (const unsigned char *p)
+{
+	return (((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+		| ((uint32_t) p[2] << 8) | (uint32_t) p[3]);
+}
+
+/**
+ * live_f1_mcast_get64:
+ * @p: bytes to read.
+ *
+ * Returns: 64-bit number at @p in network byte order.
+ **/
+static inline uint64_t
+live_f1_mcast_get64 (const unsigned char *p)
+{
+	return (((uint64_t) live_f1_mcast_get32 (p) << 32)
+		| live_f1_mcast_get32 (p + 4));
+}
+
+/**
+ * live_f1_board_apply:
+ * @board: board to change,
+ * @event: change to make.
+ *
+ * Makes the change @event describes to @board, as live-f1 made it to
+ * its own.
+ **/
+static inline void
+live_f1_board_apply (LiveF1Snapshot    *board,
+		     const LiveF1Event *event)
+{
+	char  *text = NULL;
+	size_t size = 0;
+
+	board->time = event->time;
+
+	switch (event->kind) {
+	case LIVE_F1_EVENT_BOARD:
+		/* A new event, or fewer cars, starts the board again */
+		if (((uint32_t) event->value != board->event_no)
+		    || (event->car < board->num_cars)) {
+			memset (board->position, 0, sizeof (board->position));
+			memset (board->atoms, 0, sizeof (board->atoms));
+		}
+
+		board->event_no = event->value;
+		board->event_type = event->data;
+		board->num_cars = (event->car < LIVE_F1_SHM_CARS
+				   ? event->car : LIVE_F1_SHM_CARS);
+		break;
+	case LIVE_F1_EVENT_POSITION:
+		if ((event->car > 0) && (event->car <= LIVE_F1_SHM_CARS))
+			board->position[event->car - 1] = event->value;
+		break;
+	case LIVE_F1_EVENT_ATOM:
+		if ((event->car > 0) && (event->car <= LIVE_F1_SHM_CARS)
+		    && (event->type < LIVE_F1_SHM_ATOMS)) {
+			LiveF1Atom *atom;
+
+			atom = &board->atoms[event->car - 1][event->type];
+			atom->data = event->data;
+			text = atom->text;
+			size = sizeof (atom->text);
+		}
+		break;
+	case LIVE_F1_EVENT_LAPS:
+		board->laps_completed = event->value;
+		board->total_laps = event->data;
+		break;
+	case LIVE_F1_EVENT_FLAG:
+		board->flag = event->value;
+		break;
+	case LIVE_F1_EVENT_WEATHER:
+		/* Numbered as the data stream does */
+		switch (event->type) {
+		case 1: board->track_temp = event->value; break;
+		case 2: board->air_temp = event->value; break;
+		case 4: board->wind_speed = event->value; break;
+		case 5: board->humidity = event->value; break;
+		case 6: board->pressure = event->value; break;
+		case 7: board->wind_direction = event->value; break;
+		}
+		break;
+	case LIVE_F1_EVENT_FASTEST_LAP:
+		/* Numbered as the data stream does */
+		switch (event->type) {
+		case 5:
+			text = board->fl_car;
+			size = sizeof (board->fl_car);
+			break;
+		case 6:
+			text = board->fl_driver;
+			size = sizeof (board->fl_driver);
+			break;
+		case 7:
+			text = board->fl_time;
+			size = sizeof (board->fl_time);
+			break;
+		case 8:
+			text = board->fl_lap;
+			size = sizeof (board->fl_lap);
+			break;
+		}
+		break;
+	case LIVE_F1_EVENT_CLOCK:
+		board->remaining_time = event->value;
+		board->epoch_time = event->data ? event->time : 0;
+		break;
+	}
+
+	if (text) {
+		size_t len = strnlen (event->text, size - 1);
+
+		memcpy (text, event->text, len);
+		text[len] = '\0';
+	}
+}
+
+/**
+ * live_f1_mcast_apply:
+ * @board: board to change,
+ * @buf: datagram received,
+ * @len: length of @buf.
+ *
+ * Makes each change in the datagram @buf to @board, without checking
+ * its sequence number.
+ *
+ * Returns: number of changes made, or -1 if @buf isn't a datagram this
+ * header understands.
+ **/
+static inline int
+live_f1_mcast_apply (LiveF1Snapshot *board,
+		     const void     *buf,
+		     size_t          len)
+{
+	const unsigned char *p = buf, *end = p + len;
+	LiveF1Event          event;
+	int                  count, i;
+
+	if ((len < LIVE_F1_MCAST_HEADER)
+	    || (live_f1_mcast_get32 (p) != LIVE_F1_MCAST_MAGIC)
+	    || (p[4] != LIVE_F1_MCAST_VERSION))
+		return -1;
+
+	count = (p[6] << 8) | p[7];
+	memset (&event, 0, sizeof (event));
+	event.time = live_f1_mcast_get64 (p + 16);
+	p += LIVE_F1_MCAST_HEADER;
+
+	for (i = 0; i < count; i++) {
+		size_t text_len;
+
+		if (end - p < 17)
+			return -1;
+		text_len = p[16];
+		if ((text_len >= sizeof (event.text))
+		    || ((size_t) (end - p) < 17 + text_len))
+			return -1;
+
+		event.kind = p[0];
+		event.value_type = p[1];
+		event.car = p[2];
+		event.type = p[3];
+		event.data = live_f1_mcast_get32 (p + 4);
+		event.value = live_f1_mcast_get64 (p + 8);
+		memcpy (event.text, p + 17, text_len);
+		event.text[text_len] = '\0';
+		p += 17 + text_len;
+
+		live_f1_board_apply (board, &event);
+	}
+
+	return count;
+}
+
+/**
+ * live_f1_mcast_handle:
+ * @rx: receiver from live_f1_mcast_open(),
+ * @buf: datagram received,
+ * @len: length of @buf.
+ *
+ * Applies the datagram @buf to @rx's board if it follows on from the
+ * last, or puts it towards a snapshot if the board isn't complete.  For
+ * a receiver with a socket of its own.
+ *
+ * Returns: 1 if the board has changed, 0 if not, or -1 if @buf isn't a
+ * datagram this header understands.
+ **/
+static inline int
+live_f1_mcast_handle (LiveF1Receiver *rx,
+		      const void     *buf,
+		      size_t          len)
+{
+	const unsigned char *p = buf;
+	uint64_t             seq;
+	int                  flags;
+
+	if ((len < LIVE_F1_MCAST_HEADER)
+	    || (live_f1_mcast_get32 (p) != LIVE_F1_MCAST_MAGIC)
+	    || (p[4] != LIVE_F1_MCAST_VERSION))
+		return -1;
+
+	flags = p[5];
+	seq = live_f1_mcast_get64 (p + 8);
+
+	if (rx->synced && (seq != rx->next)) {
+		rx->synced = 0;
+		rx->lost++;
+	}
+	rx->next = seq + 1;
+
+	if (! (flags & LIVE_F1_MCAST_SNAPSHOT)) {
+		if (! rx->synced)
+			return 0;
+
+		return live_f1_mcast_apply (&rx->board, buf, len) > 0;
+	}
+
+	/* A receiver that's in step already has what's in the snapshot */
+	if (rx->synced)
+		return 0;
+
+	if (flags & LIVE_F1_MCAST_FIRST) {
+		memset (&rx->staging, 0, sizeof (rx->staging));
+		rx->staging.magic = LIVE_F1_SHM_MAGIC;
+		rx->staging.version = LIVE_F1_SHM_VERSION;
+		rx->staging.size = sizeof (LiveF1Snapshot);
+		rx->building = 1;
+		rx->build_next = seq;
+	}
+
+	if ((! rx->building) || (seq != rx->build_next)
+	    || (live_f1_mcast_apply (&rx->staging, buf, len) < 0)) {
+		rx->building = 0;
+		return 0;
+	}
+	rx->build_next = seq + 1;
+
+	if (! (flags & LIVE_F1_MCAST_LAST))
+		return 0;
+
+	memcpy (&rx->board, &rx->staging, sizeof (rx->board));
+	rx->board.seq = seq;
+	rx->building = 0;
+	rx->synced = 1;
+
+	return 1;
+}
+
+/**
+ * live_f1_mcast_open:
+ * @rx: receiver to fill,
+ * @group: multicast group given to live-f1 --multicast,
+ * @port: port given with it.
+ *
+ * Joins @group and starts listening for datagrams on @port.
+ *
+ * Returns: 0 on success, -1 on failure with errno set.
+ **/
+static inline int
+live_f1_mcast_open (LiveF1Receiver *rx,
+		    const char     *group,
+		    const char     *port)
+{
+	struct addrinfo hints, *res;
+	int             one = 1, ret;
+
+	memset (rx, 0, sizeof (LiveF1Receiver));
+	rx->fd = -1;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	if (getaddrinfo (group, port, &hints, &res) != 0)
+		return -1;
+
+	rx->fd = socket (res->ai_family, SOCK_DGRAM, 0);
+	if (rx->fd < 0)
+		goto error;
+
+	setsockopt (rx->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+	if (res->ai_family == AF_INET6) {
+		struct sockaddr_in6 addr;
+		struct ipv6_mreq    mreq;
+
+		memcpy (&addr, res->ai_addr, sizeof (addr));
+		mreq.ipv6mr_multiaddr = addr.sin6_addr;
+		mreq.ipv6mr_interface = 0;
+		addr.sin6_addr = in6addr_any;
+
+		ret = bind (rx->fd, (struct sockaddr *) &addr, sizeof (addr));
+		if (! ret)
+			ret = setsockopt (rx->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+					  &mreq, sizeof (mreq));
+	} else {
+		struct sockaddr_in addr;
+		struct ip_mreq     mreq;
+
+		memcpy (&addr, res->ai_addr, sizeof (addr));
+		mreq.imr_multiaddr = addr.sin_addr;
+		mreq.imr_interface.s_addr = htonl (INADDR_ANY);
+		addr.sin_addr.s_addr = htonl (INADDR_ANY);
+
+		ret = bind (rx->fd, (struct sockaddr *) &addr, sizeof (addr));
+		if (! ret)
+			ret = setsockopt (rx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+					  &mreq, sizeof (mreq));
+	}
+	if (ret < 0)
+		goto error;
+
+	freeaddrinfo (res);
+	return 0;
+
+error:
+	if (rx->fd >= 0)
+		close (rx->fd);
+	rx->fd = -1;
+	freeaddrinfo (res);
+	return -1;
+}
+
+/**
+ * live_f1_mcast_receive:
+ * @rx: receiver from live_f1_mcast_open().
+ *
+ * Receives the next datagram, waiting for it unless @rx->fd has been
+ * made non-blocking, and applies it as live_f1_mcast_handle() does.
+ *
+ * Returns: 1 if the board has changed, 0 if not, or -1 on error with
+ * errno set.
+ **/
+static inline int
+live_f1_mcast_receive (LiveF1Receiver *rx)
+{
+	unsigned char buf[LIVE_F1_MCAST_SIZE];
+	ssize_t       len;
+
+	len = recv (rx->fd, buf, sizeof (buf), 0);
+	if (len < 0)
+		return -1;
+
+	return live_f1_mcast_handle (rx, buf, len) > 0;
+}
+
+/**
+ * live_f1_mcast_close:
+ * @rx: receiver from live_f1_mcast_open().
+ *
+ * Leaves the group and closes the socket.
+ **/
+static inline void
+live_f1_mcast_close (LiveF1Receiver *rx)
+{
+	if (rx->fd >= 0)
+		close (rx->fd);
+	rx->fd = -1;
+}
+
+#endif /* LIVE_F1_MULTICAST_H */
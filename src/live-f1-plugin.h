@@ -0,0 +1,128 @@
+/* live-f1
+ *
+ * live-f1-plugin.h - interface for plugins loaded by live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_PLUGIN_H
+#define LIVE_F1_PLUGIN_H
+
+/* This header is installed for plugins, shared objects that live-f1
+ * --plugins=DIR loads from DIR, so depends on nothing else from live-f1.
+ * A plugin exports a function named live_f1_plugin_init, which is
+ * given the host and says which packets it wants:
+ *
+ *	int
+ *	live_f1_plugin_init (const LiveF1PluginHost *host)
+ *	{
+ *		if (host->version < LIVE_F1_PLUGIN_VERSION)
+ *			return 1;
+ *
+ *		host->on_car_packet (6, lap_time, NULL);
+ *		host->on_system_packet (9, weather, NULL);
+ *		host->on_system_subtype (10, 7, fastest_lap, NULL);
+ *		host->on_burst (write_out, NULL);
+ *		return 0;
+ *	}
+ *
+ * and may export live_f1_plugin_exit, called before it's unloaded.
+ * Callbacks are made from the main loop, so should return quickly;
+ * anything slow belongs in the burst callback, or a thread of its own.
+ */
+
+#include <stdint.h>
+
+
+/* Version of the interface; LiveF1PluginHost only grows at the end, so
+ * a plugin works with any host of at least the version it was built
+ * against */
+#define LIVE_F1_PLUGIN_VERSION 1
+
+/* Types of packet, from zero; car packet types 1 to 14 are the atoms,
+ * whose meaning depends on the event type */
+#define LIVE_F1_PACKET_TYPES   16
+
+/* Sub-types of a system packet, from zero: the first byte of the
+ * payload for the speed packet, type 10, and the data field for the
+ * rest, such as which reading a weather packet, type 9, gives */
+#define LIVE_F1_SUBTYPES       256
+
+
+/**
+ * LiveF1Packet:
+ * @car: car the packet is for, from one, or zero for a system packet,
+ * @type: type of packet,
+ * @data: data from the packet header, such as the colour of an atom,
+ * @len: length of @payload, or -1 if there's none,
+ * @payload: decrypted payload, always terminated,
+ * @event_no: event number,
+ * @event_type: 1 for a race, 2 for practice and 3 for qualifying,
+ * @in_key_frame: non-zero if the packet is from a key frame rather than
+ * the data stream,
+ * @time: time of the session, in seconds since the epoch,
+ * @subtype: sub-type of a system packet, or zero for a car packet.
+ *
+ * Packet as decoded by live-f1, after it has changed the board.  Only
+ * valid for the duration of the callback.
+ **/
+typedef struct {
+	int32_t              car, type, data, len;
+	const unsigned char *payload;
+	uint32_t             event_no;
+	int32_t              event_type, in_key_frame;
+	int64_t              time;
+	int32_t              subtype;
+} LiveF1Packet;
+
+/* Callback for each packet of a type subscribed to */
+typedef void (*LiveF1PacketFunc) (const LiveF1Packet *packet, void *data);
+
+/* Callback once after each read of the data stream */
+typedef void (*LiveF1BurstFunc) (void *data);
+
+/**
+ * LiveF1PluginHost:
+ * @version: LIVE_F1_PLUGIN_VERSION live-f1 was built with,
+ * @on_car_packet: call @func with @data for each car packet of @type,
+ * @on_system_packet: call @func with @data for each system packet of
+ * @type,
+ * @on_burst: call @func with @data after each read of the data stream,
+ * once all the packets in it have been handled,
+ * @on_system_subtype: call @func with @data for each system packet of
+ * @type and @subtype only.
+ *
+ * Given to live_f1_plugin_init(); the functions may only be called from
+ * there, and return non-zero if @type or @subtype is out of range.
+ **/
+typedef struct {
+	uint32_t version;
+
+	int (*on_car_packet)    (int type, LiveF1PacketFunc func, void *data);
+	int (*on_system_packet) (int type, LiveF1PacketFunc func, void *data);
+	int (*on_burst)         (LiveF1BurstFunc func, void *data);
+
+	int (*on_system_subtype) (int type, int subtype,
+				  LiveF1PacketFunc func, void *data);
+} LiveF1PluginHost;
+
+
+/* Exported by each plugin; returns non-zero to refuse to load */
+typedef int  (*LiveF1PluginInit) (const LiveF1PluginHost *host);
+typedef void (*LiveF1PluginExit) (void);
+
+#endif /* LIVE_F1_PLUGIN_H */
@@ -0,0 +1,436 @@
+/* live-f1
+ *
+ * live-f1-shm.h - reading the board published in shared memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_SHM_H
+#define LIVE_F1_SHM_H
+
+/* This header is installed for programs reading the board that live-f1
+ * --shm=NAME publishes, or the changes to it that --ring=NAME does, so
+ * depends on nothing else from live-f1.  A reader of the board does:
+ *
+ *	const LiveF1Snapshot *shm = live_f1_shm_open ("/live-f1");
+ *	LiveF1Snapshot        board;
+ *
+ *	live_f1_shm_read (shm, &board);
+ *
+ * and may call live_f1_shm_read() as often as it likes; it never takes
+ * a lock, and never makes live-f1 wait.  A reader of the changes does:
+ *
+ *	const LiveF1Ring *ring = live_f1_ring_open ("/live-f1-ring");
+ *	uint64_t          cursor = live_f1_ring_head (ring);
+ *	LiveF1Event       event;
+ *
+ *	while (live_f1_ring_next (ring, &cursor, &event) ...
+ *
+ * each with its own cursor; live-f1 doesn't know how many there are.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Identifies the segment, and the layout of LiveF1Snapshot; a reader
+ * should check both, the version changes whenever the layout does */
+#define LIVE_F1_SHM_MAGIC   0x53314c46 /* "LF1S" */
+#define LIVE_F1_SHM_VERSION 1
+
+/* Cars and atoms for each car held */
+#define LIVE_F1_SHM_CARS    32
+#define LIVE_F1_SHM_ATOMS   16
+
+/* Identifies the ring segment, and the layout of LiveF1Ring and
+ * LiveF1Event */
+#define LIVE_F1_RING_MAGIC   0x52314c46 /* "LF1R" */
+#define LIVE_F1_RING_VERSION 1
+
+
+/**
+ * LiveF1Atom:
+ * @data: colour of the atom,
+ * @text: content of the atom, always terminated.
+ *
+ * One cell of the board.
+ **/
+typedef struct {
+	int32_t data;
+	char    text[16];
+} LiveF1Atom;
+
+/**
+ * LiveF1Snapshot:
+ * @magic: LIVE_F1_SHM_MAGIC,
+ * @version: LIVE_F1_SHM_VERSION,
+ * @size: size of the segment,
+ * @seq: sequence count, odd while the board is being written,
+ * @time: time of the session the board was written, since the epoch,
+ * @event_no: event number,
+ * @event_type: 1 for a race, 2 for practice and 3 for qualifying,
+ * @num_cars: number of cars in the event,
+ * @laps_completed: laps completed by the leader during a race,
+ * @total_laps: laps in the race, if known,
+ * @flag: track status, 1 for green through 5 for red,
+ * @remaining_time: seconds remaining in the session when @epoch_time
+ * was set,
+ * @epoch_time: time the clock was last set, or zero if it's stopped,
+ * @track_temp: track temperature in degrees C,
+ * @air_temp: air temperature in degrees C,
+ * @humidity: humidity as a percentage,
+ * @wind_speed: wind speed in tenths of metres per second,
+ * @wind_direction: wind direction in degrees,
+ * @pressure: barometric pressure in tenths of millibars,
+ * @fl_car: number of the car with the fastest lap,
+ * @fl_driver: driver with the fastest lap,
+ * @fl_time: fastest lap time,
+ * @fl_lap: lap the fastest lap was set on,
+ * @position: position of each car, zero if it has none,
+ * @atoms: atoms of each car, indexed by type.
+ *
+ * Fixed layout of the shared memory segment; there are no pointers, and
+ * cars are numbered from one, so car N is at index N - 1.
+ **/
+typedef struct {
+	uint32_t   magic, version, size, reserved;
+	uint64_t   seq;
+
+	int64_t    time;
+	uint32_t   event_no, event_type, num_cars;
+	uint32_t   laps_completed, total_laps, flag;
+	int64_t    remaining_time, epoch_time;
+
+	int32_t    track_temp, air_temp, humidity;
+	int32_t    wind_speed, wind_direction, pressure;
+
+	char       fl_car[4], fl_driver[16], fl_time[12], fl_lap[4];
+
+	int32_t    position[LIVE_F1_SHM_CARS];
+	LiveF1Atom atoms[LIVE_F1_SHM_CARS][LIVE_F1_SHM_ATOMS];
+} LiveF1Snapshot;
+
+
+/**
+ * live_f1_shm_open:
+ * @name: name given to live-f1 --shm.
+ *
+ * Maps the segment live-f1 publishes the board in, read-only.
+ *
+ * Returns: mapped segment, or NULL if it doesn't exist or isn't one
+ * this header understands.
+ **/
+static inline const LiveF1Snapshot *
+live_f1_shm_open (const char *name)
+{
+	const LiveF1Snapshot *shm;
+	void                 *addr;
+	int                   fd;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	addr = mmap (NULL, sizeof (LiveF1Snapshot), PROT_READ, MAP_SHARED,
+		     fd, 0);
+	close (fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	shm = addr;
+	if ((shm->magic != LIVE_F1_SHM_MAGIC)
+	    || (shm->version != LIVE_F1_SHM_VERSION)
+	    || (shm->size != sizeof (LiveF1Snapshot))) {
+		munmap (addr, sizeof (LiveF1Snapshot));
+		return NULL;
+	}
+
+	return shm;
+}
+
+/**
+ * live_f1_shm_read:
+ * @shm: segment from live_f1_shm_open(),
+ * @board: structure to fill.
+ *
+ * Copies a consistent board from @shm into @board, trying again if
+ * live-f1 was writing it at the time.
+ *
+ * Returns: sequence count of the board copied; it only changes when the
+ * board does.
+ **/
+static inline uint64_t
+live_f1_shm_read (const LiveF1Snapshot *shm,
+		  LiveF1Snapshot       *board)
+{
+	const volatile uint64_t *seq = &shm->seq;
+	uint64_t                 before, after;
+
+	do {
+		while ((before = *seq) & 1)
+			;
+		__sync_synchronize ();
+
+		memcpy (board, shm, sizeof (LiveF1Snapshot));
+
+		__sync_synchronize ();
+		after = *seq;
+	} while (before != after);
+
+	board->seq = before;
+	return before;
+}
+
+/**
+ * live_f1_shm_changed:
+ * @shm: segment from live_f1_shm_open(),
+ * @seq: sequence count last returned by live_f1_shm_read().
+ *
+ * Returns: non-zero if the board has changed since @seq.
+ **/
+static inline int
+live_f1_shm_changed (const LiveF1Snapshot *shm,
+		     uint64_t              seq)
+{
+	return *(const volatile uint64_t *) &shm->seq != seq;
+}
+
+/**
+ * live_f1_shm_close:
+ * @shm: segment from live_f1_shm_open().
+ *
+ * Unmaps the segment.
+ **/
+static inline void
+live_f1_shm_close (const LiveF1Snapshot *shm)
+{
+	munmap ((void *) shm, sizeof (LiveF1Snapshot));
+}
+
+
+/**
+ * LiveF1EventKind:
+ *
+ * What changed; see LiveF1Event for the members each uses.
+ **/
+typedef enum {
+	LIVE_F1_EVENT_BOARD	  = 1,
+	LIVE_F1_EVENT_POSITION	  = 2,
+	LIVE_F1_EVENT_ATOM	  = 3,
+	LIVE_F1_EVENT_LAPS	  = 4,
+	LIVE_F1_EVENT_FLAG	  = 5,
+	LIVE_F1_EVENT_WEATHER	  = 6,
+	LIVE_F1_EVENT_FASTEST_LAP = 7,
+	LIVE_F1_EVENT_CLOCK	  = 8,
+} LiveF1EventKind;
+
+/**
+ * LiveF1ValueType:
+ *
+ * How the @value of a LiveF1Event is to be taken.
+ **/
+typedef enum {
+	LIVE_F1_VALUE_NONE	= 0,
+	LIVE_F1_VALUE_INT	= 1,
+	LIVE_F1_VALUE_MS	= 2,
+	LIVE_F1_VALUE_TENTHS	= 3,
+} LiveF1ValueType;
+
+/**
+ * LiveF1Event:
+ * @seq: one more than the number of the event, or zero while it's being
+ * written,
+ * @time: time of the session the change was made, since the epoch,
+ * @value: value of the change, as @value_type says,
+ * @kind: LiveF1EventKind,
+ * @value_type: LiveF1ValueType,
+ * @car: car changed, numbered from one, or zero,
+ * @type: atom type, weather field or fastest lap field changed,
+ * @data: colour of an atom, or as below,
+ * @text: text of an atom or fastest lap field, always terminated.
+ *
+ * A single change to the board:
+ *
+ * BOARD: new event or number of cars; @value is the event number,
+ * @data the event type and @car the number of cars.
+ * POSITION: @car moved to position @value.
+ * ATOM: atom @type of @car changed to @text and colour @data; @value is
+ * the text as a number or time if it's one.
+ * LAPS: @value laps completed of @data.
+ * FLAG: track status is @value.
+ * WEATHER: weather field @type, as numbered by the data stream, is
+ * @value.
+ * FASTEST_LAP: fastest lap field @type, as numbered by the data
+ * stream, is @text.
+ * CLOCK: session clock set to @value seconds remaining; @data is
+ * non-zero if it's running.
+ **/
+typedef struct {
+	uint64_t seq;
+	int64_t  time;
+	int64_t  value;
+	uint8_t  kind, value_type, car, type;
+	int32_t  data;
+	char     text[16];
+} LiveF1Event;
+
+/**
+ * LiveF1Ring:
+ * @magic: LIVE_F1_RING_MAGIC,
+ * @version: LIVE_F1_RING_VERSION,
+ * @size: size of the segment,
+ * @slots: number of @events, a power of two,
+ * @head: number of events written so far,
+ * @events: ring of events; event N is in slot N % @slots.
+ *
+ * Fixed layout of the ring segment.
+ **/
+typedef struct {
+	uint32_t    magic, version, size, slots;
+	uint64_t    head;
+	uint64_t    reserved[7];
+	LiveF1Event events[];
+} LiveF1Ring;
+
+
+/**
+ * live_f1_ring_open:
+ * @name: name given to live-f1 --ring.
+ *
+ * Maps the segment live-f1 writes changes to the board into, read-only.
+ *
+ * Returns: mapped segment, or NULL if it doesn't exist or isn't one
+ * this header understands.
+ **/
+static inline const LiveF1Ring *
+live_f1_ring_open (const char *name)
+{
+	const LiveF1Ring *ring;
+	struct stat       statbuf;
+	void             *addr;
+	int               fd;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if ((fstat (fd, &statbuf) < 0)
+	    || (statbuf.st_size < (off_t) sizeof (LiveF1Ring))) {
+		close (fd);
+		return NULL;
+	}
+
+	addr = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	ring = addr;
+	if ((ring->magic != LIVE_F1_RING_MAGIC)
+	    || (ring->version != LIVE_F1_RING_VERSION)
+	    || (ring->size != statbuf.st_size)
+	    || (ring->size != (sizeof (LiveF1Ring)
+			       + ring->slots * sizeof (LiveF1Event)))) {
+		munmap (addr, statbuf.st_size);
+		return NULL;
+	}
+
+	return ring;
+}
+
+/**
+ * live_f1_ring_head:
+ * @ring: segment from live_f1_ring_open().
+ *
+ * Returns: cursor for the next event to be written, to only read
+ * changes from now on; a cursor of zero reads from the oldest event
+ * still in the ring.
+ **/
+static inline uint64_t
+live_f1_ring_head (const LiveF1Ring *ring)
+{
+	return *(const volatile uint64_t *) &ring->head;
+}
+
+/**
+ * live_f1_ring_next:
+ * @ring: segment from live_f1_ring_open(),
+ * @cursor: number of the next event to read,
+ * @event: structure to fill.
+ *
+ * Copies the event at @cursor into @event and moves @cursor on.  If the
+ * reader has fallen so far behind that the event has been overwritten,
+ * @cursor is moved to the oldest event still in the ring so it can
+ * carry on from there, having lost those in between.
+ *
+ * Returns: 1 if @event was filled, 0 if there are no more events yet,
+ * or -1 if events were lost.
+ **/
+static inline int
+live_f1_ring_next (const LiveF1Ring *ring,
+		   uint64_t         *cursor,
+		   LiveF1Event      *event)
+{
+	const LiveF1Event *slot;
+	uint64_t           head, seq;
+
+	head = live_f1_ring_head (ring);
+	__sync_synchronize ();
+
+	if (*cursor >= head)
+		return 0;
+	if (head - *cursor > ring->slots)
+		goto overrun;
+
+	slot = &ring->events[*cursor & (ring->slots - 1)];
+	seq = *(const volatile uint64_t *) &slot->seq;
+	__sync_synchronize ();
+	if (seq != *cursor + 1)
+		goto overrun;
+
+	memcpy (event, slot, sizeof (LiveF1Event));
+
+	__sync_synchronize ();
+	if (*(const volatile uint64_t *) &slot->seq != seq)
+		goto overrun;
+
+	(*cursor)++;
+	return 1;
+
+overrun:
+	head = live_f1_ring_head (ring);
+	*cursor = (head > ring->slots) ? head - ring->slots + 1 : 0;
+	return -1;
+}
+
+/**
+ * live_f1_ring_close:
+ * @ring: segment from live_f1_ring_open().
+ *
+ * Unmaps the segment.
+ **/
+static inline void
+live_f1_ring_close (const LiveF1Ring *ring)
+{
+	munmap ((void *) ring, ring->size);
+}
+
+#endif /* LIVE_F1_SHM_H */
@@ -62,6 +62,10 @@ typedef enum {
 } FlagStatus;
 
 
+/* Defined below */
+typedef struct DataSource DataSource;
+
+
 /**
  * CarAtom:
  * @data: data associated with atom,
@@ -76,6 +80,18 @@ typedef struct {
 	char text[16];
 } CarAtom;
 
+/**
+ * PacketReader:
+ * @buf: bytes of the packet seen so far,
+ * @len: number of bytes in @buf.
+ *
+ * Partial packet carried over between blocks of data by next_packet().
+ **/
+typedef struct {
+	unsigned char buf[129];
+	size_t        len;
+} PacketReader;
+
 /**
  * CurrentState:
  * @host: hostname to contact,
@@ -85,8 +101,11 @@ typedef struct {
  * @cookie: user's authorisation cookie,
  * @key: decryption key,
  * @salt: current decryption salt,
+ * @reader: partial packet carried between blocks of the data stream,
+ * @wanted: cars wanted for each type of car packet, or NULL for all,
  * @decryption_failure: indicates if payload decryption has failed (0=no,1=yes),
  * @frame: last seen key frame,
+ * @in_key_frame: TRUE while a key frame is being parsed,
  * @event_no: event number,
  * @event_type: event type,
  * @remaining_time: time remaining for the event,
@@ -107,7 +126,8 @@ typedef struct {
  * @fl_lap: fastest lap (lap number),
  * @num_cars: number of cars in the event,
  * @car_position: current position of car,
- * @car_info: arrays of information about each car.
+ * @car_info: arrays of information about each car,
+ * @source: where to obtain keys and key frames if not the web site.
  *
  * Holds the current application state so we don't need to pass around
  * a lot of variables or keep them globally.
@@ -116,8 +136,11 @@ typedef struct {
 	char          *host, *auth_host;
 	char          *email, *password, *cookie;
 	unsigned int   key, salt;
+	PacketReader   reader;
+	const unsigned int *wanted;
 	int            decryption_failure;
 	unsigned int   frame;
+	int            in_key_frame;
 
 	unsigned int   event_no;
 	EventType      event_type;
@@ -133,8 +156,31 @@ typedef struct {
 	int            num_cars;
 	int           *car_position;
 	CarAtom      **car_info;
+
+	const DataSource *source;
 } CurrentState;
 
+/**
+ * DataSource:
+ * @decryption_key: obtain the decryption key for an event,
+ * @key_frame: obtain the numbered key frame and parse it,
+ * @total_laps: obtain the total number of laps for the race,
+ * @time: the current time as far as the session is concerned.
+ *
+ * Provides what the data stream refers to when it's not coming live
+ * from the timing server, such as when replaying a recording; any of
+ * these may be NULL to use fallback_source, the web site in live-f1,
+ * or real time as usual.
+ **/
+struct DataSource {
+	unsigned int (*decryption_key) (CurrentState *state,
+					unsigned int event_no);
+	int          (*key_frame)      (CurrentState *state,
+					unsigned int frame);
+	unsigned int (*total_laps)     (CurrentState *state);
+	time_t       (*time)           (CurrentState *state);
+};
+
 
 SJR_BEGIN_EXTERN
 
@@ -41,15 +41,39 @@
 #include <ne_utils.h>
 
 #include "live-f1.h"
+#include "archive.h"
 #include "cfgfile.h"
+#include "client.h"
+#include "dashboard.h"
+#include "decoded.h"
 #include "display.h"
+#include "events.h"
 #include "http.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "multicast.h"
+#include "plugin.h"
+#include "record.h"
+#include "relay.h"
+#include "replay.h"
+#include "rest.h"
+#include "ring.h"
+#include "serve.h"
+#include "shm.h"
+#include "sink.h"
+#include "stats.h"
+#include "store.h"
 #include "stream.h"
+#include "timeshift.h"
+#include "watch.h"
 
 
 /* Forward prototypes */
 static void print_version (void);
 static void print_usage (void);
+static int  run_replay (CurrentState *state);
+static void close_outputs (void);
+static int  parse_list (const char *list, int max, unsigned int *mask);
 
 
 /* Program name */
@@ -58,9 +82,90 @@ const char *program_name = NULL;
 /* How verbose to be */
 static int verbosity = 0;
 
+/* Whether to run without the display */
+static int headless = FALSE;
+
+/* Unix sockets to serve the board on, or attach to */
+static const char *serve_path = NULL;
+static const char *attach_path = NULL;
+
+/* Where to write each change to the state, and publish the board */
+static const char *events_path = NULL;
+static const char *shm_name = NULL;
+static const char *ring_name = NULL;
+
+/* File to write each change to as a fixed-size record */
+static const char *decoded_path = NULL;
+
+/* Multicast group and port to send each change to */
+static const char *multicast_where = NULL;
+
+/* SQLite database to write laps, sectors and pit stops into */
+static const char *store_path = NULL;
+
+/* Directory to load plugins from */
+static const char *plugin_dir = NULL;
+
+/* Where to listen for HTTP requests for the metrics, and whether to
+ * serve the dashboard and the board as JSON there too */
+static const char *http_where = NULL;
+static int         dashboard = FALSE;
+static int         rest = FALSE;
+
+/* File to record to, and how often to sync it */
+static const char *record_path = NULL;
+static int         record_sync = 5;
+
+/* Where to pass the raw data stream on to other copies of live-f1 */
+static const char *relay_where = NULL;
+
+/* Recording to play back, how fast, and where to find what it lacks */
+static const char  *replay_path = NULL;
+static double       replay_speed = 1.0;
+static unsigned int replay_key = 0;
+static const char  *key_frame_dir = NULL;
+static const char  *seek_where = NULL;
+
+/* Archive to pack a recording into, or file to unpack one to */
+static const char  *pack_path = NULL;
+static const char  *unpack_path = NULL;
+
+/* Megabytes to keep for pausing and rewinding, and how often to
+ * checkpoint the board */
+static int          time_shift_mb = 0;
+static int          checkpoint_secs = 30;
+
 /* Command-line options */
-static const char opts[] = "v";
+static const char opts[] = "l:r:t:v";
 static const struct option longopts[] = {
+	{ "attach",	required_argument, NULL, 0400 + 'a' },
+	{ "cars",	required_argument, NULL, 0400 + 'C' },
+	{ "checkpoint",	required_argument, NULL, 0400 + 'c' },
+	{ "dashboard",	no_argument, NULL, 0400 + 'D' },
+	{ "decoded",	required_argument, NULL, 0400 + 'd' },
+	{ "events",	required_argument, NULL, 0400 + 'e' },
+	{ "headless",	no_argument, NULL, 0400 + 'H' },
+	{ "http",	required_argument, NULL, 0400 + 'w' },
+	{ "key",	required_argument, NULL, 0400 + 'k' },
+	{ "key-frames",	required_argument, NULL, 0400 + 'f' },
+	{ "latency",	required_argument, NULL, 'l' },
+	{ "multicast",	required_argument, NULL, 0400 + 'M' },
+	{ "pack",	required_argument, NULL, 0400 + 'P' },
+	{ "packet-types", required_argument, NULL, 0400 + 'T' },
+	{ "plugins",	required_argument, NULL, 0400 + 'L' },
+	{ "record",	required_argument, NULL, 'r' },
+	{ "record-sync", required_argument, NULL, 0400 + 'r' },
+	{ "relay",	required_argument, NULL, 0400 + 'l' },
+	{ "replay",	required_argument, NULL, 0400 + 'p' },
+	{ "rest",	no_argument, NULL, 0400 + 'J' },
+	{ "ring",	required_argument, NULL, 0400 + 'R' },
+	{ "seek",	required_argument, NULL, 0400 + 'S' },
+	{ "serve",	required_argument, NULL, 0400 + 's' },
+	{ "shm",	required_argument, NULL, 0400 + 'm' },
+	{ "speed",	required_argument, NULL, 0400 + 'x' },
+	{ "store",	required_argument, NULL, 0400 + 'b' },
+	{ "time-shift",	required_argument, NULL, 't' },
+	{ "unpack",	required_argument, NULL, 0400 + 'U' },
 	{ "verbose",	no_argument, NULL, 'v' },
 	{ "help",	no_argument, NULL, 0400 + 'h' },
 	{ "version",	no_argument, NULL, 0400 + 'v' },
@@ -85,9 +190,103 @@ main (int   argc,
 
 	while ((opt = getopt_long (argc, argv, opts, longopts, NULL)) != -1) {
 		switch (opt) {
+		case 'l':
+			set_display_latency (atoi (optarg));
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 0400 + 'r':
+			record_sync = atoi (optarg);
+			break;
+		case 0400 + 'l':
+			relay_where = optarg;
+			break;
+		case 't':
+			time_shift_mb = atoi (optarg);
+			break;
+		case 0400 + 'c':
+			checkpoint_secs = atoi (optarg);
+			break;
+		case 0400 + 'e':
+			events_path = optarg;
+			break;
+		case 0400 + 'R':
+			ring_name = optarg;
+			break;
+		case 0400 + 'C':
+			if (parse_list (optarg, 31, &output_filter.cars)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid list of cars"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'T':
+			if (parse_list (optarg, PACKET_TYPES - 1,
+					&output_filter.types)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid list of packet types"),
+					 optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'b':
+			store_path = optarg;
+			break;
+		case 0400 + 'd':
+			decoded_path = optarg;
+			break;
+		case 0400 + 'M':
+			multicast_where = optarg;
+			break;
+		case 0400 + 'L':
+			plugin_dir = optarg;
+			break;
+		case 0400 + 'm':
+			shm_name = optarg;
+			break;
+		case 0400 + 'H':
+			headless = TRUE;
+			break;
+		case 0400 + 'w':
+			http_where = optarg;
+			break;
+		case 0400 + 'D':
+			dashboard = TRUE;
+			break;
+		case 0400 + 'J':
+			rest = TRUE;
+			break;
 		case 'v':
 			verbosity++;
 			break;
+		case 0400 + 'a':
+			attach_path = optarg;
+			break;
+		case 0400 + 's':
+			serve_path = optarg;
+			break;
+		case 0400 + 'p':
+			replay_path = optarg;
+			break;
+		case 0400 + 'x':
+			replay_speed = atof (optarg);
+			break;
+		case 0400 + 'k':
+			replay_key = strtoul (optarg, NULL, 16);
+			break;
+		case 0400 + 'f':
+			key_frame_dir = optarg;
+			break;
+		case 0400 + 'S':
+			seek_where = optarg;
+			break;
+		case 0400 + 'P':
+			pack_path = optarg;
+			break;
+		case 0400 + 'U':
+			unpack_path = optarg;
+			break;
 		case 0400 + 'h':
 			print_usage ();
 			return 0;
@@ -112,12 +311,46 @@ main (int   argc,
 	print_version ();
 	printf ("\n");
 
+	/* Converting a recording rather than displaying anything */
+	if (replay_path && pack_path)
+		return pack_archive (replay_path, pack_path, replay_key) ? 1 : 0;
+	if (replay_path && unpack_path)
+		return unpack_archive (replay_path, unpack_path) ? 1 : 0;
+
+	/* Headless, changes only go to the sinks added for them */
+	if (headless && attach_path) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("--attach needs the display"));
+		return 1;
+	}
+	if (replay_path && relay_where) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("--relay needs the live data stream"));
+		return 1;
+	}
+	if (dashboard && (! http_where)) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("--dashboard needs --http"));
+		return 1;
+	}
+	if (rest && (! http_where)) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("--rest needs --http"));
+		return 1;
+	}
+	if (! headless)
+		add_sink (&display_sink);
+
 	if (ne_sock_init ()) {
 		fprintf (stderr, "%s: %s\n", program_name,
 			 _("unable to initialise http library"));
 		return 1;
 	}
 
+	/* Whatever a replay or the time-shift view doesn't provide comes
+	 * from the web site */
+	fallback_source = &web_source;
+
 
 	state = malloc (sizeof (CurrentState));
 	memset (state, 0, sizeof (CurrentState));
@@ -129,15 +362,50 @@ main (int   argc,
 	state->car_position = NULL;
 	state->car_info = NULL;
 
+	/* Another copy is doing all the work */
+	if (attach_path)
+		return attach_server (state, attach_path);
+
+	if (events_path && open_events (events_path, state))
+		goto error;
+	if (decoded_path && open_decoded (decoded_path, state))
+		goto error;
+	if (multicast_where && open_multicast (multicast_where, state))
+		goto error;
+	if (store_path && open_store (store_path, state))
+		goto error;
+	if (plugin_dir && load_plugins (plugin_dir, state))
+		goto error;
+	if (shm_name && open_snapshot (shm_name, state))
+		goto error;
+	if (ring_name && open_ring (ring_name, state))
+		goto error;
+	if (http_where && open_httpd (http_where))
+		goto error;
+	open_metrics (state);
+	if (dashboard)
+		open_dashboard (state);
+	if (rest)
+		open_rest (state);
+
+	/* Car packets none of the sinks want can be passed over, unless
+	 * the whole board is served, kept or made into key frames */
+	if (! (serve_path || (time_shift_mb > 0)
+	       || (relay_where && http_where)))
+		state->wanted = sink_wanted ();
+
+	if (replay_path)
+		return run_replay (state);
+
 	config_file = malloc (strlen (home_dir) + 7);
 	sprintf (config_file, "%s/.f1rc", home_dir);
 
 	if (read_config (state, config_file))
-		return 1;
+		goto error;
 
 	if ((! state->email) || (! state->password)) {
 		if (get_config (state) || write_config (state, config_file))
-			return 1;
+			goto error;
 	}
 
 	if (! state->host)
@@ -147,6 +415,17 @@ main (int   argc,
 
 	free (config_file);
 
+	if (serve_path && open_server (serve_path))
+		goto error;
+	if (record_path && open_capture (record_path, record_sync))
+		goto error;
+	if ((time_shift_mb > 0)
+	    && open_time_shift ((size_t) time_shift_mb * 1024 * 1024,
+				checkpoint_secs))
+		goto error;
+	if (relay_where && open_relay (relay_where, state))
+		goto error;
+
 	do
 	{
 		state->cookie = obtain_auth_cookie (state->auth_host, state->email, state->password);
@@ -158,61 +437,38 @@ main (int   argc,
 
 		sock = open_stream (state->host, 4321);
 		if (sock < 0) {
-			close_display ();
+			close_outputs ();
 			fprintf (stderr, "%s: %s: %s\n", program_name,
 				 _("unable to open data stream"),
 				 strerror (errno));
 			return 2;
 		}
 
-		state->key = 0;
-		state->frame = 0;
-		state->event_no = 0;
-		state->event_type = RACE_EVENT;
-		state->epoch_time = 0;
-		state->remaining_time = 0;
-		state->laps_completed = 0;
-		state->total_laps = 0;
-		state->flag = GREEN_FLAG;
-
-		state->track_temp = 0;
-		state->air_temp = 0;
-		state->wind_speed = 0;
-		state->humidity = 0;
-		state->pressure = 0;
-		state->wind_direction = 0;
-
-		if (state->fl_car) free (state->fl_car);
-		state->fl_car = calloc(3, sizeof(char));
-		if (state->fl_driver) free (state->fl_driver);
-		state->fl_driver = calloc(15, sizeof(char));
-		if (state->fl_time) free (state->fl_time);
-		state->fl_time = calloc(9, sizeof(char));
-		if (state->fl_lap) free (state->fl_lap);
-		state->fl_lap = calloc(3, sizeof(char));
-		
-		state->num_cars = 0;
-		if (state->car_position) {
-			free (state->car_position);
-			state->car_position = NULL;
-		}
-		if (state->car_info) {
-			free (state->car_info);
-			state->car_info = NULL;
-		}
-
-		reset_decryption (state);
+		reset_state (state);
+		reset_time_shift ();
+		reset_relay ();
 
 		while ((ret = read_stream (state, sock)) > 0) {
+			serve_board (state);
+			flush_capture (FALSE);
+			flush_events ();
+			flush_decoded ();
+			flush_multicast ();
+			flush_store ();
+			flush_plugins ();
+			flush_dashboard ();
+			publish_snapshot ();
+			run_time_shift ();
+
 			if (handle_keys (state) < 0) {
-				close_display ();
+				close_outputs ();
 				close (sock);
 				return 0;
 			}
 		}
 
 		if (ret < 0) {
-			close_display ();
+			close_outputs ();
 			fprintf (stderr, "%s: %s: %s\n", program_name,
 				 _("error reading from data stream"),
 				 strerror (errno));
@@ -220,8 +476,113 @@ main (int   argc,
 		}
 
 		close (sock);
+		stats.reconnects++;
 		info (1, _("Reconnecting ...\n"));
 	}
+
+error:
+	close_outputs ();
+	return 1;
+}
+
+
+/**
+ * run_replay:
+ * @state: application state structure.
+ *
+ * Plays back the recording given on the command line instead of
+ * connecting to the live data stream.
+ *
+ * Returns: exit status for the program.
+ **/
+static int
+run_replay (CurrentState *state)
+{
+	struct pollfd none;
+	int           ret;
+
+	if (serve_path && open_server (serve_path))
+		goto error;
+
+	reset_state (state);
+	if (open_replay (state, replay_path, key_frame_dir,
+			 replay_key, replay_speed))
+		goto error;
+	if (seek_where && seek_replay (state, seek_where)) {
+		close_replay (state);
+		close_outputs ();
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to seek to"), seek_where);
+		return 1;
+	}
+
+	while ((ret = read_replay (state)) > 0) {
+		serve_board (state);
+		flush_events ();
+		flush_decoded ();
+		flush_multicast ();
+		flush_store ();
+		flush_plugins ();
+		flush_dashboard ();
+		publish_snapshot ();
+
+		if (handle_keys (state) < 0) {
+			close_replay (state);
+			close_outputs ();
+			return 0;
+		}
+	}
+
+	close_replay (state);
+	serve_board (state);
+	close_events ();
+	close_decoded ();
+	close_multicast ();
+	close_store ();
+	close_plugins ();
+	close_snapshot ();
+	close_ring ();
+	info (0, _("End of replay\n"));
+
+	/* Leave the board up until the user is done with it */
+	none.fd = -1;
+	none.events = 0;
+	while (cursed && (handle_keys (state) >= 0))
+		poll_watches (&none, 100);
+
+	close_outputs ();
+	return 0;
+
+error:
+	close_outputs ();
+	return 1;
+}
+
+/**
+ * close_outputs:
+ *
+ * Closes everything main() may have opened for the board to go to,
+ * whichever of them were opened; each is safe to close when it never
+ * was.
+ **/
+static void
+close_outputs (void)
+{
+	close_time_shift ();
+	close_capture ();
+	close_events ();
+	close_decoded ();
+	close_multicast ();
+	close_store ();
+	close_plugins ();
+	close_snapshot ();
+	close_ring ();
+	close_server ();
+	close_relay ();
+	close_dashboard ();
+	close_rest ();
+	close_httpd ();
+	close_display ();
 }
 
 
@@ -260,6 +621,53 @@ info (int         irrelevance,
 	}
 }
 
+/**
+ * parse_list:
+ * @list: comma-separated numbers and ranges, such as 1,3,5-8,
+ * @max: largest number allowed,
+ * @mask: mask to fill.
+ *
+ * Sets bit 1 << n of @mask for each number n in @list, clearing the
+ * rest.
+ *
+ * Returns: 0 on success, non-zero if @list isn't valid.
+ **/
+static int
+parse_list (const char   *list,
+	    int           max,
+	    unsigned int *mask)
+{
+	const char   *ptr = list;
+	unsigned int  bits = 0;
+
+	do {
+		char *end;
+		long  first, last;
+
+		first = strtol (ptr, &end, 10);
+		if ((end == ptr) || (first < 0) || (first > max))
+			return 1;
+
+		last = first;
+		if (*end == '-') {
+			ptr = end + 1;
+			last = strtol (ptr, &end, 10);
+			if ((end == ptr) || (last < first) || (last > max))
+				return 1;
+		}
+
+		for (; first <= last; first++)
+			bits |= 1U << first;
+
+		if (*end && (*end != ','))
+			return 1;
+		ptr = end + 1;
+	} while (*(ptr - 1));
+
+	*mask = bits;
+	return 0;
+}
+
 
 /**
  * print_version:
@@ -291,6 +699,66 @@ print_usage (void)
 		  "sessions.\n"));
 	printf ("\n");
 	printf (_("Options:\n"
+		  "      --attach=SOCKET        display the board served by another copy\n"
+		  "                             of live-f1 on SOCKET.\n"
+		  "      --cars=LIST            only write changes to the cars in LIST,\n"
+		  "                             such as 1,3,5-8, with --events, --ring,\n"
+		  "                             --decoded and --multicast.\n"
+		  "      --checkpoint=SECS      with --time-shift, copy the board every SECS\n"
+		  "                             seconds (default 30).\n"
+		  "      --dashboard            with --http, also serve the board to web\n"
+		  "                             browsers, updated as it changes.\n"
+		  "      --decoded=FILE         write each change to the board as a\n"
+		  "                             fixed-size record to FILE.\n"
+		  "      --events=PATH          write each change to the board as a line\n"
+		  "                             of JSON to a file, pipe or socket.\n"
+		  "      --headless             run without the display, such as on a\n"
+		  "                             server with no terminal.\n"
+		  "      --http=[ADDR:]PORT     serve metrics at /metrics over HTTP on\n"
+		  "                             PORT of localhost, or of ADDR.\n"
+		  "      --key=HEX              decryption key to use when replaying a\n"
+		  "                             recording that doesn't contain it.\n"
+		  "      --key-frames=DIR       read key frames missing from a recording\n"
+		  "                             being replayed from DIR.\n"
+		  "  -l, --latency=MS           on a slow terminal, keep the board no more\n"
+		  "                             than MS milliseconds behind.\n"
+		  "      --multicast=GROUP:PORT send each change to the board to the\n"
+		  "                             multicast GROUP on PORT of the network.\n"
+		  "      --pack=ARCHIVE         pack the recording given with --replay\n"
+		  "                             into ARCHIVE and exit.\n"
+		  "      --packet-types=LIST    only write changes to the types of car\n"
+		  "                             packet in LIST, such as 4-6, with\n"
+		  "                             --events, --ring, --decoded and\n"
+		  "                             --multicast.\n"
+		  "      --plugins=DIR          load the plugins in DIR and pass them the\n"
+		  "                             packets they ask for.\n"
+		  "  -r, --record=FILE          record the data stream and key frames to\n"
+		  "                             FILE, appending if it exists.\n"
+		  "      --record-sync=SECS     sync the recording to disk every SECS\n"
+		  "                             seconds, or never if 0 (default 5).\n"
+		  "      --relay=[ADDR:]PORT    pass the data stream on to other copies of\n"
+		  "                             live-f1 connecting to PORT, and with\n"
+		  "                             --http, the key and key frames too.\n"
+		  "      --replay=FILE          play back a recording or raw stream dump\n"
+		  "                             instead of the live data stream.\n"
+		  "      --rest                 with --http, also serve the board as JSON\n"
+		  "                             at /state, /cars/N and /weather.\n"
+		  "      --ring=NAME            write each change to the board into a ring\n"
+		  "                             in the shared memory segment NAME.\n"
+		  "      --seek=WHERE           start a replay at lap:N, frame:N or a time\n"
+		  "                             into the recording as [H:]MM:SS.\n"
+		  "      --serve=SOCKET         serve the board to other copies of live-f1\n"
+		  "                             attaching to SOCKET.\n"
+		  "      --shm=NAME             publish the board in the shared memory\n"
+		  "                             segment NAME, such as /live-f1.\n"
+		  "      --speed=N              replay at N times real time, or as fast as\n"
+		  "                             possible if 0 (default 1).\n"
+		  "      --store=FILE           write laps, sectors, pit stops, positions\n"
+		  "                             and weather into the SQLite database FILE.\n"
+		  "  -t, --time-shift=MB        keep up to MB megabytes of the session so\n"
+		  "                             the board can be paused and rewound.\n"
+		  "      --unpack=FILE          unpack the archive given with --replay\n"
+		  "                             back into FILE and exit.\n"
 		  "  -v, --verbose              increase verbosity for each time repeated.\n"
 		  "      --help                 display this help and exit.\n"
 		  "      --version              output version information and exit.\n"));
@@ -0,0 +1,187 @@
+/* live-f1
+ *
+ * mapfile.c - mapping saved streams and key frames into memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif /* HAVE_MMAP */
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "mapfile.h"
+
+
+/* Forward prototypes */
+static int read_whole (MappedFile *map, int fd, size_t len);
+
+
+/**
+ * map_file:
+ * @map: structure to fill,
+ * @filename: file to open.
+ *
+ * Makes the contents of @filename available at @map->data without
+ * reading it in chunks; where possible it's mapped, and the kernel told
+ * we'll be going through it from start to end so it can read ahead
+ * aggressively and back the mapping with huge pages.  The mapping is
+ * shared, so any number of threads may parse it at once, and other
+ * processes mapping the same file share the same page cache.
+ *
+ * If the file can't be mapped, such as when it's a pipe, it's read into
+ * memory instead.
+ *
+ * Returns: 0 on success, non-zero on failure with errno set.
+ **/
+int
+map_file (MappedFile *map,
+	  const char *filename)
+{
+	struct stat statbuf;
+	int         fd;
+
+	map->data = NULL;
+	map->len = 0;
+	map->mapped = FALSE;
+
+	fd = open (filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat (fd, &statbuf) < 0)
+		goto error;
+
+#if HAVE_MMAP
+	if (S_ISREG (statbuf.st_mode) && (statbuf.st_size > 0)) {
+		void *addr;
+
+		addr = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
+			     fd, 0);
+		if (addr != MAP_FAILED) {
+# if HAVE_MADVISE
+			madvise (addr, statbuf.st_size, MADV_SEQUENTIAL);
+#  ifdef MADV_HUGEPAGE
+			madvise (addr, statbuf.st_size, MADV_HUGEPAGE);
+#  endif /* MADV_HUGEPAGE */
+# endif /* HAVE_MADVISE */
+
+			map->data = addr;
+			map->len = statbuf.st_size;
+			map->mapped = TRUE;
+
+			close (fd);
+			return 0;
+		}
+	}
+#endif /* HAVE_MMAP */
+
+	if (read_whole (map, fd, S_ISREG (statbuf.st_mode)
+			? statbuf.st_size : 0))
+		goto error;
+
+	close (fd);
+	return 0;
+
+error:
+	close (fd);
+	return 1;
+}
+
+/**
+ * unmap_file:
+ * @map: file opened with map_file().
+ *
+ * Releases the contents of the file.
+ **/
+void
+unmap_file (MappedFile *map)
+{
+#if HAVE_MMAP
+	if (map->mapped) {
+		munmap ((void *) map->data, map->len);
+	} else
+#endif /* HAVE_MMAP */
+	{
+		free ((void *) map->data);
+	}
+
+	map->data = NULL;
+	map->len = 0;
+	map->mapped = FALSE;
+}
+
+/**
+ * read_whole:
+ * @map: structure to fill,
+ * @fd: file descriptor to read from,
+ * @len: expected length, or zero if not known.
+ *
+ * Reads everything from @fd into newly allocated memory.
+ *
+ * Returns: 0 on success, non-zero on failure with errno set.
+ **/
+static int
+read_whole (MappedFile *map,
+	    int         fd,
+	    size_t      len)
+{
+	unsigned char *buf;
+	size_t         alloc, used = 0;
+	ssize_t        numr;
+
+	alloc = MAX (len + 1, 65536);
+	buf = malloc (alloc);
+	if (! buf)
+		abort ();
+
+	for (;;) {
+		if (used == alloc) {
+			alloc *= 2;
+			buf = realloc (buf, alloc);
+			if (! buf)
+				abort ();
+		}
+
+		numr = read (fd, buf + used, alloc - used);
+		if ((numr < 0) && (errno == EINTR))
+			continue;
+		if (numr < 0) {
+			free (buf);
+			return 1;
+		} else if (! numr) {
+			break;
+		}
+
+		used += numr;
+	}
+
+	map->data = buf;
+	map->len = used;
+	return 0;
+}
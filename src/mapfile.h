@@ -0,0 +1,51 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_MAPFILE_H
+#define LIVE_F1_MAPFILE_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/**
+ * MappedFile:
+ * @data: contents of the file,
+ * @len: length of @data,
+ * @mapped: TRUE if @data is mapped, FALSE if it was read into memory.
+ *
+ * A file opened with map_file(); @data is read-only, and may be shared
+ * by as many readers as like.
+ **/
+typedef struct {
+	const unsigned char *data;
+	size_t               len;
+	int                  mapped;
+} MappedFile;
+
+
+SJR_BEGIN_EXTERN
+
+int  map_file   (MappedFile *map, const char *filename);
+void unmap_file (MappedFile *map);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_MAPFILE_H */
@@ -0,0 +1,273 @@
+/* live-f1
+ *
+ * metrics.c - counters in Prometheus text format
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "httpd.h"
+#include "json.h"
+#include "stats.h"
+#include "metrics.h"
+
+
+/* Content-Type of the Prometheus text format */
+#define METRICS_TYPE "text/plain; version=0.0.4"
+
+
+/* Space for a time in seconds, as put by format_seconds() */
+#define SECONDS_LEN 32
+
+
+/* Forward prototypes */
+static void serve_metrics (HttpClient *client, const char *path,
+			   const char *query);
+static void put_counter   (JsonBuf *out, const char *name,
+			   const char *help, unsigned long long value);
+static void put_seconds   (JsonBuf *out, const char *name,
+			   const char *help, unsigned long long ns);
+static void put_histogram (JsonBuf *out, const char *name,
+			   const char *help, const StatsHistogram *hist);
+static void format_seconds (char *text, unsigned long long ns, int trim);
+
+
+/* Application state, for the gauges */
+static CurrentState *metrics_state = NULL;
+
+
+/**
+ * open_metrics:
+ * @state: application state structure.
+ *
+ * Serves the internal counters kept in stats, and a few gauges from
+ * @state, at /metrics on the HTTP server opened with open_httpd().
+ * Nothing is formatted until the endpoint is scraped.
+ **/
+void
+open_metrics (CurrentState *state)
+{
+	metrics_state = state;
+	add_http_handler ("/metrics", serve_metrics);
+}
+
+
+/**
+ * serve_metrics:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Formats the counters and responds with them.
+ **/
+static void
+serve_metrics (HttpClient *client,
+	       const char *path,
+	       const char *query)
+{
+	CurrentState *state = metrics_state;
+	JsonBuf       out = { NULL, 0, 0 };
+	int           i;
+
+	put_counter (&out, "live_f1_read_bytes_total",
+		     "Bytes read from the data stream.", stats.bytes);
+	put_counter (&out, "live_f1_reads_total",
+		     "Reads from the data stream.", stats.reads);
+
+	put_json (&out, "# HELP live_f1_packets_total "
+		  "Packets received, by class and type.\n"
+		  "# TYPE live_f1_packets_total counter\n");
+	for (i = 0; i < 16; i++)
+		put_json (&out, "live_f1_packets_total"
+			  "{class=\"car\",type=\"%d\"} %lu\n",
+			  i, stats.car_packets[i]);
+	for (i = 0; i < 16; i++)
+		put_json (&out, "live_f1_packets_total"
+			  "{class=\"sys\",type=\"%d\"} %lu\n",
+			  i, stats.sys_packets[i]);
+
+	put_counter (&out, "live_f1_reconnects_total",
+		     "Times the data stream has been reconnected.",
+		     stats.reconnects);
+	put_counter (&out, "live_f1_http_errors_total",
+		     "Failed requests to the web servers.",
+		     stats.http_errors);
+	put_counter (&out, "live_f1_decryption_failures_total",
+		     "Times decryption of the data stream has been lost.",
+		     stats.decryption_failures);
+	put_counter (&out, "live_f1_skipped_packets_total",
+		     "Car packets passed over as nothing wanted them.",
+		     stats.skipped);
+	put_counter (&out, "live_f1_pings_total",
+		     "Times the server has been pinged.", stats.pings);
+	put_counter (&out, "live_f1_key_frames_total",
+		     "Key frames fetched.", stats.key_frames);
+	put_histogram (&out, "live_f1_key_frame_seconds",
+		       "Time taken to fetch a key frame.",
+		       &stats.key_frame_hist);
+
+	put_seconds (&out, "live_f1_decrypt_seconds_total",
+		     "Time spent decrypting payloads.", stats.decrypt_ns);
+	put_counter (&out, "live_f1_decrypts_total",
+		     "Payloads decrypted.", stats.decrypts);
+	put_seconds (&out, "live_f1_handler_seconds_total",
+		     "Time spent in packet handlers.", stats.handler_ns);
+	put_counter (&out, "live_f1_handled_total",
+		     "Packets handled.", stats.handled);
+
+	put_histogram (&out, "live_f1_render_seconds",
+		       "Time taken to update the screen.",
+		       &stats.render_hist);
+	put_histogram (&out, "live_f1_loop_seconds",
+		       "Time the main loop spent between polls.",
+		       &stats.loop_hist);
+	put_counter (&out, "live_f1_loop_stalls_total",
+		     "Turns of the main loop that took too long.",
+		     stats.loop_stalls);
+
+	put_json (&out, "# HELP live_f1_decrypting "
+		  "Whether the data stream is being decrypted.\n"
+		  "# TYPE live_f1_decrypting gauge\n"
+		  "live_f1_decrypting %d\n",
+		  (state->key && (! state->decryption_failure)) ? 1 : 0);
+	put_json (&out, "# HELP live_f1_cars "
+		  "Cars on the board.\n"
+		  "# TYPE live_f1_cars gauge\n"
+		  "live_f1_cars %d\n", state->num_cars);
+
+	http_respond (client, 200, METRICS_TYPE, out.buf, out.len);
+	free (out.buf);
+}
+
+/**
+ * put_counter:
+ * @out: buffer to append to,
+ * @name: name of the metric,
+ * @help: description of the metric,
+ * @value: value of the counter.
+ *
+ * Appends a counter with its HELP and TYPE lines to @out.
+ **/
+static void
+put_counter (JsonBuf            *out,
+	     const char         *name,
+	     const char         *help,
+	     unsigned long long  value)
+{
+	put_json (out, "# HELP %s %s\n"
+		  "# TYPE %s counter\n"
+		  "%s %llu\n", name, help, name, name, value);
+}
+
+/**
+ * put_seconds:
+ * @out: buffer to append to,
+ * @name: name of the metric,
+ * @help: description of the metric,
+ * @ns: total time in nanoseconds.
+ *
+ * Appends a counter of total time, in seconds, to @out.
+ **/
+static void
+put_seconds (JsonBuf            *out,
+	     const char         *name,
+	     const char         *help,
+	     unsigned long long  ns)
+{
+	char seconds[SECONDS_LEN];
+
+	format_seconds (seconds, ns, FALSE);
+	put_json (out, "# HELP %s %s\n"
+		  "# TYPE %s counter\n"
+		  "%s %s\n", name, help, name, name, seconds);
+}
+
+/**
+ * put_histogram:
+ * @out: buffer to append to,
+ * @name: name of the metric,
+ * @help: description of the metric,
+ * @hist: histogram to append.
+ *
+ * Appends @hist to @out in seconds, with cumulative buckets as the
+ * format requires.
+ **/
+static void
+put_histogram (JsonBuf              *out,
+	       const char           *name,
+	       const char           *help,
+	       const StatsHistogram *hist)
+{
+	char          seconds[SECONDS_LEN];
+	unsigned long total = 0;
+	int           i;
+
+	put_json (out, "# HELP %s %s\n"
+		  "# TYPE %s histogram\n", name, help, name);
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		total += hist->buckets[i];
+		format_seconds (seconds, stats_bounds[i], TRUE);
+		put_json (out, "%s_bucket{le=\"%s\"} %lu\n",
+			  name, seconds, total);
+	}
+	total += hist->buckets[STATS_BUCKETS];
+
+	format_seconds (seconds, hist->sum_ns, FALSE);
+	put_json (out, "%s_bucket{le=\"+Inf\"} %lu\n"
+		  "%s_sum %s\n"
+		  "%s_count %lu\n",
+		  name, total, name, seconds, name, hist->count);
+}
+
+/**
+ * format_seconds:
+ * @text: buffer of SECONDS_LEN bytes,
+ * @ns: time in nanoseconds,
+ * @trim: whether to drop trailing zeros.
+ *
+ * Formats @ns as seconds into @text from its whole and fractional
+ * parts, rather than as a floating point number, so the decimal point
+ * is always a '.' whatever the locale.
+ **/
+static void
+format_seconds (char               *text,
+		unsigned long long  ns,
+		int                 trim)
+{
+	size_t len;
+
+	len = snprintf (text, SECONDS_LEN, "%llu.%09llu",
+			ns / 1000000000ULL, ns % 1000000000ULL);
+
+	if (trim) {
+		while (text[len - 1] == '0')
+			len--;
+		if (text[len - 1] == '.')
+			len--;
+		text[len] = '\0';
+	}
+}
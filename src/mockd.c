@@ -0,0 +1,1733 @@
+/* live-f1
+ *
+ * mockd.c - stand-in for the live timing server, for testing offline
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#if HAVE_GETOPT_H
+# include <getopt.h>
+#endif /* HAVE_GETOPT_H */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "archive.h"
+#include "chunk.h"
+#include "keyframe.h"
+#include "mapfile.h"
+#include "packet.h"
+#include "record.h"
+#include "stats.h"
+#include "stream.h"
+
+
+/* Ports listened on unless others are given, as the real server */
+#define MOCK_STREAM_PORT   "4321"
+#define MOCK_HTTP_PORT     "80"
+
+/* Events taken from epoll_wait() at once */
+#define MOCK_EVENTS        256
+
+/* Longest HTTP request accepted, including headers */
+#define MOCK_REQUEST_MAX   4096
+
+/* Bursts kept so connections pinging for the same ones share them */
+#define MOCK_HISTORY       CHUNK_QUEUE_MAX
+
+/* Size of the reads a raw dump is split into, one for each burst */
+#define RAW_READ_SIZE      512
+
+/* Seconds between reports of the number of connections */
+#define MOCK_REPORT_SECS   10
+
+/* Synthetic session: event number, cars, laps, base lap time, time
+ * between key frame markers and the length of the session */
+#define SYNTH_EVENT_NO     1
+#define SYNTH_KEY          0x2c4d8f1b
+#define SYNTH_CARS         20
+#define SYNTH_LAPS         58
+#define SYNTH_LAP_MS       90000
+#define SYNTH_FRAME_MS     60000
+#define SYNTH_SESSION_SECS 7200
+
+
+/**
+ * MockKind:
+ *
+ * What an epoll registration is for.
+ **/
+typedef enum {
+	MOCK_LISTEN_STREAM,
+	MOCK_LISTEN_HTTP,
+	MOCK_STREAM,
+	MOCK_HTTP,
+} MockKind;
+
+/**
+ * MockClient:
+ * @kind: what it is,
+ * @fd: socket,
+ * @events: events it's registered with epoll for,
+ * @joined: whether it's been sent the start of the stream yet,
+ * @off: offset in the feed it's been sent up to,
+ * @due_ns: when it's to be answered, or zero if it's not waiting,
+ * @next: next connection waiting to be answered,
+ * @next_stream: next data stream connection,
+ * @req: HTTP request received so far, or NULL for the data stream,
+ * @req_len: length of @req,
+ * @done: close the connection once @queue is empty,
+ * @queue: chunks waiting to be sent.
+ *
+ * A connection to the data stream or HTTP port, or one of the
+ * listening sockets themselves.
+ **/
+typedef struct mock_client MockClient;
+struct mock_client {
+	MockKind     kind;
+	int          fd;
+	unsigned int events;
+
+	int          joined;
+	size_t       off;
+
+	long long    due_ns;
+	MockClient  *next;
+	MockClient  *next_stream;
+
+	char        *req;
+	size_t       req_len;
+	int          done;
+
+	ChunkQueue   queue;
+};
+
+/**
+ * MockBurst:
+ * @off: offset in the feed the burst begins at,
+ * @chunk: the data published in it.
+ *
+ * A burst of data published to the feed.
+ **/
+typedef struct {
+	size_t  off;
+	Chunk  *chunk;
+} MockBurst;
+
+/**
+ * MockKeyFrame:
+ * @frame: key frame number,
+ * @recorded: TRUE if it came from the recording,
+ * @chunk: its contents.
+ *
+ * A key frame served over HTTP.
+ **/
+typedef struct {
+	unsigned int  frame;
+	int           recorded;
+	Chunk        *chunk;
+} MockKeyFrame;
+
+/**
+ * SynthCar:
+ * @pace_ms: base lap time,
+ * @laps: laps completed,
+ * @sector: sectors completed of the current lap,
+ * @sector_ms: time at which each sector of the lap was completed,
+ * @next_ms: time the current sector will be completed,
+ * @lap_ms: time the last lap was completed,
+ * @best_ms: best lap time,
+ * @pits: pit stops made,
+ * @position: race position.
+ *
+ * A car in the synthetic session; times are into the session.
+ **/
+typedef struct {
+	int       pace_ms;
+	int       laps, sector;
+	long long sector_ms[3], next_ms, lap_ms;
+	int       best_ms, pits, position;
+} SynthCar;
+
+
+/* Forward prototypes */
+static void          print_version  (void);
+static void          print_usage    (void);
+static int           open_recording (const char *filename);
+static void          add_key_frame  (unsigned int frame, int recorded,
+				     const unsigned char *buf, size_t len);
+static MockKeyFrame *find_key_frame (unsigned int frame);
+static void          tick           (long long now);
+static void          publish        (const unsigned char *buf, size_t len);
+static void          trim_feed      (void);
+static void          follow_packet  (void);
+static void          synth_begin    (void);
+static void          synth_advance  (long long until_ms);
+static void          synth_sector   (SynthCar *car, int index);
+static void          synth_clock    (long long ms);
+static void          synth_time     (char *text, int ms, int minutes);
+static void          watch_fd       (int fd, unsigned int events,
+				     void *ptr, int op);
+static void          accept_clients (MockClient *listener);
+static void          client_ready   (MockClient *client,
+				     unsigned int revents);
+static void          wait_client    (MockClient *client, long long due_ns);
+static void          answer_client  (MockClient *client);
+static void          send_burst     (MockClient *client);
+static void          answer_request (MockClient *client);
+static void          respond        (MockClient *client, int status,
+				     const char *type, const char *extra,
+				     Chunk *body);
+static void          send_queue     (MockClient *client);
+static void          drop_client    (MockClient *client);
+static unsigned int  mock_key       (CurrentState *state,
+				     unsigned int event_no);
+static int           mock_key_frame (CurrentState *state,
+				     unsigned int frame);
+static unsigned int  mock_laps      (CurrentState *state);
+
+
+/* Program name */
+const char *program_name = NULL;
+
+/* How verbose to be */
+static int verbosity = 0;
+
+/* Where to listen, how long to wait before answering, how often to
+ * publish new data and how fast to play the session */
+static const char *stream_where = MOCK_STREAM_PORT;
+static const char *http_where = MOCK_HTTP_PORT;
+static long long   latency_ns = 0;
+static long long   burst_ns = 100000000LL;
+static double      speed = 1.0;
+static int         loop = FALSE;
+
+/* Key to use, for the synthetic session or a recording without one */
+static unsigned int given_key = 0;
+
+/* epoll instance, and the listening sockets */
+static int        epoll_fd = -1;
+static MockClient stream_listener = { MOCK_LISTEN_STREAM, -1 };
+static MockClient http_listener = { MOCK_LISTEN_HTTP, -1 };
+
+/* Connections waiting to be answered, in the order they're due; since
+ * the latency is the same for all, that's the order they asked */
+static MockClient *waiting = NULL, *waiting_tail = NULL;
+static int         nstream = 0, nhttp = 0;
+
+/* Data stream connections, which each have an offset in the feed */
+static MockClient *streams = NULL;
+static unsigned long long answered = 0;
+
+/* Everything published that someone may still be sent, and the latest
+ * bursts; offsets are from the start of what's kept */
+static unsigned char *feed = NULL;
+static size_t         feed_len = 0, feed_size = 0;
+static MockBurst      history[MOCK_HISTORY];
+static int            history_next = 0;
+
+/* Packet being followed through the feed, and how much is to come */
+static unsigned char pkt[129];
+static size_t        pkt_len = 0, pkt_need = 2;
+
+/* Event identifier packet that began the stream, and the offset in the
+ * feed of the last key frame marker or what followed the event
+ * identifier, whichever is later */
+static unsigned char event[129];
+static size_t        event_len = 0, tail_off = 0;
+
+/* Start of the stream as sent to those joining, until it changes */
+static Chunk *start = NULL;
+
+/* Board built from the feed, from which key frames are made */
+static CurrentState board;
+static const DataSource mock_source = {
+	mock_key, mock_key_frame, mock_laps, NULL
+};
+
+/* Last key looked up, since everyone joining asks for it */
+static unsigned int key_event_no = 0, cached_key = 0;
+
+/* Key frames, and the latest marker published */
+static MockKeyFrame *key_frames = NULL;
+static int           num_key_frames = 0;
+static unsigned int  latest_frame = 0;
+
+/* Recording being served, or NULL for the synthetic session */
+static const char          *recording_name = NULL;
+static MappedFile           recording = { NULL, 0, FALSE };
+static ArchiveOutput        unpacked;
+static const unsigned char *data = NULL;
+static size_t               data_len = 0, pos = 0;
+static int                  framed = FALSE;
+static long long            first_time = 0;
+static unsigned int         total_laps = 0;
+
+/* Time the session began being played, and when the next burst is */
+static long long play_ns = 0, next_burst_ns = 0;
+
+/* Synthetic session */
+static PacketWriter  synth;
+static SynthCar      synth_cars[SYNTH_CARS];
+static unsigned int  synth_event_no = SYNTH_EVENT_NO - 1;
+static unsigned int  synth_frame = 0;
+static long long     synth_ms = 0, synth_next_frame_ms = 0;
+static int           synth_fastest_ms = 0;
+
+/* Command-line options */
+static const char opts[] = "l:p:r:v";
+static const struct option longopts[] = {
+	{ "http",	required_argument, NULL, 0400 + 'w' },
+	{ "key",	required_argument, NULL, 0400 + 'k' },
+	{ "latency",	required_argument, NULL, 'l' },
+	{ "loop",	no_argument, NULL, 0400 + 'L' },
+	{ "port",	required_argument, NULL, 'p' },
+	{ "rate",	required_argument, NULL, 'r' },
+	{ "speed",	required_argument, NULL, 0400 + 'x' },
+	{ "verbose",	no_argument, NULL, 'v' },
+	{ "help",	no_argument, NULL, 0400 + 'h' },
+	{ "version",	no_argument, NULL, 0400 + 'v' },
+	{ NULL,		no_argument, NULL, 0 }
+};
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	struct epoll_event events[MOCK_EVENTS];
+	struct rlimit      files;
+	long long          now, report_ns;
+	double             rate;
+	int                opt, numr, timeout, i;
+
+	setlocale (LC_ALL, "");
+	bindtextdomain (PACKAGE, LOCALEDIR);
+	textdomain (PACKAGE);
+
+	program_name = argv[0];
+
+	while ((opt = getopt_long (argc, argv, opts, longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'l':
+			latency_ns = atol (optarg) * 1000000LL;
+			break;
+		case 'p':
+			stream_where = optarg;
+			break;
+		case 'r':
+			rate = atof (optarg);
+			if (rate <= 0) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid burst rate"), optarg);
+				return 1;
+			}
+
+			burst_ns = 1000000000LL / rate;
+			break;
+		case 'v':
+			verbosity++;
+			break;
+		case 0400 + 'w':
+			http_where = optarg;
+			break;
+		case 0400 + 'k':
+			given_key = strtoul (optarg, NULL, 16);
+			break;
+		case 0400 + 'L':
+			loop = TRUE;
+			break;
+		case 0400 + 'x':
+			speed = atof (optarg);
+			if (speed <= 0) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid speed"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'h':
+			print_usage ();
+			return 0;
+		case 0400 + 'v':
+			print_version ();
+			return 0;
+		case '?':
+			fprintf (stderr,
+				 _("Try `%s --help' for more information.\n"),
+				 program_name);
+			return 1;
+		}
+	}
+
+	if (optind + 1 < argc) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("only one recording may be served"));
+		fprintf (stderr,
+			 _("Try `%s --help' for more information.\n"),
+			 program_name);
+		return 1;
+	}
+
+	/* Every connection is a file descriptor */
+	if (! getrlimit (RLIMIT_NOFILE, &files)) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &files);
+	}
+
+	memset (&board, 0, sizeof (board));
+	board.source = &mock_source;
+	reset_decryption (&board);
+
+	if (optind < argc) {
+		if (open_recording (argv[optind]))
+			return 1;
+	} else {
+		info (1, _("Serving a synthetic session ...\n"));
+	}
+
+	epoll_fd = epoll_create (MOCK_EVENTS);
+	if (epoll_fd < 0) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to create epoll instance"),
+			 strerror (errno));
+		return 1;
+	}
+
+	stream_listener.fd = listen_stream (stream_where, NULL);
+	http_listener.fd = listen_stream (http_where, NULL);
+	if ((stream_listener.fd < 0) || (http_listener.fd < 0))
+		return 1;
+
+	watch_fd (stream_listener.fd, EPOLLIN, &stream_listener, EPOLL_CTL_ADD);
+	watch_fd (http_listener.fd, EPOLLIN, &http_listener, EPOLL_CTL_ADD);
+
+	info (1, _("Serving the data stream on %s and HTTP on %s\n"),
+	      stream_where, http_where);
+
+	play_ns = next_burst_ns = monotonic_ns ();
+	report_ns = play_ns + MOCK_REPORT_SECS * 1000000000LL;
+	for (;;) {
+		now = monotonic_ns ();
+		if (now >= next_burst_ns) {
+			tick (now);
+			next_burst_ns += burst_ns;
+			if (next_burst_ns <= now)
+				next_burst_ns = now + burst_ns;
+		}
+
+		while (waiting && (waiting->due_ns <= now))
+			answer_client (waiting);
+
+		if (now >= report_ns) {
+			info (1, _("%d stream and %d HTTP connections, "
+				   "%llu answered\n"), nstream, nhttp,
+			      answered);
+			report_ns += MOCK_REPORT_SECS * 1000000000LL;
+		}
+
+		/* Sleep until the next burst, or the next one due */
+		timeout = (next_burst_ns - now + 999999) / 1000000;
+		if (waiting)
+			timeout = MIN (timeout, MAX ((waiting->due_ns - now
+						      + 999999) / 1000000, 0));
+
+		numr = epoll_wait (epoll_fd, events, MOCK_EVENTS, timeout);
+		if ((numr < 0) && (errno != EINTR)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("epoll_wait failed"), strerror (errno));
+			return 1;
+		}
+
+		for (i = 0; i < numr; i++) {
+			MockClient *client = events[i].data.ptr;
+
+			if ((client->kind == MOCK_LISTEN_STREAM)
+			    || (client->kind == MOCK_LISTEN_HTTP)) {
+				accept_clients (client);
+			} else {
+				client_ready (client, events[i].events);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * info:
+ * @irrelevance: minimum verbosity level to output the message,
+ * @format: format string for vprintf.
+ *
+ * Print the formatted message to standard output if verbosity is high
+ * enough.
+ **/
+int
+info (int         irrelevance,
+      const char *format, ...)
+{
+	va_list ap;
+	int     ret;
+
+	if (verbosity >= irrelevance) {
+		va_start (ap, format);
+		ret = vprintf (format, ap);
+		va_end (ap);
+
+		fflush (stdout);
+		return ret;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * print_version:
+ *
+ * Print the package name, version, copyright and licence preamble to
+ * standard output.
+ **/
+static void
+print_version (void)
+{
+	printf ("live-f1-mockd (%s)\n", PACKAGE_STRING);
+	printf ("Copyright (C) 2011, Dave Pusey <dave@puseyuk.co.uk>\n");
+	printf ("\n");
+	printf (_("This is free software, covered by the GNU General Public License; see the\n"
+		  "source for copying conditions.  There is NO warranty; not even for\n"
+		  "MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n"));
+}
+
+/**
+ * print_usage:
+ *
+ * Print the program usage instructions to standard output.
+ **/
+static void
+print_usage (void)
+{
+	printf (_("Usage: %s [OPTION]... [FILE]\n"), program_name);
+	printf (_("Stands in for the live timing server, serving the recorded session in\n"
+		  "FILE, or a synthetic race if none is given.\n"));
+	printf ("\n");
+	printf (_("Options:\n"
+		  "      --http=[ADDR:]PORT     serve the key, key frames and login over\n"
+		  "                             HTTP on PORT (default 80).\n"
+		  "      --key=HEX              decryption key for the synthetic race, or a\n"
+		  "                             recording that doesn't contain it.\n"
+		  "  -l, --latency=MS           wait MS milliseconds before answering each\n"
+		  "                             ping and request.\n"
+		  "      --loop                 start the session again when it ends.\n"
+		  "  -p, --port=[ADDR:]PORT     serve the data stream on PORT (default\n"
+		  "                             4321).\n"
+		  "  -r, --rate=N               publish new data N times a second\n"
+		  "                             (default 10).\n"
+		  "      --speed=N              play the session at N times real time\n"
+		  "                             (default 1).\n"
+		  "  -v, --verbose              increase verbosity for each time repeated.\n"
+		  "      --help                 display this help and exit.\n"
+		  "      --version              output version information and exit.\n"));
+	printf ("\n");
+	printf (_("Report bugs to <%s>\n"), PACKAGE_BUGREPORT);
+}
+
+
+/**
+ * open_recording:
+ * @filename: recording to serve.
+ *
+ * Opens @filename, a capture file, raw dump or archive, to be served
+ * in place of the synthetic session.  The key frames it contains are
+ * kept to be served as they are, the first copy of each; the key and
+ * total laps are found as they're asked for.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+open_recording (const char *filename)
+{
+	CaptureRecord record;
+	size_t        off;
+	ssize_t       used;
+	int           last = -1;
+
+	if (map_file (&recording, filename)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	data = recording.data;
+	data_len = recording.len;
+
+	memset (&unpacked, 0, sizeof (unpacked));
+	if ((data_len >= ARCHIVE_FILE_HEADER)
+	    && (! memcmp (data, ARCHIVE_MAGIC, 4))) {
+		Archive archive;
+
+		if (open_archive (&archive, data, data_len)
+		    || read_archive (&archive, &unpacked)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 filename, _("archive is corrupt"));
+			close_archive (&archive);
+			return 1;
+		}
+		close_archive (&archive);
+
+		data = unpacked.buf;
+		data_len = unpacked.len;
+	}
+
+	recording_name = filename;
+	framed = ((data_len >= CAPTURE_FILE_HEADER)
+		  && (! memcmp (data, CAPTURE_MAGIC, 4)));
+	pos = framed ? CAPTURE_FILE_HEADER : 0;
+
+	/* Copies of a key frame may be split over several records, one
+	 * after another
+	 */
+	for (off = pos; framed && (off < data_len); off += used) {
+		used = parse_capture_record (data + off, data_len - off,
+					     &record);
+		if (used <= 0)
+			break;
+
+		if (record.source != CAPTURE_KEY_FRAME) {
+			last = -1;
+			continue;
+		} else if ((last >= 0)
+			   && (key_frames[last].frame == record.arg)) {
+			Chunk *chunk = key_frames[last].chunk;
+
+			key_frames[last].chunk = new_chunk (NULL, chunk->len
+							    + record.len);
+			memcpy (key_frames[last].chunk->data, chunk->data,
+				chunk->len);
+			memcpy (key_frames[last].chunk->data + chunk->len,
+				record.data, record.len);
+			unref_chunk (chunk);
+			continue;
+		} else if (find_key_frame (record.arg)) {
+			last = -2;
+			continue;
+		}
+
+		add_key_frame (record.arg, TRUE, record.data, record.len);
+		last = num_key_frames - 1;
+	}
+
+	/* Reads are played relative to the first */
+	for (off = pos; framed && (off < data_len); off += used) {
+		used = parse_capture_record (data + off, data_len - off,
+					     &record);
+		if (used <= 0)
+			break;
+
+		if (record.source == CAPTURE_STREAM) {
+			first_time = record.time_ns;
+			break;
+		}
+	}
+
+	info (1, _("Serving %s, with %d key frames ...\n"), filename,
+	      num_key_frames);
+
+	return 0;
+}
+
+/**
+ * add_key_frame:
+ * @frame: key frame number,
+ * @recorded: TRUE if it came from the recording,
+ * @buf: key frame,
+ * @len: length of @buf.
+ *
+ * Keeps a copy of @buf to serve for @frame, replacing any made before.
+ **/
+static void
+add_key_frame (unsigned int         frame,
+	       int                  recorded,
+	       const unsigned char *buf,
+	       size_t               len)
+{
+	MockKeyFrame *kf;
+
+	kf = find_key_frame (frame);
+	if (! kf) {
+		key_frames = realloc (key_frames, (sizeof (MockKeyFrame)
+						   * (num_key_frames + 1)));
+		if (! key_frames)
+			abort ();
+
+		kf = &key_frames[num_key_frames++];
+	} else {
+		unref_chunk (kf->chunk);
+	}
+
+	kf->frame = frame;
+	kf->recorded = recorded;
+	kf->chunk = new_chunk (buf, len);
+}
+
+/**
+ * find_key_frame:
+ * @frame: key frame number.
+ *
+ * Returns: key frame kept for @frame, or NULL if there isn't one.
+ **/
+static MockKeyFrame *
+find_key_frame (unsigned int frame)
+{
+	int i;
+
+	for (i = 0; i < num_key_frames; i++)
+		if (key_frames[i].frame == frame)
+			return &key_frames[i];
+
+	return NULL;
+}
+
+
+/**
+ * tick:
+ * @now: current time.
+ *
+ * Publishes the next burst of the session: every read of a capture
+ * file that's due by now, at the playback speed; the next read of a
+ * raw dump, which has no times; or the synthetic session up to now.
+ * At the end of a recording it's started again if --loop was given.
+ **/
+static void
+tick (long long now)
+{
+	long long played = (long long) ((now - play_ns) * speed);
+	size_t    first = feed_len;
+
+	if (! recording_name) {
+		if (synth_event_no < SYNTH_EVENT_NO)
+			synth_begin ();
+
+		synth_advance (played / 1000000);
+		publish (synth.buf, synth.len);
+		synth.len = 0;
+	} else if (! framed) {
+		if (pos < data_len) {
+			size_t len = MIN (data_len - pos, RAW_READ_SIZE);
+
+			publish (data + pos, len);
+			pos += len;
+		}
+	} else {
+		CaptureRecord record;
+		ssize_t       used;
+
+		while ((used = parse_capture_record (data + pos,
+						     data_len - pos,
+						     &record)) > 0) {
+			if (record.source == CAPTURE_TOTAL_LAPS) {
+				total_laps = record.arg;
+			} else if (record.source == CAPTURE_STREAM) {
+				if (record.time_ns - first_time > played)
+					break;
+
+				publish (record.data, record.len);
+			}
+
+			pos += used;
+		}
+
+		if (used <= 0)
+			pos = data_len;
+	}
+
+	if (recording_name && (pos >= data_len) && loop) {
+		info (1, _("Starting %s again\n"), recording_name);
+		pos = framed ? CAPTURE_FILE_HEADER : 0;
+		play_ns = now;
+
+		/* So the first marker brings in its key frame again */
+		board.frame = 0;
+	}
+
+	if (feed_len == first)
+		return;
+
+	/* Keep the burst so it can be shared by everyone asking for it */
+	if (history[history_next].chunk)
+		unref_chunk (history[history_next].chunk);
+	history[history_next].off = first;
+	history[history_next].chunk = new_chunk (feed + first,
+						 feed_len - first);
+	history_next = (history_next + 1) % MOCK_HISTORY;
+
+	if (start) {
+		unref_chunk (start);
+		start = NULL;
+	}
+
+	trim_feed ();
+}
+
+/**
+ * trim_feed:
+ *
+ * Drops the start of the feed that no-one can be sent any more: what's
+ * before the last key frame marker, which those joining are sent from,
+ * and before where every joined connection has been sent up to.  The
+ * offsets into the feed are moved back to match, and bursts from
+ * before what's kept are forgotten.
+ **/
+static void
+trim_feed (void)
+{
+	MockClient *client;
+	size_t      base = tail_off;
+	int         i;
+
+	for (client = streams; client; client = client->next_stream)
+		if (client->joined && (client->off < base))
+			base = client->off;
+
+	if (! base)
+		return;
+
+	memmove (feed, feed + base, feed_len - base);
+	feed_len -= base;
+	tail_off -= base;
+
+	for (client = streams; client; client = client->next_stream)
+		if (client->joined)
+			client->off -= base;
+
+	for (i = 0; i < MOCK_HISTORY; i++) {
+		if (! history[i].chunk)
+			continue;
+
+		if (history[i].off < base) {
+			unref_chunk (history[i].chunk);
+			history[i].chunk = NULL;
+		} else {
+			history[i].off -= base;
+		}
+	}
+}
+
+/**
+ * publish:
+ * @buf: data,
+ * @len: length of @buf.
+ *
+ * Appends @buf to the feed, following the packets through it to keep
+ * the board and the start of the stream up to date.
+ **/
+static void
+publish (const unsigned char *buf,
+	 size_t               len)
+{
+	size_t n;
+
+	if (feed_len + len > feed_size) {
+		feed_size = MAX (feed_size * 2, 65536);
+		while (feed_size < feed_len + len)
+			feed_size *= 2;
+
+		feed = realloc (feed, feed_size);
+		if (! feed)
+			abort ();
+	}
+
+	memcpy (feed + feed_len, buf, len);
+
+	while (len) {
+		n = MIN (pkt_need, len);
+		memcpy (pkt + pkt_len, buf, n);
+		pkt_len += n;
+		pkt_need -= n;
+		feed_len += n;
+		buf += n;
+		len -= n;
+
+		if (! pkt_need)
+			follow_packet ();
+	}
+}
+
+/**
+ * follow_packet:
+ *
+ * Called as each header and each packet in the feed is complete.  The
+ * packet is parsed into the board, and a key frame made from it at each
+ * marker unless the recording has one; the event identifier and the
+ * offset of the marker are kept for those joining.
+ **/
+static void
+follow_packet (void)
+{
+	Packet packet;
+
+	packet_header (&packet, pkt);
+	if (pkt_len == 2) {
+		pkt_need = MAX (packet.len, 0);
+		if (pkt_need)
+			return;
+	}
+
+	parse_stream_block (&board, pkt, pkt_len);
+
+	if ((! packet.car) && (packet.type == SYS_EVENT_ID)) {
+		memcpy (event, pkt, pkt_len);
+		event_len = pkt_len;
+		tail_off = feed_len;
+	} else if ((! packet.car) && (packet.type == SYS_KEY_FRAME)) {
+		MockKeyFrame *kf;
+
+		latest_frame = board.frame;
+		tail_off = feed_len - pkt_len;
+
+		kf = find_key_frame (board.frame);
+		if (board.key && (! board.decryption_failure)
+		    && ((! kf) || (! kf->recorded))) {
+			unsigned char *buf;
+			size_t         len;
+
+			buf = encode_key_frame (&board, &len);
+			if (buf)
+				add_key_frame (board.frame, FALSE, buf, len);
+			free (buf);
+		}
+	}
+
+	pkt_len = 0;
+	pkt_need = 2;
+}
+
+
+/**
+ * synth_begin:
+ *
+ * Begins a new synthetic race: the event identifier, the grid with the
+ * number and name of each car, the flag, weather and session clock,
+ * then the first key frame marker.
+ **/
+static void
+synth_begin (void)
+{
+	char text[16];
+	int  i;
+
+	synth_event_no++;
+	synth_frame = 0;
+	synth_fastest_ms = 0;
+
+	synth.key = given_key ? given_key : SYNTH_KEY;
+	put_event_packet (&synth, RACE_EVENT, synth_event_no);
+
+	for (i = 0; i < SYNTH_CARS; i++) {
+		SynthCar *car = &synth_cars[i];
+
+		memset (car, 0, sizeof (SynthCar));
+		car->pace_ms = SYNTH_LAP_MS + i * 150 + random () % 300;
+		car->position = i + 1;
+		car->next_ms = synth_ms + car->pace_ms / 3 + i * 200;
+		car->lap_ms = synth_ms;
+
+		put_position_packet (&synth, i + 1, car->position);
+
+		sprintf (text, "%d", car->position);
+		put_short_packet (&synth, i + 1, RACE_POSITION, 1, text, TRUE);
+		sprintf (text, "%d", i + 1);
+		put_short_packet (&synth, i + 1, RACE_NUMBER, 1, text, TRUE);
+		snprintf (text, sizeof (text), "DRIVER %d", i + 1);
+		put_short_packet (&synth, i + 1, RACE_DRIVER, 1, text, TRUE);
+	}
+
+	put_short_packet (&synth, 0, SYS_TRACK_STATUS, 1, "1", TRUE);
+	put_short_packet (&synth, 0, SYS_WEATHER, WEATHER_TRACK_TEMP, "31",
+			  TRUE);
+	put_short_packet (&synth, 0, SYS_WEATHER, WEATHER_AIR_TEMP, "24",
+			  TRUE);
+	put_short_packet (&synth, 0, SYS_WEATHER, WEATHER_HUMIDITY, "45",
+			  TRUE);
+
+	/* Start the clock, then give what's left */
+	put_short_packet (&synth, 0, SYS_WEATHER, WEATHER_SESSION_CLOCK,
+			  NULL, TRUE);
+	synth_clock (synth_ms);
+
+	put_key_frame_marker (&synth, ++synth_frame);
+	synth_next_frame_ms = synth_ms + SYNTH_FRAME_MS;
+
+	info (2, _("Began synthetic race #%u\n"), synth_event_no);
+}
+
+/**
+ * synth_advance:
+ * @until_ms: time into the session to generate up to.
+ *
+ * Generates the synthetic race up to @until_ms, car by car as each
+ * completes a sector in time order; the clock is given and a key frame
+ * marker sent each minute.  Once the leader finishes, another race
+ * begins.
+ **/
+static void
+synth_advance (long long until_ms)
+{
+	while (synth_ms < until_ms) {
+		SynthCar *next = NULL;
+		int       i, index = 0;
+
+		for (i = 0; i < SYNTH_CARS; i++) {
+			if ((! next) || (synth_cars[i].next_ms < next->next_ms)) {
+				next = &synth_cars[i];
+				index = i;
+			}
+		}
+
+		if ((synth_next_frame_ms <= next->next_ms)
+		    && (synth_next_frame_ms <= until_ms)) {
+			synth_ms = synth_next_frame_ms;
+			synth_clock (synth_ms);
+			put_key_frame_marker (&synth, ++synth_frame);
+			synth_next_frame_ms += SYNTH_FRAME_MS;
+		} else if (next->next_ms <= until_ms) {
+			synth_ms = next->next_ms;
+			synth_sector (next, index);
+
+			if ((next->position == 1) && (next->laps >= SYNTH_LAPS))
+				synth_begin ();
+		} else {
+			synth_ms = until_ms;
+		}
+	}
+}
+
+/**
+ * synth_sector:
+ * @car: car completing a sector,
+ * @index: its index.
+ *
+ * Sends the sector time of @car, and when it completes a lap, its lap
+ * time, gap and interval and any change of position; then works out
+ * when it'll complete the next sector.  Every twentieth lap it stops
+ * in the pits.
+ **/
+static void
+synth_sector (SynthCar *car,
+	      int       index)
+{
+	char text[24];
+	int  sector_ms, lap_ms, i;
+
+	sector_ms = car->next_ms - (car->sector ? car->sector_ms[car->sector - 1]
+				    : car->lap_ms);
+	car->sector_ms[car->sector] = car->next_ms;
+
+	synth_time (text, sector_ms, FALSE);
+	put_short_packet (&synth, index + 1, (car->sector == 0 ? RACE_SECTOR_1
+					      : car->sector == 1 ? RACE_SECTOR_2
+					      : RACE_SECTOR_3), 1, text, TRUE);
+
+	if (++car->sector < 3) {
+		car->next_ms += car->pace_ms / 3 + random () % 600 - 300;
+		return;
+	}
+
+	lap_ms = car->next_ms - car->lap_ms;
+	car->lap_ms = car->next_ms;
+	car->sector = 0;
+	car->laps++;
+
+	synth_time (text, lap_ms, TRUE);
+	if ((! synth_fastest_ms) || (lap_ms < synth_fastest_ms)) {
+		synth_fastest_ms = car->best_ms = lap_ms;
+		put_short_packet (&synth, index + 1, RACE_LAP_TIME, 4, text,
+				  TRUE);
+
+		sprintf (text, "%d", index + 1);
+		put_long_packet (&synth, SYS_SPEED, FL_CAR, text);
+		snprintf (text, sizeof (text), "DRIVER %d", index + 1);
+		put_long_packet (&synth, SYS_SPEED, FL_DRIVER, text);
+		synth_time (text, lap_ms, TRUE);
+		put_long_packet (&synth, SYS_SPEED, FL_TIME, text);
+		sprintf (text, "%d", car->laps);
+		put_long_packet (&synth, SYS_SPEED, FL_LAP, text);
+	} else if ((! car->best_ms) || (lap_ms < car->best_ms)) {
+		car->best_ms = lap_ms;
+		put_short_packet (&synth, index + 1, RACE_LAP_TIME, 3, text,
+				  TRUE);
+	} else {
+		put_short_packet (&synth, index + 1, RACE_LAP_TIME, 1, text,
+				  TRUE);
+	}
+
+	/* Take the place of anyone behind on the road that we've passed
+	 * on the track, one lap at a time
+	 */
+	for (i = 0; i < SYNTH_CARS; i++) {
+		SynthCar *other = &synth_cars[i];
+
+		if ((other == car) || (other->position > car->position)
+		    || (other->laps >= car->laps))
+			continue;
+
+		other->position++;
+		car->position--;
+
+		put_position_packet (&synth, i + 1, other->position);
+		sprintf (text, "%d", other->position);
+		put_short_packet (&synth, i + 1, RACE_POSITION, 1, text, TRUE);
+	}
+	for (i = 0; i < SYNTH_CARS; i++) {
+		SynthCar *other = &synth_cars[i];
+
+		if ((other != car) && (other->position == car->position)) {
+			other->position++;
+			put_position_packet (&synth, i + 1, other->position);
+		}
+	}
+
+	put_position_packet (&synth, index + 1, car->position);
+	sprintf (text, "%d", car->position);
+	put_short_packet (&synth, index + 1, RACE_POSITION, 1, text, TRUE);
+
+	/* The leader's interval is the lap count; the rest are behind the
+	 * car in front when it completed the same lap, roughly
+	 */
+	if (car->position == 1) {
+		put_short_packet (&synth, index + 1, RACE_GAP, 1, "", TRUE);
+		sprintf (text, "%d", car->laps);
+		put_short_packet (&synth, index + 1, RACE_INTERVAL, 1, text,
+				  TRUE);
+	} else {
+		for (i = 0; i < SYNTH_CARS; i++) {
+			SynthCar *other = &synth_cars[i];
+
+			if (other->position == 1) {
+				synth_time (text, car->lap_ms - other->lap_ms
+					    + (other->laps - car->laps)
+					    * other->pace_ms, FALSE);
+				put_short_packet (&synth, index + 1, RACE_GAP,
+						  1, text, TRUE);
+			}
+			if (other->position == car->position - 1) {
+				synth_time (text, car->lap_ms - other->lap_ms
+					    + (other->laps - car->laps)
+					    * other->pace_ms, FALSE);
+				put_short_packet (&synth, index + 1,
+						  RACE_INTERVAL, 1, text,
+						  TRUE);
+			}
+		}
+	}
+
+	car->next_ms += car->pace_ms / 3 + random () % 600 - 300;
+	if (car->laps % 20 == 0) {
+		car->next_ms += 20000;
+		car->pits++;
+
+		sprintf (text, "%d", car->pits);
+		put_short_packet (&synth, index + 1, RACE_NUM_PITS, 2, text,
+				  TRUE);
+	}
+}
+
+/**
+ * synth_clock:
+ * @ms: time into the session.
+ *
+ * Gives the time left in the synthetic session.
+ **/
+static void
+synth_clock (long long ms)
+{
+	char text[16];
+	int  left;
+
+	left = MAX (SYNTH_SESSION_SECS - (int) (ms / 1000), 0);
+	sprintf (text, "%d:%02d:%02d", left / 3600, left / 60 % 60, left % 60);
+	put_short_packet (&synth, 0, SYS_WEATHER, WEATHER_SESSION_CLOCK,
+			  text, TRUE);
+}
+
+/**
+ * synth_time:
+ * @text: buffer to write to,
+ * @ms: time in milliseconds,
+ * @minutes: whether to give minutes.
+ *
+ * Writes @ms as the board shows a time: M:SS.mmm for a lap, or S.m
+ * for a sector or gap.
+ **/
+static void
+synth_time (char *text,
+	    int   ms,
+	    int   minutes)
+{
+	ms = MAX (ms, 0);
+	if (minutes) {
+		sprintf (text, "%d:%02d.%03d", ms / 60000, ms / 1000 % 60,
+			 ms % 1000);
+	} else {
+		sprintf (text, "%d.%d", ms / 1000, ms / 100 % 10);
+	}
+}
+
+
+/**
+ * watch_fd:
+ * @fd: file descriptor,
+ * @events: epoll events to watch for,
+ * @ptr: connection or listener,
+ * @op: EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+ *
+ * Registers @fd with epoll, or changes what it's watched for.
+ **/
+static void
+watch_fd (int           fd,
+	  unsigned int  events,
+	  void         *ptr,
+	  int           op)
+{
+	struct epoll_event ev;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+
+	epoll_ctl (epoll_fd, op, fd, &ev);
+}
+
+/**
+ * accept_clients:
+ * @listener: listening socket.
+ *
+ * Accepts every connection waiting on @listener.  Each is answered
+ * once the latency has passed: a connection to the data stream with
+ * the start of the stream, as the real server sends an initial burst.
+ **/
+static void
+accept_clients (MockClient *listener)
+{
+	MockClient *client;
+	int         sock;
+
+	while ((sock = accept (listener->fd, NULL, NULL)) >= 0) {
+		fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+
+		client = calloc (1, sizeof (MockClient));
+		if (! client)
+			abort ();
+
+		client->fd = sock;
+		client->events = EPOLLIN;
+		if (listener->kind == MOCK_LISTEN_HTTP) {
+			client->kind = MOCK_HTTP;
+			client->req = malloc (MOCK_REQUEST_MAX + 1);
+			if (! client->req)
+				abort ();
+			nhttp++;
+		} else {
+			client->kind = MOCK_STREAM;
+			client->next_stream = streams;
+			streams = client;
+			wait_client (client, monotonic_ns () + latency_ns);
+			nstream++;
+		}
+
+		watch_fd (sock, client->events, client, EPOLL_CTL_ADD);
+	}
+}
+
+/**
+ * client_ready:
+ * @client: connection,
+ * @revents: events that occurred.
+ *
+ * Reads pings from a data stream connection, each of which is answered
+ * with a burst once the latency has passed; or reads a request until
+ * the blank line after its headers.  Carries on sending once the
+ * socket has room.
+ **/
+static void
+client_ready (MockClient   *client,
+	      unsigned int  revents)
+{
+	ssize_t len;
+
+	if (revents & EPOLLIN) {
+		char buf[256];
+
+		if ((client->kind == MOCK_HTTP) && (! client->done)) {
+			len = read (client->fd, client->req + client->req_len,
+				    MOCK_REQUEST_MAX - client->req_len);
+		} else {
+			len = read (client->fd, buf, sizeof (buf));
+		}
+
+		if ((len == 0) || ((len < 0) && (errno != EAGAIN)
+				   && (errno != EINTR))) {
+			drop_client (client);
+			return;
+		}
+
+		if ((len > 0) && (client->kind == MOCK_STREAM)) {
+			if (client->joined && (! client->due_ns))
+				wait_client (client,
+					     monotonic_ns () + latency_ns);
+		} else if ((len > 0) && (! client->done)) {
+			client->req_len += len;
+			client->req[client->req_len] = '\0';
+
+			if (strstr (client->req, "\r\n\r\n")
+			    || strstr (client->req, "\n\n")
+			    || (client->req_len >= MOCK_REQUEST_MAX)) {
+				client->done = TRUE;
+				wait_client (client,
+					     monotonic_ns () + latency_ns);
+			}
+		}
+	} else if (revents & (EPOLLERR | EPOLLHUP)) {
+		drop_client (client);
+		return;
+	}
+
+	if (revents & EPOLLOUT)
+		send_queue (client);
+}
+
+/**
+ * wait_client:
+ * @client: connection,
+ * @due_ns: when to answer it.
+ *
+ * Adds @client to the end of those waiting to be answered.
+ **/
+static void
+wait_client (MockClient *client,
+	     long long   due_ns)
+{
+	client->due_ns = MAX (due_ns, 1);
+	client->next = NULL;
+
+	if (waiting_tail) {
+		waiting_tail->next = client;
+	} else {
+		waiting = client;
+	}
+	waiting_tail = client;
+}
+
+/**
+ * answer_client:
+ * @client: connection at the head of those waiting.
+ *
+ * Takes @client off those waiting and answers its ping or request.
+ **/
+static void
+answer_client (MockClient *client)
+{
+	waiting = client->next;
+	if (! waiting)
+		waiting_tail = NULL;
+
+	client->next = NULL;
+	client->due_ns = 0;
+	answered++;
+
+	if (client->kind == MOCK_STREAM) {
+		send_burst (client);
+	} else {
+		answer_request (client);
+	}
+}
+
+/**
+ * send_burst:
+ * @client: data stream connection.
+ *
+ * Sends @client everything published since it was last answered, as
+ * the bursts it shares with everyone else where the queue has room,
+ * otherwise copied.  A connection that's not yet joined is first sent
+ * the event identifier and the stream since the last key frame marker,
+ * formatted once until it changes; if nothing has been published yet,
+ * it's answered again at the next burst.  A connection whose queue is
+ * already full has fallen too far behind, and is dropped.
+ **/
+static void
+send_burst (MockClient *client)
+{
+	int i, n, first = -1;
+
+	if (client->queue.count >= CHUNK_QUEUE_MAX) {
+		info (2, _("Connection fell behind\n"));
+		drop_client (client);
+		return;
+	}
+
+	if (! client->joined) {
+		if (! event_len) {
+			wait_client (client, next_burst_ns);
+			return;
+		}
+
+		if (! start) {
+			start = new_chunk (NULL, event_len + feed_len - tail_off);
+			memcpy (start->data, event, event_len);
+			memcpy (start->data + event_len, feed + tail_off,
+				feed_len - tail_off);
+		}
+
+		client->joined = TRUE;
+		client->off = feed_len;
+		push_chunk (&client->queue, start);
+		send_queue (client);
+		return;
+	}
+
+	if (client->off >= feed_len)
+		return;
+
+	for (i = 0, n = 0; i < MOCK_HISTORY; i++) {
+		int j = (history_next + MOCK_HISTORY - 1 - i) % MOCK_HISTORY;
+
+		if ((! history[j].chunk) || (history[j].off < client->off))
+			break;
+
+		n++;
+		if (history[j].off == client->off) {
+			first = j;
+			break;
+		}
+	}
+
+	if ((first >= 0)
+	    && (n <= CHUNK_QUEUE_MAX - client->queue.count)) {
+		for (i = 0; i < n; i++)
+			push_chunk (&client->queue,
+				    history[(first + i) % MOCK_HISTORY].chunk);
+	} else {
+		Chunk *chunk;
+
+		chunk = new_chunk (feed + client->off, feed_len - client->off);
+		push_chunk (&client->queue, chunk);
+		unref_chunk (chunk);
+	}
+
+	client->off = feed_len;
+	send_queue (client);
+}
+
+/**
+ * answer_request:
+ * @client: HTTP connection.
+ *
+ * Answers the request received on @client as the live timing web site
+ * would: any login succeeds, the key is given for any event we know
+ * it for, key frames are served from the recording or made from the
+ * board, and the total laps is that of the race being served.
+ **/
+static void
+answer_request (MockClient *client)
+{
+	char         *method, *path, *end, body[32];
+	unsigned int  number;
+	Chunk        *chunk;
+
+	method = client->req;
+	path = strchr (method, ' ');
+	if (! path) {
+		respond (client, 400, "text/plain", NULL, NULL);
+		return;
+	}
+	*(path++) = '\0';
+
+	end = path + strcspn (path, " ?\r\n");
+	*end = '\0';
+
+	if (! strcmp (path, "/reg/login")) {
+		respond (client, 200, "text/html",
+			 "Set-Cookie: USER=mock; path=/\r\n", NULL);
+		return;
+	} else if (strcmp (method, "GET")) {
+		respond (client, 405, "text/plain", NULL, NULL);
+		return;
+	}
+
+	if (sscanf (path, "/reg/getkey/%u.asp", &number) == 1) {
+		number = mock_key (&board, number);
+		if (! number) {
+			respond (client, 404, "text/plain", NULL, NULL);
+			return;
+		}
+
+		sprintf (body, "%08x", number);
+	} else if ((! strcmp (path, "/keyframe.bin"))
+		   || ((sscanf (path, "/keyframe_%u.bin", &number) == 1)
+		       && number)) {
+		MockKeyFrame *kf;
+
+		kf = find_key_frame (strcmp (path, "/keyframe.bin")
+				     ? number : latest_frame);
+		if (! kf) {
+			respond (client, 404, "text/plain", NULL, NULL);
+			return;
+		}
+
+		respond (client, 200, "application/octet-stream", NULL,
+			 kf->chunk);
+		return;
+	} else if (! strcmp (path, "/laps.php")) {
+		sprintf (body, "%u", mock_laps (&board));
+	} else {
+		respond (client, 404, "text/plain", NULL, NULL);
+		return;
+	}
+
+	chunk = new_chunk (body, strlen (body));
+	respond (client, 200, "text/plain", NULL, chunk);
+	unref_chunk (chunk);
+}
+
+/**
+ * respond:
+ * @client: HTTP connection,
+ * @status: HTTP status code,
+ * @type: Content-Type of @body,
+ * @extra: further headers, or NULL,
+ * @body: body of the response, or NULL.
+ *
+ * Sends the response on @client, after which the connection is closed.
+ * @body is queued as it is, so that a key frame asked for by many is
+ * never copied.  The queue is always empty beforehand, so there's room.
+ **/
+static void
+respond (MockClient *client,
+	 int         status,
+	 const char *type,
+	 const char *extra,
+	 Chunk      *body)
+{
+	const char *reason;
+	Chunk      *chunk;
+	int         hlen;
+
+	switch (status) {
+	case 200: reason = "OK"; break;
+	case 400: reason = "Bad Request"; break;
+	case 404: reason = "Not Found"; break;
+	case 405: reason = "Method Not Allowed"; break;
+	default:  reason = "Unknown"; break;
+	}
+
+	chunk = new_chunk (NULL, 512);
+	hlen = snprintf ((char *) chunk->data, 512,
+			 "HTTP/1.0 %d %s\r\n"
+			 "Server: live-f1-mockd (%s)\r\n"
+			 "Content-Type: %s\r\n"
+			 "Content-Length: %zu\r\n"
+			 "%s"
+			 "Connection: close\r\n"
+			 "\r\n",
+			 status, reason, PACKAGE_STRING, type,
+			 body ? body->len : 0, extra ? extra : "");
+	if ((hlen < 0) || (hlen >= 512))
+		abort ();
+	chunk->len = hlen;
+
+	push_chunk (&client->queue, chunk);
+	unref_chunk (chunk);
+	if (body && body->len)
+		push_chunk (&client->queue, body);
+
+	send_queue (client);
+}
+
+/**
+ * send_queue:
+ * @client: connection.
+ *
+ * Sends as much of the queue for @client as its socket will take, and
+ * waits for room for the rest.  An HTTP connection is closed once its
+ * response has all gone.  This is always the last thing done with
+ * @client, since it may be dropped.
+ **/
+static void
+send_queue (MockClient *client)
+{
+	unsigned int events;
+
+	if (send_chunks (&client->queue, client->fd) < 0) {
+		drop_client (client);
+		return;
+	}
+
+	if ((client->kind == MOCK_HTTP) && (! client->queue.count)
+	    && client->done && (! client->due_ns)) {
+		drop_client (client);
+		return;
+	}
+
+	events = client->queue.count ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	if (events != client->events) {
+		client->events = events;
+		watch_fd (client->fd, events, client, EPOLL_CTL_MOD);
+	}
+}
+
+/**
+ * drop_client:
+ * @client: connection.
+ *
+ * Closes @client and frees it, along with anything still queued.
+ **/
+static void
+drop_client (MockClient *client)
+{
+	MockClient **ptr;
+
+	if (client->due_ns) {
+		MockClient *prev = NULL;
+
+		for (ptr = &waiting; *ptr; prev = *ptr, ptr = &(*ptr)->next) {
+			if (*ptr == client) {
+				*ptr = client->next;
+				if (waiting_tail == client)
+					waiting_tail = prev;
+				break;
+			}
+		}
+	}
+
+	if (client->kind == MOCK_HTTP) {
+		nhttp--;
+	} else {
+		for (ptr = &streams; *ptr; ptr = &(*ptr)->next_stream) {
+			if (*ptr == client) {
+				*ptr = client->next_stream;
+				break;
+			}
+		}
+		nstream--;
+	}
+
+	clear_chunks (&client->queue);
+
+	epoll_ctl (epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close (client->fd);
+	free (client->req);
+	free (client);
+}
+
+
+/**
+ * mock_key:
+ * @state: board,
+ * @event_no: official event number.
+ *
+ * Finds the decryption key for the event in the recording, or uses the
+ * one given; the synthetic race always has one.  The one found is kept,
+ * since it's asked for by everyone joining.
+ *
+ * Returns: key found, or zero.
+ **/
+static unsigned int
+mock_key (CurrentState *state,
+	  unsigned int  event_no)
+{
+	CaptureRecord record;
+	size_t        off;
+	ssize_t       used;
+
+	if (! recording_name)
+		return synth.key;
+	if (cached_key && (event_no == key_event_no))
+		return cached_key;
+
+	for (off = CAPTURE_FILE_HEADER; framed && (off < data_len); off += used) {
+		used = parse_capture_record (data + off, data_len - off,
+					     &record);
+		if (used <= 0)
+			break;
+
+		if ((record.source == CAPTURE_KEY) && (record.arg == event_no)
+		    && (record.len == 4)) {
+			cached_key = ((unsigned int) record.data[3] << 24)
+				| (record.data[2] << 16)
+				| (record.data[1] << 8) | record.data[0];
+			if (cached_key) {
+				key_event_no = event_no;
+				return cached_key;
+			}
+		}
+	}
+
+	return given_key;
+}
+
+/**
+ * mock_key_frame:
+ * @state: board,
+ * @frame: key frame number.
+ *
+ * Parses the key frame from the recording into the board, since a
+ * recording begins part way through the session just as the board
+ * does; made key frames are never needed, as they were made from it.
+ *
+ * Returns: 0 on success, non-zero if it's not in the recording.
+ **/
+static int
+mock_key_frame (CurrentState *state,
+		unsigned int  frame)
+{
+	MockKeyFrame *kf;
+
+	kf = find_key_frame (frame);
+	if ((! kf) || (! kf->recorded))
+		return 1;
+
+	parse_stream_block (state, kf->chunk->data, kf->chunk->len);
+	return 0;
+}
+
+/**
+ * mock_laps:
+ * @state: board.
+ *
+ * Returns: total number of laps of the race being served, or zero.
+ **/
+static unsigned int
+mock_laps (CurrentState *state)
+{
+	return recording_name ? total_laps : SYNTH_LAPS;
+}
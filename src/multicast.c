@@ -0,0 +1,485 @@
+/* live-f1
+ *
+ * multicast.c - sending changes to the board to a multicast group
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stddef.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "live-f1-multicast.h"
+#include "ring.h"
+#include "stats.h"
+#include "multicast.h"
+
+
+/* How often the whole board is sent */
+#define MULTICAST_SNAPSHOT_NS 2000000000LL
+
+
+/**
+ * SnapshotField:
+ * @kind: LIVE_F1_EVENT_WEATHER or LIVE_F1_EVENT_FASTEST_LAP,
+ * @type: field number in the data stream,
+ * @offset: offset of the field in LiveF1Snapshot,
+ * @value_type: LiveF1ValueType of a weather field,
+ * @size: size of a fastest lap text.
+ *
+ * Where each weather and fastest lap field is kept on the board, so
+ * that a snapshot can send them.
+ **/
+typedef struct {
+	LiveF1EventKind kind;
+	int             type;
+	size_t          offset;
+	LiveF1ValueType value_type;
+	size_t          size;
+} SnapshotField;
+
+
+/* Forward prototypes */
+static void send_change   (const LiveF1Event *event);
+static void add_entry     (const LiveF1Event *event);
+static void send_snapshot (void);
+static void send_datagram (void);
+static void put32         (unsigned char *p, uint32_t value);
+static void put64         (unsigned char *p, uint64_t value);
+
+
+/* Socket connected to the group, or -1 */
+static int mcast_fd = -1;
+
+/* State whose changes are sent */
+static CurrentState *mcast_state = NULL;
+
+/* Board as the receivers will have it, kept from the changes sent */
+static LiveF1Snapshot board;
+
+/* Datagram being filled, and what's in it */
+static unsigned char datagram[LIVE_F1_MCAST_SIZE];
+static size_t        datagram_len = LIVE_F1_MCAST_HEADER;
+static int           datagram_count = 0;
+static int           datagram_flags = 0;
+
+/* Sequence number of the next datagram, and when the last snapshot
+ * was sent */
+static uint64_t  mcast_seq = 0;
+static long long last_snapshot = 0;
+
+/* Weather and fastest lap fields of the board */
+static const SnapshotField snapshot_fields[] = {
+	{ LIVE_F1_EVENT_WEATHER, 1, offsetof (LiveF1Snapshot, track_temp),
+	  LIVE_F1_VALUE_INT, 0 },
+	{ LIVE_F1_EVENT_WEATHER, 2, offsetof (LiveF1Snapshot, air_temp),
+	  LIVE_F1_VALUE_INT, 0 },
+	{ LIVE_F1_EVENT_WEATHER, 4, offsetof (LiveF1Snapshot, wind_speed),
+	  LIVE_F1_VALUE_TENTHS, 0 },
+	{ LIVE_F1_EVENT_WEATHER, 5, offsetof (LiveF1Snapshot, humidity),
+	  LIVE_F1_VALUE_INT, 0 },
+	{ LIVE_F1_EVENT_WEATHER, 6, offsetof (LiveF1Snapshot, pressure),
+	  LIVE_F1_VALUE_TENTHS, 0 },
+	{ LIVE_F1_EVENT_WEATHER, 7, offsetof (LiveF1Snapshot, wind_direction),
+	  LIVE_F1_VALUE_INT, 0 },
+	{ LIVE_F1_EVENT_FASTEST_LAP, 5, offsetof (LiveF1Snapshot, fl_car),
+	  LIVE_F1_VALUE_NONE, sizeof (board.fl_car) },
+	{ LIVE_F1_EVENT_FASTEST_LAP, 6, offsetof (LiveF1Snapshot, fl_driver),
+	  LIVE_F1_VALUE_NONE, sizeof (board.fl_driver) },
+	{ LIVE_F1_EVENT_FASTEST_LAP, 7, offsetof (LiveF1Snapshot, fl_time),
+	  LIVE_F1_VALUE_NONE, sizeof (board.fl_time) },
+	{ LIVE_F1_EVENT_FASTEST_LAP, 8, offsetof (LiveF1Snapshot, fl_lap),
+	  LIVE_F1_VALUE_NONE, sizeof (board.fl_lap) },
+};
+#define NUM_SNAPSHOT_FIELDS (sizeof (snapshot_fields) / sizeof (SnapshotField))
+
+
+/**
+ * open_multicast:
+ * @where: multicast group and port, separated by a colon,
+ * @state: application state structure.
+ *
+ * Sends each change to @state to the group @where from now on; an IPv6
+ * group may be given in brackets.  The changes of each read of the data
+ * stream go out together when flush_multicast() is called, in one
+ * datagram unless there are too many for one, and the whole board is
+ * sent every couple of seconds so receivers can join at any time, or
+ * catch up after losing a datagram.
+ *
+ * A datagram reaches every receiver in the group at once, so there's
+ * nothing kept here about them and no cost to having more; the format
+ * and a receiver are in live-f1-multicast.h.  Datagrams aren't routed
+ * beyond the local network.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_multicast (const char   *where,
+		CurrentState *state)
+{
+	struct addrinfo  hints, *res;
+	const char      *port;
+	char            *host;
+	int              hops = 1, ret;
+
+	port = strrchr (where, ':');
+	if (! port) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, where,
+			 _("multicast group needs a port"));
+		return 1;
+	}
+
+	host = strndup (where, port - where);
+	port++;
+
+	/* Strip the brackets from an IPv6 address */
+	if ((host[0] == '[') && (host[strlen (host) - 1] == ']')) {
+		memmove (host, host + 1, strlen (host));
+		host[strlen (host) - 1] = '\0';
+	}
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+	ret = getaddrinfo (host, port, &hints, &res);
+	free (host);
+	if (ret != 0) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to send to"), where, gai_strerror (ret));
+		return 1;
+	}
+
+	mcast_fd = socket (res->ai_family, SOCK_DGRAM, 0);
+	if (mcast_fd < 0)
+		goto error;
+
+	if (res->ai_family == AF_INET6) {
+		setsockopt (mcast_fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+			    &hops, sizeof (hops));
+	} else {
+		unsigned char ttl = hops;
+
+		setsockopt (mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL,
+			    &ttl, sizeof (ttl));
+	}
+
+	if (connect (mcast_fd, res->ai_addr, res->ai_addrlen) < 0)
+		goto error;
+
+	fcntl (mcast_fd, F_SETFL, fcntl (mcast_fd, F_GETFL) | O_NONBLOCK);
+	freeaddrinfo (res);
+
+	if (watch_changes (send_change, state)) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("too many watching the changes"));
+		close (mcast_fd);
+		mcast_fd = -1;
+		return 1;
+	}
+
+	mcast_state = state;
+	memset (&board, 0, sizeof (board));
+	datagram_len = LIVE_F1_MCAST_HEADER;
+	datagram_count = 0;
+	datagram_flags = 0;
+	last_snapshot = 0;
+
+	info (1, _("Sending changes to %s\n"), where);
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to send to"), where, strerror (errno));
+	if (mcast_fd >= 0)
+		close (mcast_fd);
+	mcast_fd = -1;
+	freeaddrinfo (res);
+
+	return 1;
+}
+
+/**
+ * flush_multicast:
+ *
+ * Called from the main loop after each read of the data stream to send
+ * the changes it caused, and the whole board if it's time to.
+ **/
+void
+flush_multicast (void)
+{
+	long long now;
+
+	if (mcast_fd < 0)
+		return;
+
+	if (datagram_count)
+		send_datagram ();
+
+	now = monotonic_ns ();
+	if ((! last_snapshot) || (now - last_snapshot >= MULTICAST_SNAPSHOT_NS)) {
+		send_snapshot ();
+		last_snapshot = now;
+	}
+}
+
+/**
+ * close_multicast:
+ *
+ * Sends any changes not yet sent and stops sending them.
+ **/
+void
+close_multicast (void)
+{
+	if (mcast_fd < 0)
+		return;
+
+	if (datagram_count)
+		send_datagram ();
+
+	unwatch_changes (send_change);
+	close (mcast_fd);
+	mcast_fd = -1;
+	mcast_state = NULL;
+}
+
+
+/**
+ * send_change:
+ * @event: change to the board.
+ *
+ * Makes @event to the board kept for snapshots, and adds it to the
+ * datagram to be sent.
+ **/
+static void
+send_change (const LiveF1Event *event)
+{
+	live_f1_board_apply (&board, event);
+	add_entry (event);
+}
+
+/**
+ * add_entry:
+ * @event: change to add.
+ *
+ * Adds @event to the datagram being filled, sending that first if it
+ * has no room left.
+ **/
+static void
+add_entry (const LiveF1Event *event)
+{
+	unsigned char *p;
+	size_t         text_len;
+
+	if (datagram_len + LIVE_F1_MCAST_ENTRY > sizeof (datagram))
+		send_datagram ();
+
+	text_len = strnlen (event->text, sizeof (event->text) - 1);
+
+	p = datagram + datagram_len;
+	p[0] = event->kind;
+	p[1] = event->value_type;
+	p[2] = event->car;
+	p[3] = event->type;
+	put32 (p + 4, event->data);
+	put64 (p + 8, event->value);
+	p[16] = text_len;
+	memcpy (p + 17, event->text, text_len);
+
+	datagram_len += 17 + text_len;
+	datagram_count++;
+}
+
+/**
+ * send_snapshot:
+ *
+ * Sends the whole board, as the changes that would make it from an
+ * empty one, in as many datagrams as it takes; the first and last are
+ * flagged so a receiver knows when it has all of it.  Atoms and fields
+ * that are empty are left out.
+ **/
+static void
+send_snapshot (void)
+{
+	LiveF1Event event;
+	size_t      i;
+	int         car, type;
+
+	if (datagram_count)
+		send_datagram ();
+	datagram_flags = LIVE_F1_MCAST_SNAPSHOT | LIVE_F1_MCAST_FIRST;
+
+	memset (&event, 0, sizeof (event));
+	event.kind = LIVE_F1_EVENT_BOARD;
+	event.value_type = LIVE_F1_VALUE_INT;
+	event.value = board.event_no;
+	event.data = board.event_type;
+	event.car = board.num_cars;
+	add_entry (&event);
+
+	/* The clock is sent as it stands now, since the receiver takes
+	 * it to have been set at the time of the snapshot */
+	memset (&event, 0, sizeof (event));
+	event.kind = LIVE_F1_EVENT_CLOCK;
+	event.value_type = LIVE_F1_VALUE_INT;
+	event.value = board.remaining_time;
+	if (board.epoch_time) {
+		event.value -= board.time - board.epoch_time;
+		event.data = 1;
+	}
+	add_entry (&event);
+
+	memset (&event, 0, sizeof (event));
+	event.kind = LIVE_F1_EVENT_LAPS;
+	event.value_type = LIVE_F1_VALUE_INT;
+	event.value = board.laps_completed;
+	event.data = board.total_laps;
+	add_entry (&event);
+
+	memset (&event, 0, sizeof (event));
+	event.kind = LIVE_F1_EVENT_FLAG;
+	event.value_type = LIVE_F1_VALUE_INT;
+	event.value = board.flag;
+	add_entry (&event);
+
+	for (i = 0; i < NUM_SNAPSHOT_FIELDS; i++) {
+		const char *field = (const char *) &board
+			+ snapshot_fields[i].offset;
+
+		memset (&event, 0, sizeof (event));
+		event.kind = snapshot_fields[i].kind;
+		event.type = snapshot_fields[i].type;
+		event.value_type = snapshot_fields[i].value_type;
+
+		if (snapshot_fields[i].kind == LIVE_F1_EVENT_WEATHER) {
+			event.value = *(const int32_t *) field;
+			if (! event.value)
+				continue;
+		} else {
+			if (! *field)
+				continue;
+			memcpy (event.text, field,
+				strnlen (field, snapshot_fields[i].size));
+		}
+
+		add_entry (&event);
+	}
+
+	for (car = 1; car <= (int) board.num_cars; car++) {
+		if (board.position[car - 1]) {
+			memset (&event, 0, sizeof (event));
+			event.kind = LIVE_F1_EVENT_POSITION;
+			event.car = car;
+			event.value_type = LIVE_F1_VALUE_INT;
+			event.value = board.position[car - 1];
+			add_entry (&event);
+		}
+
+		for (type = 0; type < LIVE_F1_SHM_ATOMS; type++) {
+			const LiveF1Atom *atom = &board.atoms[car - 1][type];
+
+			if ((! atom->data) && (! atom->text[0]))
+				continue;
+
+			memset (&event, 0, sizeof (event));
+			event.kind = LIVE_F1_EVENT_ATOM;
+			event.car = car;
+			event.type = type;
+			event.data = atom->data;
+			memcpy (event.text, atom->text, sizeof (atom->text));
+			add_entry (&event);
+		}
+	}
+
+	datagram_flags |= LIVE_F1_MCAST_LAST;
+	send_datagram ();
+	datagram_flags = 0;
+}
+
+/**
+ * send_datagram:
+ *
+ * Fills in the header of the datagram and sends it to the group, then
+ * starts the next.  A datagram the socket can't take straight away is
+ * dropped; to receivers that's the same as losing it on the network.
+ **/
+static void
+send_datagram (void)
+{
+	put32 (datagram, LIVE_F1_MCAST_MAGIC);
+	datagram[4] = LIVE_F1_MCAST_VERSION;
+	datagram[5] = datagram_flags;
+	datagram[6] = datagram_count >> 8;
+	datagram[7] = datagram_count & 0xff;
+	put64 (datagram + 8, mcast_seq++);
+	put64 (datagram + 16, board.time);
+
+	send (mcast_fd, datagram, datagram_len, 0);
+
+	datagram_len = LIVE_F1_MCAST_HEADER;
+	datagram_count = 0;
+	datagram_flags &= ~LIVE_F1_MCAST_FIRST;
+}
+
+
+/**
+ * put32:
+ * @p: where to write,
+ * @value: number to write.
+ *
+ * Writes @value at @p in network byte order.
+ **/
+static void
+put32 (unsigned char *p,
+       uint32_t       value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/**
+ * put64:
+ * @p: where to write,
+ * @value: number to write.
+ *
+ * Writes @value at @p in network byte order.
+ **/
+static void
+put64 (unsigned char *p,
+       uint64_t       value)
+{
+	put32 (p, value >> 32);
+	put32 (p + 4, value);
+}
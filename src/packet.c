@@ -30,12 +30,33 @@
 #include <regex.h>
 
 #include "live-f1.h"
-#include "display.h"
-#include "http.h"
+#include "sink.h"
+#include "stats.h"
 #include "stream.h"
 #include "packet.h"
 
 
+/* Handler for each type of packet; only those a plugin has asked for
+ * go through plugin_car_packet() and plugin_system_packet(), so the
+ * rest cost no more than calling the handler directly */
+PacketHandler car_dispatch[PACKET_TYPES] = {
+	handle_car_packet, handle_car_packet, handle_car_packet,
+	handle_car_packet, handle_car_packet, handle_car_packet,
+	handle_car_packet, handle_car_packet, handle_car_packet,
+	handle_car_packet, handle_car_packet, handle_car_packet,
+	handle_car_packet, handle_car_packet, handle_car_packet,
+	handle_car_packet,
+};
+PacketHandler system_dispatch[PACKET_TYPES] = {
+	handle_system_packet, handle_system_packet, handle_system_packet,
+	handle_system_packet, handle_system_packet, handle_system_packet,
+	handle_system_packet, handle_system_packet, handle_system_packet,
+	handle_system_packet, handle_system_packet, handle_system_packet,
+	handle_system_packet, handle_system_packet, handle_system_packet,
+	handle_system_packet,
+};
+
+
 /**
  * handle_car_packet:
  * @state: application state structure,
@@ -77,7 +98,7 @@ handle_car_packet (CurrentState *state,
 		}
 
 		state->num_cars = packet->car;
-		clear_board (state);
+		sink_clear_board (state);
 	}
 
 	switch ((CarPacketType) packet->type) {
@@ -94,14 +115,14 @@ handle_car_packet (CurrentState *state,
 		 * and the next with the new position, but not always
 		 * sadly.
 		 */
-		clear_car (state, packet->car);
+		sink_clear_car (state, packet->car);
 		for (i = 0; i < state->num_cars; i++)
 			if (state->car_position[i] == packet->data)
 				state->car_position[i] = 0;
 
 		state->car_position[packet->car - 1] = packet->data;
 		if (packet->data)
-			update_car (state, packet->car);
+			sink_update_car (state, packet->car);
 		return;
 	case CAR_POSITION_HISTORY:
 		/* Currently unhandled */
@@ -128,6 +149,8 @@ handle_car_packet (CurrentState *state,
 			{
 				state->decryption_failure = 0;
 			} else {
+				if (! state->decryption_failure)
+					stats.decryption_failures++;
 				state->decryption_failure = 1;
 			}
 
@@ -141,7 +164,7 @@ handle_car_packet (CurrentState *state,
 		if (packet->len >= 0)
 			strcpy (atom->text, (const char *) packet->payload);
 
-		update_cell (state, packet->car, packet->type);
+		sink_update_cell (state, packet->car, packet->type);
 
 		/* This is the only way to grab this information, sadly */
 		if ((state->event_type == RACE_EVENT)
@@ -155,7 +178,7 @@ handle_car_packet (CurrentState *state,
 			}
 
 			state->laps_completed = number;
-			update_status (state);
+			sink_update_status (state);
 		}
 		break;
 	}
@@ -190,14 +213,13 @@ handle_system_packet (CurrentState *state,
 			number += packet->payload[i] - '0';
 		}
 
-		state->key = obtain_decryption_key (state->host, number,
-						    state->cookie);
+		state->key = get_decryption_key (state, number);
 		state->event_no = number;
 		state->event_type = packet->data;
 		state->epoch_time = 0;
 		state->remaining_time = 0;
 		state->laps_completed = 0;
-		state->total_laps = obtain_total_laps();
+		state->total_laps = get_total_laps (state);
 		state->flag = GREEN_FLAG;
 
 		state->track_temp = 0;
@@ -216,6 +238,8 @@ handle_system_packet (CurrentState *state,
 		if (state->fl_lap) free (state->fl_lap);
 		state->fl_lap = calloc(3, sizeof(char));
 	
+		for (i = 0; i < (unsigned int) state->num_cars; i++)
+			free (state->car_info[i]);
 		state->num_cars = 0;
 		if (state->car_position) {
 			free (state->car_position);
@@ -227,7 +251,10 @@ handle_system_packet (CurrentState *state,
 		}
 		reset_decryption (state);
 
-		clear_board (state);
+		/* The board is empty, so the next key frame is needed */
+		state->frame = 0;
+
+		sink_clear_board (state);
 		info (3, _("Begin new event #%d (type: %d)\n"),
 		      state->event_no, state->event_type);
 		break;
@@ -250,7 +277,7 @@ handle_system_packet (CurrentState *state,
 		if ((!state->frame) || (state->decryption_failure))
 		{
 			state->frame = number;
-			obtain_key_frame (state->host, number, state);
+			get_key_frame (state, number);
 			reset_decryption (state);
 		} else {
 			state->frame = number;
@@ -300,32 +327,37 @@ handle_system_packet (CurrentState *state,
 				total += number;
 
 				if (state->epoch_time)
-					state->epoch_time = time (NULL);
+					state->epoch_time = get_time (state);
 				state->remaining_time = total;
 			} else {
-				state->epoch_time = time (NULL);
+				state->epoch_time = get_time (state);
 			}
 
-			close_popup ();
-			update_time (state);
+			sink_update_clock (state);
 			break;
 		case WEATHER_TRACK_TEMP:
+			/* May be below zero */
 			number = 0;
-			for (i = 0; i < packet->len; i++) {
+			for (i = (packet->payload[0] == '-');
+			     i < packet->len; i++) {
 				number *= 10;
 				number += packet->payload[i] - '0';
 			}
-			state->track_temp = number;
-			update_status (state);
+			state->track_temp = ((packet->payload[0] == '-')
+					     ? -(int) number : (int) number);
+			sink_update_status (state);
 			break;
 		case WEATHER_AIR_TEMP:
+			/* May be below zero */
 			number = 0;
-			for (i = 0; i < packet->len; i++) {
+			for (i = (packet->payload[0] == '-');
+			     i < packet->len; i++) {
 				number *= 10;
 				number += packet->payload[i] - '0';
 			}
-			state->air_temp = number;
-			update_status (state);
+			state->air_temp = ((packet->payload[0] == '-')
+					   ? -(int) number : (int) number);
+			sink_update_status (state);
 			break;
 		case WEATHER_WIND_SPEED:
 			number = 0;
@@ -337,7 +369,7 @@ handle_system_packet (CurrentState *state,
 				}
 			}
 			state->wind_speed = number;
-			update_status (state);
+			sink_update_status (state);
 			break;
 		case WEATHER_HUMIDITY:
 			number = 0;
@@ -346,7 +378,7 @@ handle_system_packet (CurrentState *state,
 				number += packet->payload[i] - '0';
 			}
 			state->humidity = number;
-			update_status (state);
+			sink_update_status (state);
 			break;
 		case WEATHER_PRESSURE:
 			number = 0;
@@ -358,7 +390,7 @@ handle_system_packet (CurrentState *state,
 				}
 			}
 			state->pressure = number;
-			update_status (state);
+			sink_update_status (state);
 			break;
 		case WEATHER_WIND_DIRECTION:
 			number = 0;
@@ -367,7 +399,7 @@ handle_system_packet (CurrentState *state,
 				number += packet->payload[i] - '0';
 			}
 			state->wind_direction = number;
-			update_status (state);
+			sink_update_status (state);
 			break;
 		default:
 			/* Unhandled field */
@@ -384,19 +416,19 @@ handle_system_packet (CurrentState *state,
 		switch (packet->payload[0]) {
 		case FL_CAR:
 			memcpy(state->fl_car, packet->payload+1, 2);
-			update_status (state);
+			sink_update_status (state);
 			break;
 		case FL_DRIVER:
 			memcpy(state->fl_driver, packet->payload+1, 14);
-			update_status (state);
+			sink_update_status (state);
 			break;
 		case FL_TIME:
 			memcpy(state->fl_time, packet->payload+1, 8);
-			update_status (state);
+			sink_update_status (state);
 			break;
 		case FL_LAP:
 			memcpy(state->fl_lap, packet->payload+1, 2);
-			update_status (state);
+			sink_update_status (state);
 			break;
 		default:
 			/* Unhandled field */
@@ -417,7 +449,7 @@ handle_system_packet (CurrentState *state,
 			 * Decimal enum value.
 			 */
 			state->flag = packet->payload[0] - '0';
-			update_status (state);
+			sink_update_status (state);
 			break;
 		default:
 			/* Unhandled field */
@@ -446,3 +478,215 @@ handle_system_packet (CurrentState *state,
 		break;
 	}
 }
+
+/**
+ * reset_state:
+ * @state: application state structure.
+ *
+ * Resets everything known about the session, ready for a fresh data
+ * stream.
+ **/
+void
+reset_state (CurrentState *state)
+{
+	int i;
+
+	state->key = 0;
+	state->frame = 0;
+	state->event_no = 0;
+	state->event_type = RACE_EVENT;
+	state->epoch_time = 0;
+	state->remaining_time = 0;
+	state->laps_completed = 0;
+	state->total_laps = 0;
+	state->flag = GREEN_FLAG;
+
+	state->track_temp = 0;
+	state->air_temp = 0;
+	state->wind_speed = 0;
+	state->humidity = 0;
+	state->pressure = 0;
+	state->wind_direction = 0;
+
+	if (state->fl_car) free (state->fl_car);
+	state->fl_car = calloc(3, sizeof(char));
+	if (state->fl_driver) free (state->fl_driver);
+	state->fl_driver = calloc(15, sizeof(char));
+	if (state->fl_time) free (state->fl_time);
+	state->fl_time = calloc(9, sizeof(char));
+	if (state->fl_lap) free (state->fl_lap);
+	state->fl_lap = calloc(3, sizeof(char));
+
+	if (state->car_position) {
+		free (state->car_position);
+		state->car_position = NULL;
+	}
+	if (state->car_info) {
+		for (i = 0; i < state->num_cars; i++)
+			free (state->car_info[i]);
+		free (state->car_info);
+		state->car_info = NULL;
+	}
+	state->num_cars = 0;
+
+	reset_decryption (state);
+	reset_stream (state);
+}
+
+/**
+ * dup_field:
+ * @field: field to copy, or NULL,
+ * @len: allocated length of @field.
+ *
+ * Returns: newly allocated copy of @field, or NULL.
+ **/
+static char *
+dup_field (const char *field,
+	   size_t      len)
+{
+	char *copy;
+
+	if (! field)
+		return NULL;
+
+	copy = malloc (len);
+	if (! copy)
+		abort ();
+
+	memcpy (copy, field, len);
+	return copy;
+}
+
+/**
+ * copy_state:
+ * @dest: state to copy into,
+ * @src: state to copy.
+ *
+ * Copies everything known about the session from @src into @dest, as
+ * well as where the data stream and its decryption had got to.  @dest
+ * shares the login details and data source with @src, and must be
+ * freed with free_state().
+ **/
+void
+copy_state (CurrentState       *dest,
+	    const CurrentState *src)
+{
+	int i;
+
+	*dest = *src;
+
+	dest->fl_car = dup_field (src->fl_car, 3);
+	dest->fl_driver = dup_field (src->fl_driver, 15);
+	dest->fl_time = dup_field (src->fl_time, 9);
+	dest->fl_lap = dup_field (src->fl_lap, 3);
+
+	if (! src->num_cars) {
+		dest->car_position = NULL;
+		dest->car_info = NULL;
+		return;
+	}
+
+	dest->car_position = malloc (sizeof (int) * src->num_cars);
+	dest->car_info = malloc (sizeof (CarAtom *) * src->num_cars);
+	if ((! dest->car_position) || (! dest->car_info))
+		abort ();
+
+	memcpy (dest->car_position, src->car_position,
+		sizeof (int) * src->num_cars);
+	for (i = 0; i < src->num_cars; i++) {
+		dest->car_info[i] = malloc (sizeof (CarAtom)
+					    * LAST_CAR_PACKET);
+		if (! dest->car_info[i])
+			abort ();
+
+		memcpy (dest->car_info[i], src->car_info[i],
+			sizeof (CarAtom) * LAST_CAR_PACKET);
+	}
+}
+
+/**
+ * free_state:
+ * @state: state filled by copy_state().
+ *
+ * Frees everything copy_state() allocated.
+ **/
+void
+free_state (CurrentState *state)
+{
+	int i;
+
+	free (state->fl_car);
+	free (state->fl_driver);
+	free (state->fl_time);
+	free (state->fl_lap);
+
+	for (i = 0; i < state->num_cars; i++)
+		free (state->car_info[i]);
+	free (state->car_info);
+	free (state->car_position);
+}
+
+
+/**
+ * count_lap:
+ * @laps: laps the car had completed, or -1 if not yet known,
+ * @leader_laps: laps the leader has completed, or -1 if not known,
+ * @gap: the car's gap to the leader.
+ *
+ * Counts the lap a car has just completed.  Until we've seen the car
+ * complete one, we count from what the leader has done, less any laps
+ * the car is down, which @gap gives as "1L" and so on.
+ *
+ * Returns: laps the car has completed, or -1 if still not known.
+ **/
+int
+count_lap (int         laps,
+	   int         leader_laps,
+	   const char *gap)
+{
+	if (laps >= 0)
+		return laps + 1;
+	if (leader_laps < 0)
+		return -1;
+
+	if (strchr (gap, 'L'))
+		return leader_laps - atoi (gap);
+
+	return leader_laps;
+}
+
+/**
+ * parse_time_ms:
+ * @text: lap or sector time, as [[H:]M:]S.sss.
+ *
+ * Returns: @text in milliseconds, or -1 if it isn't a time.
+ **/
+int
+parse_time_ms (const char *text)
+{
+	const char *p;
+	long        secs = 0, part = 0, frac = 0, scale = 0;
+
+	if (! *text)
+		return -1;
+
+	for (p = text; *p; p++) {
+		if ((*p >= '0') && (*p <= '9')) {
+			if (! scale) {
+				part = part * 10 + (*p - '0');
+			} else if (scale > 1) {
+				scale /= 10;
+				frac += (*p - '0') * scale;
+			}
+		} else if ((*p == ':') && (! scale)) {
+			secs = (secs + part) * 60;
+			part = 0;
+		} else if ((*p == '.') && (! scale)) {
+			scale = 1000;
+		} else {
+			return -1;
+		}
+	}
+
+	return (secs + part) * 1000 + frac;
+}
@@ -23,6 +23,10 @@
 #include "live-f1.h"
 
 
+/* Types of packet, as the four bits of the header allow */
+#define PACKET_TYPES 16
+
+
 /**
  * CarPacketType:
  *
@@ -166,11 +170,25 @@ typedef struct {
 	unsigned char payload[128];
 } Packet;
 
+/* Handles a packet of one type */
+typedef void (*PacketHandler) (CurrentState *state, const Packet *packet);
+
 
 SJR_BEGIN_EXTERN
 
+/* Handler for each type of car and system packet; those below unless
+ * a plugin, or live-f1-export, wants the type too */
+extern PacketHandler car_dispatch[PACKET_TYPES];
+extern PacketHandler system_dispatch[PACKET_TYPES];
+
 void handle_car_packet    (CurrentState *state, const Packet *packet);
 void handle_system_packet (CurrentState *state, const Packet *packet);
+void reset_state          (CurrentState *state);
+void copy_state           (CurrentState *dest, const CurrentState *src);
+void free_state           (CurrentState *state);
+
+int  count_lap            (int laps, int leader_laps, const char *gap);
+int  parse_time_ms        (const char *text);
 
 SJR_END_EXTERN
 
@@ -0,0 +1,553 @@
+/* live-f1
+ *
+ * plugin.c - loading plugins and passing packets on to them
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_DLOPEN
+# include <dlfcn.h>
+#endif /* HAVE_DLOPEN */
+
+#include "live-f1.h"
+#include "live-f1-plugin.h"
+#include "packet.h"
+#include "plugin.h"
+#include "sink.h"
+#include "stream.h"
+
+
+/* Most plugins that may be loaded at once */
+#define MAX_PLUGINS 32
+
+
+/**
+ * PacketCall:
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Callback a plugin has asked for on each packet of a type.
+ **/
+typedef struct {
+	LiveF1PacketFunc func;
+	void            *data;
+} PacketCall;
+
+/**
+ * BurstCall:
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Callback a plugin has asked for after each read of the data stream.
+ **/
+typedef struct {
+	LiveF1BurstFunc func;
+	void           *data;
+} BurstCall;
+
+/**
+ * CallList:
+ * @calls: callbacks in the order they were asked for,
+ * @num_calls: number of entries in @calls.
+ *
+ * Callbacks for one type of packet.
+ **/
+typedef struct {
+	PacketCall *calls;
+	int         num_calls;
+} CallList;
+
+/**
+ * PluginSymbol:
+ * @ptr: symbol as dlsym() gives it,
+ * @init: symbol as an init function,
+ * @exit: symbol as an exit function.
+ *
+ * ISO C has no conversion from an object pointer to a function
+ * pointer, so symbols are read out as functions through this.
+ **/
+typedef union {
+	void             *ptr;
+	LiveF1PluginInit  init;
+	LiveF1PluginExit  exit;
+} PluginSymbol;
+
+
+/* Forward prototypes */
+static void plugin_car_packet    (CurrentState *state,
+				  const Packet *packet);
+static void plugin_system_packet (CurrentState *state,
+				  const Packet *packet);
+static void call_plugins         (const CallList *list,
+				  CurrentState *state,
+				  const Packet *packet, int subtype);
+static int  on_car_packet        (int type, LiveF1PacketFunc func,
+				  void *data);
+static int  on_system_packet     (int type, LiveF1PacketFunc func,
+				  void *data);
+static int  on_burst             (LiveF1BurstFunc func, void *data);
+static int  on_system_subtype    (int type, int subtype,
+				  LiveF1PacketFunc func, void *data);
+static int  add_call             (CallList *list, LiveF1PacketFunc func,
+				  void *data);
+#if HAVE_DLOPEN
+static int  is_plugin            (const struct dirent *entry);
+#endif /* HAVE_DLOPEN */
+
+
+/* Callbacks for each type of packet, for each sub-type of system
+ * packet once one is asked for, and after each read */
+static CallList   car_calls[PACKET_TYPES];
+static CallList   system_calls[PACKET_TYPES];
+static CallList  *subtype_calls[PACKET_TYPES];
+static BurstCall *burst_calls = NULL;
+static int        num_burst_calls = 0;
+
+/* Car packets the plugins have asked for, so they aren't passed over */
+static SinkFilter plugin_filter = { ~0U, 0 };
+static const Sink plugin_sink = {
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+	&plugin_filter,
+};
+
+/* Plugins loaded, in the order they were */
+static void *plugins[MAX_PLUGINS];
+static int   num_plugins = 0;
+
+/* State whose packets the plugins are given */
+static CurrentState *plugin_state = NULL;
+
+/* Given to each plugin's live_f1_plugin_init() */
+static const LiveF1PluginHost plugin_host = {
+	LIVE_F1_PLUGIN_VERSION,
+	on_car_packet,
+	on_system_packet,
+	on_burst,
+	on_system_subtype,
+};
+
+
+/**
+ * load_plugins:
+ * @dir: directory to load plugins from,
+ * @state: application state structure.
+ *
+ * Loads each shared object in @dir whose name ends in .so, in order of
+ * name, and calls its live_f1_plugin_init() to say which packets it
+ * wants.  If any fails to load, or refuses to, none are kept.  Only
+ * packets parsed into @state are passed on, not those of the board
+ * shown when time-shifted.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+load_plugins (const char   *dir,
+	      CurrentState *state)
+{
+#if HAVE_DLOPEN
+	struct dirent **names;
+	int             num_names, i;
+
+	plugin_state = state;
+
+	num_names = scandir (dir, &names, is_plugin, alphasort);
+	if (num_names < 0) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to load plugins from"), dir,
+			 strerror (errno));
+		return 1;
+	}
+
+	for (i = 0; i < num_names; i++) {
+		PluginSymbol  init;
+		char         *path;
+		void         *handle;
+
+		if (num_plugins == MAX_PLUGINS) {
+			fprintf (stderr, "%s: %s: %s\n", program_name, dir,
+				 _("too many plugins"));
+			goto error;
+		}
+
+		path = malloc (strlen (dir) + strlen (names[i]->d_name) + 2);
+		if (! path)
+			abort ();
+		sprintf (path, "%s/%s", dir, names[i]->d_name);
+
+		handle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+		if (! handle) {
+			fprintf (stderr, "%s: %s\n", program_name, dlerror ());
+			free (path);
+			goto error;
+		}
+
+		plugins[num_plugins++] = handle;
+		init.ptr = dlsym (handle, "live_f1_plugin_init");
+		if (! init.ptr) {
+			fprintf (stderr, "%s: %s: %s\n", program_name, path,
+				 _("not a live-f1 plugin"));
+			free (path);
+			goto error;
+		} else if (init.init (&plugin_host)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name, path,
+				 _("plugin refused to load"));
+			free (path);
+			goto error;
+		}
+
+		info (1, _("Loaded plugin %s\n"), path);
+		free (path);
+	}
+
+	for (i = 0; i < num_names; i++)
+		free (names[i]);
+	free (names);
+
+	if (plugin_filter.types)
+		add_sink (&plugin_sink);
+
+	return 0;
+error:
+	for (i = 0; i < num_names; i++)
+		free (names[i]);
+	free (names);
+	close_plugins ();
+	return 1;
+#else /* HAVE_DLOPEN */
+	fprintf (stderr, "%s: %s: %s\n", program_name, dir,
+		 _("live-f1 was built without plugin support"));
+	return 1;
+#endif /* HAVE_DLOPEN */
+}
+
+/**
+ * flush_plugins:
+ *
+ * Called from the main loop after each read of the data stream, once
+ * every packet in it has been handled, to make the burst callbacks.
+ **/
+void
+flush_plugins (void)
+{
+	int i;
+
+	for (i = 0; i < num_burst_calls; i++)
+		burst_calls[i].func (burst_calls[i].data);
+}
+
+/**
+ * close_plugins:
+ *
+ * Calls each plugin's live_f1_plugin_exit(), if it has one, and unloads
+ * them, in the reverse of the order they were loaded.  Packets go
+ * straight to their handlers again.
+ **/
+void
+close_plugins (void)
+{
+	int i;
+
+	remove_sink (&plugin_sink);
+	plugin_filter.types = 0;
+
+	for (i = 0; i < PACKET_TYPES; i++) {
+		car_dispatch[i] = handle_car_packet;
+		system_dispatch[i] = handle_system_packet;
+
+		free (car_calls[i].calls);
+		car_calls[i].calls = NULL;
+		car_calls[i].num_calls = 0;
+
+		free (system_calls[i].calls);
+		system_calls[i].calls = NULL;
+		system_calls[i].num_calls = 0;
+
+		if (subtype_calls[i]) {
+			int j;
+
+			for (j = 0; j < LIVE_F1_SUBTYPES; j++)
+				free (subtype_calls[i][j].calls);
+			free (subtype_calls[i]);
+			subtype_calls[i] = NULL;
+		}
+	}
+
+	free (burst_calls);
+	burst_calls = NULL;
+	num_burst_calls = 0;
+
+#if HAVE_DLOPEN
+	while (num_plugins) {
+		void        *handle = plugins[--num_plugins];
+		PluginSymbol plugin_exit;
+
+		plugin_exit.ptr = dlsym (handle, "live_f1_plugin_exit");
+		if (plugin_exit.ptr)
+			plugin_exit.exit ();
+
+		dlclose (handle);
+	}
+#endif /* HAVE_DLOPEN */
+}
+
+
+/**
+ * plugin_car_packet:
+ * @state: application state structure,
+ * @packet: decoded packet structure.
+ *
+ * Handles a car packet of a type a plugin has asked for, then passes it
+ * on to each plugin that did if it's for the live state.
+ **/
+static void
+plugin_car_packet (CurrentState *state,
+		   const Packet *packet)
+{
+	handle_car_packet (state, packet);
+	if (state == plugin_state)
+		call_plugins (&car_calls[packet->type], state, packet, 0);
+}
+
+/**
+ * plugin_system_packet:
+ * @state: application state structure,
+ * @packet: decoded packet structure.
+ *
+ * Handles a system packet of a type a plugin has asked for, then passes
+ * it on to each plugin that did if it's for the live state; first those
+ * that asked for every packet of the type, then those that asked for
+ * its sub-type.
+ **/
+static void
+plugin_system_packet (CurrentState *state,
+		      const Packet *packet)
+{
+	int subtype;
+
+	handle_system_packet (state, packet);
+	if (state != plugin_state)
+		return;
+
+	subtype = ((packet->type == SYS_SPEED) ? packet->payload[0]
+		   : packet->data);
+
+	call_plugins (&system_calls[packet->type], state, packet, subtype);
+	if (subtype_calls[packet->type])
+		call_plugins (&subtype_calls[packet->type][subtype], state,
+			      packet, subtype);
+}
+
+/**
+ * call_plugins:
+ * @list: callbacks for the type of @packet,
+ * @state: application state structure,
+ * @packet: decoded packet structure,
+ * @subtype: sub-type of a system packet, or zero.
+ *
+ * Makes each callback in @list with @packet, in the form plugins are
+ * given it.
+ **/
+static void
+call_plugins (const CallList *list,
+	      CurrentState   *state,
+	      const Packet   *packet,
+	      int             subtype)
+{
+	LiveF1Packet plugin_packet;
+	int          i;
+
+	if (! list->num_calls)
+		return;
+
+	plugin_packet.car = packet->car;
+	plugin_packet.type = packet->type;
+	plugin_packet.data = packet->data;
+	plugin_packet.len = packet->len;
+	plugin_packet.payload = packet->payload;
+	plugin_packet.event_no = state->event_no;
+	plugin_packet.event_type = state->event_type;
+	plugin_packet.in_key_frame = state->in_key_frame;
+	plugin_packet.time = get_time (state);
+	plugin_packet.subtype = subtype;
+
+	for (i = 0; i < list->num_calls; i++)
+		list->calls[i].func (&plugin_packet, list->calls[i].data);
+}
+
+
+/**
+ * on_car_packet:
+ * @type: type of car packet,
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Called by a plugin to have @func called for each car packet of @type.
+ *
+ * Returns: 0 on success, non-zero if @type is out of range.
+ **/
+static int
+on_car_packet (int              type,
+	       LiveF1PacketFunc func,
+	       void            *data)
+{
+	if ((type < 0) || (type >= PACKET_TYPES) || (! func))
+		return 1;
+
+	car_dispatch[type] = plugin_car_packet;
+	plugin_filter.types |= 1U << type;
+	return add_call (&car_calls[type], func, data);
+}
+
+/**
+ * on_system_packet:
+ * @type: type of system packet,
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Called by a plugin to have @func called for each system packet of
+ * @type.
+ *
+ * Returns: 0 on success, non-zero if @type is out of range.
+ **/
+static int
+on_system_packet (int              type,
+		  LiveF1PacketFunc func,
+		  void            *data)
+{
+	if ((type < 0) || (type >= PACKET_TYPES) || (! func))
+		return 1;
+
+	system_dispatch[type] = plugin_system_packet;
+	return add_call (&system_calls[type], func, data);
+}
+
+/**
+ * on_burst:
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Called by a plugin to have @func called after each read of the data
+ * stream.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+on_burst (LiveF1BurstFunc func,
+	  void           *data)
+{
+	if (! func)
+		return 1;
+
+	burst_calls = realloc (burst_calls,
+			       sizeof (BurstCall) * (num_burst_calls + 1));
+	if (! burst_calls)
+		abort ();
+
+	burst_calls[num_burst_calls].func = func;
+	burst_calls[num_burst_calls].data = data;
+	num_burst_calls++;
+	return 0;
+}
+
+/**
+ * on_system_subtype:
+ * @type: type of system packet,
+ * @subtype: sub-type of system packet,
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Called by a plugin to have @func called for each system packet of
+ * @type whose sub-type is @subtype.
+ *
+ * Returns: 0 on success, non-zero if @type or @subtype is out of range.
+ **/
+static int
+on_system_subtype (int              type,
+		   int              subtype,
+		   LiveF1PacketFunc func,
+		   void            *data)
+{
+	if ((type < 0) || (type >= PACKET_TYPES)
+	    || (subtype < 0) || (subtype >= LIVE_F1_SUBTYPES) || (! func))
+		return 1;
+
+	if (! subtype_calls[type]) {
+		subtype_calls[type] = calloc (LIVE_F1_SUBTYPES,
+					      sizeof (CallList));
+		if (! subtype_calls[type])
+			abort ();
+	}
+
+	system_dispatch[type] = plugin_system_packet;
+	return add_call (&subtype_calls[type][subtype], func, data);
+}
+
+/**
+ * add_call:
+ * @list: callbacks for a type of packet,
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Adds a callback to the end of @list.
+ *
+ * Returns: 0, always.
+ **/
+static int
+add_call (CallList         *list,
+	  LiveF1PacketFunc  func,
+	  void             *data)
+{
+	list->calls = realloc (list->calls,
+			       sizeof (PacketCall) * (list->num_calls + 1));
+	if (! list->calls)
+		abort ();
+
+	list->calls[list->num_calls].func = func;
+	list->calls[list->num_calls].data = data;
+	list->num_calls++;
+	return 0;
+}
+
+#if HAVE_DLOPEN
+/**
+ * is_plugin:
+ * @entry: entry in the plugin directory.
+ *
+ * Returns: TRUE if @entry is named as a shared object, FALSE otherwise.
+ **/
+static int
+is_plugin (const struct dirent *entry)
+{
+	size_t len = strlen (entry->d_name);
+
+	return ((len > 3) && (entry->d_name[0] != '.')
+		&& (! strcmp (entry->d_name + len - 3, ".so")));
+}
+#endif /* HAVE_DLOPEN */
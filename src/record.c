@@ -0,0 +1,525 @@
+/* live-f1
+ *
+ * record.c - recording of the raw data stream and key frames
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "stats.h"
+#include "record.h"
+
+
+/* Size of the ring that records are staged in before writing */
+#define STAGE_SIZE  65536
+
+/* Write staged records once this much is waiting, or they're this old */
+#define FLUSH_BYTES (STAGE_SIZE / 4)
+#define FLUSH_NS    250000000LL
+
+/* Largest record we believe when reading a capture back */
+#define MAX_RECORD  (16 * 1024 * 1024)
+
+
+/* Forward prototypes */
+static void          stage_bytes (const unsigned char *buf, size_t len);
+static int           write_iov   (struct iovec *iov, int iovcnt);
+static int           recover     (const char *filename, off_t size);
+
+
+/* Capture file being written, or -1 */
+static int capture_fd = -1;
+
+/* Ring of staged records not yet written */
+static unsigned char stage[STAGE_SIZE];
+static size_t        stage_tail = 0, staged = 0;
+
+/* Seconds between syncing to disk, and when we last wrote or synced */
+static int       sync_interval = 0;
+static long long last_flush = 0, last_sync = 0;
+
+
+/**
+ * put_le32:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value into @buf in little-endian byte order.
+ **/
+static inline void
+put_le32 (unsigned char *buf,
+	  unsigned long  value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * get_le32:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian value read from @buf.
+ **/
+static inline unsigned long
+get_le32 (const unsigned char *buf)
+{
+	return ((unsigned long) buf[3] << 24) | (buf[2] << 16)
+		| (buf[1] << 8) | buf[0];
+}
+
+
+/**
+ * open_capture:
+ * @filename: capture file to record to,
+ * @sync_secs: seconds between syncing to disk, or zero.
+ *
+ * Opens @filename to record everything read from the data stream and
+ * key frames with capture().  If the file already exists we append to
+ * it, first discarding any partial record left at the end by a crash.
+ *
+ * Records are staged in memory and written in batches by
+ * flush_capture(), which also syncs the file every @sync_secs seconds;
+ * if zero, that's left to the kernel.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_capture (const char *filename,
+	      int         sync_secs)
+{
+	struct stat statbuf;
+
+	capture_fd = open (filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (capture_fd < 0)
+		goto error;
+	if (fstat (capture_fd, &statbuf) < 0)
+		goto error;
+
+	if (statbuf.st_size > 0) {
+		if (recover (filename, statbuf.st_size))
+			goto close;
+	} else {
+		unsigned char header[CAPTURE_FILE_HEADER];
+
+		memcpy (header, CAPTURE_MAGIC, 4);
+		put_le32 (header + 4, CAPTURE_VERSION);
+		if (write (capture_fd, header, sizeof (header)) != sizeof (header))
+			goto error;
+	}
+
+	sync_interval = sync_secs;
+	last_flush = last_sync = monotonic_ns ();
+	stage_tail = staged = 0;
+
+	info (1, _("Recording to %s\n"), filename);
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to record"), filename, strerror (errno));
+close:
+	if (capture_fd >= 0)
+		close (capture_fd);
+	capture_fd = -1;
+
+	return 1;
+}
+
+/**
+ * recover:
+ * @filename: capture file,
+ * @size: size of the file.
+ *
+ * Checks the existing capture file, truncating it after the last
+ * complete record.
+ *
+ * Returns: 0 on success, non-zero if it isn't a capture file.
+ **/
+static int
+recover (const char *filename,
+	 off_t       size)
+{
+	unsigned char *buf;
+	size_t         bufsz, len = 0;
+	off_t          good, offset;
+	ssize_t        numr;
+
+	bufsz = 1024 * 1024;
+	buf = malloc (bufsz);
+	if (! buf)
+		abort ();
+
+	if ((pread (capture_fd, buf, CAPTURE_FILE_HEADER, 0)
+	     != CAPTURE_FILE_HEADER)
+	    || memcmp (buf, CAPTURE_MAGIC, 4)
+	    || (get_le32 (buf + 4) != CAPTURE_VERSION)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("not a capture file"));
+		free (buf);
+		return 1;
+	}
+
+	good = offset = CAPTURE_FILE_HEADER;
+	for (;;) {
+		CaptureRecord record;
+		size_t        pos = 0;
+		ssize_t       used;
+
+		numr = pread (capture_fd, buf + len, bufsz - len, offset);
+		if (numr <= 0)
+			break;
+		offset += numr;
+		len += numr;
+
+		while ((used = parse_capture_record (buf + pos, len - pos,
+						     &record)) > 0) {
+			pos += used;
+			good += used;
+		}
+		if (used < 0)
+			break;
+
+		/* Keep the incomplete record, making room if needed */
+		memmove (buf, buf + pos, len - pos);
+		len -= pos;
+		if (len == bufsz) {
+			bufsz *= 2;
+			buf = realloc (buf, bufsz);
+			if (! buf)
+				abort ();
+		}
+	}
+
+	free (buf);
+
+	if (good < size) {
+		info (1, _("Discarding %ld bytes at the end of %s\n"),
+		      (long) (size - good), filename);
+		if (ftruncate (capture_fd, good) < 0) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 filename, strerror (errno));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * capture:
+ * @source: where the data came from,
+ * @arg: source-specific argument,
+ * @buf: data read,
+ * @len: length of @buf.
+ *
+ * Records the data given, stamped with the current monotonic time, if
+ * we're recording.  The record is only copied into memory here; it's
+ * written by a later call to flush_capture().
+ **/
+void
+capture (CaptureSource  source,
+	 unsigned int   arg,
+	 const void    *buf,
+	 size_t         len)
+{
+	unsigned char header[CAPTURE_HEADER];
+
+	if (capture_fd < 0)
+		return;
+
+	put_capture_header (header, monotonic_ns (), source, arg, buf, len);
+
+	if (CAPTURE_HEADER + len > STAGE_SIZE - staged)
+		flush_capture (TRUE);
+
+	/* Too large to stage, write it straight out */
+	if (CAPTURE_HEADER + len > STAGE_SIZE) {
+		struct iovec iov[2];
+
+		iov[0].iov_base = header;
+		iov[0].iov_len = sizeof (header);
+		iov[1].iov_base = (void *) buf;
+		iov[1].iov_len = len;
+		write_iov (iov, 2);
+		return;
+	}
+
+	stage_bytes (header, sizeof (header));
+	stage_bytes (buf, len);
+
+	if (staged >= FLUSH_BYTES)
+		flush_capture (TRUE);
+}
+
+/**
+ * stage_bytes:
+ * @buf: bytes to stage,
+ * @len: length of @buf.
+ *
+ * Copies @buf into the staging ring, which must have room.
+ **/
+static void
+stage_bytes (const unsigned char *buf,
+	     size_t               len)
+{
+	size_t head, first;
+
+	head = (stage_tail + staged) % STAGE_SIZE;
+	first = MIN (len, STAGE_SIZE - head);
+
+	memcpy (stage + head, buf, first);
+	memcpy (stage, buf + first, len - first);
+	staged += len;
+}
+
+/**
+ * flush_capture:
+ * @force: write even if there's little waiting.
+ *
+ * Called from the main loop to write any staged records once enough
+ * are waiting, or they've been waiting long enough; since the ring may
+ * have wrapped, this is a single writev() of up to two pieces.  Also
+ * syncs the file to disk if it's time.
+ **/
+void
+flush_capture (int force)
+{
+	struct iovec iov[2];
+	long long    now;
+	int          iovcnt = 1;
+
+	if (capture_fd < 0)
+		return;
+
+	now = monotonic_ns ();
+	if (staged && (force || (staged >= FLUSH_BYTES)
+		       || (now - last_flush >= FLUSH_NS))) {
+		iov[0].iov_base = stage + stage_tail;
+		iov[0].iov_len = MIN (staged, STAGE_SIZE - stage_tail);
+		if (iov[0].iov_len < staged) {
+			iov[1].iov_base = stage;
+			iov[1].iov_len = staged - iov[0].iov_len;
+			iovcnt = 2;
+		}
+
+		if (write_iov (iov, iovcnt))
+			return;
+
+		stage_tail = staged = 0;
+		last_flush = now;
+	}
+
+	if ((sync_interval > 0)
+	    && (now - last_sync >= sync_interval * 1000000000LL)) {
+		fdatasync (capture_fd);
+		last_sync = now;
+	}
+}
+
+/**
+ * write_iov:
+ * @iov: pieces to write,
+ * @iovcnt: number of pieces in @iov.
+ *
+ * Writes all of @iov to the capture file, modifying it if the write is
+ * only partial.  If there's an error, recording is stopped rather than
+ * interrupting the display.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_iov (struct iovec *iov,
+	   int           iovcnt)
+{
+	ssize_t len;
+
+	while (iovcnt) {
+		len = writev (capture_fd, iov, iovcnt);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			info (0, _("Unable to write to capture file: %s\n"),
+			      strerror (errno));
+			close (capture_fd);
+			capture_fd = -1;
+			return 1;
+		}
+
+		while (iovcnt && ((size_t) len >= iov->iov_len)) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *) iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * close_capture:
+ *
+ * Writes any staged records, syncs and closes the capture file.
+ **/
+void
+close_capture (void)
+{
+	if (capture_fd < 0)
+		return;
+
+	flush_capture (TRUE);
+	if (capture_fd < 0)
+		return;
+
+	fdatasync (capture_fd);
+	close (capture_fd);
+	capture_fd = -1;
+}
+
+
+/**
+ * parse_capture_record:
+ * @buf: buffer containing a capture file, after the file header,
+ * @len: length of @buf,
+ * @record: record to fill.
+ *
+ * Parses the record at the start of @buf, filling @record; the data
+ * pointer in @record points into @buf and is not copied.
+ *
+ * Returns: number of bytes used, 0 if @buf doesn't hold a complete
+ * record, or -1 if the record is corrupt.
+ **/
+ssize_t
+parse_capture_record (const unsigned char *buf,
+		      size_t               len,
+		      CaptureRecord       *record)
+{
+	unsigned long check;
+
+	if (len < CAPTURE_HEADER)
+		return 0;
+
+	record->time_ns = (long long) (((unsigned long long) get_le32 (buf + 4)
+					<< 32) | get_le32 (buf));
+	record->len = get_le32 (buf + 8);
+	record->arg = get_le32 (buf + 12);
+	record->source = buf[16];
+	record->data = buf + CAPTURE_HEADER;
+
+	if ((record->len > MAX_RECORD) || (! record->source)
+	    || (record->source >= LAST_CAPTURE_SOURCE))
+		return -1;
+	if (len < CAPTURE_HEADER + record->len)
+		return 0;
+
+	check = adler32_sum (1, buf, 20);
+	check = adler32_sum (check, record->data, record->len);
+	if (check != get_le32 (buf + 20))
+		return -1;
+
+	return CAPTURE_HEADER + record->len;
+}
+
+/**
+ * put_capture_header:
+ * @header: CAPTURE_HEADER bytes to fill,
+ * @time_ns: time the data was read,
+ * @source: where the data came from,
+ * @arg: source-specific argument,
+ * @buf: data of the record,
+ * @len: length of @buf.
+ *
+ * Fills @header with the header for a record of @buf, including its
+ * checksum.
+ **/
+void
+put_capture_header (unsigned char *header,
+		    long long      time_ns,
+		    CaptureSource  source,
+		    unsigned int   arg,
+		    const void    *buf,
+		    size_t         len)
+{
+	unsigned long check;
+
+	put_le32 (header, time_ns & 0xffffffffUL);
+	put_le32 (header + 4, (unsigned long long) time_ns >> 32);
+	put_le32 (header + 8, len);
+	put_le32 (header + 12, arg);
+	header[16] = source;
+	header[17] = header[18] = header[19] = 0;
+
+	check = adler32_sum (1, header, 20);
+	check = adler32_sum (check, buf, len);
+	put_le32 (header + 20, check);
+}
+
+/**
+ * adler32_sum:
+ * @adler: checksum so far, 1 to begin,
+ * @buf: bytes to add,
+ * @len: length of @buf.
+ *
+ * Returns: Adler-32 checksum of the bytes so far and @buf.
+ **/
+unsigned long
+adler32_sum (unsigned long        adler,
+	     const unsigned char *buf,
+	     size_t               len)
+{
+	unsigned long a = adler & 0xffff, b = (adler >> 16) & 0xffff;
+	size_t        n;
+
+	while (len) {
+		/* Largest run that can't overflow before the modulo */
+		n = MIN (len, 5552);
+		len -= n;
+
+		while (n--) {
+			a += *(buf++);
+			b += a;
+		}
+
+		a %= 65521;
+		b %= 65521;
+	}
+
+	return (b << 16) | a;
+}
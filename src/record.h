@@ -0,0 +1,94 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_RECORD_H
+#define LIVE_F1_RECORD_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+/* Capture file magic, and the size of the file header */
+#define CAPTURE_MAGIC       "LF1C"
+#define CAPTURE_VERSION     1
+#define CAPTURE_FILE_HEADER 8
+
+/* Size of the header before each record's data */
+#define CAPTURE_HEADER      24
+
+
+/**
+ * CaptureSource:
+ *
+ * Where the data in a capture record came from; @arg in the record
+ * gives the key frame number for CAPTURE_KEY_FRAME and the event number
+ * for CAPTURE_KEY.
+ **/
+typedef enum {
+	CAPTURE_STREAM		= 1,
+	CAPTURE_KEY_FRAME	= 2,
+	CAPTURE_KEY		= 3,
+	CAPTURE_TOTAL_LAPS	= 4,
+	LAST_CAPTURE_SOURCE
+} CaptureSource;
+
+/**
+ * CaptureRecord:
+ * @time_ns: CLOCK_MONOTONIC time the data was read, in nanoseconds,
+ * @source: where the data came from,
+ * @arg: source-specific argument,
+ * @len: length of @data,
+ * @data: pointer to the data, within the buffer parsed.
+ *
+ * A single record from a capture file.  On disk each record is a
+ * CAPTURE_HEADER byte header, of little-endian fields: 64-bit time,
+ * 32-bit length, 32-bit argument, 8-bit source, three reserved bytes
+ * and a 32-bit Adler-32 checksum of everything else in the record; then
+ * the data itself.
+ **/
+typedef struct {
+	long long            time_ns;
+	CaptureSource        source;
+	unsigned int         arg;
+	size_t               len;
+	const unsigned char *data;
+} CaptureRecord;
+
+
+SJR_BEGIN_EXTERN
+
+int     open_capture         (const char *filename, int sync_secs);
+void    capture              (CaptureSource source, unsigned int arg,
+			      const void *buf, size_t len);
+void    flush_capture        (int force);
+void    close_capture        (void);
+
+ssize_t parse_capture_record (const unsigned char *buf, size_t len,
+			      CaptureRecord *record);
+void    put_capture_header   (unsigned char *header, long long time_ns,
+			      CaptureSource source, unsigned int arg,
+			      const void *buf, size_t len);
+
+unsigned long adler32_sum    (unsigned long adler,
+			      const unsigned char *buf, size_t len);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_RECORD_H */
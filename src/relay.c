@@ -0,0 +1,643 @@
+/* live-f1
+ *
+ * relay.c - pass the raw data stream on to other copies of live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "chunk.h"
+#include "http.h"
+#include "httpd.h"
+#include "keyframe.h"
+#include "packet.h"
+#include "stream.h"
+#include "watch.h"
+#include "relay.h"
+
+
+/* Most downstream connections at once; any more are closed straight
+ * away */
+#define RELAY_MAX_CLIENTS  256
+
+/* Most of the stream kept since the last key frame marker for those
+ * joining late; past this they wait for the next marker instead */
+#define RELAY_TAIL_MAX     (4 * 1024 * 1024)
+
+/* Key frames kept to answer requests for them */
+#define RELAY_KEY_FRAMES   16
+
+/**
+ * RelayClient:
+ * @fd: connected socket,
+ * @joined: whether it's been sent the start of the stream yet,
+ * @queue: chunks waiting to be sent.
+ *
+ * A downstream copy of live-f1 connected to the relay.
+ **/
+typedef struct {
+	int         fd;
+	int         joined;
+	ChunkQueue  queue;
+} RelayClient;
+
+/**
+ * RelayKeyFrame:
+ * @frame: key frame number,
+ * @chunk: its contents.
+ *
+ * A key frame fetched on behalf of downstream.
+ **/
+typedef struct {
+	unsigned int  frame;
+	Chunk        *chunk;
+} RelayKeyFrame;
+
+
+/* Forward prototypes */
+static void accept_client   (void *data, int fd, short revents);
+static void client_ready    (void *data, int fd, short revents);
+static void join_clients    (void);
+static void queue_chunk     (RelayClient *client, Chunk *chunk);
+static void send_queue      (RelayClient *client);
+static void drop_client     (RelayClient *client);
+static void follow_stream   (const unsigned char *buf, size_t len);
+static void keep_tail       (const unsigned char *buf, size_t len);
+static void serve_key       (HttpClient *client, const char *path,
+			     const char *query);
+static void serve_key_frame (HttpClient *client, const char *path,
+			     const char *query);
+
+
+/* Application state, for the key and key frame number */
+static CurrentState *relay_state = NULL;
+
+/* Listening socket */
+static int listen_fd = -1;
+
+/* Downstream connections */
+static RelayClient **clients = NULL;
+static int           nclients = 0;
+
+/* Header of the packet being read, and how much of it there is */
+static unsigned char hdr[2];
+static size_t        hdr_len = 0;
+
+/* Payload bytes of the packet being read still to come */
+static size_t need = 0;
+
+/* Event identifier packet that began the stream, and whether it's
+ * still being read */
+static unsigned char event[2 + 128];
+static size_t        event_len = 0;
+static int           in_event = FALSE;
+
+/* The stream since the event identifier packet or last key frame
+ * marker, and whether it's complete */
+static unsigned char *tail = NULL;
+static size_t         tail_len = 0, tail_size = 0;
+static int            tail_valid = FALSE;
+
+/* Start of the stream as sent to those joining, until it changes */
+static Chunk *start = NULL;
+
+/* Key frames fetched, oldest replaced first */
+static RelayKeyFrame key_frames[RELAY_KEY_FRAMES];
+static int           next_key_frame = 0;
+
+
+/**
+ * open_relay:
+ * @where: port to listen on, optionally preceded by an address and colon,
+ * @state: application state structure.
+ *
+ * Listens on @where, on any address unless one is given, for other
+ * copies of live-f1 to connect to in place of the live timing server.
+ * Everything read from the server is passed on to each of them
+ * unchanged, and any pings they send are thrown away; one that joins
+ * part way through is first sent the event identifier packet and the
+ * stream since the last key frame marker, so that its decryption salt
+ * is in step with ours.
+ *
+ * The key and key frames are also served over HTTP, if open_httpd() is
+ * used, so that downstream can be pointed at us entirely.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_relay (const char   *where,
+	    CurrentState *state)
+{
+	relay_state = state;
+
+	listen_fd = listen_stream (where, NULL);
+	if (listen_fd < 0)
+		return 1;
+
+	if (add_watch (listen_fd, POLLIN, accept_client, NULL) < 0) {
+		close (listen_fd);
+		listen_fd = -1;
+		return 1;
+	}
+
+	add_http_handler ("/reg/getkey/*", serve_key);
+	add_http_handler ("/keyframe*", serve_key_frame);
+
+	info (1, _("Relaying data stream on %s\n"), where);
+
+	return 0;
+}
+
+/**
+ * relay_block:
+ * @buf: block of data read from the server,
+ * @len: length of @buf.
+ *
+ * Passes @buf on to every connection, as a single chunk whatever their
+ * number.  Any that have fallen too far behind are dropped.
+ **/
+void
+relay_block (const unsigned char *buf,
+	     size_t               len)
+{
+	Chunk *chunk;
+	int    i;
+
+	if (listen_fd < 0)
+		return;
+
+	follow_stream (buf, len);
+	if (start) {
+		unref_chunk (start);
+		start = NULL;
+	}
+
+	chunk = new_chunk (buf, len);
+	for (i = nclients - 1; i >= 0; i--)
+		if (clients[i]->joined)
+			queue_chunk (clients[i], chunk);
+	unref_chunk (chunk);
+
+	join_clients ();
+}
+
+/**
+ * reset_relay:
+ *
+ * Drops every connection, since the stream they were following has
+ * ended, and forgets it; called each time we connect to the server.
+ **/
+void
+reset_relay (void)
+{
+	while (nclients)
+		drop_client (clients[0]);
+
+	if (start) {
+		unref_chunk (start);
+		start = NULL;
+	}
+
+	hdr_len = need = 0;
+	event_len = 0;
+	in_event = FALSE;
+	tail_len = 0;
+	tail_valid = FALSE;
+}
+
+/**
+ * close_relay:
+ *
+ * Drops every connection and stops listening.
+ **/
+void
+close_relay (void)
+{
+	int i;
+
+	reset_relay ();
+
+	for (i = 0; i < RELAY_KEY_FRAMES; i++) {
+		if (key_frames[i].chunk)
+			unref_chunk (key_frames[i].chunk);
+		key_frames[i].chunk = NULL;
+	}
+
+	free (tail);
+	tail = NULL;
+	tail_size = 0;
+
+	if (listen_fd < 0)
+		return;
+
+	remove_watch (listen_fd);
+	close (listen_fd);
+	listen_fd = -1;
+}
+
+
+/**
+ * follow_stream:
+ * @buf: block of data read from the server,
+ * @len: length of @buf.
+ *
+ * Follows the packet headers through @buf, without decrypting
+ * anything, to keep the event identifier packet and the stream since
+ * the last key frame marker.
+ **/
+static void
+follow_stream (const unsigned char *buf,
+	       size_t               len)
+{
+	while (len) {
+		Packet packet;
+		size_t n;
+
+		if (need) {
+			n = MIN (need, len);
+			if (in_event) {
+				memcpy (event + event_len, buf, n);
+				event_len += n;
+			} else {
+				keep_tail (buf, n);
+			}
+
+			need -= n;
+			buf += n;
+			len -= n;
+			continue;
+		}
+
+		hdr[hdr_len++] = *(buf++);
+		len--;
+		if (hdr_len < 2)
+			continue;
+
+		hdr_len = 0;
+		packet_header (&packet, hdr);
+		need = MAX (packet.len, 0);
+
+		if ((! packet.car) && (packet.type == SYS_EVENT_ID)) {
+			memcpy (event, hdr, 2);
+			event_len = 2;
+			in_event = TRUE;
+
+			tail_len = 0;
+			tail_valid = TRUE;
+			continue;
+		} else if ((! packet.car) && (packet.type == SYS_KEY_FRAME)) {
+			tail_len = 0;
+			tail_valid = (event_len > 0);
+		}
+
+		in_event = FALSE;
+		keep_tail (hdr, 2);
+	}
+}
+
+/**
+ * keep_tail:
+ * @buf: bytes of the stream,
+ * @len: length of @buf.
+ *
+ * Appends @buf to the stream kept for those joining, unless it's grown
+ * too long, in which case nobody joins until the next marker.
+ **/
+static void
+keep_tail (const unsigned char *buf,
+	   size_t               len)
+{
+	if (! tail_valid)
+		return;
+
+	if (tail_len + len > RELAY_TAIL_MAX) {
+		tail_len = 0;
+		tail_valid = FALSE;
+		return;
+	}
+
+	if (tail_len + len > tail_size) {
+		tail_size = MAX (tail_size * 2, 4096);
+		while (tail_size < tail_len + len)
+			tail_size *= 2;
+
+		tail = realloc (tail, tail_size);
+		if (! tail)
+			abort ();
+	}
+
+	memcpy (tail + tail_len, buf, len);
+	tail_len += len;
+}
+
+/**
+ * join_clients:
+ *
+ * Sends the start of the stream to any connection still waiting for it,
+ * if we have it and are between packets; it's only formatted once until
+ * it changes.
+ **/
+static void
+join_clients (void)
+{
+	int i;
+
+	if ((! tail_valid) || hdr_len || (in_event && need))
+		return;
+
+	for (i = nclients - 1; i >= 0; i--) {
+		if (clients[i]->joined)
+			continue;
+
+		if (! start) {
+			start = new_chunk (NULL, event_len + tail_len);
+			memcpy (start->data, event, event_len);
+			memcpy (start->data + event_len, tail, tail_len);
+		}
+
+		clients[i]->joined = TRUE;
+		queue_chunk (clients[i], start);
+	}
+}
+
+
+/**
+ * accept_client:
+ * @data: unused,
+ * @fd: listening socket,
+ * @revents: events that occurred.
+ *
+ * Accepts a new connection and sends it the start of the stream, or
+ * leaves it waiting until there is one.
+ **/
+static void
+accept_client (void  *data,
+	       int    fd,
+	       short  revents)
+{
+	RelayClient *client;
+	int          sock;
+
+	sock = accept (fd, NULL, NULL);
+	if (sock < 0)
+		return;
+
+	if (nclients >= RELAY_MAX_CLIENTS) {
+		close (sock);
+		return;
+	}
+
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+
+	client = calloc (1, sizeof (RelayClient));
+	clients = realloc (clients, sizeof (RelayClient *) * (nclients + 1));
+	if ((! client) || (! clients))
+		abort ();
+
+	client->fd = sock;
+	clients[nclients++] = client;
+
+	add_watch (sock, POLLIN, client_ready, client);
+	info (3, _("Relay connection accepted\n"));
+
+	join_clients ();
+}
+
+/**
+ * client_ready:
+ * @data: connection,
+ * @fd: its socket,
+ * @revents: events that occurred.
+ *
+ * Throws away the pings sent on a connection, noticing when it's
+ * closed; or carries on sending once the socket has room.
+ **/
+static void
+client_ready (void  *data,
+	      int    fd,
+	      short  revents)
+{
+	RelayClient *client = data;
+
+	if (revents & POLLIN) {
+		char    buf[64];
+		ssize_t len;
+
+		len = read (fd, buf, sizeof (buf));
+		if ((len == 0) || ((len < 0) && (errno != EAGAIN)
+				   && (errno != EINTR))) {
+			drop_client (client);
+			return;
+		}
+	} else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		drop_client (client);
+		return;
+	}
+
+	if (revents & POLLOUT)
+		send_queue (client);
+}
+
+/**
+ * queue_chunk:
+ * @client: connection,
+ * @chunk: chunk to send.
+ *
+ * Adds @chunk to the queue for @client and sends what it can straight
+ * away.  A connection too far behind is dropped rather than letting the
+ * queue grow; it will have lost its place in the stream anyway.
+ **/
+static void
+queue_chunk (RelayClient *client,
+	     Chunk       *chunk)
+{
+	if (push_chunk (&client->queue, chunk) < 0) {
+		info (2, _("Relay connection fell behind\n"));
+		drop_client (client);
+		return;
+	}
+
+	/* Already waiting for room */
+	if (client->queue.count > 1)
+		return;
+
+	send_queue (client);
+}
+
+/**
+ * send_queue:
+ * @client: connection.
+ *
+ * Sends as much of the queue for @client as its socket will take, and
+ * waits for room for the rest.
+ **/
+static void
+send_queue (RelayClient *client)
+{
+	if (send_chunks (&client->queue, client->fd) < 0) {
+		drop_client (client);
+		return;
+	}
+
+	change_watch (client->fd, (client->queue.count
+				   ? POLLIN | POLLOUT : POLLIN));
+}
+
+/**
+ * drop_client:
+ * @client: connection.
+ *
+ * Closes @client and frees it, along with anything still queued.
+ **/
+static void
+drop_client (RelayClient *client)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (clients[i] == client) {
+			clients[i] = clients[--nclients];
+			break;
+		}
+	}
+
+	clear_chunks (&client->queue);
+
+	remove_watch (client->fd);
+	close (client->fd);
+	free (client);
+}
+
+
+/**
+ * serve_key:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Answers a request for the decryption key of an event, in the same
+ * way as the live timing website, if it's the one we're following.
+ * No login is needed.
+ **/
+static void
+serve_key (HttpClient *client,
+	   const char *path,
+	   const char *query)
+{
+	CurrentState *state = relay_state;
+	unsigned int  event_no;
+	char          body[16];
+
+	if ((sscanf (path, "/reg/getkey/%u.asp", &event_no) != 1)
+	    || (event_no != state->event_no) || (! state->key)) {
+		http_respond (client, 404, "text/plain", "", 0);
+		return;
+	}
+
+	sprintf (body, "%08x", state->key);
+	http_respond (client, 200, "text/plain", body, strlen (body));
+}
+
+/**
+ * serve_key_frame:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Answers a request for a key frame.  The latest is taken to be the last
+ * we've seen a marker for, and is made from our own board so long as
+ * we're decrypting the stream; what follows the marker then brings it
+ * back up to date again.  Any other is served from those already
+ * fetched where possible, since fetching one blocks, as it does when we
+ * need one ourselves.
+ **/
+static void
+serve_key_frame (HttpClient *client,
+		 const char *path,
+		 const char *query)
+{
+	CurrentState *state = relay_state;
+	unsigned int  frame;
+	char         *buf;
+	size_t        len;
+	int           i;
+
+	if (! strcmp (path, "/keyframe.bin")) {
+		frame = state->frame;
+	} else if ((sscanf (path, "/keyframe_%u.bin", &frame) != 1)
+		   || (! frame)) {
+		http_respond (client, 404, "text/plain", "", 0);
+		return;
+	}
+
+	if (frame && (frame == state->frame) && state->key
+	    && (! state->decryption_failure)) {
+		buf = (char *) encode_key_frame (state, &len);
+		if (buf) {
+			http_respond (client, 200, "application/octet-stream",
+				      buf, len);
+			free (buf);
+			return;
+		}
+	}
+
+	for (i = 0; frame && (i < RELAY_KEY_FRAMES); i++) {
+		if (key_frames[i].chunk && (key_frames[i].frame == frame)) {
+			http_respond (client, 200, "application/octet-stream",
+				      (const char *) key_frames[i].chunk->data,
+				      key_frames[i].chunk->len);
+			return;
+		}
+	}
+
+	buf = fetch_key_frame (state->host, frame, &len);
+	if (! buf) {
+		http_respond (client, 502, "text/plain", "", 0);
+		return;
+	}
+
+	http_respond (client, 200, "application/octet-stream", buf, len);
+
+	if (frame) {
+		RelayKeyFrame *kf = &key_frames[next_key_frame];
+
+		if (kf->chunk)
+			unref_chunk (kf->chunk);
+		kf->frame = frame;
+		kf->chunk = new_chunk (buf, len);
+
+		next_key_frame = (next_key_frame + 1) % RELAY_KEY_FRAMES;
+	}
+
+	free (buf);
+}
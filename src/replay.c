@@ -0,0 +1,785 @@
+/* live-f1
+ *
+ * replay.c - playing back recorded data streams
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/poll.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "archive.h"
+#include "display.h"
+#include "index.h"
+#include "mapfile.h"
+#include "packet.h"
+#include "record.h"
+#include "stats.h"
+#include "stream.h"
+#include "watch.h"
+#include "replay.h"
+
+
+/* Size of the reads a raw dump is split into, as read_stream() does */
+#define RAW_READ_SIZE 512
+
+/* Most key frames to try to find when seeking */
+#define SEEK_ATTEMPTS 16
+
+
+/**
+ * SideRecord:
+ * @source: CAPTURE_KEY, CAPTURE_KEY_FRAME or CAPTURE_TOTAL_LAPS,
+ * @arg: argument of the record,
+ * @key: decryption key, for CAPTURE_KEY,
+ * @off: offset of the record,
+ * @end: offset after the record, or after the last record of the same
+ * copy of a key frame,
+ * @after: offset after the last read from the data stream before it.
+ *
+ * Record in a capture file other than a read from the data stream,
+ * found when it's opened so that it needn't be searched for.
+ **/
+typedef struct {
+	CaptureSource source;
+	unsigned int  arg;
+	unsigned int  key;
+	size_t        off, end, after;
+} SideRecord;
+
+
+/* Forward prototypes */
+static void         find_side_records (void);
+static int          next_record     (CaptureRecord *record, size_t *next);
+static long long    virtual_ns      (void);
+static unsigned int replay_key      (CurrentState *state,
+				     unsigned int event_no);
+static int          replay_key_frame (CurrentState *state,
+				      unsigned int frame);
+static unsigned int replay_laps     (CurrentState *state);
+static time_t       replay_time     (CurrentState *state);
+static void         seek_to         (CurrentState *state, SeekBy by,
+				     long long value);
+
+
+/* Replayed data; framed if a capture file, otherwise a raw dump */
+static MappedFile     recording = { NULL, 0, FALSE };
+static const unsigned char *data = NULL;
+static size_t         data_len = 0, pos = 0;
+static int            framed = FALSE;
+
+/* Bytes of the next read already played, after a seek */
+static size_t         skip = 0;
+
+/* Key frame markers in the recording */
+static SeekIndex      seek_index = { NULL, 0, 0 };
+
+/* Keys, key frames and total laps in the recording, in order */
+static SideRecord    *side = NULL;
+static size_t         num_side = 0;
+
+/* Directory of key frame files, and key given by the user */
+static const char    *key_frames = NULL;
+static unsigned int   given_key = 0;
+
+/* Playback speed, 0 for as fast as possible */
+static double         speed = 1.0;
+
+/* Clock used for scheduling; and the recorded time at a clock time */
+static ReplayClock    clock_func = NULL;
+static long long      base_clock = 0, base_time = 0;
+
+/* Recorded time of the first and latest reads */
+static long long      first_time = 0, last_time = 0;
+static time_t         start_time = 0;
+
+/* Whether playback is paused, and if we should do a read anyway */
+static int            paused = FALSE, stepping = FALSE;
+
+/* Sources of keys and key frames while replaying */
+static const DataSource replay_source = {
+	replay_key,
+	replay_key_frame,
+	replay_laps,
+	replay_time,
+};
+
+
+/**
+ * open_replay:
+ * @state: application state structure,
+ * @filename: recording to play back,
+ * @key_frame_dir: directory of key frame files, or NULL,
+ * @key: decryption key, or zero,
+ * @speed: playback speed multiplier, or zero.
+ *
+ * Opens a recording to be played back through the usual stream parser
+ * by read_replay(), at @speed times real time; or as fast as possible,
+ * without drawing anything until the end, if @speed is zero.
+ *
+ * @filename may be a capture file written with --record, which has the
+ * time of each read and contains the key frames and decryption key; or
+ * a raw dump of the data stream, which has no times so is always
+ * played as fast as possible.  Key frames not in the recording are
+ * read from files named as on the web site in @key_frame_dir, and @key
+ * is used if the recording doesn't contain one.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_replay (CurrentState *state,
+	     const char   *filename,
+	     const char   *key_frame_dir,
+	     unsigned int  key,
+	     double        replay_speed)
+{
+	CaptureRecord record;
+	size_t        next;
+
+	if (map_file (&recording, filename)) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to replay"), filename, strerror (errno));
+		return 1;
+	}
+
+	/* Archives are unpacked in memory, and played from there */
+	if ((recording.len >= ARCHIVE_FILE_HEADER)
+	    && (! memcmp (recording.data, ARCHIVE_MAGIC, 4))) {
+		Archive       archive;
+		ArchiveOutput out;
+
+		memset (&out, 0, sizeof (out));
+		if (open_archive (&archive, recording.data, recording.len)
+		    || read_archive (&archive, &out)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 filename, _("archive is corrupt"));
+			close_archive (&archive);
+			unmap_file (&recording);
+			free (out.buf);
+			return 1;
+		}
+		close_archive (&archive);
+		unmap_file (&recording);
+
+		recording.data = out.buf;
+		recording.len = out.len;
+	}
+
+	data = recording.data;
+	data_len = recording.len;
+	framed = ((data_len >= CAPTURE_FILE_HEADER)
+		  && (! memcmp (data, CAPTURE_MAGIC, 4)));
+	pos = framed ? CAPTURE_FILE_HEADER : 0;
+	skip = 0;
+	find_side_records ();
+
+	key_frames = key_frame_dir;
+	given_key = key;
+	speed = framed ? MAX (replay_speed, 0.0) : 0.0;
+
+	if (! clock_func)
+		clock_func = monotonic_ns;
+
+	first_time = last_time = 0;
+	if (next_record (&record, &next))
+		first_time = last_time = record.time_ns;
+
+	base_clock = clock_func ();
+	base_time = first_time;
+	start_time = time (NULL);
+	paused = stepping = FALSE;
+
+	state->source = &replay_source;
+	if (! speed)
+		suspend_display (state, TRUE);
+
+	update_index (&seek_index, state, filename, data, data_len, framed);
+
+	info (1, _("Replaying %s ...\n"), filename);
+
+	return 0;
+}
+
+/**
+ * close_replay:
+ * @state: application state structure.
+ *
+ * Finishes playing back, drawing the display if it wasn't being drawn.
+ **/
+void
+close_replay (CurrentState *state)
+{
+	suspend_display (state, FALSE);
+
+	free_index (&seek_index);
+	free (side);
+	side = NULL;
+	num_side = 0;
+	unmap_file (&recording);
+	data = NULL;
+	data_len = pos = skip = 0;
+}
+
+/**
+ * find_side_records:
+ *
+ * Goes through a capture file once to find the records that aren't
+ * reads from the data stream, which replay_key(), replay_key_frame()
+ * and replay_laps() then look up; consecutive records of the same key
+ * frame are one copy of it.
+ **/
+static void
+find_side_records (void)
+{
+	CaptureRecord record;
+	SideRecord   *last = NULL;
+	size_t        off, after, alloc = 0;
+	ssize_t       used;
+
+	after = CAPTURE_FILE_HEADER;
+	for (off = CAPTURE_FILE_HEADER; framed && (off < data_len); off += used) {
+		used = parse_capture_record (data + off, data_len - off,
+					     &record);
+		if (used <= 0)
+			break;
+
+		if (record.source == CAPTURE_STREAM) {
+			after = off + used;
+			last = NULL;
+			continue;
+		} else if ((record.source == CAPTURE_KEY_FRAME) && last
+			   && (last->source == CAPTURE_KEY_FRAME)
+			   && (last->arg == record.arg)) {
+			last->end = off + used;
+			continue;
+		} else if (((record.source == CAPTURE_KEY)
+			    && (record.len != 4))
+			   || ((record.source != CAPTURE_KEY)
+			       && (record.source != CAPTURE_KEY_FRAME)
+			       && (record.source != CAPTURE_TOTAL_LAPS))) {
+			last = NULL;
+			continue;
+		}
+
+		if (num_side == alloc) {
+			alloc = MAX (alloc * 2, 64);
+			side = realloc (side, sizeof (SideRecord) * alloc);
+			if (! side)
+				abort ();
+		}
+
+		last = &side[num_side++];
+		last->source = record.source;
+		last->arg = record.arg;
+		last->key = 0;
+		last->off = off;
+		last->end = off + used;
+		last->after = after;
+
+		if (record.source == CAPTURE_KEY)
+			last->key = (((unsigned int) record.data[3] << 24)
+				     | (record.data[2] << 16)
+				     | (record.data[1] << 8) | record.data[0]);
+	}
+}
+
+/**
+ * next_record:
+ * @record: record to fill,
+ * @next: pointer to store offset after the record.
+ *
+ * Finds the next read from the data stream in the recording, skipping
+ * over key frames and such which are only read when asked for.  For a
+ * raw dump, each read is the next RAW_READ_SIZE bytes.
+ *
+ * Returns: TRUE if there was one, FALSE at the end.
+ **/
+static int
+next_record (CaptureRecord *record,
+	     size_t        *next)
+{
+	ssize_t used;
+
+	if (! framed) {
+		if (pos >= data_len)
+			return FALSE;
+
+		record->time_ns = 0;
+		record->source = CAPTURE_STREAM;
+		record->arg = 0;
+		record->data = data + pos;
+		record->len = MIN (data_len - pos, RAW_READ_SIZE);
+
+		*next = pos + record->len;
+		return TRUE;
+	}
+
+	while ((used = parse_capture_record (data + pos, data_len - pos,
+					     record)) > 0) {
+		if (record->source == CAPTURE_STREAM) {
+			record->data += MIN (skip, record->len);
+			record->len -= MIN (skip, record->len);
+
+			*next = pos + used;
+			return TRUE;
+		}
+
+		pos += used;
+	}
+
+	if (used < 0)
+		info (1, _("Recording is corrupt, stopping early\n"));
+
+	pos = data_len;
+	return FALSE;
+}
+
+/**
+ * read_replay:
+ * @state: application state structure.
+ *
+ * Replays the next read from the recording once it's due, which is
+ * when as much time has passed on the replay clock since the start,
+ * scaled by the playback speed, as had passed when it was recorded.
+ * Until then, or while paused, waits for up to a tenth of a second
+ * polling any other watched file descriptors; the same as
+ * read_stream() does.
+ *
+ * Returns: 0 at the end of the recording, > 0 otherwise.
+ **/
+int
+read_replay (CurrentState *state)
+{
+	CaptureRecord record;
+	struct pollfd none;
+	size_t        next;
+
+	if (! next_record (&record, &next))
+		return 0;
+
+	if (speed && (! stepping)) {
+		long long wait = 100;
+
+		if (! paused) {
+			long long now = virtual_ns ();
+
+			if (record.time_ns <= now)
+				wait = 0;
+			else
+				wait = MIN ((record.time_ns - now) / speed
+					    / 1000000 + 1, 100);
+		}
+
+		if (wait) {
+			none.fd = -1;
+			none.events = 0;
+			poll_watches (&none, wait);
+			return 1;
+		}
+	}
+
+	pos = next;
+	skip = 0;
+	last_time = record.time_ns;
+	if (stepping) {
+		/* Let the clock jump to the read we just did */
+		base_time = last_time;
+		base_clock = clock_func ();
+		stepping = FALSE;
+	}
+
+	stats.bytes += record.len;
+	stats.reads++;
+
+	parse_stream_block (state, record.data, record.len);
+	return MAX (record.len, 1);
+}
+
+/**
+ * virtual_ns:
+ *
+ * Returns: recorded time that playback has reached.
+ **/
+static long long
+virtual_ns (void)
+{
+	if ((! speed) || paused)
+		return MAX (base_time, last_time);
+
+	return base_time + (long long) ((clock_func () - base_clock) * speed);
+}
+
+/**
+ * set_replay_clock:
+ * @clock: function returning the time in nanoseconds.
+ *
+ * Changes the clock that replayed reads are scheduled by.
+ **/
+void
+set_replay_clock (ReplayClock clock)
+{
+	clock_func = clock;
+	base_clock = clock_func ();
+}
+
+/**
+ * pause_replay:
+ *
+ * Pauses playback, or resumes it from where it was paused.
+ **/
+void
+pause_replay (void)
+{
+	if (! data)
+		return;
+
+	if (paused) {
+		base_clock = clock_func ();
+		paused = FALSE;
+	} else {
+		base_time = virtual_ns ();
+		paused = TRUE;
+	}
+}
+
+/**
+ * step_replay:
+ *
+ * Does the next read from the recording straight away, even if
+ * playback is paused.
+ **/
+void
+step_replay (void)
+{
+	if (! data)
+		return;
+
+	stepping = TRUE;
+}
+
+/**
+ * seek_replay:
+ * @state: application state structure,
+ * @where: where to seek to.
+ *
+ * Seeks playback to @where, which may be "lap:N" for when the leader
+ * completes lap N, "frame:N" for key frame N, or a time into the
+ * recording as "[H:]MM:SS"; raw dumps have no times, so can only be
+ * seeked by lap or key frame.
+ *
+ * Returns: 0 on success, non-zero if @where wasn't understood.
+ **/
+int
+seek_replay (CurrentState *state,
+	     const char   *where)
+{
+	long long value = 0;
+	char     *end;
+
+	if (! strncmp (where, "lap:", 4)) {
+		value = strtol (where + 4, &end, 10);
+		if ((end == where + 4) || *end)
+			return 1;
+
+		seek_to (state, SEEK_LAP, value);
+		return 0;
+	} else if (! strncmp (where, "frame:", 6)) {
+		value = strtol (where + 6, &end, 10);
+		if ((end == where + 6) || *end)
+			return 1;
+
+		seek_to (state, SEEK_FRAME, value);
+		return 0;
+	}
+
+	do {
+		const char *field = where;
+
+		value = value * 60 + strtol (field, &end, 10);
+		if (end == field)
+			return 1;
+
+		where = end + 1;
+	} while (*end == ':');
+	if (*end || (! framed))
+		return 1;
+
+	seek_to (state, SEEK_TIME, first_time + value * 1000000000LL);
+	return 0;
+}
+
+/**
+ * seek_replay_laps:
+ * @state: application state structure,
+ * @laps: number of laps to move by.
+ *
+ * Seeks playback forwards, or backwards if @laps is negative, by that
+ * many of the leader's laps.
+ **/
+void
+seek_replay_laps (CurrentState *state,
+		  int           laps)
+{
+	if (! data)
+		return;
+
+	seek_to (state, SEEK_LAP,
+		 MAX ((long long) state->laps_completed + laps, 0));
+}
+
+/**
+ * seek_to:
+ * @state: application state structure,
+ * @by: what @value is measured in,
+ * @value: where to seek to.
+ *
+ * Finds the last key frame marker before @value in the index, applies
+ * the key frame and plays forward from just after the marker without
+ * drawing anything until @value is reached.  If the key frame isn't in
+ * the recording or the key frame directory, earlier ones are tried,
+ * and failing that we play forward from the start.
+ **/
+static void
+seek_to (CurrentState *state,
+	 SeekBy        by,
+	 long long     value)
+{
+	const IndexEntry *entry;
+	CaptureRecord     record;
+	size_t            next;
+	int               attempts = 0;
+
+	entry = find_key_frame (&seek_index, by, value);
+
+	suspend_display (state, TRUE);
+	for (; entry; entry = ((entry > seek_index.entries)
+			       ? entry - 1 : NULL)) {
+		if ((! (entry->flags & INDEX_HAVE_KEY_FRAME))
+		    && (! key_frames))
+			continue;
+		if (attempts++ >= SEEK_ATTEMPTS) {
+			entry = NULL;
+			break;
+		}
+
+		reset_state (state);
+		reset_stream (state);
+
+		pos = entry->record;
+		state->event_no = entry->event_no;
+		state->key = get_decryption_key (state, entry->event_no);
+		state->frame = entry->frame;
+		if (! get_key_frame (state, entry->frame))
+			break;
+	}
+
+	reset_stream (state);
+	reset_decryption (state);
+	if (entry) {
+		info (2, _("Seeking from key frame %u\n"), entry->frame);
+		pos = entry->record;
+		if (framed) {
+			skip = entry->offset - entry->record - CAPTURE_HEADER;
+		} else {
+			pos = entry->offset;
+			skip = 0;
+		}
+		last_time = entry->time_ns;
+	} else {
+		info (2, _("Seeking from the start\n"));
+		reset_state (state);
+		pos = framed ? CAPTURE_FILE_HEADER : 0;
+		skip = 0;
+		last_time = first_time;
+	}
+
+	/* Play forward until we get there */
+	while (next_record (&record, &next)) {
+		if ((by == SEEK_FRAME) && (state->frame >= value))
+			break;
+		if ((by == SEEK_LAP) && (state->laps_completed >= value))
+			break;
+		if ((by == SEEK_TIME) && (record.time_ns >= value))
+			break;
+
+		pos = next;
+		skip = 0;
+		last_time = record.time_ns;
+		parse_stream_block (state, record.data, record.len);
+	}
+
+	base_time = last_time;
+	base_clock = clock_func ();
+	if (speed)
+		suspend_display (state, FALSE);
+}
+
+
+/**
+ * replay_key:
+ * @state: application state structure,
+ * @event_no: official event number.
+ *
+ * Finds the decryption key for the event in the recording, or uses the
+ * one given.
+ *
+ * Returns: key found, or zero.
+ **/
+static unsigned int
+replay_key (CurrentState *state,
+	    unsigned int  event_no)
+{
+	size_t i;
+
+	for (i = 0; i < num_side; i++) {
+		if ((side[i].source == CAPTURE_KEY)
+		    && (side[i].arg == event_no) && side[i].key)
+			return side[i].key;
+	}
+
+	if (! given_key)
+		info (0, _("No decryption key for event %u, use --key\n"),
+		      event_no);
+
+	return given_key;
+}
+
+/**
+ * replay_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number.
+ *
+ * Finds the key frame in the recording, preferring the copy recorded
+ * just after the current read, otherwise the latest before it; or if
+ * it's not there, reads it from the key frame directory.  Either way
+ * it's parsed.
+ *
+ * Returns: 0 on success, non-zero if it couldn't be found.
+ **/
+static int
+replay_key_frame (CurrentState *state,
+		  unsigned int  frame)
+{
+	CaptureRecord     record;
+	MappedFile        map;
+	const SideRecord *found = NULL;
+	char             *filename;
+	size_t            i, off;
+	ssize_t           used;
+
+	for (i = 0; i < num_side; i++) {
+		if ((side[i].source != CAPTURE_KEY_FRAME)
+		    || (side[i].arg != frame))
+			continue;
+
+		found = &side[i];
+		if (found->off >= pos)
+			break;
+	}
+
+	if (found) {
+		for (off = found->off; off < found->end; off += used) {
+			used = parse_capture_record (data + off,
+						     found->end - off, &record);
+			if (used <= 0)
+				break;
+
+			parse_stream_block (state, record.data, record.len);
+		}
+
+		return 0;
+	}
+
+	if (! key_frames) {
+		info (1, _("Key frame %u not in recording\n"), frame);
+		return 1;
+	}
+
+	filename = malloc (strlen (key_frames) + 32);
+	if (! filename)
+		abort ();
+
+	if (frame > 0) {
+		sprintf (filename, "%s/keyframe_%05u.bin", key_frames, frame);
+	} else {
+		sprintf (filename, "%s/keyframe.bin", key_frames);
+	}
+
+	if (map_file (&map, filename)) {
+		info (1, _("Key frame %u not found: %s: %s\n"), frame,
+		      filename, strerror (errno));
+		free (filename);
+		return 1;
+	}
+
+	parse_stream_block (state, map.data, map.len);
+
+	unmap_file (&map);
+	free (filename);
+	return 0;
+}
+
+/**
+ * replay_laps:
+ * @state: application state structure.
+ *
+ * Returns: total number of laps last obtained in the recording, or zero.
+ **/
+static unsigned int
+replay_laps (CurrentState *state)
+{
+	unsigned int laps = 0;
+	size_t       i;
+
+	for (i = 0; i < num_side; i++) {
+		if (side[i].source != CAPTURE_TOTAL_LAPS)
+			continue;
+
+		/* It's obtained just after the read that needed it */
+		if (side[i].off >= pos)
+			return (side[i].after <= pos) ? side[i].arg : laps;
+
+		laps = side[i].arg;
+	}
+
+	return laps;
+}
+
+/**
+ * replay_time:
+ * @state: application state structure.
+ *
+ * Returns: time during the recording that playback has reached, as if
+ * the recording had begun when playback did.
+ **/
+static time_t
+replay_time (CurrentState *state)
+{
+	return start_time + (virtual_ns () - first_time) / 1000000000LL;
+}
@@ -0,0 +1,51 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_REPLAY_H
+#define LIVE_F1_REPLAY_H
+
+#include "live-f1.h"
+
+
+/**
+ * ReplayClock:
+ *
+ * Returns: current time in nanoseconds, used to schedule replayed reads;
+ * monotonic_ns() unless changed with set_replay_clock().
+ **/
+typedef long long (*ReplayClock) (void);
+
+
+SJR_BEGIN_EXTERN
+
+int  open_replay      (CurrentState *state, const char *filename,
+		       const char *key_frame_dir, unsigned int key,
+		       double speed);
+int  read_replay      (CurrentState *state);
+void close_replay     (CurrentState *state);
+
+void set_replay_clock (ReplayClock clock);
+void pause_replay     (void);
+void step_replay      (void);
+int  seek_replay      (CurrentState *state, const char *where);
+void seek_replay_laps (CurrentState *state, int laps);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_REPLAY_H */
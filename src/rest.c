@@ -0,0 +1,536 @@
+/* live-f1
+ *
+ * rest.c - serving the board as JSON documents
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "chunk.h"
+#include "httpd.h"
+#include "json.h"
+#include "packet.h"
+#include "sink.h"
+#include "rest.h"
+
+
+/* Content-Type of the documents */
+#define REST_TYPE    "application/json"
+
+/* Path the documents for each car are under */
+#define CARS_PATH    "/cars/"
+
+/* Longest fastest lap field sent */
+#define FL_TEXT_MAX  32
+
+
+/**
+ * RestCache:
+ * @version: version of the state the responses are for,
+ * @ok: the document, headers and all,
+ * @not_modified: response to a request that already has it.
+ *
+ * Responses to one path, kept until the part of the state it covers
+ * changes.
+ **/
+typedef struct {
+	unsigned long long  version;
+	Chunk              *ok, *not_modified;
+} RestCache;
+
+/* Encodes the document for a path */
+typedef void (*RestEncoder) (JsonBuf *out, CurrentState *state, int car);
+
+
+/* Forward prototypes */
+static void changed_board  (CurrentState *state);
+static void changed_car    (CurrentState *state, int car);
+static void changed_cell   (CurrentState *state, int car, int type);
+static void changed_status (CurrentState *state);
+static void grow_cars      (int cars);
+static void serve_state    (HttpClient *client, const char *path,
+			    const char *query);
+static void serve_car      (HttpClient *client, const char *path,
+			    const char *query);
+static void serve_weather  (HttpClient *client, const char *path,
+			    const char *query);
+static void respond        (HttpClient *client, RestCache *cache,
+			    unsigned long long current, RestEncoder encode,
+			    int car);
+static int  has_etag       (HttpClient *client, const char *etag);
+static void clear_cache    (RestCache *cache);
+static void encode_state   (JsonBuf *out, CurrentState *state, int car);
+static void encode_car     (JsonBuf *out, CurrentState *state, int car);
+static void encode_weather (JsonBuf *out, CurrentState *state, int car);
+
+
+/* State served, or NULL if the documents aren't */
+static CurrentState *rest_state = NULL;
+
+/* Version of the state as a whole, given out afresh on every change,
+ * and the version each part was at when it last changed */
+static unsigned long long  version = 0;
+static unsigned long long  board_version = 0, weather_version = 0;
+static unsigned long long *car_versions = NULL;
+
+/* Weather as of weather_version */
+static int last_weather[6];
+
+/* Responses for each path */
+static RestCache  state_cache, weather_cache;
+static RestCache *car_caches = NULL;
+static int        num_cars = 0;
+
+/* Sink noting what has changed */
+static const Sink rest_sink = {
+	changed_board,
+	changed_car,
+	changed_car,
+	changed_cell,
+	changed_status,
+	changed_status,
+	NULL,
+};
+
+
+/**
+ * open_rest:
+ * @state: application state structure.
+ *
+ * Serves @state as JSON documents on the HTTP server opened with
+ * open_httpd(): the whole board at /state, each car at /cars/N and the
+ * weather at /weather.
+ *
+ * Each document is only encoded when it's asked for after the part of
+ * the board it covers has changed, and the response is kept for every
+ * request after until it changes again; so any number of clients
+ * polling cost one encoding per change.  The version of the state is
+ * sent as the ETag, so a client that already has it gets a 304 without
+ * anything being encoded at all.
+ **/
+void
+open_rest (CurrentState *state)
+{
+	rest_state = state;
+
+	/* Versions carry on rising across restarts, so that a client
+	 * never sees the same ETag for a different document */
+	version = (unsigned long long) time (NULL) << 20;
+	board_version = weather_version = version;
+	memset (last_weather, 0, sizeof (last_weather));
+
+	add_sink (&rest_sink);
+	add_http_handler ("/state", serve_state);
+	add_http_handler (CARS_PATH "*", serve_car);
+	add_http_handler ("/weather", serve_weather);
+}
+
+/**
+ * close_rest:
+ *
+ * Stops keeping track of changes and throws away the responses kept;
+ * the HTTP server closes the connections.
+ **/
+void
+close_rest (void)
+{
+	int i;
+
+	if (! rest_state)
+		return;
+
+	remove_sink (&rest_sink);
+
+	clear_cache (&state_cache);
+	clear_cache (&weather_cache);
+	for (i = 0; i < num_cars; i++)
+		clear_cache (&car_caches[i]);
+
+	free (car_caches);
+	free (car_versions);
+	car_caches = NULL;
+	car_versions = NULL;
+	num_cars = 0;
+
+	rest_state = NULL;
+}
+
+
+/**
+ * changed_board:
+ * @state: application state structure.
+ *
+ * Notes that every car has changed, since the cars or the event have;
+ * changes to time-shift views are ignored.
+ **/
+static void
+changed_board (CurrentState *state)
+{
+	if (state != rest_state)
+		return;
+
+	grow_cars (state->num_cars);
+	board_version = ++version;
+}
+
+/**
+ * changed_car:
+ * @state: application state structure,
+ * @car: car that is moving.
+ *
+ * Notes that @car has changed.
+ **/
+static void
+changed_car (CurrentState *state,
+	     int           car)
+{
+	if ((state != rest_state) || (car < 1))
+		return;
+
+	grow_cars (car);
+	car_versions[car - 1] = ++version;
+}
+
+/**
+ * changed_cell:
+ * @state: application state structure,
+ * @car: car whose atom has changed,
+ * @type: type of the atom.
+ *
+ * As changed_car().
+ **/
+static void
+changed_cell (CurrentState *state,
+	      int           car,
+	      int           type)
+{
+	changed_car (state, car);
+}
+
+/**
+ * changed_status:
+ * @state: application state structure.
+ *
+ * Notes that the status has changed, and the weather too if it's any
+ * different; the same readings are sent again every so often.
+ **/
+static void
+changed_status (CurrentState *state)
+{
+	int weather[6];
+
+	if (state != rest_state)
+		return;
+
+	version++;
+
+	weather[0] = state->track_temp;
+	weather[1] = state->air_temp;
+	weather[2] = state->humidity;
+	weather[3] = state->wind_speed;
+	weather[4] = state->wind_direction;
+	weather[5] = state->pressure;
+	if (memcmp (weather, last_weather, sizeof (weather))) {
+		memcpy (last_weather, weather, sizeof (weather));
+		weather_version = version;
+	}
+}
+
+/**
+ * grow_cars:
+ * @cars: number of cars to keep versions and responses for.
+ *
+ * Makes room for @cars cars, if there isn't already.
+ **/
+static void
+grow_cars (int cars)
+{
+	if (cars <= num_cars)
+		return;
+
+	car_versions = realloc (car_versions,
+				sizeof (unsigned long long) * cars);
+	car_caches = realloc (car_caches, sizeof (RestCache) * cars);
+	if ((! car_versions) || (! car_caches))
+		abort ();
+
+	memset (car_versions + num_cars, 0,
+		sizeof (unsigned long long) * (cars - num_cars));
+	memset (car_caches + num_cars, 0,
+		sizeof (RestCache) * (cars - num_cars));
+	num_cars = cars;
+}
+
+
+/**
+ * serve_state:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Responds with the whole board.
+ **/
+static void
+serve_state (HttpClient *client,
+	     const char *path,
+	     const char *query)
+{
+	respond (client, &state_cache, version, encode_state, 0);
+}
+
+/**
+ * serve_car:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Responds with the car numbered at the end of @path, or 404 if there
+ * isn't one.
+ **/
+static void
+serve_car (HttpClient *client,
+	   const char *path,
+	   const char *query)
+{
+	const char *num = path + strlen (CARS_PATH);
+	char       *end;
+	long        car;
+
+	car = strtol (num, &end, 10);
+	if ((end == num) || *end || (car < 1)
+	    || (car > rest_state->num_cars)) {
+		http_respond (client, 404, "text/plain", "", 0);
+		return;
+	}
+
+	grow_cars (car);
+	respond (client, &car_caches[car - 1],
+		 MAX (car_versions[car - 1], board_version), encode_car, car);
+}
+
+/**
+ * serve_weather:
+ * @client: connection the request arrived on,
+ * @path: path requested,
+ * @query: query string, ignored.
+ *
+ * Responds with the weather.
+ **/
+static void
+serve_weather (HttpClient *client,
+	       const char *path,
+	       const char *query)
+{
+	respond (client, &weather_cache, weather_version, encode_weather, 0);
+}
+
+/**
+ * respond:
+ * @client: connection the request arrived on,
+ * @cache: responses kept for the path,
+ * @current: version of the part of the state the path covers,
+ * @encode: function to encode the document,
+ * @car: car to pass to @encode.
+ *
+ * Responds with 304 if @client already has @current, otherwise with
+ * the document, only encoding it if @cache is for an older version.
+ **/
+static void
+respond (HttpClient         *client,
+	 RestCache          *cache,
+	 unsigned long long  current,
+	 RestEncoder         encode,
+	 int                 car)
+{
+	char etag[24];
+
+	snprintf (etag, sizeof (etag), "%llu", current);
+
+	if ((! cache->ok) || (cache->version != current)) {
+		JsonBuf out = { NULL, 0, 0 };
+
+		clear_cache (cache);
+
+		put_json (&out, "{\"version\":%llu,", current);
+		encode (&out, rest_state, car);
+		put_json (&out, "}\n");
+
+		cache->ok = http_response (200, REST_TYPE, etag,
+					   out.buf, out.len);
+		cache->not_modified = http_response (304, NULL, etag,
+						     NULL, 0);
+		cache->version = current;
+		free (out.buf);
+	}
+
+	http_respond_chunk (client, (has_etag (client, etag)
+				     ? cache->not_modified : cache->ok));
+}
+
+/**
+ * has_etag:
+ * @client: connection the request arrived on,
+ * @etag: entity tag of the document, without the quotes.
+ *
+ * Returns: TRUE if the If-None-Match header of the request names
+ * @etag, FALSE otherwise.
+ **/
+static int
+has_etag (HttpClient *client,
+	  const char *etag)
+{
+	const char *match, *p;
+	size_t      len, etag_len = strlen (etag);
+
+	match = http_header (client, "If-None-Match", &len);
+	if (! match)
+		return FALSE;
+
+	for (p = match; p < match + len; p++) {
+		if (*p == '*')
+			return TRUE;
+
+		if ((*p == '"') && (p + etag_len + 1 < match + len)
+		    && (! strncmp (p + 1, etag, etag_len))
+		    && (p[etag_len + 1] == '"'))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * clear_cache:
+ * @cache: responses to throw away.
+ *
+ * Drops the responses kept in @cache; any still being sent are freed
+ * once they have been.
+ **/
+static void
+clear_cache (RestCache *cache)
+{
+	if (cache->ok)
+		unref_chunk (cache->ok);
+	if (cache->not_modified)
+		unref_chunk (cache->not_modified);
+
+	cache->ok = cache->not_modified = NULL;
+}
+
+
+/**
+ * encode_state:
+ * @out: buffer to append to,
+ * @state: application state structure,
+ * @car: ignored.
+ *
+ * Appends the whole board: the event, the status of the session, and
+ * each car as encode_car() does.
+ **/
+static void
+encode_state (JsonBuf      *out,
+	      CurrentState *state,
+	      int           car)
+{
+	int i;
+
+	put_json (out, "\"event\":%u,\"type\":%d,"
+		  "\"laps\":%u,\"total\":%u,\"flag\":%d,"
+		  "\"remaining\":%ld,\"clock_set\":%ld,",
+		  state->event_no, state->event_type,
+		  state->laps_completed, state->total_laps, state->flag,
+		  (long) state->remaining_time, (long) state->epoch_time);
+
+	put_json (out, "\"fl_car\":");
+	put_json_text (out, state->fl_car, FL_TEXT_MAX);
+	put_json (out, ",\"fl_driver\":");
+	put_json_text (out, state->fl_driver, FL_TEXT_MAX);
+	put_json (out, ",\"fl_time\":");
+	put_json_text (out, state->fl_time, FL_TEXT_MAX);
+	put_json (out, ",\"fl_lap\":");
+	put_json_text (out, state->fl_lap, FL_TEXT_MAX);
+
+	put_json (out, ",\"weather\":{");
+	encode_weather (out, state, 0);
+	put_json (out, "},\"cars\":[");
+
+	for (i = 1; i <= state->num_cars; i++) {
+		put_json (out, "%s{", (i > 1) ? "," : "");
+		encode_car (out, state, i);
+		put_json (out, "}");
+	}
+	put_json (out, "]");
+}
+
+/**
+ * encode_car:
+ * @out: buffer to append to,
+ * @state: application state structure,
+ * @car: car to encode.
+ *
+ * Appends @car's number and position, and every atom of it as its
+ * colour and text, indexed by type.
+ **/
+static void
+encode_car (JsonBuf      *out,
+	    CurrentState *state,
+	    int           car)
+{
+	int i;
+
+	put_json (out, "\"car\":%d,\"position\":%d,\"cells\":[",
+		  car, state->car_position[car - 1]);
+
+	for (i = 0; i < LAST_CAR_PACKET; i++) {
+		const CarAtom *atom = &state->car_info[car - 1][i];
+
+		put_json (out, "%s[%d,", i ? "," : "", atom->data);
+		put_json_text (out, atom->text, sizeof (atom->text));
+		put_json (out, "]");
+	}
+	put_json (out, "]");
+}
+
+/**
+ * encode_weather:
+ * @out: buffer to append to,
+ * @state: application state structure,
+ * @car: ignored.
+ *
+ * Appends the weather; the wind speed and pressure are in tenths.
+ **/
+static void
+encode_weather (JsonBuf      *out,
+		CurrentState *state,
+		int           car)
+{
+	put_json (out, "\"track_temp\":%d,\"air_temp\":%d,\"humidity\":%d,"
+		  "\"wind_speed\":%d,\"wind_direction\":%d,\"pressure\":%d",
+		  state->track_temp, state->air_temp, state->humidity,
+		  state->wind_speed, state->wind_direction, state->pressure);
+}
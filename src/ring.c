@@ -0,0 +1,619 @@
+/* live-f1
+ *
+ * ring.c - writing changes to the board into a ring in shared memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "live-f1-shm.h"
+#include "packet.h"
+#include "sink.h"
+#include "stream.h"
+#include "ring.h"
+
+
+/* Number of events the ring holds, a power of two */
+#define RING_SLOTS 65536
+
+/* Size of the segment */
+#define RING_SIZE  (sizeof (LiveF1Ring) + RING_SLOTS * sizeof (LiveF1Event))
+
+/* Most functions that may watch the changes at once */
+#define MAX_WATCHERS 4
+
+
+/**
+ * RingField:
+ * @type: field number in the data stream,
+ * @offset: offset of the field in CurrentState,
+ * @value_type: LiveF1ValueType of a weather field, or LIVE_F1_VALUE_NONE
+ * for a fastest lap text.
+ *
+ * Where each weather and fastest lap field is kept, so that they can be
+ * compared with what was last written.
+ **/
+typedef struct {
+	int             type;
+	size_t          offset;
+	LiveF1ValueType value_type;
+} RingField;
+
+
+/* Forward prototypes */
+static void         clear_board   (CurrentState *state);
+static void         update_car    (CurrentState *state, int car);
+static void         update_cell   (CurrentState *state, int car, int type);
+static void         update_status (CurrentState *state);
+static void         update_clock  (CurrentState *state);
+static void         start_changes (void);
+static LiveF1Event *begin_event   (CurrentState *state, LiveF1EventKind kind);
+static void         end_event     (LiveF1Event *event);
+static void         drop_watcher  (int i);
+static void         copy_text     (char *dest, const char *src, size_t len);
+static int          parse_value   (const char *text, int64_t *value);
+
+
+/* Ring being written, or NULL */
+static LiveF1Ring *ring = NULL;
+static char       *ring_name = NULL;
+
+/* State whose changes are written */
+static CurrentState *ring_state = NULL;
+
+/* Also called with each change; and where changes are made when
+ * there's no ring to make them in */
+static ChangeFunc  change_funcs[MAX_WATCHERS];
+static int         num_watchers = 0;
+static int         dispatching = FALSE;
+static LiveF1Event scratch;
+
+/* Weather and fastest lap fields, and what was last written of each */
+static const RingField ring_fields[] = {
+	{ WEATHER_TRACK_TEMP, offsetof (CurrentState, track_temp),
+	  LIVE_F1_VALUE_INT },
+	{ WEATHER_AIR_TEMP, offsetof (CurrentState, air_temp),
+	  LIVE_F1_VALUE_INT },
+	{ WEATHER_WIND_SPEED, offsetof (CurrentState, wind_speed),
+	  LIVE_F1_VALUE_TENTHS },
+	{ WEATHER_HUMIDITY, offsetof (CurrentState, humidity),
+	  LIVE_F1_VALUE_INT },
+	{ WEATHER_PRESSURE, offsetof (CurrentState, pressure),
+	  LIVE_F1_VALUE_TENTHS },
+	{ WEATHER_WIND_DIRECTION, offsetof (CurrentState, wind_direction),
+	  LIVE_F1_VALUE_INT },
+	{ FL_CAR, offsetof (CurrentState, fl_car), LIVE_F1_VALUE_NONE },
+	{ FL_DRIVER, offsetof (CurrentState, fl_driver), LIVE_F1_VALUE_NONE },
+	{ FL_TIME, offsetof (CurrentState, fl_time), LIVE_F1_VALUE_NONE },
+	{ FL_LAP, offsetof (CurrentState, fl_lap), LIVE_F1_VALUE_NONE },
+};
+#define NUM_RING_FIELDS (sizeof (ring_fields) / sizeof (RingField))
+
+static int          last_value[NUM_RING_FIELDS];
+static char         last_text[NUM_RING_FIELDS][16];
+static unsigned int last_laps, last_total_laps;
+static FlagStatus   last_flag;
+
+/* Sink writing the events */
+static const Sink ring_sink = {
+	clear_board,
+	update_car,
+	NULL,
+	update_cell,
+	update_status,
+	update_clock,
+	NULL,
+	&output_filter,
+};
+
+
+/**
+ * open_ring:
+ * @name: name of the shared memory segment, such as /live-f1-ring,
+ * @state: application state structure.
+ *
+ * Creates the shared memory segment @name, laid out as LiveF1Ring, and
+ * writes each change to @state into it as a LiveF1Event from now on.
+ *
+ * There is one writer and any number of readers, which each keep their
+ * own cursor using the functions in live-f1-shm.h; nothing about them is
+ * kept here, so a reader costs the writer nothing and can never hold it
+ * up.  A reader that falls more than the size of the ring behind finds
+ * out it has lost events when it next reads.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_ring (const char   *name,
+	   CurrentState *state)
+{
+#if HAVE_SHM_OPEN
+	void *addr;
+	int   fd;
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto error;
+	if (ftruncate (fd, RING_SIZE) < 0) {
+		close (fd);
+		shm_unlink (name);
+		goto error;
+	}
+
+	addr = mmap (NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	close (fd);
+	if (addr == MAP_FAILED) {
+		shm_unlink (name);
+		goto error;
+	}
+
+	ring = addr;
+	ring_name = strdup (name);
+	ring_state = state;
+
+	ring->version = LIVE_F1_RING_VERSION;
+	ring->size = RING_SIZE;
+	ring->slots = RING_SLOTS;
+	ring->head = 0;
+
+	/* Readers check the magic last */
+	__sync_synchronize ();
+	ring->magic = LIVE_F1_RING_MAGIC;
+
+	if (! num_watchers)
+		start_changes ();
+
+	info (1, _("Writing changes to ring %s\n"), name);
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to create shared memory"), name, strerror (errno));
+	return 1;
+#else /* HAVE_SHM_OPEN */
+	fprintf (stderr, "%s: %s\n", program_name,
+		 _("shared memory isn't supported on this system"));
+	return 1;
+#endif /* HAVE_SHM_OPEN */
+}
+
+/**
+ * close_ring:
+ *
+ * Removes the shared memory segment; readers that have it mapped can
+ * still read what's left in it.
+ **/
+void
+close_ring (void)
+{
+	if (! ring)
+		return;
+
+	if (! num_watchers)
+		remove_sink (&ring_sink);
+
+#if HAVE_SHM_OPEN
+	munmap (ring, RING_SIZE);
+	shm_unlink (ring_name);
+#endif /* HAVE_SHM_OPEN */
+
+	free (ring_name);
+	ring = NULL;
+	ring_name = NULL;
+	if (! num_watchers)
+		ring_state = NULL;
+}
+
+/**
+ * watch_changes:
+ * @func: function to call,
+ * @state: application state structure.
+ *
+ * Calls @func with each change to @state from now on, as the LiveF1Event
+ * that's written into the ring, whether or not there is one.  Up to
+ * MAX_WATCHERS functions may watch at a time, called in the order they
+ * were given.
+ *
+ * Returns: 0 on success, non-zero if too many are already watching.
+ **/
+int
+watch_changes (ChangeFunc    func,
+	       CurrentState *state)
+{
+	if (num_watchers == MAX_WATCHERS)
+		return 1;
+
+	if ((! ring) && (! num_watchers)) {
+		ring_state = state;
+		start_changes ();
+	}
+
+	change_funcs[num_watchers++] = func;
+	return 0;
+}
+
+/**
+ * unwatch_changes:
+ * @func: function given to watch_changes().
+ *
+ * Stops calling @func with each change.
+ **/
+void
+unwatch_changes (ChangeFunc func)
+{
+	int i;
+
+	for (i = 0; i < num_watchers; i++) {
+		if (change_funcs[i] != func)
+			continue;
+
+		/* end_event() is still calling watchers and drops this
+		 * one once it's finished with them */
+		if (dispatching) {
+			change_funcs[i] = NULL;
+		} else {
+			drop_watcher (i);
+		}
+		return;
+	}
+}
+
+/**
+ * drop_watcher:
+ * @i: index in change_funcs.
+ *
+ * Removes the watcher at @i, and the ring sink once nothing needs it.
+ **/
+static void
+drop_watcher (int i)
+{
+	for (num_watchers--; i < num_watchers; i++)
+		change_funcs[i] = change_funcs[i + 1];
+
+	if ((! ring) && (! num_watchers)) {
+		remove_sink (&ring_sink);
+		ring_state = NULL;
+	}
+}
+
+/**
+ * start_changes:
+ *
+ * Forgets what was last written of the status and starts making events
+ * for each change, once the ring or something watching needs them.
+ **/
+static void
+start_changes (void)
+{
+	memset (last_value, 0, sizeof (last_value));
+	memset (last_text, 0, sizeof (last_text));
+	last_laps = last_total_laps = 0;
+	last_flag = 0;
+	add_sink (&ring_sink);
+}
+
+
+/**
+ * clear_board:
+ * @state: application state structure.
+ *
+ * Writes a BOARD event with the event number and type and number of
+ * cars.
+ **/
+static void
+clear_board (CurrentState *state)
+{
+	LiveF1Event *event;
+
+	if (state != ring_state)
+		return;
+
+	event = begin_event (state, LIVE_F1_EVENT_BOARD);
+	event->value_type = LIVE_F1_VALUE_INT;
+	event->value = state->event_no;
+	event->data = state->event_type;
+	event->car = state->num_cars;
+	end_event (event);
+}
+
+/**
+ * update_car:
+ * @state: application state structure,
+ * @car: car that has moved.
+ *
+ * Writes a POSITION event for @car.
+ **/
+static void
+update_car (CurrentState *state,
+	    int           car)
+{
+	LiveF1Event *event;
+
+	if (state != ring_state)
+		return;
+
+	event = begin_event (state, LIVE_F1_EVENT_POSITION);
+	event->car = car;
+	event->value_type = LIVE_F1_VALUE_INT;
+	event->value = state->car_position[car - 1];
+	end_event (event);
+}
+
+/**
+ * update_cell:
+ * @state: application state structure,
+ * @car: car whose atom has changed,
+ * @type: type of the atom.
+ *
+ * Writes an ATOM event with the colour and text of the atom, and its
+ * value if the text is a number or time.
+ **/
+static void
+update_cell (CurrentState *state,
+	     int           car,
+	     int           type)
+{
+	const CarAtom *atom;
+	LiveF1Event   *event;
+
+	if (state != ring_state)
+		return;
+
+	atom = &state->car_info[car - 1][type];
+
+	event = begin_event (state, LIVE_F1_EVENT_ATOM);
+	event->car = car;
+	event->type = type;
+	event->data = atom->data;
+	copy_text (event->text, atom->text, sizeof (atom->text));
+	event->value_type = parse_value (event->text, &event->value);
+	end_event (event);
+}
+
+/**
+ * update_status:
+ * @state: application state structure.
+ *
+ * Compares the status of the session with what was last written, and
+ * writes a LAPS, FLAG, WEATHER or FASTEST_LAP event for each field that
+ * has changed.
+ **/
+static void
+update_status (CurrentState *state)
+{
+	LiveF1Event *event;
+	size_t       i;
+
+	if (state != ring_state)
+		return;
+
+	if ((state->laps_completed != last_laps)
+	    || (state->total_laps != last_total_laps)) {
+		event = begin_event (state, LIVE_F1_EVENT_LAPS);
+		event->value_type = LIVE_F1_VALUE_INT;
+		event->value = state->laps_completed;
+		event->data = state->total_laps;
+		end_event (event);
+
+		last_laps = state->laps_completed;
+		last_total_laps = state->total_laps;
+	}
+
+	if (state->flag != last_flag) {
+		event = begin_event (state, LIVE_F1_EVENT_FLAG);
+		event->value_type = LIVE_F1_VALUE_INT;
+		event->value = state->flag;
+		end_event (event);
+
+		last_flag = state->flag;
+	}
+
+	for (i = 0; i < NUM_RING_FIELDS; i++) {
+		const char *field = (const char *) state + ring_fields[i].offset;
+
+		if (ring_fields[i].value_type != LIVE_F1_VALUE_NONE) {
+			int value = *(const int *) field;
+
+			if (value == last_value[i])
+				continue;
+
+			event = begin_event (state, LIVE_F1_EVENT_WEATHER);
+			event->value_type = ring_fields[i].value_type;
+			event->value = last_value[i] = value;
+		} else {
+			const char *text = *(char * const *) field;
+
+			if (! text)
+				text = "";
+			if (! strncmp (text, last_text[i],
+				       sizeof (last_text[i]) - 1))
+				continue;
+
+			copy_text (last_text[i], text, sizeof (last_text[i]));
+
+			event = begin_event (state, LIVE_F1_EVENT_FASTEST_LAP);
+			copy_text (event->text, text, sizeof (event->text));
+		}
+
+		event->type = ring_fields[i].type;
+		end_event (event);
+	}
+}
+
+/**
+ * update_clock:
+ * @state: application state structure.
+ *
+ * Writes a CLOCK event with the time remaining in the session when it
+ * was set, and whether the clock is running.
+ **/
+static void
+update_clock (CurrentState *state)
+{
+	LiveF1Event *event;
+
+	if (state != ring_state)
+		return;
+
+	event = begin_event (state, LIVE_F1_EVENT_CLOCK);
+	event->value_type = LIVE_F1_VALUE_INT;
+	event->value = state->remaining_time;
+	event->data = state->epoch_time ? 1 : 0;
+	end_event (event);
+}
+
+
+/**
+ * begin_event:
+ * @state: application state structure,
+ * @kind: what changed.
+ *
+ * Claims the next slot in the ring, marking it as being written so a
+ * reader that was about to read what was there knows it's gone.  If
+ * there's no ring, only something watching, the event is made aside.
+ *
+ * Returns: event to fill in, then pass to end_event().
+ **/
+static LiveF1Event *
+begin_event (CurrentState    *state,
+	     LiveF1EventKind  kind)
+{
+	LiveF1Event *event;
+
+	if (ring) {
+		event = &ring->events[ring->head & (RING_SLOTS - 1)];
+		*(volatile uint64_t *) &event->seq = 0;
+		__sync_synchronize ();
+	} else {
+		event = &scratch;
+	}
+
+	memset ((char *) event + sizeof (event->seq), 0,
+		sizeof (LiveF1Event) - sizeof (event->seq));
+	event->time = get_time (state);
+	event->kind = kind;
+
+	return event;
+}
+
+/**
+ * end_event:
+ * @event: event from begin_event().
+ *
+ * Marks @event as written, then moves the head of the ring past it so
+ * readers can see it, and passes it to anything watching.  Watchers
+ * may stop watching from within their function; they're skipped and
+ * then dropped once every other has been called.
+ **/
+static void
+end_event (LiveF1Event *event)
+{
+	int i;
+
+	if (ring) {
+		__sync_synchronize ();
+		*(volatile uint64_t *) &event->seq = ring->head + 1;
+		__sync_synchronize ();
+		*(volatile uint64_t *) &ring->head = ring->head + 1;
+	}
+
+	dispatching = TRUE;
+	for (i = 0; i < num_watchers; i++)
+		if (change_funcs[i])
+			change_funcs[i] (event);
+	dispatching = FALSE;
+
+	for (i = num_watchers - 1; i >= 0; i--)
+		if (! change_funcs[i])
+			drop_watcher (i);
+}
+
+/**
+ * copy_text:
+ * @dest: text in an event,
+ * @src: string to copy,
+ * @len: size of @dest.
+ *
+ * Copies @src into @dest, always terminated.
+ **/
+static void
+copy_text (char       *dest,
+	   const char *src,
+	   size_t      len)
+{
+	size_t n = strnlen (src, len - 1);
+
+	memcpy (dest, src, n);
+	dest[n] = 0;
+}
+
+/**
+ * parse_value:
+ * @text: text of an atom,
+ * @value: set to the value.
+ *
+ * Works out whether @text is a whole number, or a time as M:SS.sss or
+ * SS.s, which parse_time_ms() converts to milliseconds.
+ *
+ * Returns: LiveF1ValueType of @value.
+ **/
+static int
+parse_value (const char *text,
+	     int64_t    *value)
+{
+	const char *p;
+	int64_t     number = 0;
+	int         ms;
+
+	if (! *text)
+		return LIVE_F1_VALUE_NONE;
+
+	if (strpbrk (text, ":.")) {
+		ms = parse_time_ms (text);
+		if (ms < 0)
+			return LIVE_F1_VALUE_NONE;
+
+		*value = ms;
+		return LIVE_F1_VALUE_MS;
+	}
+
+	for (p = text; *p; p++) {
+		if ((*p < '0') || (*p > '9'))
+			return LIVE_F1_VALUE_NONE;
+
+		number = number * 10 + (*p - '0');
+	}
+
+	*value = number;
+	return LIVE_F1_VALUE_INT;
+}
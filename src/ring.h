@@ -0,0 +1,41 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_RING_H
+#define LIVE_F1_RING_H
+
+#include "live-f1.h"
+#include "live-f1-shm.h"
+
+
+/* Called with each change to the board, as written into the ring */
+typedef void (*ChangeFunc) (const LiveF1Event *event);
+
+
+SJR_BEGIN_EXTERN
+
+int  open_ring  (const char *name, CurrentState *state);
+void close_ring (void);
+
+int  watch_changes   (ChangeFunc func, CurrentState *state);
+void unwatch_changes (ChangeFunc func);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_RING_H */
@@ -0,0 +1,791 @@
+/* live-f1
+ *
+ * serve.c - sharing the board with other terminals
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "display.h"
+#include "packet.h"
+#include "watch.h"
+#include "serve.h"
+
+
+/* Board message magic and format version */
+#define BOARD_MAGIC   "LF1B"
+#define BOARD_VERSION 1
+
+/* Size of the message header: magic and length */
+#define BOARD_HEADER  8
+
+/* Sizes of the fastest lap strings in the message */
+#define FL_CAR_LEN    3
+#define FL_DRIVER_LEN 15
+#define FL_TIME_LEN   9
+#define FL_LAP_LEN    3
+
+/* Size of the fixed part of a message, after the header */
+#define BOARD_FIXED   (4 * 18 + FL_CAR_LEN + FL_DRIVER_LEN + FL_TIME_LEN \
+		       + FL_LAP_LEN)
+
+/* Size of each car in a message */
+#define BOARD_CAR     (4 + LAST_CAR_PACKET * (1 + sizeof (((CarAtom *) 0)->text)))
+
+
+/**
+ * Client:
+ * @fd: connected socket,
+ * @buf: copy of the message being sent,
+ * @len: length of @buf,
+ * @off: how much of @buf has been sent,
+ * @stale: a newer board is waiting to be sent.
+ *
+ * A terminal attached to the server.
+ **/
+typedef struct {
+	int            fd;
+	unsigned char *buf;
+	size_t         len, off;
+	int            stale;
+} Client;
+
+
+/* Forward prototypes */
+static void   accept_client (void *data, int fd, short revents);
+static void   client_ready  (void *data, int fd, short revents);
+static void   send_board    (Client *client);
+static void   drop_client   (Client *client);
+static size_t encode_board  (CurrentState *state, unsigned char *buf);
+static int    apply_board   (CurrentState *state, const unsigned char *buf,
+			     size_t len);
+
+
+/* Listening socket and its path */
+static int   listen_fd = -1;
+static char *listen_path = NULL;
+
+/* Attached terminals */
+static Client **clients = NULL;
+static int      nclients = 0;
+
+/* Latest board sent, and the scratch space for the next */
+static unsigned char *board = NULL, *next_board = NULL;
+static size_t         board_len = 0, board_size = 0;
+
+
+/**
+ * put_u32:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value into @buf in network byte order.
+ *
+ * Returns: @buf moved past the value.
+ **/
+static inline unsigned char *
+put_u32 (unsigned char *buf,
+	 unsigned int   value)
+{
+	buf[0] = (value >> 24) & 0xff;
+	buf[1] = (value >> 16) & 0xff;
+	buf[2] = (value >> 8) & 0xff;
+	buf[3] = value & 0xff;
+
+	return buf + 4;
+}
+
+/**
+ * get_u32:
+ * @buf: pointer to buffer to read from.
+ *
+ * Reads a value in network byte order from @buf, and moves it on.
+ *
+ * Returns: value read.
+ **/
+static inline unsigned int
+get_u32 (const unsigned char **buf)
+{
+	const unsigned char *p = *buf;
+
+	*buf += 4;
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ * put_str:
+ * @buf: buffer to write to,
+ * @str: string to write, may be NULL,
+ * @len: size of field.
+ *
+ * Writes @str into the fixed-size field at @buf, padding with NULs.
+ *
+ * Returns: @buf moved past the field.
+ **/
+static inline unsigned char *
+put_str (unsigned char *buf,
+	 const char    *str,
+	 size_t         len)
+{
+	memset (buf, 0, len);
+	if (str)
+		memcpy (buf, str, strnlen (str, len - 1));
+
+	return buf + len;
+}
+
+
+/**
+ * open_server:
+ * @path: path of Unix socket.
+ *
+ * Creates the Unix socket that other copies of live-f1 attach to with
+ * attach_server(); the board is sent to each of them by serve_board()
+ * so the data stream is only received and decoded once.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_server (const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, path,
+			 _("socket path too long"));
+		return 1;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		goto error;
+
+	/* Only replace the socket if nobody is listening on it */
+	if (connect (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) == 0) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, path,
+			 _("already being served"));
+		close (listen_fd);
+		listen_fd = -1;
+		return 1;
+	}
+	unlink (path);
+
+	if (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+		goto error;
+	if (listen (listen_fd, 16) < 0)
+		goto error;
+
+	fcntl (listen_fd, F_SETFL, fcntl (listen_fd, F_GETFL) | O_NONBLOCK);
+	if (add_watch (listen_fd, POLLIN, accept_client, NULL) < 0)
+		goto error;
+
+	listen_path = strdup (path);
+	info (1, _("Serving board on %s\n"), path);
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to serve board"), path, strerror (errno));
+	if (listen_fd >= 0)
+		close (listen_fd);
+	listen_fd = -1;
+
+	return 1;
+}
+
+/**
+ * close_server:
+ *
+ * Disconnects any attached terminals and removes the socket.
+ **/
+void
+close_server (void)
+{
+	while (nclients)
+		drop_client (clients[0]);
+
+	if (listen_fd < 0)
+		return;
+
+	remove_watch (listen_fd);
+	close (listen_fd);
+	listen_fd = -1;
+
+	unlink (listen_path);
+	free (listen_path);
+	listen_path = NULL;
+}
+
+/**
+ * accept_client:
+ * @data: unused,
+ * @fd: listening socket,
+ * @revents: events that occurred.
+ *
+ * Accepts a new terminal and sends it the current board.
+ **/
+static void
+accept_client (void  *data,
+	       int    fd,
+	       short  revents)
+{
+	Client *client;
+	int     sock;
+
+	sock = accept (fd, NULL, NULL);
+	if (sock < 0)
+		return;
+
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+
+	client = calloc (1, sizeof (Client));
+	clients = realloc (clients, sizeof (Client *) * (nclients + 1));
+	if ((! client) || (! clients))
+		abort ();
+
+	client->fd = sock;
+	clients[nclients++] = client;
+
+	add_watch (sock, POLLIN, client_ready, client);
+	info (2, _("Terminal attached\n"));
+
+	if (board_len)
+		send_board (client);
+}
+
+/**
+ * drop_client:
+ * @client: attached terminal.
+ *
+ * Disconnects @client and frees it.
+ **/
+static void
+drop_client (Client *client)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (clients[i] == client) {
+			clients[i] = clients[--nclients];
+			break;
+		}
+	}
+
+	remove_watch (client->fd);
+	close (client->fd);
+	free (client->buf);
+	free (client);
+
+	info (2, _("Terminal detached\n"));
+}
+
+/**
+ * client_ready:
+ * @data: attached terminal,
+ * @fd: its socket,
+ * @revents: events that occurred.
+ *
+ * Carries on sending to an attached terminal once its socket has room,
+ * and notices when it goes away.  Terminals don't send us anything, so
+ * any input is thrown away.
+ **/
+static void
+client_ready (void  *data,
+	      int    fd,
+	      short  revents)
+{
+	Client *client = data;
+
+	if (revents & POLLIN) {
+		char    buf[64];
+		ssize_t len;
+
+		len = read (fd, buf, sizeof (buf));
+		if ((len == 0) || ((len < 0) && (errno != EAGAIN)
+				   && (errno != EINTR))) {
+			drop_client (client);
+			return;
+		}
+	} else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		drop_client (client);
+		return;
+	}
+
+	if (revents & POLLOUT)
+		send_board (client);
+}
+
+/**
+ * send_board:
+ * @client: attached terminal.
+ *
+ * Sends as much of the board to @client as its socket will take.  Once
+ * a message has been sent completely, the latest board is begun if it
+ * has changed meanwhile; boards in between are never sent.
+ **/
+static void
+send_board (Client *client)
+{
+	ssize_t len;
+
+	if (client->off >= client->len) {
+		client->buf = realloc (client->buf, board_len);
+		if (! client->buf)
+			abort ();
+
+		memcpy (client->buf, board, board_len);
+		client->len = board_len;
+		client->off = 0;
+		client->stale = 0;
+	}
+
+	while (client->off < client->len) {
+		len = send (client->fd, client->buf + client->off,
+			    client->len - client->off, MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+
+			drop_client (client);
+			return;
+		}
+
+		client->off += len;
+		if ((client->off >= client->len) && client->stale) {
+			send_board (client);
+			return;
+		}
+	}
+
+	change_watch (client->fd, (client->off < client->len
+				   ? POLLIN | POLLOUT : POLLIN));
+}
+
+/**
+ * serve_board:
+ * @state: application state structure.
+ *
+ * Called from the main loop; if the board has changed since it was last
+ * sent, sends it to every attached terminal.
+ **/
+void
+serve_board (CurrentState *state)
+{
+	unsigned char *tmp;
+	size_t         len, size;
+	int            i;
+
+	if (listen_fd < 0)
+		return;
+
+	size = BOARD_HEADER + BOARD_FIXED + state->num_cars * BOARD_CAR;
+	if (size > board_size) {
+		board = realloc (board, size);
+		next_board = realloc (next_board, size);
+		if ((! board) || (! next_board))
+			abort ();
+
+		board_size = size;
+	}
+
+	len = encode_board (state, next_board);
+	if ((len == board_len) && (! memcmp (board, next_board, len)))
+		return;
+
+	tmp = board;
+	board = next_board;
+	next_board = tmp;
+	board_len = len;
+
+	for (i = nclients - 1; i >= 0; i--) {
+		if (clients[i]->off < clients[i]->len) {
+			clients[i]->stale = 1;
+		} else {
+			send_board (clients[i]);
+		}
+	}
+}
+
+/**
+ * encode_board:
+ * @state: application state structure,
+ * @buf: buffer to write to.
+ *
+ * Writes a message containing everything needed to draw the board into
+ * @buf, which must be large enough.
+ *
+ * Returns: length of the message.
+ **/
+static size_t
+encode_board (CurrentState  *state,
+	      unsigned char *buf)
+{
+	unsigned char *p;
+	int            i, j;
+
+	p = buf + BOARD_HEADER;
+	p = put_u32 (p, BOARD_VERSION);
+	p = put_u32 (p, state->event_no);
+	p = put_u32 (p, state->event_type);
+	p = put_u32 (p, state->remaining_time);
+	p = put_u32 (p, state->epoch_time);
+	p = put_u32 (p, state->laps_completed);
+	p = put_u32 (p, state->total_laps);
+	p = put_u32 (p, state->flag);
+	p = put_u32 (p, state->track_temp);
+	p = put_u32 (p, state->air_temp);
+	p = put_u32 (p, state->humidity);
+	p = put_u32 (p, state->wind_speed);
+	p = put_u32 (p, state->wind_direction);
+	p = put_u32 (p, state->pressure);
+	p = put_u32 (p, state->key);
+	p = put_u32 (p, state->decryption_failure);
+	p = put_u32 (p, state->frame);
+	p = put_u32 (p, state->num_cars);
+	p = put_str (p, state->fl_car, FL_CAR_LEN);
+	p = put_str (p, state->fl_driver, FL_DRIVER_LEN);
+	p = put_str (p, state->fl_time, FL_TIME_LEN);
+	p = put_str (p, state->fl_lap, FL_LAP_LEN);
+
+	for (i = 0; i < state->num_cars; i++) {
+		p = put_u32 (p, state->car_position[i]);
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			CarAtom *atom = &state->car_info[i][j];
+
+			*(p++) = atom->data;
+			p = put_str (p, atom->text, sizeof (atom->text));
+		}
+	}
+
+	memcpy (buf, BOARD_MAGIC, 4);
+	put_u32 (buf + 4, p - buf - BOARD_HEADER);
+
+	return p - buf;
+}
+
+
+/**
+ * attach_server:
+ * @state: application state structure,
+ * @path: path of Unix socket.
+ *
+ * Attaches to another copy of live-f1 serving the board on @path, and
+ * displays each board received until the user quits or the server goes
+ * away.  The board is drawn and scrolled by this terminal alone.
+ *
+ * Returns: exit status for the program.
+ **/
+int
+attach_server (CurrentState *state,
+	       const char   *path)
+{
+	struct sockaddr_un  addr;
+	unsigned char      *buf = NULL;
+	size_t              len = 0, size = 0;
+	time_t              last = 0;
+	int                 sock;
+
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, path,
+			 _("socket path too long"));
+		return 1;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	sock = socket (AF_UNIX, SOCK_STREAM, 0);
+	if ((sock < 0)
+	    || (connect (sock, (struct sockaddr *) &addr, sizeof (addr)) < 0)) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("unable to attach"), path, strerror (errno));
+		return 2;
+	}
+
+	info (1, _("Attached to %s, waiting for board ...\n"), path);
+
+	for (;;) {
+		struct pollfd poll_fd;
+		ssize_t       numr;
+
+		poll_fd.fd = sock;
+		poll_fd.events = POLLIN;
+		poll_fd.revents = 0;
+
+		if (poll (&poll_fd, 1, 100) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (poll_fd.revents) {
+			if (size - len < 4096) {
+				size = len + 16384;
+				buf = realloc (buf, size);
+				if (! buf)
+					abort ();
+			}
+
+			numr = read (sock, buf + len, size - len);
+			if ((numr < 0) && (errno == EINTR))
+				continue;
+			if (numr == 0)
+				errno = 0;
+			if (numr <= 0)
+				break;
+			len += numr;
+
+			/* Apply each complete message */
+			while (len >= BOARD_HEADER) {
+				const unsigned char *p = buf + 4;
+				size_t               msglen;
+
+				if (memcmp (buf, BOARD_MAGIC, 4)) {
+					errno = EPROTO;
+					goto error;
+				}
+
+				msglen = get_u32 (&p) + BOARD_HEADER;
+				if (len < msglen)
+					break;
+
+				if (apply_board (state, buf + BOARD_HEADER,
+						 msglen - BOARD_HEADER) < 0) {
+					errno = EPROTO;
+					goto error;
+				}
+
+				memmove (buf, buf + msglen, len - msglen);
+				len -= msglen;
+			}
+		}
+
+		if (handle_keys (state) < 0) {
+			close_display ();
+			close (sock);
+			free (buf);
+			return 0;
+		}
+
+		if (time (NULL) != last) {
+			last = time (NULL);
+			update_time (state);
+		}
+	}
+
+error:
+	close_display ();
+	fprintf (stderr, "%s: %s: %s\n", program_name,
+		 _("lost connection to server"),
+		 errno ? strerror (errno) : _("server went away"));
+	close (sock);
+	free (buf);
+
+	return 2;
+}
+
+/**
+ * apply_board:
+ * @state: application state structure,
+ * @buf: message received,
+ * @len: length of @buf.
+ *
+ * Copies the board in the message into @state, and updates those parts
+ * of the display that have changed.
+ *
+ * Returns: 0 on success, -1 if the message is invalid.
+ **/
+static int
+apply_board (CurrentState        *state,
+	     const unsigned char *buf,
+	     size_t               len)
+{
+	const unsigned char *p = buf;
+	EventType            event_type;
+	unsigned int         laps_completed, total_laps, flag, num_cars, i;
+	int                  weather[6], redraw, status, j;
+	char                *moved;
+
+	if ((len < BOARD_FIXED) || (get_u32 (&p) != BOARD_VERSION))
+		return -1;
+
+	state->event_no = get_u32 (&p);
+	event_type = get_u32 (&p);
+	state->remaining_time = get_u32 (&p);
+	state->epoch_time = get_u32 (&p);
+	laps_completed = get_u32 (&p);
+	total_laps = get_u32 (&p);
+	flag = get_u32 (&p);
+	for (j = 0; j < 6; j++)
+		weather[j] = get_u32 (&p);
+	state->key = get_u32 (&p);
+	state->decryption_failure = get_u32 (&p);
+	state->frame = get_u32 (&p);
+	num_cars = get_u32 (&p);
+
+	if (len != BOARD_FIXED + num_cars * BOARD_CAR)
+		return -1;
+
+	if (! state->fl_car) {
+		state->fl_car = calloc (FL_CAR_LEN, sizeof (char));
+		state->fl_driver = calloc (FL_DRIVER_LEN, sizeof (char));
+		state->fl_time = calloc (FL_TIME_LEN, sizeof (char));
+		state->fl_lap = calloc (FL_LAP_LEN, sizeof (char));
+	}
+
+	status = ((laps_completed != state->laps_completed)
+		  || (total_laps != state->total_laps)
+		  || (flag != state->flag)
+		  || (weather[0] != state->track_temp)
+		  || (weather[1] != state->air_temp)
+		  || (weather[2] != state->humidity)
+		  || (weather[3] != state->wind_speed)
+		  || (weather[4] != state->wind_direction)
+		  || (weather[5] != state->pressure)
+		  || memcmp (state->fl_car, p, FL_CAR_LEN)
+		  || memcmp (state->fl_driver, p + FL_CAR_LEN, FL_DRIVER_LEN)
+		  || memcmp (state->fl_time, p + FL_CAR_LEN + FL_DRIVER_LEN,
+			     FL_TIME_LEN)
+		  || memcmp (state->fl_lap, p + FL_CAR_LEN + FL_DRIVER_LEN
+			     + FL_TIME_LEN, FL_LAP_LEN));
+
+	state->laps_completed = laps_completed;
+	state->total_laps = total_laps;
+	state->flag = flag;
+	state->track_temp = weather[0];
+	state->air_temp = weather[1];
+	state->humidity = weather[2];
+	state->wind_speed = weather[3];
+	state->wind_direction = weather[4];
+	state->pressure = weather[5];
+
+	memcpy (state->fl_car, p, FL_CAR_LEN);
+	p += FL_CAR_LEN;
+	memcpy (state->fl_driver, p, FL_DRIVER_LEN);
+	p += FL_DRIVER_LEN;
+	memcpy (state->fl_time, p, FL_TIME_LEN);
+	p += FL_TIME_LEN;
+	memcpy (state->fl_lap, p, FL_LAP_LEN);
+	p += FL_LAP_LEN;
+
+	/* A different event or number of cars means a new board */
+	redraw = ((event_type != state->event_type)
+		  || (num_cars != state->num_cars));
+	if (redraw) {
+		for (i = 0; i < state->num_cars; i++)
+			free (state->car_info[i]);
+
+		state->event_type = event_type;
+		state->num_cars = num_cars;
+		state->car_position = realloc (state->car_position,
+					       sizeof (int) * MAX (num_cars, 1));
+		state->car_info = realloc (state->car_info,
+					   sizeof (CarAtom *) * MAX (num_cars, 1));
+		if ((! state->car_position) || (! state->car_info))
+			abort ();
+
+		for (i = 0; i < num_cars; i++) {
+			state->car_info[i] = calloc (LAST_CAR_PACKET,
+						     sizeof (CarAtom));
+			if (! state->car_info[i])
+				abort ();
+		}
+	}
+
+	/* Clear the old rows of cars that have moved, before any of them
+	 * are drawn in their new place.
+	 */
+	moved = calloc (MAX (num_cars, 1), sizeof (char));
+	if (! moved)
+		abort ();
+
+	for (i = 0; i < num_cars; i++) {
+		unsigned int position;
+
+		position = ((unsigned int) p[0] << 24) | (p[1] << 16)
+			| (p[2] << 8) | p[3];
+		if (redraw) {
+			state->car_position[i] = position;
+		} else if (position != state->car_position[i]) {
+			clear_car (state, i + 1);
+			moved[i] = 1;
+		}
+
+		p += BOARD_CAR;
+	}
+	p -= num_cars * BOARD_CAR;
+
+	for (i = 0; i < num_cars; i++) {
+		state->car_position[i] = get_u32 (&p);
+
+		for (j = 0; j < LAST_CAR_PACKET; j++) {
+			CarAtom *atom = &state->car_info[i][j];
+			int      changed;
+
+			changed = ((atom->data != p[0])
+				   || strncmp (atom->text, (const char *) p + 1,
+					       sizeof (atom->text)));
+
+			atom->data = *(p++);
+			memcpy (atom->text, p, sizeof (atom->text));
+			atom->text[sizeof (atom->text) - 1] = 0;
+			p += sizeof (atom->text);
+
+			if (changed && (! redraw) && (! moved[i]))
+				update_cell (state, i + 1, j);
+		}
+
+		if (moved[i] && state->car_position[i])
+			update_car (state, i + 1);
+	}
+
+	free (moved);
+
+	if (redraw) {
+		clear_board (state);
+		update_status (state);
+	} else if (status) {
+		update_status (state);
+	}
+
+	return 0;
+}
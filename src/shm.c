@@ -0,0 +1,300 @@
+/* live-f1
+ *
+ * shm.c - publishing the board in shared memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "live-f1-shm.h"
+#include "sink.h"
+#include "stream.h"
+#include "shm.h"
+
+
+/* Forward prototypes */
+static void changed      (CurrentState *state);
+static void changed_car  (CurrentState *state, int car);
+static void changed_cell (CurrentState *state, int car, int type);
+static void copy_field   (char *dest, const char *src, size_t len);
+
+
+/* Segment the board is published in, or NULL */
+static LiveF1Snapshot *snapshot = NULL;
+static char           *snapshot_name = NULL;
+
+/* State published, and whether it's changed since */
+static CurrentState *snapshot_state = NULL;
+static int           dirty = FALSE;
+
+/* Sink noting when the board has changed */
+static const Sink snapshot_sink = {
+	changed,
+	changed_car,
+	changed_car,
+	changed_cell,
+	changed,
+	changed,
+	NULL,
+};
+
+
+/**
+ * open_snapshot:
+ * @name: name of the shared memory segment, such as /live-f1,
+ * @state: application state structure.
+ *
+ * Creates the shared memory segment @name, laid out as LiveF1Snapshot,
+ * and publishes @state in it each time publish_snapshot() is called
+ * after it has changed.  Other processes read it with the functions in
+ * live-f1-shm.h.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_snapshot (const char   *name,
+	       CurrentState *state)
+{
+#if HAVE_SHM_OPEN
+	void *addr;
+	int   fd;
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto error;
+	if (ftruncate (fd, sizeof (LiveF1Snapshot)) < 0) {
+		close (fd);
+		shm_unlink (name);
+		goto error;
+	}
+
+	addr = mmap (NULL, sizeof (LiveF1Snapshot), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0);
+	close (fd);
+	if (addr == MAP_FAILED) {
+		shm_unlink (name);
+		goto error;
+	}
+
+	snapshot = addr;
+	snapshot_name = strdup (name);
+	snapshot_state = state;
+
+	memset (snapshot, 0, sizeof (LiveF1Snapshot));
+	snapshot->version = LIVE_F1_SHM_VERSION;
+	snapshot->size = sizeof (LiveF1Snapshot);
+
+	/* Readers check the magic last */
+	__sync_synchronize ();
+	snapshot->magic = LIVE_F1_SHM_MAGIC;
+
+	add_sink (&snapshot_sink);
+	dirty = TRUE;
+
+	info (1, _("Publishing board in %s\n"), name);
+
+	return 0;
+
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to create shared memory"), name, strerror (errno));
+	return 1;
+#else /* HAVE_SHM_OPEN */
+	fprintf (stderr, "%s: %s\n", program_name,
+		 _("shared memory isn't supported on this system"));
+	return 1;
+#endif /* HAVE_SHM_OPEN */
+}
+
+/**
+ * publish_snapshot:
+ *
+ * Called from the main loop after each read of the data stream to copy
+ * the board into the shared memory segment, if it has changed.
+ *
+ * The segment is guarded by a sequence count, made odd before the board
+ * is written and even again after, so readers never need to take a
+ * lock: they copy the board and try again if the count was odd or has
+ * changed.  Publishing once per read rather than on every change keeps
+ * the time the count is odd, and so readers retry, to a minimum.
+ **/
+void
+publish_snapshot (void)
+{
+	volatile uint64_t *seq;
+	CurrentState      *state = snapshot_state;
+	int                i, j;
+
+	if ((! snapshot) || (! dirty))
+		return;
+
+	seq = &snapshot->seq;
+	(*seq)++;
+	__sync_synchronize ();
+
+	snapshot->time = get_time (state);
+	snapshot->event_no = state->event_no;
+	snapshot->event_type = state->event_type;
+	snapshot->num_cars = MIN (state->num_cars, LIVE_F1_SHM_CARS);
+	snapshot->laps_completed = state->laps_completed;
+	snapshot->total_laps = state->total_laps;
+	snapshot->flag = state->flag;
+	snapshot->remaining_time = state->remaining_time;
+	snapshot->epoch_time = state->epoch_time;
+
+	snapshot->track_temp = state->track_temp;
+	snapshot->air_temp = state->air_temp;
+	snapshot->humidity = state->humidity;
+	snapshot->wind_speed = state->wind_speed;
+	snapshot->wind_direction = state->wind_direction;
+	snapshot->pressure = state->pressure;
+
+	copy_field (snapshot->fl_car, state->fl_car,
+		    sizeof (snapshot->fl_car));
+	copy_field (snapshot->fl_driver, state->fl_driver,
+		    sizeof (snapshot->fl_driver));
+	copy_field (snapshot->fl_time, state->fl_time,
+		    sizeof (snapshot->fl_time));
+	copy_field (snapshot->fl_lap, state->fl_lap,
+		    sizeof (snapshot->fl_lap));
+
+	for (i = 0; i < (int) snapshot->num_cars; i++) {
+		snapshot->position[i] = state->car_position[i];
+
+		for (j = 0; j < LIVE_F1_SHM_ATOMS; j++) {
+			snapshot->atoms[i][j].data = state->car_info[i][j].data;
+			copy_field (snapshot->atoms[i][j].text,
+				    state->car_info[i][j].text,
+				    sizeof (snapshot->atoms[i][j].text));
+		}
+	}
+	for (; i < LIVE_F1_SHM_CARS; i++) {
+		snapshot->position[i] = 0;
+		memset (snapshot->atoms[i], 0, sizeof (snapshot->atoms[i]));
+	}
+
+	__sync_synchronize ();
+	(*seq)++;
+
+	dirty = FALSE;
+}
+
+/**
+ * close_snapshot:
+ *
+ * Removes the shared memory segment; readers that have it mapped keep
+ * the last board published.
+ **/
+void
+close_snapshot (void)
+{
+	if (! snapshot)
+		return;
+
+	remove_sink (&snapshot_sink);
+
+#if HAVE_SHM_OPEN
+	munmap (snapshot, sizeof (LiveF1Snapshot));
+	shm_unlink (snapshot_name);
+#endif /* HAVE_SHM_OPEN */
+
+	free (snapshot_name);
+	snapshot = NULL;
+	snapshot_name = NULL;
+	snapshot_state = NULL;
+}
+
+
+/**
+ * changed:
+ * @state: application state structure.
+ *
+ * Notes the board needs publishing again if @state is the one being
+ * published; changes to time-shift views are ignored.
+ **/
+static void
+changed (CurrentState *state)
+{
+	if (state == snapshot_state)
+		dirty = TRUE;
+}
+
+/**
+ * changed_car:
+ * @state: application state structure,
+ * @car: car that has changed.
+ *
+ * As changed().
+ **/
+static void
+changed_car (CurrentState *state,
+	     int           car)
+{
+	changed (state);
+}
+
+/**
+ * changed_cell:
+ * @state: application state structure,
+ * @car: car that has changed,
+ * @type: type of the atom that has changed.
+ *
+ * As changed().
+ **/
+static void
+changed_cell (CurrentState *state,
+	      int           car,
+	      int           type)
+{
+	changed (state);
+}
+
+/**
+ * copy_field:
+ * @dest: field in the segment,
+ * @src: string to copy, may be NULL,
+ * @len: size of @dest.
+ *
+ * Copies @src into @dest, truncating it if need be and padding it with
+ * zeros so nothing of the previous value is left.
+ **/
+static void
+copy_field (char       *dest,
+	    const char *src,
+	    size_t      len)
+{
+	size_t n = 0;
+
+	if (src) {
+		n = strnlen (src, len - 1);
+		memcpy (dest, src, n);
+	}
+	memset (dest + n, 0, len - n);
+}
@@ -0,0 +1,306 @@
+/* live-f1
+ *
+ * sink.c - passing changes to the state on to whatever wants them
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "packet.h"
+#include "sink.h"
+
+
+/* Forward prototypes */
+static int  wants_car     (const Sink *sink, int car);
+static void update_wanted (void);
+
+
+/* Sinks in the order they were added */
+static const Sink **sinks = NULL;
+static int          num_sinks = 0, sinks_alloc = 0;
+
+/* Cars wanted for each type of car packet, by all the sinks together */
+static unsigned int wanted[PACKET_TYPES];
+
+/* Car packets wanted by every sink that writes changes out: events,
+ * ring, and decoded and multicast through the ring; one filter for
+ * them all, set by --cars and --packet-types */
+SinkFilter output_filter = { ~0U, ~0U };
+
+
+/**
+ * add_sink:
+ * @sink: sink to add.
+ *
+ * Passes every change to the state on to @sink from now on, after the
+ * sinks already added.
+ **/
+void
+add_sink (const Sink *sink)
+{
+	if (num_sinks == sinks_alloc) {
+		sinks_alloc = MAX (sinks_alloc * 2, 8);
+		sinks = realloc (sinks, sizeof (const Sink *) * sinks_alloc);
+		if (! sinks)
+			abort ();
+	}
+
+	sinks[num_sinks++] = sink;
+	update_wanted ();
+}
+
+/**
+ * remove_sink:
+ * @sink: sink to remove.
+ *
+ * Stops passing changes to @sink.
+ **/
+void
+remove_sink (const Sink *sink)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++) {
+		if (sinks[i] != sink)
+			continue;
+
+		for (num_sinks--; i < num_sinks; i++)
+			sinks[i] = sinks[i + 1];
+
+		update_wanted ();
+		return;
+	}
+}
+
+/**
+ * has_sink:
+ * @sink: sink to look for.
+ *
+ * Returns: TRUE if @sink has been added, FALSE otherwise.
+ **/
+int
+has_sink (const Sink *sink)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i] == sink)
+			return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * sink_wanted:
+ *
+ * Gives the cars any sink wants for each type of car packet, as a mask
+ * of 1 << car for each type, suitable for the wanted member of the
+ * state.  This follows sinks being added and removed.
+ *
+ * Returns: array of PACKET_TYPES masks.
+ **/
+const unsigned int *
+sink_wanted (void)
+{
+	return wanted;
+}
+
+/**
+ * update_wanted:
+ *
+ * Works out again which cars are wanted for each type of car packet,
+ * from the filters of the sinks.
+ **/
+static void
+update_wanted (void)
+{
+	int i, type;
+
+	memset (wanted, 0, sizeof (wanted));
+
+	for (i = 0; i < num_sinks; i++) {
+		const SinkFilter *filter = sinks[i]->filter;
+
+		for (type = 0; type < PACKET_TYPES; type++) {
+			if (! filter) {
+				wanted[type] = ~0U;
+			} else if (filter->types & (1U << type)) {
+				wanted[type] |= filter->cars;
+			}
+		}
+	}
+
+	/* The position atom is how we notice decryption going wrong, so
+	 * that's always needed; and every car could be the leader, whose
+	 * position and interval give the laps completed */
+	wanted[CAR_POSITION_UPDATE] = ~0U;
+	wanted[RACE_POSITION] = ~0U;
+	wanted[RACE_INTERVAL] = ~0U;
+}
+
+/**
+ * wants_car:
+ * @sink: sink to check,
+ * @car: car that has changed.
+ *
+ * Returns: TRUE if @sink's filter lets through @car, FALSE otherwise.
+ **/
+static int
+wants_car (const Sink *sink,
+	   int         car)
+{
+	return (! sink->filter) || (sink->filter->cars & (1U << car));
+}
+
+
+/**
+ * sink_clear_board:
+ * @state: application state structure.
+ *
+ * Tells each sink the cars or event have changed.
+ **/
+void
+sink_clear_board (CurrentState *state)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i]->clear_board)
+			sinks[i]->clear_board (state);
+}
+
+/**
+ * sink_update_car:
+ * @state: application state structure,
+ * @car: car that has moved.
+ *
+ * Tells each sink whose filter lets through @car that it's in a new
+ * position.
+ **/
+void
+sink_update_car (CurrentState *state,
+		 int           car)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i]->update_car && wants_car (sinks[i], car))
+			sinks[i]->update_car (state, car);
+}
+
+/**
+ * sink_clear_car:
+ * @state: application state structure,
+ * @car: car about to move.
+ *
+ * Tells each sink whose filter lets through @car that it's about to
+ * leave its position.
+ **/
+void
+sink_clear_car (CurrentState *state,
+		int           car)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i]->clear_car && wants_car (sinks[i], car))
+			sinks[i]->clear_car (state, car);
+}
+
+/**
+ * sink_update_cell:
+ * @state: application state structure,
+ * @car: car whose atom has changed,
+ * @type: type of the atom.
+ *
+ * Tells each sink whose filter lets through @car and @type that an
+ * atom of @car has changed.
+ **/
+void
+sink_update_cell (CurrentState *state,
+		  int           car,
+		  int           type)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++) {
+		const SinkFilter *filter = sinks[i]->filter;
+
+		if ((! sinks[i]->update_cell)
+		    || (filter && (! (filter->types & (1U << type)))))
+			continue;
+
+		if (wants_car (sinks[i], car))
+			sinks[i]->update_cell (state, car, type);
+	}
+}
+
+/**
+ * sink_update_status:
+ * @state: application state structure.
+ *
+ * Tells each sink the status of the session has changed.
+ **/
+void
+sink_update_status (CurrentState *state)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i]->update_status)
+			sinks[i]->update_status (state);
+}
+
+/**
+ * sink_update_clock:
+ * @state: application state structure.
+ *
+ * Tells each sink the data stream has set the session clock.
+ **/
+void
+sink_update_clock (CurrentState *state)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i]->update_clock)
+			sinks[i]->update_clock (state);
+}
+
+/**
+ * sink_update_time:
+ * @state: application state structure.
+ *
+ * Tells each sink to bring the session clock up to date.
+ **/
+void
+sink_update_time (CurrentState *state)
+{
+	int i;
+
+	for (i = 0; i < num_sinks; i++)
+		if (sinks[i]->update_time)
+			sinks[i]->update_time (state);
+}
@@ -0,0 +1,98 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_SINK_H
+#define LIVE_F1_SINK_H
+
+#include "live-f1.h"
+#include "packet.h"
+
+
+/**
+ * SinkFilter:
+ * @cars: bit 1 << car set for each car wanted,
+ * @types: bit 1 << type set for each type of car packet wanted.
+ *
+ * The car packets a sink cares about; packets for other cars, or of
+ * other types, can be passed over before they're decrypted.  Packets
+ * that aren't for a car are always handled.
+ **/
+typedef struct {
+	unsigned int cars;
+	unsigned int types;
+} SinkFilter;
+
+/**
+ * Sink:
+ * @clear_board: the cars or event have changed, so everything should be
+ * gone through again,
+ * @update_car: a car has moved into a new position,
+ * @clear_car: a car is about to move out of its position,
+ * @update_cell: an atom of a car has changed,
+ * @update_status: the laps, flag, weather or fastest lap have changed,
+ * @update_clock: the session clock has been set by the data stream,
+ * @update_time: the session clock should be brought up to date,
+ * @filter: car packets the sink needs handled.
+ *
+ * Receives the changes made to the state as packets are handled; the
+ * display is one sink, and running headless there may be none.  Any of
+ * these may be NULL if the sink isn't interested; a NULL @filter means
+ * the sink needs every packet.
+ *
+ * Sinks are called for every state packets are parsed into, which
+ * includes the time-shift view; those that write changes out keep the
+ * state they were opened with, and pass over the others.
+ **/
+typedef struct {
+	void (*clear_board)   (CurrentState *state);
+	void (*update_car)    (CurrentState *state, int car);
+	void (*clear_car)     (CurrentState *state, int car);
+	void (*update_cell)   (CurrentState *state, int car, int type);
+	void (*update_status) (CurrentState *state);
+	void (*update_clock)  (CurrentState *state);
+	void (*update_time)   (CurrentState *state);
+
+	const SinkFilter *filter;
+} Sink;
+
+
+SJR_BEGIN_EXTERN
+
+/* Car packets wanted by the events and ring sinks, and so by decoded
+ * and multicast which follow the ring; a single filter shared by all
+ * of them, from --cars and --packet-types */
+extern SinkFilter output_filter;
+
+void add_sink    (const Sink *sink);
+void remove_sink (const Sink *sink);
+int  has_sink    (const Sink *sink);
+
+const unsigned int *sink_wanted (void);
+
+void sink_clear_board   (CurrentState *state);
+void sink_update_car    (CurrentState *state, int car);
+void sink_clear_car     (CurrentState *state, int car);
+void sink_update_cell   (CurrentState *state, int car, int type);
+void sink_update_status (CurrentState *state);
+void sink_update_clock  (CurrentState *state);
+void sink_update_time   (CurrentState *state);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_SINK_H */
@@ -0,0 +1,105 @@
+/* live-f1
+ *
+ * stats.c - counters of what's going on inside
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include "live-f1.h"
+#include "stats.h"
+
+
+/* Counters, updated directly by the code doing the work; one set for
+ * each thread */
+__thread Statistics stats;
+
+/* Upper bounds of the histogram buckets, from 100us to 10s */
+const long long stats_bounds[STATS_BUCKETS] = {
+	100000LL, 250000LL, 500000LL,
+	1000000LL, 2500000LL, 5000000LL,
+	10000000LL, 25000000LL, 50000000LL,
+	100000000LL, 250000000LL, 500000000LL,
+	1000000000LL, 2500000000LL, 5000000000LL,
+	10000000000LL,
+};
+
+/* Counters when sample_stats() was last called */
+static Statistics last;
+static long long  last_ns = 0;
+
+
+/**
+ * sample_stats:
+ * @rates: structure to fill.
+ *
+ * Samples the counters of the main thread, which is the only one that
+ * may call this, and fills @rates with the rates since the previous
+ * call; the first call covers the time since the program started.
+ **/
+void
+sample_stats (StatsRates *rates)
+{
+	long long now;
+	double    secs;
+	int       i;
+
+	now = monotonic_ns ();
+	if (! last_ns)
+		last_ns = now;
+
+	secs = (now - last_ns) / 1e9;
+	if (secs <= 0.0)
+		secs = 1.0;
+
+	rates->interval = secs;
+	rates->bytes = (stats.bytes - last.bytes) / secs;
+	rates->packets = 0;
+	for (i = 0; i < 16; i++) {
+		rates->car_packets[i] = (stats.car_packets[i]
+					 - last.car_packets[i]) / secs;
+		rates->sys_packets[i] = (stats.sys_packets[i]
+					 - last.sys_packets[i]) / secs;
+		rates->packets += rates->car_packets[i];
+		rates->packets += rates->sys_packets[i];
+	}
+
+	rates->decrypt_us = 0;
+	if (stats.decrypts > last.decrypts)
+		rates->decrypt_us = ((stats.decrypt_ns - last.decrypt_ns)
+				     / 1e3 / (stats.decrypts - last.decrypts));
+
+	rates->handler_us = 0;
+	if (stats.handled > last.handled)
+		rates->handler_us = ((stats.handler_ns - last.handler_ns)
+				     / 1e3 / (stats.handled - last.handled));
+
+	rates->render_ms = 0;
+	if (stats.renders > last.renders)
+		rates->render_ms = ((stats.render_ns - last.render_ns)
+				    / 1e6 / (stats.renders - last.renders));
+
+	rates->ping_burst_ms = stats.ping_burst_ns / 1e6;
+	rates->key_frame_ms = stats.key_frame_ns / 1e6;
+
+	last = stats;
+	last_ns = now;
+}
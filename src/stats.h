@@ -0,0 +1,187 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_STATS_H
+#define LIVE_F1_STATS_H
+
+#include <time.h>
+
+#include "live-f1.h"
+
+
+/* Number of bounded histogram buckets; one more counts everything else */
+#define STATS_BUCKETS 16
+
+/* Time a turn of the main loop may take before it counts as a stall */
+#define STATS_STALL_NS 250000000LL
+
+
+/**
+ * StatsHistogram:
+ * @buckets: number of observations in each bucket, not cumulative,
+ * @sum_ns: total of all observations,
+ * @count: number of observations.
+ *
+ * Distribution of a time, bucketed by the bounds in stats_bounds.
+ **/
+typedef struct {
+	unsigned long      buckets[STATS_BUCKETS + 1];
+	unsigned long long sum_ns;
+	unsigned long      count;
+} StatsHistogram;
+
+/**
+ * Statistics:
+ * @bytes: bytes read from the data stream,
+ * @reads: number of reads from the data stream,
+ * @car_packets: car packets received, by type,
+ * @sys_packets: system packets received, by type,
+ * @decrypt_ns: total time spent decrypting payloads,
+ * @decrypts: number of payloads decrypted,
+ * @skipped: number of car packets passed over as nobody wanted them,
+ * @handler_ns: total time spent in packet handlers,
+ * @handled: number of packets handled,
+ * @render_ns: total time spent updating the screen,
+ * @renders: number of screen updates,
+ * @pings: number of times the server has been pinged,
+ * @ping_ns: time of the last ping not yet answered,
+ * @ping_burst_ns: time between the last ping and its burst of data,
+ * @key_frames: number of key frames fetched,
+ * @key_frame_ns: time taken to fetch the last key frame,
+ * @decryption_failures: number of times decryption has been lost,
+ * @reconnects: number of times the data stream has been reconnected,
+ * @http_errors: number of failed requests to the web servers,
+ * @key_frame_hist: distribution of key frame fetch times,
+ * @render_hist: distribution of screen update times,
+ * @loop_hist: distribution of time spent in the main loop between polls,
+ * @loop_stalls: number of turns of the main loop over STATS_STALL_NS.
+ *
+ * Counters of what the client is doing internally.  Each thread has
+ * its own, so these are plain increments with no locking even while the
+ * store writer or the live-f1-export workers run; the stats panel and
+ * /metrics read those of the main thread, which reads the data stream,
+ * sampling them once a second and working out the rates from the
+ * difference.
+ **/
+typedef struct {
+	unsigned long long bytes;
+	unsigned long      reads;
+	unsigned long      car_packets[16];
+	unsigned long      sys_packets[16];
+
+	unsigned long long decrypt_ns;
+	unsigned long      decrypts;
+	unsigned long      skipped;
+	unsigned long long handler_ns;
+	unsigned long      handled;
+	unsigned long long render_ns;
+	unsigned long      renders;
+
+	unsigned long      pings;
+	long long          ping_ns;
+	long long          ping_burst_ns;
+
+	unsigned long      key_frames;
+	long long          key_frame_ns;
+
+	unsigned long      decryption_failures;
+	unsigned long      reconnects;
+	unsigned long      http_errors;
+
+	StatsHistogram     key_frame_hist;
+	StatsHistogram     render_hist;
+	StatsHistogram     loop_hist;
+	unsigned long      loop_stalls;
+} Statistics;
+
+/**
+ * StatsRates:
+ * @interval: seconds covered by the sample,
+ * @bytes: bytes read per second,
+ * @packets: packets received per second,
+ * @car_packets: car packets per second, by type,
+ * @sys_packets: system packets per second, by type,
+ * @decrypt_us: average time to decrypt a payload in microseconds,
+ * @handler_us: average time to handle a packet in microseconds,
+ * @render_ms: average time to update the screen in milliseconds,
+ * @ping_burst_ms: time between the last ping and its burst of data,
+ * @key_frame_ms: time taken to fetch the last key frame.
+ *
+ * Rates worked out from the difference between two samples of the
+ * counters.
+ **/
+typedef struct {
+	double interval;
+	double bytes, packets;
+	double car_packets[16], sys_packets[16];
+
+	double decrypt_us, handler_us, render_ms;
+	double ping_burst_ms, key_frame_ms;
+} StatsRates;
+
+
+SJR_BEGIN_EXTERN
+
+extern __thread Statistics stats;
+extern const long long     stats_bounds[STATS_BUCKETS];
+
+
+void sample_stats (StatsRates *rates);
+
+
+/**
+ * monotonic_ns:
+ *
+ * Returns: monotonic clock time in nanoseconds.
+ **/
+static inline long long
+monotonic_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * observe:
+ * @hist: histogram to add to,
+ * @ns: time observed.
+ *
+ * Counts @ns in the first bucket of @hist whose bound it doesn't
+ * exceed; the bounds are only formatted when something asks for them.
+ **/
+static inline void
+observe (StatsHistogram *hist,
+	 long long       ns)
+{
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if (ns <= stats_bounds[i])
+			break;
+
+	hist->buckets[i]++;
+	hist->sum_ns += ns;
+	hist->count++;
+}
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_STATS_H */
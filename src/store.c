@@ -0,0 +1,1024 @@
+/* live-f1
+ *
+ * store.c - writing laps, sectors, pits and weather into SQLite
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "live-f1.h"
+#include "store.h"
+
+#if HAVE_LIBSQLITE3
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "packet.h"
+#include "sink.h"
+#include "stream.h"
+
+
+/* Rows that can be waiting for the writer; any more are dropped */
+#define STORE_ROWS        4096
+
+/* Least time between transactions, in milliseconds */
+#define STORE_INTERVAL_MS 250
+
+/* Length of the text of an atom */
+#define TEXT_LEN          sizeof (((CarAtom *) 0)->text)
+
+/* Number or time not known, stored as NULL */
+#define UNKNOWN           -1
+
+
+/**
+ * StoreTable:
+ *
+ * Tables rows are written into, in the order of their statements.
+ **/
+typedef enum {
+	STORE_LAP,
+	STORE_SECTOR,
+	STORE_PIT,
+	STORE_POSITION,
+	STORE_WEATHER,
+	LAST_STORE_TABLE
+} StoreTable;
+
+/**
+ * StoreRow:
+ * @table: table the row is for,
+ * @event_no: event number,
+ * @event_type: event type,
+ * @ts: time of the session the row was made,
+ * @car: car the row is about, or zero for the weather,
+ * @number: car number,
+ * @driver: driver's name,
+ * @u: columns particular to @table.
+ *
+ * Row waiting to be written by the writer thread.  Everything is
+ * copied from the board, since that will have moved on by the time the
+ * row is written.
+ **/
+typedef struct {
+	StoreTable   table;
+	unsigned int event_no;
+	EventType    event_type;
+	time_t       ts;
+	int          car;
+	char         number[TEXT_LEN], driver[TEXT_LEN];
+
+	union {
+		struct {
+			int  lap, position, pits;
+			char time[TEXT_LEN], sector[3][TEXT_LEN];
+			char gap[TEXT_LEN], interval[TEXT_LEN];
+		} lap;
+		struct {
+			int  lap, sector;
+			char time[TEXT_LEN];
+		} sector;
+		struct {
+			int  lap, stop;
+		} pit;
+		struct {
+			int  position;
+		} position;
+		struct {
+			int  track_temp, air_temp, humidity;
+			int  wind_speed, wind_direction, pressure;
+		} weather;
+	} u;
+} StoreRow;
+
+/**
+ * StoreCar:
+ * @laps: laps completed, or UNKNOWN,
+ * @lap_time: text of the lap time, or of the laps completed, last seen,
+ * @sector: text of each sector time last seen,
+ * @pits: text of the number of pit stops last seen.
+ *
+ * What's been seen of each car, so that a row is only made when a time
+ * or the number of stops actually changes.
+ **/
+typedef struct {
+	int  laps;
+	char lap_time[TEXT_LEN], sector[3][TEXT_LEN], pits[TEXT_LEN];
+} StoreCar;
+
+/**
+ * StoreMap:
+ * @number: atom giving the car number,
+ * @driver: atom giving the driver's name,
+ * @lap_time: atom giving the time of the lap just completed,
+ * @laps: atom giving the number of laps completed,
+ * @sector: atoms giving the time of each sector just completed,
+ * @gap: atom giving the gap to the leader,
+ * @interval: atom giving the gap to the car in front,
+ * @pits: atom giving the number of pit stops.
+ *
+ * Which atoms mean what, for each type of event; zero if not sent.
+ **/
+typedef struct {
+	int number, driver, lap_time, laps;
+	int sector[3];
+	int gap, interval, pits;
+} StoreMap;
+
+
+/* Forward prototypes */
+static void  clear_board   (CurrentState *state);
+static void  update_car    (CurrentState *state, int car);
+static void  update_cell   (CurrentState *state, int car, int type);
+static void  hand_over     (void);
+static void  lap_row       (CurrentState *state, int car);
+static void  sector_row    (CurrentState *state, int car, int sector);
+static void  pit_row       (CurrentState *state, int car);
+static void  weather_row   (CurrentState *state);
+static StoreRow *new_row   (CurrentState *state, StoreTable table, int car);
+static int   seen_text     (char *last, const char *text);
+static void *writer        (void *arg);
+static int   write_rows    (const StoreRow *rows, size_t num_rows);
+static void  keep_error    (void);
+static int   bind_row      (sqlite3_stmt *stmt, const StoreRow *row);
+static void  bind_int      (sqlite3_stmt *stmt, int col, int value);
+static void  bind_tenths   (sqlite3_stmt *stmt, int col, int value);
+static void  bind_text     (sqlite3_stmt *stmt, int col, const char *text);
+
+
+/* Database written to, or NULL */
+static sqlite3 *store_db = NULL;
+
+/* Statement inserting into each table */
+static sqlite3_stmt *statements[LAST_STORE_TABLE];
+
+/* State whose changes are written */
+static CurrentState *store_state = NULL;
+
+/* What's been seen of each car */
+static StoreCar *cars = NULL;
+static int       num_cars = 0;
+
+/* Weather last written */
+static int last_weather[6];
+
+/* Rows made during this read of the data stream, only touched by the
+ * main thread.
+ */
+static StoreRow *pending = NULL;
+static size_t    pending_len = 0;
+
+/* Rows handed to the writer, and those it's writing */
+static pthread_t       store_thread;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  store_cond = PTHREAD_COND_INITIALIZER;
+static StoreRow       *queued = NULL, *writing = NULL;
+static size_t          queued_len = 0;
+static int             store_stop = FALSE;
+
+/* Rows dropped and the last error, for the main thread to report */
+static unsigned long dropped = 0, reported = 0;
+static char          store_error[256] = "";
+
+/* Sink writing the rows */
+static const Sink store_sink = {
+	clear_board,
+	update_car,
+	NULL,
+	update_cell,
+	NULL,
+	NULL,
+	NULL,
+};
+
+/* Meaning of the atoms, indexed by EventType */
+static const StoreMap store_maps[] = {
+	{ 0, 0, 0, 0, { 0, 0, 0 }, 0, 0, 0 },
+	{ RACE_NUMBER, RACE_DRIVER, RACE_LAP_TIME, 0,
+	  { RACE_SECTOR_1, RACE_SECTOR_2, RACE_SECTOR_3 },
+	  RACE_GAP, RACE_INTERVAL, RACE_NUM_PITS },
+	{ PRACTICE_NUMBER, PRACTICE_DRIVER, 0, PRACTICE_LAP,
+	  { PRACTICE_SECTOR_1, PRACTICE_SECTOR_2, PRACTICE_SECTOR_3 },
+	  PRACTICE_GAP, 0, 0 },
+	{ QUALIFYING_NUMBER, QUALIFYING_DRIVER, 0, QUALIFYING_LAP,
+	  { QUALIFYING_SECTOR_1, QUALIFYING_SECTOR_2, QUALIFYING_SECTOR_3 },
+	  0, 0, 0 },
+};
+
+/* Tables, created if the database doesn't have them */
+static const char store_schema[] =
+	"CREATE TABLE IF NOT EXISTS laps ("
+	" event INTEGER, event_type INTEGER, ts INTEGER, car INTEGER,"
+	" number TEXT, driver TEXT, lap INTEGER, lap_time TEXT,"
+	" lap_ms INTEGER, sector_1 TEXT, sector_2 TEXT, sector_3 TEXT,"
+	" position INTEGER, gap TEXT, interval TEXT, pits INTEGER);"
+	"CREATE TABLE IF NOT EXISTS sectors ("
+	" event INTEGER, event_type INTEGER, ts INTEGER, car INTEGER,"
+	" number TEXT, driver TEXT, lap INTEGER, sector INTEGER,"
+	" sector_time TEXT, sector_ms INTEGER);"
+	"CREATE TABLE IF NOT EXISTS pits ("
+	" event INTEGER, event_type INTEGER, ts INTEGER, car INTEGER,"
+	" number TEXT, driver TEXT, lap INTEGER, stop INTEGER);"
+	"CREATE TABLE IF NOT EXISTS positions ("
+	" event INTEGER, event_type INTEGER, ts INTEGER, car INTEGER,"
+	" number TEXT, driver TEXT, position INTEGER);"
+	"CREATE TABLE IF NOT EXISTS weather ("
+	" event INTEGER, event_type INTEGER, ts INTEGER,"
+	" track_temp INTEGER, air_temp INTEGER, humidity INTEGER,"
+	" wind_speed REAL, wind_direction INTEGER, pressure REAL);"
+	"CREATE INDEX IF NOT EXISTS laps_car ON laps (event, car, lap);"
+	"CREATE INDEX IF NOT EXISTS sectors_car ON sectors (event, car, lap);"
+	"CREATE INDEX IF NOT EXISTS positions_car ON positions (event, car);";
+
+/* Statement inserting into each table, indexed by StoreTable */
+static const char *const store_inserts[] = {
+	"INSERT INTO laps VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)",
+	"INSERT INTO sectors VALUES (?,?,?,?,?,?,?,?,?,?)",
+	"INSERT INTO pits VALUES (?,?,?,?,?,?,?,?)",
+	"INSERT INTO positions VALUES (?,?,?,?,?,?,?)",
+	"INSERT INTO weather VALUES (?,?,?,?,?,?,?,?,?)",
+};
+
+
+/**
+ * open_store:
+ * @path: SQLite database to write to,
+ * @state: application state structure.
+ *
+ * Writes each lap, sector and pit stop completed, each change of
+ * position and each change in the weather into tables of the database
+ * at @path from now on, creating it and the tables if need be.
+ *
+ * The database is put into WAL mode so that it can be queried while
+ * it's being written.  Rows are collected without touching it, and
+ * handed to a writer thread by flush_store() after each read of the
+ * data stream; that writes everything it's been handed in a single
+ * transaction, at most every STORE_INTERVAL_MS milliseconds, so a slow
+ * disk never holds up the board.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_store (const char   *path,
+	    CurrentState *state)
+{
+	char *errmsg = NULL;
+	int   i, err;
+
+	if (sqlite3_open (path, &store_db) != SQLITE_OK)
+		goto error;
+
+	sqlite3_busy_timeout (store_db, 1000);
+	if ((sqlite3_exec (store_db, "PRAGMA journal_mode=WAL;"
+			   "PRAGMA synchronous=NORMAL;", NULL, NULL,
+			   &errmsg) != SQLITE_OK)
+	    || (sqlite3_exec (store_db, store_schema, NULL, NULL,
+			      &errmsg) != SQLITE_OK))
+		goto error;
+
+	for (i = 0; i < LAST_STORE_TABLE; i++)
+		if (sqlite3_prepare_v2 (store_db, store_inserts[i], -1,
+					&statements[i], NULL) != SQLITE_OK)
+			goto error;
+
+	pending = malloc (sizeof (StoreRow) * STORE_ROWS * 3);
+	if (! pending)
+		abort ();
+	queued = pending + STORE_ROWS;
+	writing = queued + STORE_ROWS;
+	pending_len = queued_len = 0;
+	store_stop = FALSE;
+	dropped = reported = 0;
+	store_error[0] = 0;
+
+	/* This returns the error rather than setting errno */
+	err = pthread_create (&store_thread, NULL, writer, NULL);
+	if (err) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to start store writer"), strerror (err));
+		free (pending);
+		pending = NULL;
+		goto finalize;
+	}
+
+	store_state = state;
+	clear_board (state);
+	add_sink (&store_sink);
+
+	info (1, _("Writing laps to %s\n"), path);
+
+	return 0;
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to open store"), path,
+		 errmsg ? errmsg : (store_db ? sqlite3_errmsg (store_db)
+				    : strerror (ENOMEM)));
+	sqlite3_free (errmsg);
+finalize:
+	for (i = 0; i < LAST_STORE_TABLE; i++) {
+		sqlite3_finalize (statements[i]);
+		statements[i] = NULL;
+	}
+	sqlite3_close (store_db);
+	store_db = NULL;
+	return 1;
+}
+
+/**
+ * flush_store:
+ *
+ * Called from the main loop after each read of the data stream to hand
+ * the rows it made to the writer thread.  Any error writing them is
+ * reported from here, since the writer can't touch the display.
+ **/
+void
+flush_store (void)
+{
+	char error[sizeof (store_error)];
+
+	if (! store_db)
+		return;
+
+	weather_row (store_state);
+	hand_over ();
+
+	pthread_mutex_lock (&store_lock);
+	strcpy (error, store_error);
+	store_error[0] = 0;
+	pthread_mutex_unlock (&store_lock);
+
+	if (error[0])
+		info (0, _("Unable to write to store: %s\n"), error);
+	if (dropped != reported) {
+		info (1, _("Store is behind, %lu rows dropped\n"), dropped);
+		reported = dropped;
+	}
+}
+
+/**
+ * close_store:
+ *
+ * Hands over any rows still to be written, waits for the writer thread
+ * to write them and closes the database.
+ **/
+void
+close_store (void)
+{
+	int i;
+
+	if (! store_db)
+		return;
+
+	remove_sink (&store_sink);
+	flush_store ();
+
+	pthread_mutex_lock (&store_lock);
+	store_stop = TRUE;
+	pthread_cond_signal (&store_cond);
+	pthread_mutex_unlock (&store_lock);
+	pthread_join (store_thread, NULL);
+
+	for (i = 0; i < LAST_STORE_TABLE; i++) {
+		sqlite3_finalize (statements[i]);
+		statements[i] = NULL;
+	}
+	sqlite3_close (store_db);
+	store_db = NULL;
+
+	free (pending);
+	pending = queued = writing = NULL;
+	free (cars);
+	cars = NULL;
+	num_cars = 0;
+	store_state = NULL;
+}
+
+
+/**
+ * hand_over:
+ *
+ * Hands the rows made so far to the writer thread, waking it.  If it's
+ * fallen so far behind that there's no room, the rows are dropped
+ * rather than holding up the board.
+ **/
+static void
+hand_over (void)
+{
+	size_t room;
+
+	if (! pending_len)
+		return;
+
+	pthread_mutex_lock (&store_lock);
+	room = MIN (pending_len, STORE_ROWS - queued_len);
+	memcpy (queued + queued_len, pending, sizeof (StoreRow) * room);
+	queued_len += room;
+	dropped += pending_len - room;
+	pthread_cond_signal (&store_cond);
+	pthread_mutex_unlock (&store_lock);
+
+	pending_len = 0;
+}
+
+
+/**
+ * clear_board:
+ * @state: application state structure.
+ *
+ * Forgets everything seen of the cars when a new event begins.
+ **/
+static void
+clear_board (CurrentState *state)
+{
+	int i;
+
+	if (state != store_state)
+		return;
+
+	for (i = 0; i < num_cars; i++) {
+		memset (&cars[i], 0, sizeof (StoreCar));
+		cars[i].laps = UNKNOWN;
+	}
+	for (i = 0; i < 6; i++)
+		last_weather[i] = UNKNOWN;
+}
+
+/**
+ * update_car:
+ * @state: application state structure,
+ * @car: car that has moved.
+ *
+ * Makes a positions row for @car, unless the position is only being
+ * filled in by a key frame.
+ **/
+static void
+update_car (CurrentState *state,
+	    int           car)
+{
+	StoreRow *row;
+
+	if ((state != store_state) || state->in_key_frame)
+		return;
+
+	row = new_row (state, STORE_POSITION, car);
+	row->u.position.position = state->car_position[car - 1];
+}
+
+/**
+ * update_cell:
+ * @state: application state structure,
+ * @car: car whose atom has changed,
+ * @type: type of the atom.
+ *
+ * Keeps count of the laps @car has completed, and makes a laps, sectors
+ * or pits row when one of the times or the number of stops changes.
+ * Atoms filled in by a key frame are only noted, since they give what
+ * happened before rather than something just completed.
+ **/
+static void
+update_cell (CurrentState *state,
+	     int           car,
+	     int           type)
+{
+	const StoreMap *map;
+	const CarAtom  *atom;
+	StoreCar       *seen;
+	int             i;
+
+	if ((state != store_state)
+	    || (state->event_type < RACE_EVENT)
+	    || (state->event_type > QUALIFYING_EVENT))
+		return;
+
+	if (car > num_cars) {
+		cars = realloc (cars, sizeof (StoreCar) * car);
+		if (! cars)
+			abort ();
+
+		for (i = num_cars; i < car; i++) {
+			memset (&cars[i], 0, sizeof (StoreCar));
+			cars[i].laps = UNKNOWN;
+		}
+
+		num_cars = car;
+	}
+
+	map = &store_maps[state->event_type];
+	atom = &state->car_info[car - 1][type];
+	seen = &cars[car - 1];
+
+	if (type == map->laps)
+		seen->laps = atoi (atom->text);
+
+	if ((type == map->lap_time) || (type == map->laps)) {
+		if ((! seen_text (seen->lap_time, atom->text))
+		    || state->in_key_frame)
+			return;
+
+		/* Practice and qualifying send the count instead */
+		if (type == map->lap_time) {
+			const char *gap = state->car_info[car - 1][map->gap].text;
+			int         leader_laps = UNKNOWN;
+
+			if (state->laps_completed)
+				leader_laps = state->laps_completed;
+
+			seen->laps = count_lap (seen->laps, leader_laps, gap);
+		}
+
+		lap_row (state, car);
+	}
+
+	for (i = 0; i < 3; i++)
+		if ((type == map->sector[i])
+		    && seen_text (seen->sector[i], atom->text)
+		    && (! state->in_key_frame))
+			sector_row (state, car, i);
+
+	if (map->pits && (type == map->pits)
+	    && seen_text (seen->pits, atom->text)
+	    && (! state->in_key_frame))
+		pit_row (state, car);
+}
+
+/**
+ * lap_row:
+ * @state: application state structure,
+ * @car: car that has completed a lap.
+ *
+ * Makes a laps row for @car from its atoms.
+ **/
+static void
+lap_row (CurrentState *state,
+	 int           car)
+{
+	const StoreMap *map = &store_maps[state->event_type];
+	const CarAtom  *atoms = state->car_info[car - 1];
+	StoreRow       *row;
+	int             i;
+
+	row = new_row (state, STORE_LAP, car);
+	row->u.lap.lap = cars[car - 1].laps;
+	row->u.lap.position = state->car_position[car - 1]
+		? state->car_position[car - 1] : UNKNOWN;
+	row->u.lap.pits = map->pits ? atoi (atoms[map->pits].text) : UNKNOWN;
+	strcpy (row->u.lap.time, map->lap_time ? atoms[map->lap_time].text : "");
+	for (i = 0; i < 3; i++)
+		strcpy (row->u.lap.sector[i], atoms[map->sector[i]].text);
+	strcpy (row->u.lap.gap, map->gap ? atoms[map->gap].text : "");
+	strcpy (row->u.lap.interval,
+		map->interval ? atoms[map->interval].text : "");
+}
+
+/**
+ * sector_row:
+ * @state: application state structure,
+ * @car: car that has completed a sector,
+ * @sector: sector completed, from zero.
+ *
+ * Makes a sectors row for @car, in the lap after the last completed.
+ **/
+static void
+sector_row (CurrentState *state,
+	    int           car,
+	    int           sector)
+{
+	const StoreMap *map = &store_maps[state->event_type];
+	StoreRow       *row;
+	int             laps = cars[car - 1].laps;
+
+	row = new_row (state, STORE_SECTOR, car);
+	row->u.sector.lap = (laps != UNKNOWN) ? laps + 1 : UNKNOWN;
+	row->u.sector.sector = sector + 1;
+	strcpy (row->u.sector.time,
+		state->car_info[car - 1][map->sector[sector]].text);
+}
+
+/**
+ * pit_row:
+ * @state: application state structure,
+ * @car: car that has made a pit stop.
+ *
+ * Makes a pits row for @car.
+ **/
+static void
+pit_row (CurrentState *state,
+	 int           car)
+{
+	const StoreMap *map = &store_maps[state->event_type];
+	StoreRow       *row;
+
+	row = new_row (state, STORE_PIT, car);
+	row->u.pit.lap = cars[car - 1].laps;
+	row->u.pit.stop = atoi (state->car_info[car - 1][map->pits].text);
+}
+
+/**
+ * weather_row:
+ * @state: application state structure.
+ *
+ * Makes a weather row if any of the weather has changed since the last.
+ * This is checked once per read of the data stream rather than as each
+ * part arrives, so a new reading makes one row rather than several;
+ * nothing is written while none of it is known.
+ **/
+static void
+weather_row (CurrentState *state)
+{
+	StoreRow *row;
+	int       weather[6], i;
+
+	weather[0] = state->track_temp;
+	weather[1] = state->air_temp;
+	weather[2] = state->humidity;
+	weather[3] = state->wind_speed;
+	weather[4] = state->wind_direction;
+	weather[5] = state->pressure;
+	if (! memcmp (weather, last_weather, sizeof (weather)))
+		return;
+
+	memcpy (last_weather, weather, sizeof (weather));
+	for (i = 0; (i < 6) && (! weather[i]); i++)
+		;
+	if (i == 6)
+		return;
+
+	row = new_row (state, STORE_WEATHER, 0);
+	row->u.weather.track_temp = state->track_temp;
+	row->u.weather.air_temp = state->air_temp;
+	row->u.weather.humidity = state->humidity;
+	row->u.weather.wind_speed = state->wind_speed;
+	row->u.weather.wind_direction = state->wind_direction;
+	row->u.weather.pressure = state->pressure;
+}
+
+/**
+ * new_row:
+ * @state: application state structure,
+ * @table: table the row is for,
+ * @car: car the row is about, or zero.
+ *
+ * Adds a row to those made during this read of the data stream, handing
+ * them to the writer first if there's no room, and fills in the columns
+ * every table has.
+ *
+ * Returns: row to fill in the rest of.
+ **/
+static StoreRow *
+new_row (CurrentState *state,
+	 StoreTable    table,
+	 int           car)
+{
+	StoreRow *row;
+
+	if (pending_len == STORE_ROWS)
+		hand_over ();
+
+	row = &pending[pending_len++];
+	row->table = table;
+	row->event_no = state->event_no;
+	row->event_type = state->event_type;
+	row->ts = get_time (state);
+	row->car = car;
+	row->number[0] = row->driver[0] = 0;
+
+	if (car && (state->event_type >= RACE_EVENT)
+	    && (state->event_type <= QUALIFYING_EVENT)) {
+		const StoreMap *map = &store_maps[state->event_type];
+
+		strcpy (row->number, state->car_info[car - 1][map->number].text);
+		strcpy (row->driver, state->car_info[car - 1][map->driver].text);
+	}
+
+	return row;
+}
+
+/**
+ * seen_text:
+ * @last: copy last seen,
+ * @text: text of the atom now.
+ *
+ * Compares an atom with the copy last seen, updating the copy.  An
+ * atom sent again with only its colour changed doesn't count, nor does
+ * one being blanked, though the same time sent after a blank does.
+ *
+ * Returns: TRUE if @text is new and not empty, FALSE otherwise.
+ **/
+static int
+seen_text (char       *last,
+	   const char *text)
+{
+	if (! strcmp (last, text))
+		return FALSE;
+
+	strcpy (last, text);
+	return text[0] != 0;
+}
+
+
+/**
+ * writer:
+ * @arg: unused.
+ *
+ * Writer thread, the only one to touch the database once it's open.
+ * Waits for rows to be handed over, swaps them for the buffer it last
+ * wrote so the main thread can carry on, and writes them in a single
+ * transaction.  Anything handed over in the next STORE_INTERVAL_MS
+ * milliseconds waits for the transaction after, so a busy session
+ * makes fewer, larger ones, unless it's enough to half fill the queue,
+ * as when replaying as fast as possible.
+ *
+ * Returns: NULL.
+ **/
+static void *
+writer (void *arg)
+{
+	pthread_mutex_lock (&store_lock);
+	for (;;) {
+		struct timespec until;
+		StoreRow       *rows;
+		size_t          num_rows;
+
+		while ((! queued_len) && (! store_stop))
+			pthread_cond_wait (&store_cond, &store_lock);
+		if (! queued_len)
+			break;
+
+		rows = queued;
+		num_rows = queued_len;
+		queued = writing;
+		queued_len = 0;
+		writing = rows;
+		pthread_mutex_unlock (&store_lock);
+
+		write_rows (rows, num_rows);
+
+		clock_gettime (CLOCK_REALTIME, &until);
+		until.tv_nsec += STORE_INTERVAL_MS * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock (&store_lock);
+		while ((! store_stop) && (queued_len < STORE_ROWS / 2)
+		       && (pthread_cond_timedwait (&store_cond, &store_lock,
+						   &until) != ETIMEDOUT))
+			;
+	}
+	pthread_mutex_unlock (&store_lock);
+
+	return NULL;
+}
+
+/**
+ * write_rows:
+ * @rows: rows to write,
+ * @num_rows: number of rows in @rows.
+ *
+ * Writes @rows into the database in a single transaction, using the
+ * statements prepared when it was opened.  If any fails, none of them
+ * are written, and the error is kept for flush_store() to report.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_rows (const StoreRow *rows,
+	    size_t          num_rows)
+{
+	size_t i;
+
+	if (sqlite3_exec (store_db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		keep_error ();
+		return 1;
+	}
+
+	for (i = 0; i < num_rows; i++) {
+		sqlite3_stmt *stmt = statements[rows[i].table];
+		int           ret;
+
+		bind_row (stmt, &rows[i]);
+		ret = sqlite3_step (stmt);
+		sqlite3_reset (stmt);
+		if (ret != SQLITE_DONE)
+			goto error;
+	}
+
+	if (sqlite3_exec (store_db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		goto error;
+
+	return 0;
+error:
+	/* Before the rollback replaces it */
+	keep_error ();
+	sqlite3_exec (store_db, "ROLLBACK", NULL, NULL, NULL);
+	return 1;
+}
+
+/**
+ * keep_error:
+ *
+ * Copies the database's last error message into store_error, for
+ * flush_store() to report.
+ **/
+static void
+keep_error (void)
+{
+	const char *errmsg = sqlite3_errmsg (store_db);
+	size_t      len;
+
+	len = strnlen (errmsg, sizeof (store_error) - 1);
+
+	pthread_mutex_lock (&store_lock);
+	memcpy (store_error, errmsg, len);
+	store_error[len] = 0;
+	pthread_mutex_unlock (&store_lock);
+}
+
+/**
+ * bind_row:
+ * @stmt: statement inserting into the table of @row,
+ * @row: row to insert.
+ *
+ * Binds the columns of @row to the parameters of @stmt, which are in
+ * the order of the table's columns.
+ *
+ * Returns: number of parameters bound.
+ **/
+static int
+bind_row (sqlite3_stmt   *stmt,
+	  const StoreRow *row)
+{
+	int col = 1;
+
+	bind_int (stmt, col++, row->event_no);
+	bind_int (stmt, col++, row->event_type);
+	sqlite3_bind_int64 (stmt, col++, row->ts);
+
+	switch (row->table) {
+	case STORE_LAP:
+		bind_int (stmt, col++, row->car);
+		bind_text (stmt, col++, row->number);
+		bind_text (stmt, col++, row->driver);
+		bind_int (stmt, col++, row->u.lap.lap);
+		bind_text (stmt, col++, row->u.lap.time);
+		bind_int (stmt, col++, parse_time_ms (row->u.lap.time));
+		bind_text (stmt, col++, row->u.lap.sector[0]);
+		bind_text (stmt, col++, row->u.lap.sector[1]);
+		bind_text (stmt, col++, row->u.lap.sector[2]);
+		bind_int (stmt, col++, row->u.lap.position);
+		bind_text (stmt, col++, row->u.lap.gap);
+		bind_text (stmt, col++, row->u.lap.interval);
+		bind_int (stmt, col++, row->u.lap.pits);
+		break;
+	case STORE_SECTOR:
+		bind_int (stmt, col++, row->car);
+		bind_text (stmt, col++, row->number);
+		bind_text (stmt, col++, row->driver);
+		bind_int (stmt, col++, row->u.sector.lap);
+		bind_int (stmt, col++, row->u.sector.sector);
+		bind_text (stmt, col++, row->u.sector.time);
+		bind_int (stmt, col++, parse_time_ms (row->u.sector.time));
+		break;
+	case STORE_PIT:
+		bind_int (stmt, col++, row->car);
+		bind_text (stmt, col++, row->number);
+		bind_text (stmt, col++, row->driver);
+		bind_int (stmt, col++, row->u.pit.lap);
+		bind_int (stmt, col++, row->u.pit.stop);
+		break;
+	case STORE_POSITION:
+		bind_int (stmt, col++, row->car);
+		bind_text (stmt, col++, row->number);
+		bind_text (stmt, col++, row->driver);
+		bind_int (stmt, col++, row->u.position.position);
+		break;
+	case STORE_WEATHER:
+		bind_int (stmt, col++, row->u.weather.track_temp);
+		bind_int (stmt, col++, row->u.weather.air_temp);
+		bind_int (stmt, col++, row->u.weather.humidity);
+		bind_tenths (stmt, col++, row->u.weather.wind_speed);
+		bind_int (stmt, col++, row->u.weather.wind_direction);
+		bind_tenths (stmt, col++, row->u.weather.pressure);
+		break;
+	default:
+		break;
+	}
+
+	return col - 1;
+}
+
+/**
+ * bind_int:
+ * @stmt: statement to bind to,
+ * @col: parameter to bind, from one,
+ * @value: value to bind, or UNKNOWN.
+ *
+ * Binds @value, or NULL if it isn't known.
+ **/
+static void
+bind_int (sqlite3_stmt *stmt,
+	  int           col,
+	  int           value)
+{
+	if (value == UNKNOWN) {
+		sqlite3_bind_null (stmt, col);
+	} else {
+		sqlite3_bind_int (stmt, col, value);
+	}
+}
+
+/**
+ * bind_tenths:
+ * @stmt: statement to bind to,
+ * @col: parameter to bind, from one,
+ * @value: value to bind in tenths.
+ *
+ * Binds @value as a decimal, since wind speed and pressure are sent in
+ * tenths by the data stream.
+ **/
+static void
+bind_tenths (sqlite3_stmt *stmt,
+	     int           col,
+	     int           value)
+{
+	sqlite3_bind_double (stmt, col, value / 10.0);
+}
+
+/**
+ * bind_text:
+ * @stmt: statement to bind to,
+ * @col: parameter to bind, from one,
+ * @text: text to bind, copied from the row.
+ *
+ * Binds @text, or NULL if it's empty.  The row stays put until the
+ * statement has been stepped, so the text isn't copied again.
+ **/
+static void
+bind_text (sqlite3_stmt *stmt,
+	   int           col,
+	   const char   *text)
+{
+	if (text[0]) {
+		sqlite3_bind_text (stmt, col, text, -1, SQLITE_STATIC);
+	} else {
+		sqlite3_bind_null (stmt, col);
+	}
+}
+
+#else /* HAVE_LIBSQLITE3 */
+
+/**
+ * open_store:
+ * @path: SQLite database to write to,
+ * @state: application state structure.
+ *
+ * Without SQLite there's nowhere to write laps to.
+ *
+ * Returns: non-zero, always.
+ **/
+int
+open_store (const char   *path,
+	    CurrentState *state)
+{
+	fprintf (stderr, "%s: %s: %s\n", program_name, path,
+		 _("live-f1 was built without SQLite"));
+	return 1;
+}
+
+void
+flush_store (void)
+{
+}
+
+void
+close_store (void)
+{
+}
+
+#endif /* HAVE_LIBSQLITE3 */
@@ -24,25 +24,23 @@
 #endif /* HAVE_CONFIG_H */
 
 
-#include <sys/poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "live-f1.h"
-#include "display.h"
 #include "packet.h"
+#include "stats.h"
 #include "stream.h"
 
 
-/* Encryption seed */
-#define CRYPTO_SEED 0x55555555
-
 /* Which car the packet is for */
 #define PACKET_CAR(_p) ((_p)[0] & 0x1f)
 
@@ -68,140 +66,83 @@
 #define SPECIAL_PACKET_LEN(_p) 0
 
 
-/* Forward prototypes */
-static int next_packet (CurrentState *state, Packet *packet,
-			const unsigned char **buf, size_t *buf_len);
+/* Where the data source of a state sends what it doesn't provide; the
+ * web site in live-f1, and nowhere in the programs that only work from
+ * recordings */
+const DataSource *fallback_source = NULL;
+
+
 
 
 /**
- * open_stream:
- * @hostname: hostname of timing server,
- * @port: port of timing server.
+ * listen_stream:
+ * @where: port to listen on, optionally preceded by an address and colon,
+ * @default_addr: address to listen on if @where doesn't give one, or
+ * NULL for any.
  *
- * Creates a socket for the data stream and connects to the live timing
- * server so data can be received.
+ * Creates a non-blocking socket listening for TCP connections on
+ * @where; an IPv6 address may be given in brackets.
  *
- * Returns: connected socket or -1 on failure.
+ * Returns: listening socket or -1 on failure.
  **/
 int
-open_stream (const char   *hostname,
-	     unsigned int  port)
+listen_stream (const char *where,
+	       const char *default_addr)
 {
-	struct addrinfo *res, *addr, hints;
-	static char      service[6];
-	int              sock, ret;
-
-	info (2, _("Looking up %s ...\n"), hostname);
-
-	sprintf (service, "%hu", port);
+	struct addrinfo  hints, *res;
+	const char      *port;
+	char            *host;
+	int              sock, ret, one = 1;
+
+	port = strrchr (where, ':');
+	if (port) {
+		host = strndup (where, port - where);
+		port++;
+
+		/* Strip the brackets from an IPv6 address */
+		if ((host[0] == '[') && (host[strlen (host) - 1] == ']')) {
+			memmove (host, host + 1, strlen (host));
+			host[strlen (host) - 1] = '\0';
+		}
+	} else {
+		host = strdup (default_addr ? default_addr : "");
+		port = where;
+	}
 
 	memset (&hints, 0, sizeof (hints));
 	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_CANONNAME;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
 
-	ret = getaddrinfo (hostname, service, &hints, &res);
+	ret = getaddrinfo (*host ? host : NULL, port, &hints, &res);
+	free (host);
 	if (ret != 0) {
 		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
-			 _("failed to resolve host"), hostname,
-			 gai_strerror (ret));
+			 _("unable to listen on"), where, gai_strerror (ret));
 		return -1;
 	}
 
-	info (1, _("Connecting to data stream ...\n"));
+	sock = socket (res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock < 0)
+		goto error;
 
-	sock = -1;
-	for (addr = res; addr; addr = addr->ai_next) {
-		info (3, _("Trying %s ...\n"), addr->ai_canonname);
+	setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	if ((bind (sock, res->ai_addr, res->ai_addrlen) < 0)
+	    || (listen (sock, 128) < 0))
+		goto error;
 
-		sock = socket (addr->ai_family, addr->ai_socktype,
-			       addr->ai_protocol);
-		if (sock < 0)
-			continue;
-
-		ret = connect (sock, addr->ai_addr, addr->ai_addrlen);
-		if (ret < 0) {
-			close (sock);
-			sock = -1;
-			continue;
-		}
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+	freeaddrinfo (res);
 
-		break;
-	}
+	return sock;
 
+error:
+	fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+		 _("unable to listen on"), where, strerror (errno));
 	if (sock >= 0)
-		info (2, _("Connected to %s.\n"), addr->ai_canonname);
-
+		close (sock);
 	freeaddrinfo (res);
-	return sock;
-}
 
-/**
- * read_stream:
- * @state: application state structure,
- * @sock: socket to read from.
- *
- * Read a block of data from the stream, this isn't quite as simple as it
- * seems because the server won't actually send us data unless we ping it;
- * but we don't want to ping as often as we need to check for things like
- * key presses from the user.
- *
- * Returns: 0 if socket closed, > 0 on success, < 0 on error.
- **/
-int
-read_stream (CurrentState *state, int sock)
-{
-	struct pollfd poll_fd;
-	static int    timer = 0;
-	int           numr, len;
-
-	poll_fd.fd = sock;
-	poll_fd.events = POLLIN;
-	poll_fd.revents = 0;
-
-	numr = poll (&poll_fd, 1, 100);
-	if (numr > 0) {
-		unsigned char buf[512];
-
-		len = read (sock, buf, sizeof (buf));
-		if (len > 0) {
-			parse_stream_block (state, buf, len);
-			timer = 0;
-			return len;
-		} else if ((len < 0) && (errno != ECONNRESET)) {
-			if (errno == EINTR)
-				return 1;
-
-			return -1;
-		} else {
-			return 0;
-		}
-	} else if (numr < 0) {
-		if (errno == EINTR)
-			return 1;
-
-		return -1;
-	} else {
-		char buf[1];
-
-		if (timer++ < 10)
-			return 1;
-
-		/* Wake the server up */
-		buf[0] = 0x10;
-		len = write (sock, buf, sizeof (buf));
-		if (len > 0) {
-			update_time (state);
-			timer = 0;
-			return len;
-		} else if ((len < 0) && (errno != EPIPE)) {
-			if (errno == EINTR)
-				return 1;
-
-			return -1;
-		} else {
-			return 0;
-		}
-	}
+	return -1;
 }
 
 /**
@@ -211,96 +152,229 @@ read_stream (CurrentState *state, int sock)
  * @buf_len: length of @buf.
  *
  * Parse a data stream block obtained either from the data server or a
- * key frame.  Calls either handle_car_packet() or handle_system_packet(),
- * and is safe for those to result in further stream parsing calls.
+ * key frame.  Calls the handler for the type of each packet from
+ * car_dispatch or system_dispatch, which is handle_car_packet() or
+ * handle_system_packet() unless a plugin wants that type too, and is
+ * safe for those to result in further stream parsing calls.
  **/
 int
 parse_stream_block (CurrentState        *state,
 		    const unsigned char *buf,
 		    size_t               buf_len)
 {
-	Packet packet;
+	Packet    packet;
+	long long start;
 
-	while (next_packet (state, &packet, &buf, &buf_len)) {
+	while (next_packet (state, &state->reader, &packet, &buf, &buf_len)) {
+		start = monotonic_ns ();
 		if (packet.car) {
-			handle_car_packet (state, &packet);
+			stats.car_packets[packet.type]++;
+			car_dispatch[packet.type] (state, &packet);
 		} else {
-			handle_system_packet (state, &packet);
+			stats.sys_packets[packet.type]++;
+			system_dispatch[packet.type] (state, &packet);
 		}
+
+		stats.handler_ns += monotonic_ns () - start;
+		stats.handled++;
 	}
 
 	return 0;
 }
 
+/**
+ * reset_stream:
+ * @state: application state structure.
+ *
+ * Discards any partial packet left over from the last block parsed by
+ * parse_stream_block(), for when the next block doesn't follow on from
+ * it.
+ **/
+void
+reset_stream (CurrentState *state)
+{
+	state->reader.len = 0;
+}
+
 /**
  * next_packet:
  * @state: application state structure,
+ * @reader: partial packet carried between calls,
  * @packet: packet structure to fill,
  * @buf: buffer to copy packet from,
  * @buf_len: length of @buf.
  *
  * Takes bytes from @buf until a complete raw packet has been seen,
  * at which point if fills @packet with the decoded information about
- * it.
+ * it.  Car packets of a car and type not in @state's wanted are passed
+ * over without copying or decrypting them, as soon as their header
+ * has been seen.
  *
  * @buf_len is decreased and @buf moved upwards each time bytes are
- * taken from it.  The bytes are copied into an internal buffer so
- * there's no need to worry about packets crossing block boundaries.
+ * taken from it.  The bytes are copied into @reader's buffer so
+ * there's no need to worry about packets crossing block boundaries,
+ * as long as the same @reader is passed for each block.
  *
  * Returns: 0 if the packet was not complete, 1 if it is complete
  **/
-static int
+int
 next_packet (CurrentState         *state,
+	     PacketReader         *reader,
 	     Packet               *packet,
 	     const unsigned char **buf,
 	     size_t               *buf_len)
 {
-	static unsigned char pbuf[129];
-	static size_t        pbuf_len = 0;
-	int                  decrypt = 0;
+	unsigned char       *pbuf = reader->buf;
+	size_t              *pbuf_len = &reader->len;
+	const unsigned char *hdr, *payload;
+	int                  decrypt = 0, wanted;
 
+again:
 	/* We need a minimum of two bytes to figure out how long the rest
-	 * of it's supposed to be; copy those now if we have room.
+	 * of it's supposed to be.  If we're not part way through a packet
+	 * and have those, we frame the packet straight from @buf; so a
+	 * block that's all in memory, such as a mapped file, is parsed
+	 * without copying it first.  Otherwise copy those now if we have
+	 * room.
 	 */
-	if (pbuf_len < 2) {
+	if ((! *pbuf_len) && (*buf_len >= 2)) {
+		hdr = *buf;
+	} else if (*pbuf_len < 2) {
 		size_t needed;
 
-		needed = MIN (*buf_len, 2 - pbuf_len);
-		memcpy (pbuf + pbuf_len, *buf, needed);
+		needed = MIN (*buf_len, 2 - *pbuf_len);
+		memcpy (pbuf + *pbuf_len, *buf, needed);
 
-		pbuf_len += needed;
+		*pbuf_len += needed;
 		*buf += needed;
 		*buf_len -= needed;
 
-		if (pbuf_len < 2)
+		if (*pbuf_len < 2)
 			return 0;
+
+		hdr = pbuf;
+	} else {
+		hdr = pbuf;
 	}
 
 	/* We now have the packet header, this is enough information to
 	 * figure out how long the rest of it is and whether we need to
 	 * decrypt it or not.
-	 *
-	 * Fill in some of the fields now, ok we'll rewrite these every
-	 * time we come through, but that's not really that bad.
 	 */
-	packet->car = PACKET_CAR (pbuf);
-	packet->type = PACKET_TYPE (pbuf);
+	decrypt = packet_header (packet, hdr);
+	wanted = ((! packet->car) || (! state->wanted)
+		  || (state->wanted[packet->type] & (1U << packet->car)));
+
+	if (hdr != pbuf) {
+		size_t needed = MAX (packet->len, 0) + 2;
+
+		/* Take the packet from @buf if it's all there, otherwise
+		 * carry over what there is.
+		 */
+		if (*buf_len < needed) {
+			memcpy (pbuf, *buf, *buf_len);
+			*pbuf_len = *buf_len;
+			*buf += *buf_len;
+			*buf_len = 0;
+
+			return 0;
+		}
+
+		payload = *buf + 2;
+		*buf += needed;
+		*buf_len -= needed;
+	} else {
+		/* Copy as much as we can of the rest of the packet */
+		if (packet->len > 0) {
+			size_t needed;
+
+			needed = MIN (*buf_len,
+				      (packet->len + 2) - *pbuf_len);
+			memcpy (pbuf + *pbuf_len, *buf, needed);
+
+			*pbuf_len += needed;
+			*buf += needed;
+			*buf_len -= needed;
+
+			if (*pbuf_len < (packet->len + 2))
+				return 0;
+		}
+
+		/* We have a full packet, reset our cache length so we
+		 * can re-use it for the next packet (which might happen
+		 * before this one has finished being handled when key
+		 * frames are being fetched).
+		 */
+		*pbuf_len = 0;
+		payload = pbuf + 2;
+	}
+
+	/* If nobody wants the packet, only keep the salt in step and go
+	 * on to the next one.
+	 */
+	if (! wanted) {
+		if (decrypt && (packet->len > 0))
+			skip_bytes (state, packet->len);
+
+		stats.skipped++;
+		goto again;
+	}
+
+	/* Copy the payload and decrypt it */
+	if (packet->len > 0) {
+		memcpy (packet->payload, payload, packet->len);
+		packet->payload[packet->len] = 0;
+
+		if (decrypt) {
+			long long start;
+
+			start = monotonic_ns ();
+			decrypt_bytes (state, packet->payload, packet->len);
+
+			stats.decrypt_ns += monotonic_ns () - start;
+			stats.decrypts++;
+		}
+	} else {
+		packet->payload[0] = 0;
+	}
+
+	return 1;
+}
+
+/**
+ * packet_header:
+ * @packet: packet structure to fill,
+ * @hdr: the two bytes of the packet header.
+ *
+ * Fills in the car, type, data and payload length of @packet from its
+ * header; the payload itself is left alone.
+ *
+ * Returns: TRUE if the payload is encrypted, FALSE if not.
+ **/
+int
+packet_header (Packet              *packet,
+	       const unsigned char *hdr)
+{
+	int decrypt;
+
+	packet->car = PACKET_CAR (hdr);
+	packet->type = PACKET_TYPE (hdr);
 
 	if (packet->car) {
 		switch ((CarPacketType) packet->type) {
 		case CAR_POSITION_UPDATE:
-			packet->len = SPECIAL_PACKET_LEN (pbuf);
-			packet->data = SPECIAL_PACKET_DATA (pbuf);
+			packet->len = SPECIAL_PACKET_LEN (hdr);
+			packet->data = SPECIAL_PACKET_DATA (hdr);
 			decrypt = 0;
 			break;
 		case CAR_POSITION_HISTORY:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
+			packet->len = LONG_PACKET_LEN (hdr);
+			packet->data = LONG_PACKET_DATA (hdr);
 			decrypt = 1;
 			break;
 		default:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
+			packet->len = SHORT_PACKET_LEN (hdr);
+			packet->data = SHORT_PACKET_DATA (hdr);
 			decrypt = 1;
 			break;
 		}
@@ -308,8 +382,8 @@ next_packet (CurrentState         *state,
 		switch ((SystemPacketType) packet->type) {
 		case SYS_EVENT_ID:
 		case SYS_KEY_FRAME:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
+			packet->len = SHORT_PACKET_LEN (hdr);
+			packet->data = SHORT_PACKET_DATA (hdr);
 			decrypt = 0;
 			break;
 		case SYS_TIMESTAMP:
@@ -319,20 +393,20 @@ next_packet (CurrentState         *state,
 			break;
 		case SYS_WEATHER:
 		case SYS_TRACK_STATUS:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
+			packet->len = SHORT_PACKET_LEN (hdr);
+			packet->data = SHORT_PACKET_DATA (hdr);
 			decrypt = 1;
 			break;
 		case SYS_COMMENTARY:
 		case SYS_NOTICE:
 		case SYS_SPEED:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
+			packet->len = LONG_PACKET_LEN (hdr);
+			packet->data = LONG_PACKET_DATA (hdr);
 			decrypt = 1;
 			break;
 		case SYS_COPYRIGHT:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
+			packet->len = LONG_PACKET_LEN (hdr);
+			packet->data = LONG_PACKET_DATA (hdr);
 			decrypt = 0;
 			break;
 		case SYS_VALID_MARKER:
@@ -351,40 +425,94 @@ next_packet (CurrentState         *state,
 		}
 	}
 
-	/* Copy as much as we can of the rest of the packet */
-	if (packet->len > 0) {
-		size_t needed;
+	return decrypt;
+}
 
-		needed = MIN (*buf_len, (packet->len + 2) - pbuf_len);
-		memcpy (pbuf + pbuf_len, *buf, needed);
+/**
+ * get_decryption_key:
+ * @state: application state structure,
+ * @event_no: official event number.
+ *
+ * Obtains the decryption key for the event from the data source, or
+ * from fallback_source if there isn't one.
+ *
+ * Returns: key obtained on success, or zero on failure.
+ **/
+unsigned int
+get_decryption_key (CurrentState *state,
+		    unsigned int  event_no)
+{
+	if (state->source && state->source->decryption_key)
+		return state->source->decryption_key (state, event_no);
+	if (fallback_source && fallback_source->decryption_key)
+		return fallback_source->decryption_key (state, event_no);
 
-		pbuf_len += needed;
-		*buf += needed;
-		*buf_len -= needed;
+	return 0;
+}
 
-		if (pbuf_len < (packet->len + 2))
-			return 0;
+/**
+ * get_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number to obtain.
+ *
+ * Obtains the numbered key frame from the data source, or from
+ * fallback_source if there isn't one, and parses it.  Sinks can tell
+ * the changes it makes apart from those in the data stream by @state's
+ * in_key_frame.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+get_key_frame (CurrentState *state,
+	       unsigned int  frame)
+{
+	int ret = 1;
+
+	state->in_key_frame = TRUE;
+	if (state->source && state->source->key_frame) {
+		ret = state->source->key_frame (state, frame);
+	} else if (fallback_source && fallback_source->key_frame) {
+		ret = fallback_source->key_frame (state, frame);
 	}
+	state->in_key_frame = FALSE;
 
-	/* We have a full packet, reset our static cache length so we
-	 * can re-use it for the next packet (which might happen before
-	 * this one has finished being handled when key frames are being
-	 * fetched).
-	 */
-	pbuf_len = 0;
+	return ret;
+}
 
-	/* Copy the payload and decrypt it */
-	if (packet->len > 0) {
-		memcpy (packet->payload, pbuf + 2, packet->len);
-		packet->payload[packet->len] = 0;
+/**
+ * get_total_laps:
+ * @state: application state structure.
+ *
+ * Obtains the total number of laps for the race from the data source,
+ * or from fallback_source if there isn't one.
+ *
+ * Returns: total obtained on success, or zero on failure.
+ **/
+unsigned int
+get_total_laps (CurrentState *state)
+{
+	if (state->source && state->source->total_laps)
+		return state->source->total_laps (state);
+	if (fallback_source && fallback_source->total_laps)
+		return fallback_source->total_laps (state);
 
-		if (decrypt)
-			decrypt_bytes (state, packet->payload, packet->len);
-	} else {
-		packet->payload[0] = 0;
-	}
+	return 0;
+}
 
-	return 1;
+/**
+ * get_time:
+ * @state: application state structure.
+ *
+ * Returns: the current time as far as the session is concerned, which
+ * is only the real time when it's live.
+ **/
+time_t
+get_time (CurrentState *state)
+{
+	if (state->source && state->source->time)
+		return state->source->time (state);
+
+	return time (NULL);
 }
 
 /**
@@ -423,3 +551,23 @@ decrypt_bytes (CurrentState  *state,
 		*(buf++) ^= (state->salt & 0xff);
 	}
 }
+
+/**
+ * skip_bytes:
+ * @state: application state structure,
+ * @len: number of bytes to skip.
+ *
+ * Moves the salt on as decrypt_bytes() would for @len bytes, without
+ * decrypting anything, for a payload nobody wants.
+ **/
+void
+skip_bytes (CurrentState *state,
+	    size_t        len)
+{
+	if (! state->key)
+		return;
+
+	while (len--)
+		state->salt = ((state->salt >> 1)
+			       ^ (state->salt & 0x01 ? state->key : 0));
+}
@@ -21,17 +21,34 @@
 #define LIVE_F1_STREAM_H
 
 #include "live-f1.h"
+#include "packet.h"
+
+
+/* Encryption seed */
+#define CRYPTO_SEED 0x55555555
 
 
 SJR_BEGIN_EXTERN
 
-int  open_stream        (const char *hostname, unsigned int port);
-int  read_stream        (CurrentState *state, int sock);
+extern const DataSource *fallback_source;
+
+int  listen_stream      (const char *where, const char *default_addr);
 int  parse_stream_block (CurrentState *state, const unsigned char *buf,
 			 size_t buf_len);
+int  next_packet        (CurrentState *state, PacketReader *reader,
+			 Packet *packet, const unsigned char **buf,
+			 size_t *buf_len);
+int  packet_header      (Packet *packet, const unsigned char *hdr);
+void reset_stream       (CurrentState *state);
+
+unsigned int get_decryption_key (CurrentState *state, unsigned int event_no);
+int          get_key_frame      (CurrentState *state, unsigned int frame);
+unsigned int get_total_laps     (CurrentState *state);
+time_t       get_time           (CurrentState *state);
 
 void reset_decryption   (CurrentState *state);
 void decrypt_bytes      (CurrentState *state, unsigned char *buf, size_t len);
+void skip_bytes         (CurrentState *state, size_t len);
 
 SJR_END_EXTERN
 
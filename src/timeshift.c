@@ -0,0 +1,627 @@
+/* live-f1
+ *
+ * timeshift.c - pausing and rewinding a live session
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "live-f1.h"
+#include "display.h"
+#include "packet.h"
+#include "stats.h"
+#include "stream.h"
+#include "timeshift.h"
+
+
+/* Size of the header stored in the ring before each burst: the 64-bit
+ * time it was read and its 32-bit length */
+#define BURST_HEADER 12
+
+/* Largest burst read_stream() gives us */
+#define MAX_BURST    512
+
+/* Share of the memory allowed that is kept for checkpoints */
+#define CHECKPOINT_SHARE 4
+
+
+/**
+ * Checkpoint:
+ * @seq: position in the ring the state was copied at,
+ * @time_ns: time the state was copied,
+ * @size: memory used by @state,
+ * @state: copy of the live state.
+ *
+ * The board as it was at a point in the ring, so the view can be moved
+ * there without parsing everything from the start.
+ **/
+typedef struct {
+	unsigned long long seq;
+	long long          time_ns;
+	size_t             size;
+	CurrentState       state;
+} Checkpoint;
+
+
+/* Forward prototypes */
+static void   add_checkpoint    (CurrentState *state, long long now);
+static void   drop_checkpoints  (void);
+static void   seek_view         (long long target);
+static void   play_view         (long long until);
+static unsigned int shift_key   (CurrentState *state,
+				 unsigned int event_no);
+static int    shift_key_frame   (CurrentState *state, unsigned int frame);
+static unsigned int shift_laps  (CurrentState *state);
+static time_t shift_time        (CurrentState *state);
+
+
+/* Ring of recent bursts, and how many bytes have ever been put in it */
+static unsigned char     *ring = NULL;
+static size_t             ring_size = 0;
+static unsigned long long total = 0;
+
+/* Checkpoints in the ring, oldest first */
+static Checkpoint        *checkpoints = NULL;
+static size_t             num_checkpoints = 0, checkpoint_alloc = 0;
+static size_t             checkpoint_bytes = 0, checkpoint_limit = 0;
+static long long          checkpoint_interval = 0, last_checkpoint = 0;
+
+/* Live state, and the state shown while time-shifted */
+static CurrentState      *live = NULL;
+static CurrentState       view;
+static int                shifted = FALSE, paused = FALSE;
+
+/* Position of the view in the ring, and the time it has reached */
+static unsigned long long view_seq = 0;
+static long long          view_ns = 0, last_tick = 0;
+static time_t             view_drawn = 0;
+
+/* Keys, key frames and laps for the view come from the live state,
+ * never the web site, and its clock is behind */
+static const DataSource shift_source = {
+	shift_key,
+	shift_key_frame,
+	shift_laps,
+	shift_time,
+};
+
+
+/**
+ * put_le32:
+ * @buf: buffer to write to,
+ * @value: value to write.
+ *
+ * Writes @value into @buf in little-endian byte order.
+ **/
+static inline void
+put_le32 (unsigned char *buf,
+	  unsigned long  value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * get_le32:
+ * @buf: buffer to read from.
+ *
+ * Returns: little-endian value read from @buf.
+ **/
+static inline unsigned long
+get_le32 (const unsigned char *buf)
+{
+	return ((unsigned long) buf[3] << 24) | (buf[2] << 16)
+		| (buf[1] << 8) | buf[0];
+}
+
+/**
+ * oldest:
+ *
+ * Returns: position of the oldest byte still in the ring.
+ **/
+static inline unsigned long long
+oldest (void)
+{
+	return (total > ring_size) ? total - ring_size : 0;
+}
+
+/**
+ * ring_put:
+ * @buf: bytes to add,
+ * @len: length of @buf.
+ *
+ * Adds @buf to the end of the ring, overwriting the oldest bytes.
+ **/
+static void
+ring_put (const unsigned char *buf,
+	  size_t               len)
+{
+	size_t off, piece;
+
+	off = total % ring_size;
+	piece = MIN (len, ring_size - off);
+	memcpy (ring + off, buf, piece);
+	memcpy (ring, buf + piece, len - piece);
+
+	total += len;
+}
+
+/**
+ * ring_get:
+ * @seq: position in the ring,
+ * @buf: buffer to copy into,
+ * @len: number of bytes to copy.
+ *
+ * Copies @len bytes from @seq in the ring into @buf.
+ **/
+static void
+ring_get (unsigned long long  seq,
+	  unsigned char      *buf,
+	  size_t              len)
+{
+	size_t off, piece;
+
+	off = seq % ring_size;
+	piece = MIN (len, ring_size - off);
+	memcpy (buf, ring + off, piece);
+	memcpy (buf + piece, ring, len - piece);
+}
+
+
+/**
+ * open_time_shift:
+ * @bytes: memory to use,
+ * @checkpoint_secs: seconds between checkpoints.
+ *
+ * Starts keeping the recent bursts of the data stream in memory, with
+ * a copy of the live state every @checkpoint_secs seconds, so that the
+ * board can be paused and rewound while the session carries on; going
+ * back to any point means copying the checkpoint before it and parsing
+ * only the bursts since.
+ *
+ * No more than @bytes are used; as the session goes on, the oldest
+ * bursts and checkpoints are thrown away.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_time_shift (size_t bytes,
+		 int    checkpoint_secs)
+{
+	checkpoint_limit = bytes / CHECKPOINT_SHARE;
+	ring_size = bytes - checkpoint_limit;
+	if (ring_size < BURST_HEADER + MAX_BURST) {
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("time-shift buffer too small"));
+		return 1;
+	}
+
+	ring = malloc (ring_size);
+	if (! ring)
+		abort ();
+
+	total = 0;
+	checkpoint_interval = MAX (checkpoint_secs, 1) * 1000000000LL;
+	last_checkpoint = 0;
+
+	return 0;
+}
+
+/**
+ * close_time_shift:
+ *
+ * Frees the time-shift buffer and checkpoints.
+ **/
+void
+close_time_shift (void)
+{
+	if (! ring)
+		return;
+
+	if (shifted)
+		free_state (&view);
+	shifted = paused = FALSE;
+
+	while (num_checkpoints)
+		free_state (&checkpoints[--num_checkpoints].state);
+	free (checkpoints);
+	checkpoints = NULL;
+	checkpoint_alloc = checkpoint_bytes = 0;
+
+	free (ring);
+	ring = NULL;
+	live = NULL;
+}
+
+/**
+ * time_shift:
+ * @state: application state structure,
+ * @buf: burst just parsed,
+ * @len: length of @buf.
+ *
+ * Adds a burst from the data stream to the ring once @state has been
+ * updated with it, taking a checkpoint of @state if it's time.  Called
+ * by read_stream().
+ **/
+void
+time_shift (CurrentState        *state,
+	    const unsigned char *buf,
+	    size_t               len)
+{
+	unsigned char header[BURST_HEADER];
+	long long     now;
+
+	if ((! ring) || (len > MAX_BURST))
+		return;
+
+	live = state;
+	now = monotonic_ns ();
+
+	put_le32 (header, now & 0xffffffff);
+	put_le32 (header + 4, (unsigned long long) now >> 32);
+	put_le32 (header + 8, len);
+	ring_put (header, sizeof (header));
+	ring_put (buf, len);
+
+	if (now - last_checkpoint >= checkpoint_interval)
+		add_checkpoint (state, now);
+
+	drop_checkpoints ();
+}
+
+/**
+ * add_checkpoint:
+ * @state: application state structure,
+ * @now: current time.
+ *
+ * Copies @state as it is at the end of the ring.
+ **/
+static void
+add_checkpoint (CurrentState *state,
+		long long     now)
+{
+	Checkpoint *cp;
+
+	if (num_checkpoints == checkpoint_alloc) {
+		checkpoint_alloc = MAX (checkpoint_alloc * 2, 16);
+		checkpoints = realloc (checkpoints, (sizeof (Checkpoint)
+						     * checkpoint_alloc));
+		if (! checkpoints)
+			abort ();
+	}
+
+	cp = &checkpoints[num_checkpoints++];
+	cp->seq = total;
+	cp->time_ns = now;
+	cp->size = (sizeof (Checkpoint) + 30
+		    + state->num_cars * (sizeof (int) + sizeof (CarAtom *)
+					 + sizeof (CarAtom) * LAST_CAR_PACKET));
+	copy_state (&cp->state, state);
+
+	checkpoint_bytes += cp->size;
+	last_checkpoint = now;
+}
+
+/**
+ * drop_checkpoints:
+ *
+ * Throws away the oldest checkpoints while they're for bursts no
+ * longer in the ring, or there are more than the memory allowed; the
+ * newest is always kept.
+ **/
+static void
+drop_checkpoints (void)
+{
+	while ((num_checkpoints > 1)
+	       && ((checkpoints[0].seq < oldest ())
+		   || (checkpoint_bytes > checkpoint_limit))) {
+		checkpoint_bytes -= checkpoints[0].size;
+		free_state (&checkpoints[0].state);
+
+		memmove (checkpoints, checkpoints + 1,
+			 sizeof (Checkpoint) * --num_checkpoints);
+	}
+}
+
+/**
+ * reset_time_shift:
+ *
+ * Throws away the ring and checkpoints, going back to the live board;
+ * for when the data stream is reconnected and the bursts that follow
+ * don't carry on from those before.
+ **/
+void
+reset_time_shift (void)
+{
+	if (! ring)
+		return;
+
+	go_live ();
+
+	while (num_checkpoints)
+		free_state (&checkpoints[--num_checkpoints].state);
+	checkpoint_bytes = 0;
+	last_checkpoint = 0;
+	total = 0;
+}
+
+
+/**
+ * pause_time_shift:
+ *
+ * Freezes the board where it is while the session carries on in the
+ * background, or starts it moving again from where it was frozen.
+ **/
+void
+pause_time_shift (void)
+{
+	if (! live)
+		return;
+
+	if (! shifted) {
+		copy_state (&view, live);
+		view.source = &shift_source;
+		view_seq = total;
+		view_ns = last_tick = monotonic_ns ();
+		shifted = paused = TRUE;
+
+		show_state (&view);
+		info (0, _("Paused, press Space to resume or l to go live\n"));
+	} else {
+		paused = ! paused;
+	}
+}
+
+/**
+ * skip_time_shift:
+ * @secs: seconds to move by.
+ *
+ * Moves the board back by @secs seconds, or forward if @secs is
+ * positive; going forward past the live session goes back to it.  The
+ * view is kept paused if it was.
+ **/
+void
+skip_time_shift (int secs)
+{
+	long long now, target;
+
+	if (! live)
+		return;
+
+	now = monotonic_ns ();
+	target = (shifted ? view_ns : now) + secs * 1000000000LL;
+	if (target >= now) {
+		go_live ();
+	} else {
+		seek_view (target);
+	}
+}
+
+/**
+ * go_live:
+ *
+ * Catches the board up with the live session.
+ **/
+void
+go_live (void)
+{
+	if (! shifted)
+		return;
+
+	free_state (&view);
+	shifted = paused = FALSE;
+
+	show_state (live);
+}
+
+/**
+ * run_time_shift:
+ *
+ * Moves a time-shifted board on by the time since this was last
+ * called, unless it's paused; going live if it catches up.  Called
+ * from the main loop.
+ **/
+void
+run_time_shift (void)
+{
+	long long now;
+
+	if (! shifted)
+		return;
+
+	now = monotonic_ns ();
+	if (! paused)
+		view_ns += now - last_tick;
+	last_tick = now;
+
+	/* The bursts the view needs have gone */
+	if (view_seq < oldest ()) {
+		info (0, _("Time-shift buffer full, skipping ahead\n"));
+		seek_view (view_ns);
+	}
+
+	if (! paused) {
+		play_view (view_ns);
+		if (view_seq >= total) {
+			go_live ();
+			return;
+		}
+	}
+
+	if (time (NULL) != view_drawn) {
+		update_time (&view);
+		view_drawn = time (NULL);
+	}
+}
+
+/**
+ * seek_view:
+ * @target: time to move the view to.
+ *
+ * Moves the view to @target without drawing it until it gets there;
+ * forwards by parsing the bursts in between, and backwards by copying
+ * the last checkpoint before @target first.  If the checkpoints don't
+ * go back that far, the view goes to the oldest one.
+ **/
+static void
+seek_view (long long target)
+{
+	suspend_display (live, TRUE);
+
+	if ((! shifted) || (target < view_ns) || (view_seq < oldest ())) {
+		Checkpoint *cp = NULL;
+		size_t      i;
+
+		for (i = num_checkpoints; i > 0; i--) {
+			if (checkpoints[i - 1].seq < oldest ())
+				break;
+
+			cp = &checkpoints[i - 1];
+			if (cp->time_ns <= target)
+				break;
+		}
+
+		if (! cp) {
+			suspend_display (live, FALSE);
+			return;
+		}
+
+		if (shifted)
+			free_state (&view);
+
+		copy_state (&view, &cp->state);
+		view.source = &shift_source;
+		view_seq = cp->seq;
+		target = MAX (target, cp->time_ns);
+
+		if (! shifted)
+			last_tick = monotonic_ns ();
+		shifted = TRUE;
+		show_state (&view);
+	}
+
+	play_view (target);
+	view_ns = target;
+
+	suspend_display (live, FALSE);
+}
+
+/**
+ * play_view:
+ * @until: time to stop at.
+ *
+ * Parses the bursts in the ring after the view's position that were
+ * read no later than @until into the view.
+ **/
+static void
+play_view (long long until)
+{
+	unsigned char header[BURST_HEADER], buf[MAX_BURST];
+	long long     time_ns;
+	size_t        len;
+
+	while (view_seq < total) {
+		ring_get (view_seq, header, sizeof (header));
+		time_ns = (long long) (((unsigned long long) get_le32 (header + 4)
+					<< 32) | get_le32 (header));
+		len = get_le32 (header + 8);
+		if (time_ns > until)
+			break;
+
+		ring_get (view_seq + BURST_HEADER, buf, len);
+		view_seq += BURST_HEADER + len;
+
+		parse_stream_block (&view, buf, len);
+	}
+}
+
+/**
+ * shift_time:
+ * @state: application state structure.
+ *
+ * Returns: time of day that the time-shifted board has reached.
+ **/
+static time_t
+shift_time (CurrentState *state)
+{
+	return time (NULL) - (monotonic_ns () - view_ns) / 1000000000LL;
+}
+
+/**
+ * shift_key:
+ * @state: application state structure,
+ * @event_no: official event number.
+ *
+ * The view only replays what the live state has already read, so the
+ * key for the event is the one the live state, or the view itself,
+ * already has.
+ *
+ * Returns: key for @event_no, or zero if neither has it.
+ **/
+static unsigned int
+shift_key (CurrentState *state,
+	   unsigned int  event_no)
+{
+	if (event_no == live->event_no)
+		return live->key;
+	if (event_no == state->event_no)
+		return state->key;
+
+	return 0;
+}
+
+/**
+ * shift_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number.
+ *
+ * Key frames aren't fetched for the view.  It starts from a copy of a
+ * board that had every key frame the live state needed applied, and
+ * is decrypted again from each key frame marker, so a key frame the
+ * live state has reached is treated as applied.
+ *
+ * Returns: 0 if the live state has reached @frame, non-zero otherwise.
+ **/
+static int
+shift_key_frame (CurrentState *state,
+		 unsigned int  frame)
+{
+	return (frame <= live->frame) ? 0 : 1;
+}
+
+/**
+ * shift_laps:
+ * @state: application state structure.
+ *
+ * Returns: total number of laps the live state has.
+ **/
+static unsigned int
+shift_laps (CurrentState *state)
+{
+	return live->total_laps;
+}
@@ -0,0 +1,42 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_TIMESHIFT_H
+#define LIVE_F1_TIMESHIFT_H
+
+#include <sys/types.h>
+
+#include "live-f1.h"
+
+
+SJR_BEGIN_EXTERN
+
+int  open_time_shift   (size_t bytes, int checkpoint_secs);
+void time_shift        (CurrentState *state, const unsigned char *buf,
+			size_t len);
+void run_time_shift    (void);
+void pause_time_shift  (void);
+void skip_time_shift   (int secs);
+void go_live           (void);
+void reset_time_shift  (void);
+void close_time_shift  (void);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_TIMESHIFT_H */
@@ -0,0 +1,204 @@
+/* live-f1
+ *
+ * watch.c - file descriptors polled alongside the data stream
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/poll.h>
+#include <stdlib.h>
+
+#include "live-f1.h"
+#include "stats.h"
+#include "watch.h"
+
+
+/**
+ * Watch:
+ * @fd: file descriptor,
+ * @events: events to watch for,
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * A file descriptor that the main loop polls along with the data stream.
+ **/
+typedef struct {
+	int        fd;
+	short      events;
+	WatchFunc  func;
+	void      *data;
+} Watch;
+
+
+/* Watched file descriptors */
+static Watch         *watches = NULL;
+static int            nwatches = 0;
+
+/* Array handed to poll(), the first entry is the caller's */
+static struct pollfd *pollfds = NULL;
+static int            npollfds = 0;
+
+/* When poll() last returned */
+static long long      woke_ns = 0;
+
+
+/**
+ * add_watch:
+ * @fd: file descriptor to watch,
+ * @events: poll() events to watch for,
+ * @func: function to call,
+ * @data: pointer to pass to @func.
+ *
+ * Arranges for @func to be called from the main loop whenever one of
+ * @events occurs on @fd.
+ *
+ * Returns: 0 on success, -1 on failure.
+ **/
+int
+add_watch (int        fd,
+	   short      events,
+	   WatchFunc  func,
+	   void      *data)
+{
+	Watch *new_watches;
+
+	new_watches = realloc (watches, sizeof (Watch) * (nwatches + 1));
+	if (! new_watches)
+		return -1;
+
+	watches = new_watches;
+	watches[nwatches].fd = fd;
+	watches[nwatches].events = events;
+	watches[nwatches].func = func;
+	watches[nwatches].data = data;
+	nwatches++;
+
+	return 0;
+}
+
+/**
+ * change_watch:
+ * @fd: file descriptor being watched,
+ * @events: poll() events to watch for.
+ *
+ * Changes the events watched for on @fd, usually to add or remove
+ * POLLOUT while there's data waiting to be written.
+ **/
+void
+change_watch (int   fd,
+	      short events)
+{
+	int i;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].fd == fd)
+			watches[i].events = events;
+}
+
+/**
+ * remove_watch:
+ * @fd: file descriptor being watched.
+ *
+ * Stops watching @fd; does not close it.
+ **/
+void
+remove_watch (int fd)
+{
+	int i;
+
+	for (i = 0; i < nwatches; i++) {
+		if (watches[i].fd == fd) {
+			watches[i] = watches[--nwatches];
+			return;
+		}
+	}
+}
+
+/**
+ * poll_watches:
+ * @extra: caller's own file descriptor to poll,
+ * @timeout: timeout in milliseconds.
+ *
+ * Polls @extra along with all of the watched file descriptors, calling
+ * the watch functions for any events that occur.  The revents member
+ * of @extra is filled in.
+ *
+ * The time since the previous poll returned is how long the main loop
+ * took to deal with what it was woken for, so it's counted here too.
+ *
+ * Returns: as poll(), counting only @extra.
+ **/
+int
+poll_watches (struct pollfd *extra,
+	      int            timeout)
+{
+	long long busy;
+	int       numr, npolled, i, j;
+
+	if (woke_ns) {
+		busy = monotonic_ns () - woke_ns;
+		observe (&stats.loop_hist, busy);
+		if (busy > STATS_STALL_NS)
+			stats.loop_stalls++;
+	}
+
+	if (npollfds < nwatches + 1) {
+		pollfds = realloc (pollfds,
+				   sizeof (struct pollfd) * (nwatches + 1));
+		if (! pollfds)
+			abort ();
+
+		npollfds = nwatches + 1;
+	}
+
+	pollfds[0] = *extra;
+	pollfds[0].revents = 0;
+	for (i = 0; i < nwatches; i++) {
+		pollfds[i + 1].fd = watches[i].fd;
+		pollfds[i + 1].events = watches[i].events;
+		pollfds[i + 1].revents = 0;
+	}
+
+	npolled = nwatches + 1;
+	numr = poll (pollfds, npolled, timeout);
+	woke_ns = monotonic_ns ();
+	if (numr <= 0)
+		return numr;
+
+	/* Find the watch each time, since functions may change them */
+	for (i = 1; i < npolled; i++) {
+		if (! pollfds[i].revents)
+			continue;
+
+		for (j = 0; j < nwatches; j++) {
+			if (watches[j].fd == pollfds[i].fd) {
+				watches[j].func (watches[j].data,
+						 watches[j].fd,
+						 pollfds[i].revents);
+				break;
+			}
+		}
+	}
+
+	extra->revents = pollfds[0].revents;
+	return extra->revents ? 1 : 0;
+}
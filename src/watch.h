@@ -0,0 +1,51 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_WATCH_H
+#define LIVE_F1_WATCH_H
+
+#include <sys/poll.h>
+
+#include "live-f1.h"
+
+
+/**
+ * WatchFunc:
+ * @data: pointer given to add_watch(),
+ * @fd: file descriptor being watched,
+ * @revents: events that occurred.
+ *
+ * Called from the main loop when one of the events being watched for
+ * occurs on @fd.  It's safe for the function to add or remove watches,
+ * including its own.
+ **/
+typedef void (*WatchFunc) (void *data, int fd, short revents);
+
+
+SJR_BEGIN_EXTERN
+
+int  add_watch     (int fd, short events, WatchFunc func, void *data);
+void change_watch  (int fd, short events);
+void remove_watch  (int fd);
+
+int  poll_watches  (struct pollfd *extra, int timeout);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_WATCH_H */